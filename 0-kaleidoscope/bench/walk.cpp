@@ -0,0 +1,158 @@
+// Compares ways of walking a large syntax tree: the Visitor interface, (two virtual calls per
+// item, results passed back through a member) ast::Walker, (a switch on the kind, results
+// returned directly) and a flat::Tree. (See flat.cpp)
+//
+// Each walk evaluates the same tree of arithmetic, so that there is some work done per
+// item, and so that the results can be checked against each other.
+//
+// Usage: bench-walk [depth] [runs]
+// The tree is balanced, with 2^depth leaves.
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <functional>
+
+#include "../compiler/ast.cpp"
+#include "../compiler/flat.cpp"
+
+namespace {
+    const symbols::Id X = symbols::intern("x");
+    const double X_VALUE = 1.0001;
+
+    // Leaves alternate between numbers and x, and operators between '+', '-' and '*',
+    // with the odd unary '-' thrown in.
+    std::unique_ptr<ast::Expr> build(int depth, uint32_t& counter) {
+        uint32_t n = counter++;
+        if (depth == 0) {
+            if (n % 2)
+                return std::make_unique<ast::Var>(X);
+            return std::make_unique<ast::Num>((double)(n % 7) / 8);
+        }
+
+        std::unique_ptr<ast::Expr> lhs = build(depth - 1, counter);
+        std::unique_ptr<ast::Expr> rhs = build(depth - 1, counter);
+        if (n % 5 == 0)
+            rhs = std::make_unique<ast::Un>('-', std::move(rhs));
+        return std::make_unique<ast::Bin>("+-*"[n % 3], std::move(lhs), std::move(rhs));
+    }
+
+    double apply(char op, double lhs, double rhs) {
+        switch (op) {
+            case '+': return lhs + rhs;
+            case '-': return lhs - rhs;
+            default: return lhs * rhs;
+        }
+    }
+
+    class VisitorEvaluator : public Visitor {
+    public:
+        double value = 0;
+
+        void visit_num(ast::Num& target) override { value = target.value; }
+        void visit_var(ast::Var&) override { value = X_VALUE; }
+
+        void visit_un(ast::Un& target) override {
+            target.rhs->visit(*this);
+            value = -value;
+        }
+
+        void visit_bin(ast::Bin& target) override {
+            target.lhs->visit(*this);
+            double lhs = value;
+            target.rhs->visit(*this);
+            value = apply(target.op, lhs, value);
+        }
+
+        // Not in the tree.
+        void visit_call(ast::Call&) override {}
+        void visit_pro(ast::Pro&) override {}
+        void visit_fn(ast::Fn&) override {}
+        void visit_if(ast::If&) override {}
+        void visit_for(ast::For&) override {}
+        void visit_import(ast::Import&) override {}
+        void visit_block(ast::Block&) override {}
+        void visit_assignment(ast::Assignment&) override {}
+        void visit_with(ast::With&) override {}
+        void visit_command(ast::Command&) override {}
+    };
+
+    class WalkerEvaluator : public ast::Walker<WalkerEvaluator, double> {
+    public:
+        double walk_num(ast::Num& target) { return target.value; }
+        double walk_var(ast::Var&) { return X_VALUE; }
+        double walk_un(ast::Un& target) { return -walk(*target.rhs); }
+
+        double walk_bin(ast::Bin& target) {
+            double lhs = walk(*target.lhs);
+            return apply(target.op, lhs, walk(*target.rhs));
+        }
+
+        // Not in the tree.
+        double walk_call(ast::Call&) { return 0; }
+        double walk_pro(ast::Pro&) { return 0; }
+        double walk_fn(ast::Fn&) { return 0; }
+        double walk_if(ast::If&) { return 0; }
+        double walk_for(ast::For&) { return 0; }
+        double walk_import(ast::Import&) { return 0; }
+        double walk_block(ast::Block&) { return 0; }
+        double walk_assignment(ast::Assignment&) { return 0; }
+        double walk_with(ast::With&) { return 0; }
+        double walk_command(ast::Command&) { return 0; }
+    };
+
+    double evaluate(const flat::Tree& tree, flat::Ref ref) {
+        switch (ref.kind()) {
+            case flat::NUM: return tree.literals[tree.nums[ref.index()].literal];
+            case flat::VAR: return X_VALUE;
+            case flat::UN: return -evaluate(tree, tree.uns[ref.index()].rhs);
+            case flat::BIN: {
+                const flat::Bin& bin = tree.bins[ref.index()];
+                double lhs = evaluate(tree, bin.lhs);
+                return apply(bin.op, lhs, evaluate(tree, bin.rhs));
+            }
+            default: return 0;
+        }
+    }
+
+    // The best of the runs, in nanoseconds per item.
+    double time(const char* name, int runs, size_t items, std::function<double()> walk) {
+        double best = 1e300;
+        double result = 0;
+        for (int i = 0; i < runs; i++) {
+            auto start = std::chrono::steady_clock::now();
+            result = walk();
+            std::chrono::duration<double, std::nano> taken = std::chrono::steady_clock::now() - start;
+            if (taken.count() < best)
+                best = taken.count();
+        }
+
+        printf("%-10s %8.2f ns/item  (result %g)\n", name, best / items, result);
+        return result;
+    }
+}
+
+int main(int argc, char** argv) {
+    int depth = argc > 1 ? atoi(argv[1]) : 20;
+    int runs = argc > 2 ? atoi(argv[2]) : 10;
+
+    uint32_t counter = 0;
+    std::unique_ptr<ast::Expr> body = build(depth, counter);
+    ast::Fn fn(std::make_unique<ast::Pro>(symbols::intern("f"), std::vector<symbols::Id> {X}, 0), std::move(body));
+    flat::Tree tree = flat::flatten(fn);
+    size_t items = tree.size();
+    flat::Ref root = tree.fns[0].body;
+    printf("%zu items, %d runs\n", items, runs);
+
+    VisitorEvaluator visitor;
+    WalkerEvaluator walker;
+    double a = time("visitor", runs, items, [&]() { fn.body->visit(visitor); return visitor.value; });
+    double b = time("walker", runs, items, [&]() { return walker.walk(*fn.body); });
+    double c = time("flat", runs, items, [&]() { return evaluate(tree, root); });
+
+    if (a != b || a != c) {
+        printf("Results differ!\n");
+        return 1;
+    }
+    return 0;
+}
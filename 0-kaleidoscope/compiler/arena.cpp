@@ -0,0 +1,187 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <new>
+
+// Bump allocation for syntax trees.
+//
+// Parsing makes lots of small allocations, (a node for every number and name, an array for
+// the arguments of every call) and they all go away at about the same time. An arena hands
+// them out from big chunks by moving a pointer along, and frees the chunks all at once.
+//
+// Nothing is freed one at a time. Destructors still run, but giving the memory back does
+// nothing, so an arena can only be reset (or destroyed) once everything in it is gone.
+// Whatever lives longer than the parse has to keep the arena alive. (See ast::Fn)
+//
+// Allocations go to the thread's current arena, see Scope. If there isn't one, they go to
+// the heap as usual, so trees built outside of a parse (such as copies) don't need one.
+
+namespace arena {
+
+class Arena {
+public:
+    // Bytes handed out, and the number of allocations, since the last reset.
+    size_t bytes = 0;
+    size_t allocations = 0;
+
+    Arena(size_t first_chunk = 4096): next_chunk(first_chunk) {}
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t size, size_t align) {
+        uintptr_t start = ((uintptr_t)cursor + align - 1) & ~(uintptr_t)(align - 1);
+        if (!cursor || start + size > (uintptr_t)end) {
+            add_chunk(size + align);
+            start = ((uintptr_t)cursor + align - 1) & ~(uintptr_t)(align - 1);
+        }
+
+        cursor = (char*)(start + size);
+        bytes += size;
+        allocations++;
+        return (void*)start;
+    }
+
+    // Start again from the beginning, keeping only the newest (and biggest) chunk.
+    // Anything still allocated from the arena is lost.
+    void reset() {
+        if (chunks.size() > 1)
+            chunks.erase(chunks.begin(), chunks.end() - 1);
+        if (!chunks.empty()) {
+            cursor = chunks.back().data.get();
+            end = cursor + chunks.back().size;
+        }
+        bytes = 0;
+        allocations = 0;
+    }
+
+    // Bytes held, whether used or not.
+    size_t capacity() const {
+        size_t total = 0;
+        for (const Chunk& chunk: chunks)
+            total += chunk.size;
+        return total;
+    }
+
+private:
+    struct Chunk {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    // Each chunk is twice the size of the last, up to this.
+    static constexpr size_t MAX_CHUNK = 1 << 20;
+
+    std::vector<Chunk> chunks;
+    size_t next_chunk;
+    char* cursor = nullptr;
+    char* end = nullptr;
+
+    void add_chunk(size_t at_least) {
+        size_t size = next_chunk;
+        while (size < at_least)
+            size *= 2;
+        if (next_chunk < MAX_CHUNK)
+            next_chunk *= 2;
+
+        chunks.push_back({std::unique_ptr<char[]>(new char[size]), size});
+        cursor = chunks.back().data.get();
+        end = cursor + size;
+    }
+};
+
+namespace {
+    thread_local std::shared_ptr<Arena> current_arena;
+}
+
+// The arena that allocations on this thread go to, or nullptr for the heap.
+const std::shared_ptr<Arena>& current() {
+    return current_arena;
+}
+
+// Makes an arena the current one for this thread, until the end of the scope.
+class Scope {
+    std::shared_ptr<Arena> previous;
+public:
+    Scope(std::shared_ptr<Arena> arena): previous(std::move(current_arena)) {
+        current_arena = std::move(arena);
+    }
+
+    ~Scope() {
+        current_arena = std::move(previous);
+    }
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+};
+
+namespace {
+    // Put in front of each object from allocate(), so that release() knows where it came from.
+    struct alignas(std::max_align_t) Header {
+        Arena* arena;
+    };
+}
+
+// For class specific operator new and delete.
+// The memory comes from the current arena, if there is one.
+void* allocate(size_t size) {
+    Arena* arena = current_arena.get();
+    void* memory = arena ?
+        arena->allocate(sizeof(Header) + size, alignof(Header)) :
+        ::operator new(sizeof(Header) + size);
+
+    Header* header = new (memory) Header{arena};
+    return header + 1;
+}
+
+void release(void* memory) {
+    if (!memory)
+        return;
+
+    Header* header = (Header*)memory - 1;
+    if (!header->arena)
+        ::operator delete(header);
+}
+
+// For containers of nodes, such as the arguments of a call.
+// Uses the arena that was current when the container was made.
+template<class T>
+class Allocator {
+public:
+    typedef T value_type;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    Arena* arena;
+
+    Allocator(): arena(current_arena.get()) {}
+
+    template<class U>
+    Allocator(const Allocator<U>& other): arena(other.arena) {}
+
+    T* allocate(size_t count) {
+        if (arena)
+            return (T*)arena->allocate(count * sizeof(T), alignof(T));
+        return std::allocator<T>().allocate(count);
+    }
+
+    void deallocate(T* items, size_t count) {
+        if (!arena)
+            std::allocator<T>().deallocate(items, count);
+    }
+
+    // A copy goes wherever things are being allocated now, not where the original is.
+    Allocator select_on_container_copy_construction() const {
+        return Allocator();
+    }
+
+    template<class U>
+    bool operator==(const Allocator<U>& other) const { return arena == other.arena; }
+    template<class U>
+    bool operator!=(const Allocator<U>& other) const { return arena != other.arena; }
+};
+
+}
@@ -5,16 +5,45 @@
 #include <memory>
 #include <map>
 #include <utility>
+#include <array>
+#include <atomic>
+#include <cstdlib>
 
 #include "visitor.h"
+#include "symbols.cpp"
+#include "source.cpp"
+#include "arena.cpp"
 
 namespace ast {
     class Import;
 
+    // What an item is, so that it can be switched on. (See Walker)
+    enum class Kind : uint8_t {
+        NUM, VAR, UN, BIN, CALL, PRO, FN, IF, FOR, IMPORT, BLOCK, ASSIGNMENT, WITH, COMMAND
+    };
+
     // Item (abstract) on the abstract syntax tree.
     // This can be a node or a leaf.
     class Item {
     public:
+        const Kind kind;
+
+        // Where the item starts in its source, as a count of characters. For operators and
+        // calls, this is where the operator or the name is. (See source::File for lines)
+        uint32_t offset = 0;
+
+        Item(Kind kind): kind(kind) {}
+        virtual ~Item() = default;
+
+        // Items are allocated from the current arena, if there is one. (See arena.cpp)
+        static void* operator new(size_t size) {
+            return arena::allocate(size);
+        }
+
+        static void operator delete(void* memory) {
+            arena::release(memory);
+        }
+
         virtual void visit(Visitor& visitor) = 0;
 
         // This is a bit silly, but I needed a dynamic cast.
@@ -39,15 +68,42 @@ namespace ast {
         }
     };
 
+    // Give a new item the offset of the one it is a copy of.
+    template<class T>
+    std::unique_ptr<T> at(uint32_t offset, std::unique_ptr<T> item) {
+        item->offset = offset;
+        return item;
+    }
+
+    // A list of child items, from the same arena as the item that holds it.
+    template<class T>
+    using List = std::vector<T, arena::Allocator<T>>;
+
     // Statement. (Abstract)
     // A statement can be executed to cause sideeffects. 
     // It does not have a value.
-    class Statement : public Item {};
+    class Statement : public Item {
+    public:
+        Statement(Kind kind): Item(kind) {}
+    };
 
     class Block : public Item {
     public:
+        // The arena that the statements were parsed into, if any, which is kept alive until
+        // they are gone. Declared first, so that it is destroyed last.
+        // The block itself is always on the heap, so that it can outlive the arena.
+        const std::shared_ptr<arena::Arena> memory = arena::current();
+
         std::vector<std::unique_ptr<Statement>> statements;
-        Block(std::vector<std::unique_ptr<Statement>> statements): statements(std::move(statements)) {}
+        Block(std::vector<std::unique_ptr<Statement>> statements): Item(Kind::BLOCK), statements(std::move(statements)) {}
+
+        static void* operator new(size_t size) {
+            return ::operator new(size);
+        }
+
+        static void operator delete(void* memory) {
+            ::operator delete(memory);
+        }
 
         void visit(Visitor& visitor) override {
             visitor.visit_block(*this);
@@ -64,7 +120,7 @@ namespace ast {
     class Command: public Statement {
     public:
         std::string text;
-        Command(std::string&& text): text(text) {}
+        Command(std::string&& text): Statement(Kind::COMMAND), text(text) {}
 
         void visit(Visitor& visitor) override {
             visitor.visit_command(*this);
@@ -77,28 +133,53 @@ namespace ast {
 
     // Expression. (Abstract)
     // An expression can be evaluated to yield a value.
-    class Expr : public Item {};
+    class Expr : public Item {
+    public:
+        Expr(Kind kind): Item(kind) {}
+
+        // A deep copy of the expression.
+        virtual std::unique_ptr<Expr> copy() const = 0;
+    };
+
+    // Copy an optional expression.
+    std::unique_ptr<Expr> copy(const std::unique_ptr<Expr>& expr) {
+        return expr ? expr->copy() : nullptr;
+    }
+
+    // The slot or function of an item that hasn't been resolved, or doesn't refer to one, such
+    // as a builtin operator. (See resolve.cpp)
+    const uint32_t UNRESOLVED = ~0u;
 
     // Number.
     class Num : public Expr {
     public:
         const double value;
-        Num(double val): value(val) {}
+        Num(double val): Expr(Kind::NUM), value(val) {}
 
         void visit(Visitor& visitor) override {
             visitor.visit_num(*this);
         }
+
+        std::unique_ptr<Expr> copy() const override {
+            return at(offset, std::make_unique<Num>(value));
+        }
     };
 
     // Variable reference.
     class Var : public Expr {
     public:
-        const std::string name;
-        Var(std::string name): name(name) {}
+        const symbols::Id name;
+        // The local variable it refers to.
+        uint32_t slot = UNRESOLVED;
+        Var(symbols::Id name): Expr(Kind::VAR), name(name) {}
 
         void visit(Visitor& visitor) override {
             visitor.visit_var(*this);
         }
+
+        std::unique_ptr<Expr> copy() const override {
+            return at(offset, std::make_unique<Var>(name));
+        }
     };
 
     // Unary Operator.
@@ -106,12 +187,18 @@ namespace ast {
     class Un : public Expr {
     public:
         const char op;
-        const std::unique_ptr<Expr> rhs;
-        Un(char op, std::unique_ptr<Expr> rhs): op(op), rhs(std::move(rhs)) {}
+        std::unique_ptr<Expr> rhs;
+        // The function for the operator.
+        uint32_t fn = UNRESOLVED;
+        Un(char op, std::unique_ptr<Expr> rhs): Expr(Kind::UN), op(op), rhs(std::move(rhs)) {}
 
         void visit(Visitor& visitor) {
             visitor.visit_un(*this);
         }
+
+        std::unique_ptr<Expr> copy() const override {
+            return at(offset, std::make_unique<Un>(op, rhs->copy()));
+        }
     };
 
     // Binary Operator. 
@@ -119,26 +206,41 @@ namespace ast {
     class Bin : public Expr {
     public:
         const char op;
-        const std::unique_ptr<Expr> lhs, rhs;
+        std::unique_ptr<Expr> lhs, rhs;
+        // The function for the operator, unless it is a builtin one.
+        uint32_t fn = UNRESOLVED;
         Bin(char op, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs):
-            op(op), lhs(std::move(lhs)), rhs(std::move(rhs)) {}
+            Expr(Kind::BIN), op(op), lhs(std::move(lhs)), rhs(std::move(rhs)) {}
         
         void visit(Visitor& visitor) override {
             visitor.visit_bin(*this);
         }
+
+        std::unique_ptr<Expr> copy() const override {
+            return at(offset, std::make_unique<Bin>(op, lhs->copy(), rhs->copy()));
+        }
     };
 
     // Function call.
     class Call : public Expr {
     public:
-        const std::string callee;
-        const std::vector<std::unique_ptr<Expr>> args;
-        Call(std::string callee, std::vector<std::unique_ptr<Expr>> args):
-            callee(callee), args(std::move(args)) {}
+        const symbols::Id callee;
+        List<std::unique_ptr<Expr>> args;
+        uint32_t fn = UNRESOLVED;
+        Call(symbols::Id callee, List<std::unique_ptr<Expr>> args):
+            Expr(Kind::CALL), callee(callee), args(std::move(args)) {}
         
         void visit(Visitor& visitor) override {
             visitor.visit_call(*this);
         }
+
+        std::unique_ptr<Expr> copy() const override {
+            List<std::unique_ptr<Expr>> new_args;
+            new_args.reserve(args.size());
+            for (const std::unique_ptr<Expr>& arg: args)
+                new_args.push_back(arg->copy());
+            return at(offset, std::make_unique<Call>(callee, std::move(new_args)));
+        }
     };
 
     // Prototype. Used as a signature for
@@ -147,12 +249,12 @@ namespace ast {
     // for a unary '+' operator, for example.
     class Pro : public Statement {
     public:
-        const std::string name;
-        const std::vector<std::string> args;
+        const symbols::Id name;
+        const std::vector<symbols::Id> args;
         const double precedence;
 
-        Pro(std::string name, std::vector<std::string> args, double precedence):
-            name(name), args(args), precedence(precedence) {}
+        Pro(symbols::Id name, std::vector<symbols::Id> args, double precedence):
+            Statement(Kind::PRO), name(name), args(std::move(args)), precedence(precedence) {}
         
         void visit(Visitor& visitor) override {
             visitor.visit_pro(*this);
@@ -163,17 +265,12 @@ namespace ast {
         }
 
         std::unique_ptr<Pro> copy() {
-            std::string new_name = name;
-
-            std::vector<std::string> new_args;
-            for (std::string item: args)
-                new_args.push_back(item);
-            
-            return std::make_unique<Pro>(new_name, new_args, precedence);
+            return at(offset, std::make_unique<Pro>(name, args, precedence));
         }
 
         bool is_operator() {
-            return !isalpha(name[name.size() - 1]);
+            std::string_view text = symbols::name(name);
+            return !isalpha(text[text.size() - 1]);
         }
 
         bool is_unary() {
@@ -185,23 +282,83 @@ namespace ast {
         }
 
         char get_symbol() {
-            return name[name.size() - 1];
+            std::string_view text = symbols::name(name);
+            return text[text.size() - 1];
         }
     };
 
+    // The name of the top-level function that wraps anonymous expressions.
+    const symbols::Id MAIN = symbols::intern("_main");
+
+    namespace {
+        // Cached ids for operator function names, plus one. (So that zero means not cached yet)
+        // These are atomic since the parser may be running on several threads.
+        std::array<std::atomic<symbols::Id>, 256> unary_names, binary_names;
+
+        symbols::Id operator_name(std::atomic<symbols::Id>& cached, const char* prefix, char op) {
+            symbols::Id id = cached.load(std::memory_order_relaxed);
+            if (id == 0) {
+                // If two threads get here at once, they both intern the same name, and get the same id.
+                id = symbols::intern(prefix + std::string(1, op)) + 1;
+                cached.store(id, std::memory_order_relaxed);
+            }
+            return id - 1;
+        }
+    }
+
+    // The name of the function for a unary operator, such as "unary-".
+    symbols::Id unary_name(char op) {
+        return operator_name(unary_names[(unsigned char)op], "unary", op);
+    }
+
+    // The name of the function for a binary operator, such as "binary|".
+    symbols::Id binary_name(char op) {
+        return operator_name(binary_names[(unsigned char)op], "binary", op);
+    }
+
+    // Binary operators that are instructions, rather than calls to a function.
+    bool is_builtin(char op) {
+        return op == '+' || op == '-' || op == '*' || op == '<';
+    }
+
     // Function declaration. 
     // Has a prototype (signature) and an expression body.
     class Fn : public Statement {
     public:
+        // Functions outlive the input they were parsed from, so each one keeps its arena alive,
+        // the same way as Block.
+        const std::shared_ptr<arena::Arena> memory = arena::current();
+
         const std::unique_ptr<Pro> proto;
-        const std::unique_ptr<Expr> body;
+        std::unique_ptr<Expr> body;
+        // The source it was parsed from, or nullptr if that isn't known, as for the REPL.
+        std::shared_ptr<const source::File> file;
+        // How many local variables it has, including the parameters, which come first.
+        uint32_t slots = 0;
+        // Whether the names in it have been resolved, and slots set. (See resolve::function)
+        // Copies aren't, since what they refer to may have changed by the time they are.
+        bool resolved = false;
         Fn(std::unique_ptr<Pro> proto, std::unique_ptr<Expr> body):
-            proto(std::move(proto)), body(std::move(body)) {}
+            Statement(Kind::FN), proto(std::move(proto)), body(std::move(body)) {}
+
+        static void* operator new(size_t size) {
+            return ::operator new(size);
+        }
+
+        static void operator delete(void* memory) {
+            ::operator delete(memory);
+        }
         
         void visit(Visitor& visitor) override {
             visitor.visit_fn(*this);
         }
 
+        std::unique_ptr<Fn> copy() const {
+            std::unique_ptr<Fn> result = at(offset, std::make_unique<Fn>(proto->copy(), body->copy()));
+            result->file = file;
+            return result;
+        }
+
         Fn* as_fn() override {
             return this;
         }
@@ -212,13 +369,17 @@ namespace ast {
     // b is optional, and will a nullptr if no else section is given.
     class If : public Expr {
     public:
-        const std::unique_ptr<Expr> cond, a, b;
+        std::unique_ptr<Expr> cond, a, b;
         If(std::unique_ptr<Expr> cond, std::unique_ptr<Expr> a, std::unique_ptr<Expr> b)
-            : cond(std::move(cond)), a(std::move(a)), b(std::move(b)) {}
+            : Expr(Kind::IF), cond(std::move(cond)), a(std::move(a)), b(std::move(b)) {}
         
         void visit(Visitor& visitor) override {
             visitor.visit_if(*this);
         }
+
+        std::unique_ptr<Expr> copy() const override {
+            return at(offset, std::make_unique<If>(cond->copy(), a->copy(), ast::copy(b)));
+        }
     };
 
     // For loop. 
@@ -227,22 +388,27 @@ namespace ast {
     // The increment expression is optional and will be no nullptr if not given.
     class For : public Expr {
     public:
-        std::string var_name;
+        symbols::Id var_name;
         std::unique_ptr<Expr> start, end, inc, body;
-        For(std::string var_name, std::unique_ptr<Expr> start,
+        uint32_t slot = UNRESOLVED;
+        For(symbols::Id var_name, std::unique_ptr<Expr> start,
             std::unique_ptr<Expr> end, std::unique_ptr<Expr> inc, std::unique_ptr<Expr> body): 
-            var_name(var_name), start(std::move(start)), 
+            Expr(Kind::FOR), var_name(var_name), start(std::move(start)), 
             end(std::move(end)), inc(std::move(inc)), body(std::move(body)) {}
         
         void visit(Visitor& visitor) override {
             visitor.visit_for(*this);
         }
+
+        std::unique_ptr<Expr> copy() const override {
+            return at(offset, std::make_unique<For>(var_name, start->copy(), end->copy(), ast::copy(inc), body->copy()));
+        }
     };
 
     class Import : public Statement {
     public:
         std::string file;
-        Import(std::string file): file(file) {}
+        Import(std::string file): Statement(Kind::IMPORT), file(file) {}
 
         void visit(Visitor& visitor) override {
             visitor.visit_import(*this);
@@ -255,27 +421,72 @@ namespace ast {
 
     class Assignment: public Expr {
     public:
-        std::string identifier;
+        symbols::Id identifier;
         std::unique_ptr<ast::Expr> value;
-        Assignment(std::string identifier, std::unique_ptr<ast::Expr> val):
-            identifier(identifier), value(std::move(val)) {}
+        uint32_t slot = UNRESOLVED;
+        Assignment(symbols::Id identifier, std::unique_ptr<ast::Expr> val):
+            Expr(Kind::ASSIGNMENT), identifier(identifier), value(std::move(val)) {}
         
         void visit(Visitor& visitor) override {
             visitor.visit_assignment(*this);
         }
+
+        std::unique_ptr<Expr> copy() const override {
+            return at(offset, std::make_unique<Assignment>(identifier, value->copy()));
+        }
     };
 
     class With: public Expr {
     public:
-        std::vector<std::pair<std::string, std::unique_ptr<ast::Expr>>> assignments;
+        List<std::pair<symbols::Id, std::unique_ptr<ast::Expr>>> assignments;
         std::unique_ptr<ast::Expr> body;
+        // The slot of each variable, in the same order.
+        std::vector<uint32_t> slots;
         With(   
-            std::vector<std::pair<std::string, std::unique_ptr<ast::Expr>>> assignments, 
+            List<std::pair<symbols::Id, std::unique_ptr<ast::Expr>>> assignments, 
             std::unique_ptr<ast::Expr> body
-        ): assignments(std::move(assignments)), body(std::move(body)) {}
+        ): Expr(Kind::WITH), assignments(std::move(assignments)), body(std::move(body)) {}
 
         void visit(Visitor& visitor) override {
             visitor.visit_with(*this);
         }
+
+        std::unique_ptr<Expr> copy() const override {
+            List<std::pair<symbols::Id, std::unique_ptr<ast::Expr>>> new_assignments;
+            new_assignments.reserve(assignments.size());
+            for (const auto& assignment: assignments)
+                new_assignments.emplace_back(assignment.first, ast::copy(assignment.second));
+            return at(offset, std::make_unique<With>(std::move(new_assignments), body->copy()));
+        }
+    };
+
+    // Static dispatch over items, as an alternative to Visitor.
+    // walk() switches on the item's kind and calls the derived class's function for it directly,
+    // (walk_num(Num&) and so on, one for every kind) which returns its result. That is one
+    // plain call per item, instead of two virtual ones with the result left in a member.
+    template<class Derived, class Result>
+    class Walker {
+    public:
+        Result walk(Item& item) {
+            Derived& self = static_cast<Derived&>(*this);
+            switch (item.kind) {
+                case Kind::NUM: return self.walk_num(static_cast<Num&>(item));
+                case Kind::VAR: return self.walk_var(static_cast<Var&>(item));
+                case Kind::UN: return self.walk_un(static_cast<Un&>(item));
+                case Kind::BIN: return self.walk_bin(static_cast<Bin&>(item));
+                case Kind::CALL: return self.walk_call(static_cast<Call&>(item));
+                case Kind::PRO: return self.walk_pro(static_cast<Pro&>(item));
+                case Kind::FN: return self.walk_fn(static_cast<Fn&>(item));
+                case Kind::IF: return self.walk_if(static_cast<If&>(item));
+                case Kind::FOR: return self.walk_for(static_cast<For&>(item));
+                case Kind::IMPORT: return self.walk_import(static_cast<Import&>(item));
+                case Kind::BLOCK: return self.walk_block(static_cast<Block&>(item));
+                case Kind::ASSIGNMENT: return self.walk_assignment(static_cast<Assignment&>(item));
+                case Kind::WITH: return self.walk_with(static_cast<With&>(item));
+                case Kind::COMMAND: return self.walk_command(static_cast<Command&>(item));
+            }
+            // Every kind is handled above. (Result may not have a default, like llvm::Expected)
+            std::abort();
+        }
     };
 }
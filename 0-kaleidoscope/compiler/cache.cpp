@@ -0,0 +1,354 @@
+#pragma once
+
+// LLVM generates lots of warnings I can't do anything about.
+#pragma warning(push, 0)
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+#pragma warning(pop)
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "flat.cpp"
+
+// A cache of parsed sources, so that importing something again doesn't mean lexing and
+// parsing it again.
+//
+// Trees are saved as a binary image of a flat::Tree: a header, then each of the tree's arrays
+// as they are in memory, one after the other. Flat trees have no pointers in them, and every
+// place in the image is an offset from its start, so it doesn't matter where it is loaded.
+// Loading maps the file, (see llvm::MemoryBuffer) checks the header, and copies each array
+// out in one go. Nothing is decoded a node at a time.
+//
+// Names are saved as text, since symbol ids can be different from run to run. They are the
+// only thing that has to be looked at one by one when loading.
+//
+// Images are named by key(), a hash of the source and whatever else changes how it is parsed,
+// so an edited source is a miss rather than an old tree. The header has a version, and the
+// size of each kind of node, so that images from an older build (or another kind of machine)
+// are ignored instead of being misread. There is a checksum of the rest of the image, so a
+// damaged one is ignored too. What the nodes refer to is also checked once they are loaded,
+// (see flat::check) since a walk that went outside of the tree would crash rather than fail.
+
+namespace cache {
+    bool debug = false;
+
+    // Where images are saved. Set by init(), empty if there is nowhere to put them.
+    std::string directory;
+
+    namespace {
+        // Changes whenever the layout of an image does.
+        const uint32_t VERSION = 2;
+        const char MAGIC[4] = {'K', 'A', 'S', 'T'};
+        // Reads back differently if the image is from a machine with the other byte order.
+        const uint32_t ORDER_MARK = 0x01020304;
+
+        // Arrays, and other sections, are aligned to this in an image.
+        const size_t ALIGN = 8;
+
+        // The text of a name or an import/command, as a range of the CHARS section.
+        struct Text { uint32_t first; uint32_t size; };
+
+        // The tree's arrays, (plus the node hashes for a shared tree, one per kind) then text.
+        enum Section : uint32_t {
+            NUMS, VARS, UNS, BINS, CALLS, IFS, FORS, ASSIGNMENTS, WITHS,
+            PROS, FNS, STATEMENTS, LITERALS, ARGS, BINDINGS, PARAMS,
+            HASHES, NAMES = HASHES + flat::KINDS, TEXTS, CHARS, SECTIONS
+        };
+
+        struct Extent {
+            uint64_t offset;
+            uint64_t count;
+            // The size of each entry, which is checked when loading.
+            uint32_t size;
+            uint32_t unused;
+        };
+
+        struct Header {
+            char magic[4];
+            uint32_t version;
+            // Of everything after it, in the header or not. (See CHECKED)
+            uint64_t checksum;
+            uint32_t byte_order;
+            uint32_t shared;
+            uint64_t key;
+            Extent sections[SECTIONS];
+        };
+        const size_t CHECKED = offsetof(Header, byte_order);
+
+        // Calls f(section, array) for each of the tree's arrays, in order.
+        template<class T, class F>
+        void for_each_array(T& tree, F f) {
+            f(NUMS, tree.nums);
+            f(VARS, tree.vars);
+            f(UNS, tree.uns);
+            f(BINS, tree.bins);
+            f(CALLS, tree.calls);
+            f(IFS, tree.ifs);
+            f(FORS, tree.fors);
+            f(ASSIGNMENTS, tree.assignments);
+            f(WITHS, tree.withs);
+            f(PROS, tree.pros);
+            f(FNS, tree.fns);
+            f(STATEMENTS, tree.statements);
+            f(LITERALS, tree.literals);
+            f(ARGS, tree.args);
+            f(BINDINGS, tree.bindings);
+            f(PARAMS, tree.params);
+            for (uint32_t kind = 0; kind < flat::KINDS; kind++)
+                f(Section(HASHES + kind), tree.hashes[kind]);
+        }
+
+        // Adds a section to the end of an image.
+        template<class T>
+        void append(std::string& image, Section section, const T* items, size_t count) {
+            static_assert(std::is_trivially_copyable<T>::value, "Only plain data can go in an image.");
+
+            image.resize((image.size() + ALIGN - 1) & ~(ALIGN - 1), '\0');
+            Header* header = (Header*)image.data();
+            header->sections[section] = {image.size(), count, sizeof(T), 0};
+            image.append((const char*)items, count * sizeof(T));
+        }
+
+        // Whether a section of an image of the given size has entries of the given size, and
+        // is all inside it.
+        bool check_extent(const Header& header, Section section, size_t entry, size_t size) {
+            const Extent& extent = header.sections[section];
+            return extent.size == entry && extent.offset % ALIGN == 0
+                && extent.offset <= size && extent.count <= (size - extent.offset) / entry;
+        }
+
+        // The same for every section.
+        bool check_extents(const Header& header, size_t size) {
+            flat::Tree sizes;
+            bool valid = true;
+            for_each_array(sizes, [&](Section section, const auto& items) {
+                valid = valid && check_extent(header, section, sizeof(items[0]), size);
+            });
+            return valid && check_extent(header, NAMES, sizeof(Text), size)
+                && check_extent(header, TEXTS, sizeof(Text), size) && check_extent(header, CHARS, sizeof(char), size);
+        }
+    }
+
+    // Find somewhere to keep images. KALEIDOSCOPE_CACHE can be set to use a particular
+    // directory, or to an empty string to not cache anything.
+    void init() {
+        if (const char* path = std::getenv("KALEIDOSCOPE_CACHE")) {
+            directory = path;
+            return;
+        }
+
+        llvm::SmallString<256> path;
+        if (llvm::sys::path::cache_directory(path)) {
+            llvm::sys::path::append(path, "kaleidoscope");
+            directory = std::string(path.str());
+        }
+    }
+
+    // The key for a source. Anything else that changes the tree it is parsed into should be
+    // passed as the context, such as the operator precedences it is parsed with.
+    uint64_t key(llvm::StringRef source, llvm::ArrayRef<uint8_t> context = {}) {
+        uint64_t hash = llvm::xxHash64(source);
+        return hash ^ (llvm::xxHash64(context) * 0x9e3779b97f4a7c15) ^ VERSION;
+    }
+
+    // The binary image of a tree.
+    std::string write(const flat::Tree& tree, uint64_t key) {
+        std::string image(sizeof(Header), '\0');
+        Header* header = (Header*)image.data();
+        std::memcpy(header->magic, MAGIC, sizeof(MAGIC));
+        header->version = VERSION;
+        header->byte_order = ORDER_MARK;
+        header->shared = tree.shared;
+        header->key = key;
+
+        for_each_array(tree, [&](Section section, const auto& items) {
+            append(image, section, items.data(), items.size());
+        });
+
+        std::string chars;
+        auto texts = [&](Section section, const auto& strings, auto text_of) {
+            std::vector<Text> result;
+            result.reserve(strings.size());
+            for (const auto& string: strings) {
+                std::string_view text = text_of(string);
+                result.push_back({(uint32_t)chars.size(), (uint32_t)text.size()});
+                chars += text;
+            }
+            append(image, section, result.data(), result.size());
+        };
+        texts(NAMES, tree.names, [](symbols::Id id) { return symbols::name(id); });
+        texts(TEXTS, tree.texts, [](const std::string& text) { return std::string_view(text); });
+        append(image, CHARS, chars.data(), chars.size());
+
+        header = (Header*)image.data();
+        header->checksum = llvm::xxHash64(llvm::StringRef(image).drop_front(CHECKED));
+        return image;
+    }
+
+    // A saved tree, mapped into memory. The arrays can be looked at where they are, with
+    // section(), or copied out into a tree with tree().
+    class Image {
+    public:
+        // The image for a key, or nullptr if there isn't a usable one.
+        static std::unique_ptr<Image> open(const std::string& path, uint64_t key) {
+            auto buffer = llvm::MemoryBuffer::getFile(path, /*IsText*/ false, /*RequiresNullTerminator*/ false);
+            if (!buffer)
+                return nullptr;
+
+            std::unique_ptr<Image> image(new Image(std::move(*buffer)));
+            if (!image->check(key))
+                return nullptr;
+            return image;
+        }
+
+        template<class T>
+        llvm::ArrayRef<T> section(Section section) const {
+            const Extent& extent = header().sections[section];
+            return llvm::ArrayRef<T>((const T*)(buffer->getBufferStart() + extent.offset), extent.count);
+        }
+
+        flat::Tree tree() const {
+            flat::Tree result;
+            result.shared = header().shared != 0;
+
+            for_each_array(result, [&](Section index, auto& items) {
+                typedef typename std::decay<decltype(items)>::type::value_type T;
+                llvm::ArrayRef<T> saved = section<T>(index);
+                items.assign(saved.begin(), saved.end());
+            });
+
+            llvm::ArrayRef<char> chars = section<char>(CHARS);
+            auto text = [&](const Text& text) {
+                return std::string_view(chars.data() + text.first, text.size);
+            };
+
+            llvm::ArrayRef<Text> names = section<Text>(NAMES);
+            result.names.reserve(names.size());
+            for (const Text& name: names)
+                result.names.push_back(symbols::intern(text(name)));
+
+            llvm::ArrayRef<Text> texts = section<Text>(TEXTS);
+            result.texts.reserve(texts.size());
+            for (const Text& saved: texts)
+                result.texts.emplace_back(text(saved));
+
+            return result;
+        }
+
+    private:
+        std::unique_ptr<llvm::MemoryBuffer> buffer;
+
+        Image(std::unique_ptr<llvm::MemoryBuffer> buffer): buffer(std::move(buffer)) {}
+
+        const Header& header() const {
+            return *(const Header*)buffer->getBufferStart();
+        }
+
+        // Whether the image is one that this build wrote, for the key, and nothing in the
+        // header points outside of it.
+        bool check(uint64_t key) const {
+            size_t size = buffer->getBufferSize();
+            if (size < sizeof(Header) || ((uintptr_t)buffer->getBufferStart() & (ALIGN - 1)) != 0)
+                return false;
+
+            const Header& saved = header();
+            if (std::memcmp(saved.magic, MAGIC, sizeof(MAGIC)) != 0 || saved.version != VERSION
+                || saved.byte_order != ORDER_MARK || saved.key != key)
+                return false;
+
+            if (!check_extents(saved, size))
+                return false;
+            if (saved.checksum != llvm::xxHash64(buffer->getBuffer().drop_front(CHECKED)))
+                return false;
+
+            // The text ranges are looked at while loading, so they are checked here. What the
+            // nodes refer to is checked once they have been copied out. (See load)
+            uint64_t chars = saved.sections[CHARS].count;
+            for (Section index: {NAMES, TEXTS}) {
+                for (const Text& text: section<Text>(index)) {
+                    if ((uint64_t)text.first + text.size > chars)
+                        return false;
+                }
+            }
+            return true;
+        }
+    };
+
+    namespace {
+        std::string path_for(uint64_t key) {
+            char name[32];
+            snprintf(name, sizeof(name), "%016llx.kast", (unsigned long long)key);
+            llvm::SmallString<256> path(directory);
+            llvm::sys::path::append(path, name);
+            return std::string(path.str());
+        }
+    }
+
+    // The saved tree for a key, if there is one.
+    std::optional<flat::Tree> load(uint64_t key) {
+        if (directory.empty())
+            return std::nullopt;
+
+        std::string path = path_for(key);
+        std::unique_ptr<Image> image = Image::open(path, key);
+        if (!image) {
+            if (debug) printf("Parse cache miss: '%s'\n", path.c_str());
+            return std::nullopt;
+        }
+
+        // A damaged image could have anything in it, even with the right key and sizes.
+        flat::Tree tree = image->tree();
+        if (!flat::check(tree)) {
+            if (debug) printf("Parse cache image damaged: '%s'\n", path.c_str());
+            return std::nullopt;
+        }
+
+        if (debug) printf("Parse cache hit: '%s'\n", path.c_str());
+        return tree;
+    }
+
+    // Save a tree for a key. The image is written to a temporary file first, and then moved
+    // into place, so that nothing ever sees half of one.
+    // Failing to save isn't an error, the source is just parsed again next time.
+    void store(uint64_t key, const flat::Tree& tree) {
+        if (directory.empty() || llvm::sys::fs::create_directories(directory))
+            return;
+
+        std::string image = write(tree, key);
+        std::string path = path_for(key);
+
+        auto temp = llvm::sys::fs::TempFile::create(path + ".%%%%%%.tmp");
+        if (!temp) {
+            llvm::consumeError(temp.takeError());
+            return;
+        }
+
+        {
+            llvm::raw_fd_ostream out(temp->FD, /*shouldClose*/ false);
+            out.write(image.data(), image.size());
+        }
+
+        if (auto error = temp->keep(path)) {
+            llvm::consumeError(std::move(error));
+            llvm::consumeError(temp->discard());
+            return;
+        }
+
+        if (debug) printf("Parse cache saved: '%s' (%zd bytes)\n", path.c_str(), image.size());
+    }
+}
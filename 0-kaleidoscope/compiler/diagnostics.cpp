@@ -0,0 +1,176 @@
+#pragma once
+
+// LLVM generates lots of warnings I can't do anything about.
+#pragma warning(push, 0)
+#include "llvm/Support/Error.h"
+#include "llvm/Support/raw_ostream.h"
+#pragma warning(pop)
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "source.cpp"
+
+// Errors in source code, from parsing it or generating code for it.
+//
+// A diagnostic has a code, a message, and the span of the source that it is about. They are
+// passed back up as an llvm::Error, (see diag::Error) rather than being thrown, and each
+// function one passes through on the way up can add its name to it with trace(). That is what
+// makes the "parse_expr -> parse_primary -> Expected ..." part of the message.
+//
+// Several errors can be joined together, (see llvm::joinErrors) so that everything wrong with
+// a file is reported at once, and a Log takes them all out again in order.
+
+namespace diag {
+
+// Parse errors are in the 100s, and code generation errors are in the 200s.
+enum class Code : uint16_t {
+    // Something the grammar doesn't allow at this point.
+    UNEXPECTED = 101,
+    // Something after what should have been the end of a statement.
+    END_OF_STATEMENT = 102,
+    // An operator definition with the wrong number of parameters.
+    OPERATOR_ARITY = 103,
+
+    UNKNOWN_VARIABLE = 201,
+    UNKNOWN_FUNCTION = 202,
+    UNKNOWN_OPERATOR = 203,
+    ARGUMENT_COUNT = 204,
+
+    // A mistake in the compiler, rather than in the source.
+    INTERNAL = 900,
+};
+
+struct Diagnostic {
+    Code code = Code::INTERNAL;
+    std::string message;
+
+    // Where it is, if the source is known.
+    std::shared_ptr<const source::File> file;
+    uint32_t offset = 0;
+    uint32_t length = 0;
+
+    // The functions the error passed through, innermost first.
+    std::vector<std::string> trace;
+    // Shown on a line of its own after the message, such as the token it was found at.
+    std::string note;
+
+    // As "Error E202 at file:line:column: visit_fn -> visit_call -> message", and the note.
+    std::string describe() const {
+        char code_text[16];
+        snprintf(code_text, sizeof(code_text), "E%03u", (unsigned)code);
+
+        std::string text = "Error " + std::string(code_text);
+        if (file)
+            text += " at " + file->describe(offset);
+        text += ": ";
+        for (size_t i = trace.size(); i-- > 0;)
+            text += trace[i] + " -> ";
+        text += message;
+
+        if (!note.empty())
+            text += "\n" + note;
+        return text;
+    }
+};
+
+// A diagnostic, as an llvm::Error.
+class Error : public llvm::ErrorInfo<Error> {
+public:
+    static char ID;
+    Diagnostic diagnostic;
+
+    Error(Diagnostic diagnostic): diagnostic(std::move(diagnostic)) {}
+
+    void log(llvm::raw_ostream& out) const override {
+        out << diagnostic.describe();
+    }
+
+    std::error_code convertToErrorCode() const override {
+        return llvm::inconvertibleErrorCode();
+    }
+};
+char Error::ID = 0;
+
+// A new error, raised in the function named. (Which is the first name in its trace)
+llvm::Error error(Code code, const std::string& function, std::string message,
+    std::shared_ptr<const source::File> file = nullptr, uint32_t offset = 0, uint32_t length = 0) {
+    Diagnostic diagnostic;
+    diagnostic.code = code;
+    diagnostic.message = std::move(message);
+    diagnostic.file = std::move(file);
+    diagnostic.offset = offset;
+    diagnostic.length = length;
+    diagnostic.trace.push_back(function);
+    return llvm::make_error<Error>(std::move(diagnostic));
+}
+
+// Add the name of a function that an error is being passed back up through, and optionally
+// what it was doing at the time, as in "visit_if: condition".
+llvm::Error trace(llvm::Error error, const std::string& function, const std::string& detail = "") {
+    return llvm::handleErrors(std::move(error), [&](std::unique_ptr<Error> found) -> llvm::Error {
+        found->diagnostic.trace.push_back(detail.empty() ? function : function + ": " + detail);
+        return llvm::Error(std::move(found));
+    });
+}
+
+// Diagnostics gathered from some input, in the order they were found.
+class Log {
+public:
+    std::vector<Diagnostic> diagnostics;
+
+    // Takes all of the diagnostics out of an error. Anything else in it is kept as an
+    // internal error, with its message.
+    void add(llvm::Error error) {
+        llvm::handleAllErrors(std::move(error),
+            [&](Error& found) {
+                diagnostics.push_back(std::move(found.diagnostic));
+            },
+            [&](const llvm::ErrorInfoBase& other) {
+                Diagnostic diagnostic;
+                diagnostic.message = other.message();
+                diagnostics.push_back(std::move(diagnostic));
+            });
+    }
+
+    bool empty() const {
+        return diagnostics.empty();
+    }
+
+    size_t size() const {
+        return diagnostics.size();
+    }
+
+    void clear() {
+        diagnostics.clear();
+    }
+
+    // All of the diagnostics, as one error, leaving the log empty.
+    llvm::Error take() {
+        llvm::Error result = llvm::Error::success();
+        for (Diagnostic& diagnostic: diagnostics)
+            result = llvm::joinErrors(std::move(result), llvm::make_error<Error>(std::move(diagnostic)));
+        diagnostics.clear();
+        return result;
+    }
+
+    // Each diagnostic, with a newline after each.
+    std::string describe() const {
+        std::string text;
+        for (const Diagnostic& diagnostic: diagnostics)
+            text += diagnostic.describe() + "\n";
+        return text;
+    }
+};
+
+// Print everything in an error, one diagnostic after the other.
+void print(llvm::Error error) {
+    Log log;
+    log.add(std::move(error));
+    printf("%s", log.describe().c_str());
+}
+
+}
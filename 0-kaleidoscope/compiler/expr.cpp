@@ -6,10 +6,14 @@
 #include <map>
 #include <memory>
 #include <sstream>
+#include <array>
+#include <unordered_map>
 
 #include "tokens.cpp"
 #include "ast.cpp"
-#include "util.cpp"
+#include "diagnostics.cpp"
+#include "imports.cpp"
+#include "threads.cpp"
 #include "visitors/stringify.cpp"
 
 // LLVM generates lots of warnings I can't do anything about.
@@ -20,116 +24,247 @@
 namespace expr {
 
 bool debug = false;
+// How expressions are shown when debug is on.
+Stringifier::Options style;
 
-// If true, a new block is returned on each newline.
-// If false, a single block is returned for the entire input stream.
-bool interactive_mode = true;
+// Binary operator precedences, indexed by operator symbol.
+// Operators that haven't been given one have a precedence of 0.
+typedef std::array<double, 256> Precedences;
 
-/*
-    EXAMPLE
-*/
-
-void init();
-bool has_next();
-std::unique_ptr<ast::Block> current;
-void input(std::string);
-
-llvm::Error interactive() {
-    init();
-    debug = true;
-
-    printf("\n");
-    printf("Expressions:\n");
-    printf(" -> x \t\t\t(basic reference)\n");
-    printf(" -> 2 + 2 \t\t(binary operator)\n");
-    printf(" -> 2*2 + 2/2 \t\t(operator precedence)\n");
-    printf(" -> 2*(2 + var) \t(grouping)\n");
-    printf(" -> 2 + 3 + 4 \t\t(associativity)\n");
-    printf("\nDefintions:\n");
-    printf(" -> def f() x \t\t\t(function definition)\n");
-    printf(" -> def f(x) 2*x; f(2) \t\t(function call, multiple statements)\n");
-    printf(" -> extern print(text, end); \t(external definition)\n");
-    printf("\n");
-
-    while (tokens::has_next())
-        input("parsing");
+// The precedences that everything is parsed with, unless parsing in a batch. (See parse_files)
+// Definitions are added as they are parsed.
+Precedences precedences {};
 
-    printf("Info: end of input reached, exiting.\n");
-        
-    return llvm::Error::success();
+void register_precedence(char op, double precedence) {
+    precedences[(unsigned char)op] = precedence;
 }
 
 namespace {
-    void setup_precedence();
+    void setup_precedence() {
+        // TODO: extend this for other ops!
+        register_precedence('^', 11);
+        register_precedence('*', 10);
+        register_precedence('/', 10);
+        register_precedence('+', 9);
+        register_precedence('-', 9);
+        register_precedence('<', 8);
+        register_precedence('>', 8);
+        register_precedence('=', 7);
+        register_precedence('&', 6);
+        register_precedence('|', 5);
+    }
 }
 
 void init() {
     setup_precedence();
 }
 
-namespace {
-    std::unique_ptr<ast::Statement> parse_statement();
-}
+// The tokens an expression was parsed from, as positions in the token buffer.
+struct Span {
+    uint32_t first, end;
+    // Whether the span includes brackets around the expression.
+    bool grouped;
+};
+typedef std::unordered_map<const ast::Expr*, Span> Spans;
+
+// Parses statements from a lexer into blocks, see input().
+// Each parser has its own lexer, so several inputs can be parsed at once.
+class Parser {
+public:
+    tokens::Lexer lexer;
+
+    // If true, a new block is returned on each newline.
+    // If false, a single block is returned for the entire input.
+    bool interactive_mode = true;
+
+    // The result of the latest input(), or nullptr if nothing was parsed.
+    std::unique_ptr<ast::Block> current;
+
+    // Operator precedences defined by what has been parsed, in order.
+    std::vector<std::pair<char, double>> defined;
+    // Which operators have had their precedence looked up while parsing.
+    std::array<bool, 256> used {};
+
+    // If set, errors are added to this instead of being printed.
+    std::string* errors = nullptr;
+    // How many errors input() has found, in all.
+    size_t failures = 0;
+    // The errors found by the latest input(), in order.
+    diag::Log diagnostics;
+
+    // If set, the span of every expression parsed is added to this. 
+    // Only possible when reading from a token buffer. (See incremental.cpp)
+    Spans* spans = nullptr;
+
+    // What input() parses into, made on first use. (See arena.cpp)
+    // statement() and expression() don't use it, so what they return is on the heap.
+    std::shared_ptr<arena::Arena> arena;
+
+    // Precedences are looked up in, and added to, the given table.
+    Parser(Precedences& table): table(&table) {}
+
+    bool has_next() {
+        return lexer.has_next();
+    }
 
-void input(std::string promt) {
-    if (!tokens::has_next())  {
-        current = nullptr;
-        return;
+    // A single statement or expression, from the current token on.
+    // Unlike input(), an error is returned as it is, and nothing after it is looked at.
+    llvm::Expected<std::unique_ptr<ast::Statement>> statement() {
+        return parse_statement();
     }
 
-    if (tokens::current::is(tokens::START) || tokens::current::is_key_symbol('\n')) {
-        if (interactive_mode && promt.size() > 0)
-            printf("%s> ", promt.c_str());
-        tokens::next();
-        tokens::skip_newlines();
+    llvm::Expected<std::unique_ptr<ast::Expr>> expression() {
+        return parse_expr();
     }
-    std::vector<std::unique_ptr<ast::Statement>> vector;
-    std::unique_ptr<ast::Block> result_block = std::make_unique<ast::Block>(std::move(vector));
-
-    // The condition on this while should be the 'not' of the condition above, so that the
-    // promt is printed after this is reached.
-    while (tokens::has_current() && !(interactive_mode && tokens::current::is_key_symbol('\n'))) {
-        if (tokens::current::is_key_symbol(';') || ((!interactive_mode) && tokens::current::is_key_symbol('\n'))) {
-            tokens::next();
-            continue;
+
+    void input(std::string promt) {
+        if (!lexer.has_next())  {
+            current = nullptr;
+            return;
         }
 
-        try {
-            result_block->statements.push_back(std::move(parse_statement()));
+        if (!arena)
+            arena = std::make_shared<arena::Arena>();
+        arena::Scope scope(arena);
 
-            if (tokens::has_current() && !(tokens::current::is_key_symbol(';') || tokens::current::is_key_symbol('\n')))
-                util::init_throw(__func__, "End of statement expected.");
-        } catch (std::exception& e) {
-            util::print_exception(e);
-            printf("(Error Token: %s)\n", tokens::current::describe().c_str());
+        if (lexer.current.is(tokens::START) || lexer.current.is_key_symbol('\n')) {
+            if (interactive_mode && promt.size() > 0)
+                printf("%s> ", promt.c_str());
+            lexer.next();
+            lexer.skip_newlines();
+        }
+        std::vector<std::unique_ptr<ast::Statement>> vector;
+        std::unique_ptr<ast::Block> result_block = std::make_unique<ast::Block>(std::move(vector));
+        diagnostics.clear();
 
-            // After an error, skip past the rest of the line.
-            while (tokens::has_next() && !(interactive_mode && tokens::current::is_key_symbol('\n')))
-                tokens::next();
+        // The condition on this while should be the 'not' of the condition above, so that the
+        // promt is printed after this is reached.
+        while (lexer.has_current() && !(interactive_mode && lexer.current.is_key_symbol('\n'))) {
+            if (lexer.current.is_key_symbol(';') || ((!interactive_mode) && lexer.current.is_key_symbol('\n'))) {
+                lexer.next();
+                continue;
+            }
 
+            llvm::Error error = llvm::Error::success();
+            llvm::Expected<std::unique_ptr<ast::Statement>> statement = parse_statement();
+            if (!statement) {
+                error = statement.takeError();
+            }
+            else {
+                result_block->statements.push_back(std::move(*statement));
+                if (lexer.has_current() && !(lexer.current.is_key_symbol(';') || lexer.current.is_key_symbol('\n')))
+                    error = fail(diag::Code::END_OF_STATEMENT, __func__, "End of statement expected.");
+            }
+            if (!error)
+                continue;
+
+            size_t first = diagnostics.size();
+            diagnostics.add(std::move(error));
+            for (size_t i = first; i < diagnostics.size(); i++) {
+                diagnostics.diagnostics[i].note = "(Error Token: " + lexer.current.describe() + ")";
+                report(diagnostics.diagnostics[i].describe() + "\n");
+            }
+            failures++;
+
+            // In the REPL, the rest of the line is skipped. Otherwise, parsing starts again at
+            // the next statement, so that every error in the file is found in one go. Nothing
+            // in a file with errors is run though.
+            if (interactive_mode) {
+                while (lexer.has_next() && !lexer.current.is_key_symbol('\n'))
+                    lexer.next();
+                current = nullptr;
+                return;
+            }
+            recover();
+        }
+
+        if (result_block->statements.size() == 0 || !diagnostics.empty())
             current = nullptr;
-            return;
+        else
+            current = std::move(result_block);
+
+        if (debug) {
+            if (current) {
+                std::string text = "Expression: ";
+                llvm::raw_string_ostream out(text);
+                Stringifier(out, style).walk(*current);
+                out << "\n";
+                out.flush();
+                report(text);
+            }
+            else {
+                report("Expression: nullptr\n");
+            }
         }
     }
 
-    if (result_block->statements.size() == 0)
-        current = nullptr;
-    else
-        current = std::move(result_block);
-
-    if (debug) {
-        if (current) {
-            Stringifier stringifier;
-            current.get()->visit(stringifier);
-            printf("Expression: %s\n", stringifier.getResult().c_str());
-        }
-        else {
-            printf("Expression: nullptr\n");
+    // Skip to the start of the next statement, after an error. That is after the next ';' or
+    // newline outside of any brackets, unless what follows carries the statement on, like an
+    // 'else' on the next line does. Keywords that only start statements, such as 'def', are
+    // always the start of the next one, even if a bracket was left open before them.
+    void recover() {
+        int depth = 0;
+        while (lexer.has_current()) {
+            if (lexer.current.is_keyword(tokens::KW_DEF) || lexer.current.is_keyword(tokens::KW_EXTERN)
+                || lexer.current.is_keyword(tokens::KW_IMPORT))
+                return;
+
+            if (lexer.current.is_key_symbol('(')) {
+                depth++;
+            }
+            else if (lexer.current.is_key_symbol(')')) {
+                if (depth > 0)
+                    depth--;
+            }
+            else if (depth == 0 && (lexer.current.is_key_symbol(';') || lexer.current.is_key_symbol('\n'))) {
+                lexer.next();
+                lexer.skip_newlines();
+                if (!(lexer.current.is_keyword(tokens::KW_THEN) || lexer.current.is_keyword(tokens::KW_ELSE)
+                    || lexer.current.is_keyword(tokens::KW_IN)))
+                    return;
+                continue;
+            }
+            lexer.next();
         }
     }
-}
 
-namespace {
+    // Once the result of input() is done with, the arena can be used again for the next one.
+    // Unless something from it is still around, (a function definition) in which case it is
+    // left to whatever has it, and a new one is started.
+    void reuse_arena() {
+        if (current || !arena)
+            return;
+
+        if (arena.use_count() == 1)
+            arena->reset();
+        else
+            arena = nullptr;
+    }
+
+private:
+    Precedences* table;
+
+    void report(const std::string& text) {
+        if (errors)
+            *errors += text;
+        else
+            printf("%s", text.c_str());
+    }
+
+    // An error at the current token, from the function named.
+    // (Without a file, the offset is still kept, in case the caller knows where it was from)
+    llvm::Error fail(diag::Code code, const char* function, std::string message) {
+        if (lexer.current.is(tokens::START))
+            return diag::error(code, function, std::move(message));
+        return diag::error(code, function, std::move(message), lexer.file, lexer.current.offset, (uint32_t)lexer.current.text.size());
+    }
+
+    // The expression has just been parsed, from the token at first up to the current one.
+    void record(const ast::Expr* expr, size_t first, bool grouped = false) {
+        if (spans)
+            (*spans)[expr] = {(uint32_t)first, (uint32_t)lexer.position(), grouped};
+    }
+
     /*
         PARSING
 
@@ -160,577 +295,668 @@ namespace {
         Num ::= number
     */
 
-    std::unique_ptr<ast::Command> parse_command();
-    std::unique_ptr<ast::Fn> parse_top_level_expr();
-    std::unique_ptr<ast::Import> parse_import();
-    std::unique_ptr<ast::Fn> parse_def();
-    std::unique_ptr<ast::Pro> parse_extern();
-
     // Statement ::= FnDef | Extern | Expr
-    std::unique_ptr<ast::Statement> parse_statement() {
-        if (tokens::current::kind == tokens::END || tokens::current::is_key_symbol(';')) 
+    llvm::Expected<std::unique_ptr<ast::Statement>> parse_statement() {
+        if (lexer.current.kind == tokens::END || lexer.current.is_key_symbol(';')) 
             return nullptr;
 
-        try {
-            std::unique_ptr<ast::Statement> result = nullptr;
-
-            if (tokens::current::is(tokens::COMMAND))
-                result = parse_command();
-            else if (tokens::current::is_keyword("import"))
-                result = parse_import();
-            else if (tokens::current::is_keyword("def")) 
-                result = parse_def();
-            else if (tokens::current::is_keyword("extern"))
-                result = parse_extern();
-            else
-                result = parse_top_level_expr();
-
-            return result;
-        } catch (...) {
-            util::rethrow(__func__);
-            return nullptr;
-        }
+        llvm::Expected<std::unique_ptr<ast::Statement>> result = nullptr;
+
+        if (lexer.current.is(tokens::COMMAND))
+            result = parse_command();
+        else if (lexer.current.is_keyword(tokens::KW_IMPORT))
+            result = parse_import();
+        else if (lexer.current.is_keyword(tokens::KW_DEF)) 
+            result = parse_def();
+        else if (lexer.current.is_keyword(tokens::KW_EXTERN))
+            result = parse_extern();
+        else
+            result = parse_top_level_expr();
+
+        if (!result)
+            return diag::trace(result.takeError(), __func__);
+        return result;
     }
 
-    std::unique_ptr<ast::Command> parse_command() {
-        if (!tokens::current::is(tokens::COMMAND))
-            util::init_throw(__func__, "Attempted to parse statement that was not a command, as a command.");
-        std::string content = tokens::current::text;
-        tokens::next(); // Move past the command.
-        return std::make_unique<ast::Command>(std::move(content));
+    llvm::Expected<std::unique_ptr<ast::Command>> parse_command() {
+        if (!lexer.current.is(tokens::COMMAND))
+            return fail(diag::Code::INTERNAL, __func__, "Attempted to parse statement that was not a command, as a command.");
+        std::string content(lexer.current.text);
+        uint32_t offset = lexer.current.offset;
+        lexer.next(); // Move past the command.
+        return ast::at(offset, std::make_unique<ast::Command>(std::move(content)));
     }
 
-    std::unique_ptr<ast::Import> parse_import() {
-        if (!tokens::current::is_keyword("import"))
-            util::init_throw(__func__, "Attempted to parse statement not beginning with 'import' as an import statement.");
-        tokens::next(); // Move past the 'import' keyword.
+    llvm::Expected<std::unique_ptr<ast::Import>> parse_import() {
+        if (!lexer.current.is_keyword(tokens::KW_IMPORT))
+            return fail(diag::Code::INTERNAL, __func__, "Attempted to parse statement not beginning with 'import' as an import statement.");
+        uint32_t offset = lexer.current.offset;
+        lexer.next(); // Move past the 'import' keyword.
 
-        if (!tokens::current::is(tokens::IDENTIFIER))
-            util::init_throw(__func__, "Expected file identifier after 'import' keyword.");
-        std::string name = tokens::current::text;
-        tokens::next(); // Move past the file identifier.
+        if (!lexer.current.is(tokens::IDENTIFIER))
+            return fail(diag::Code::UNEXPECTED, __func__, "Expected file identifier after 'import' keyword.");
+        std::string name(lexer.current.text);
+        lexer.next(); // Move past the file identifier.
 
-        return std::make_unique<ast::Import>(name);
-    }
+        // The import isn't run until after parsing, but anything after it
+        // may use operators it defines.
+        define_imported(name);
 
-    std::unique_ptr<ast::Expr> parse_expr();
+        return ast::at(offset, std::make_unique<ast::Import>(name));
+    }
 
     // Same as parse_expression, but wraps the result in an anonymous function.
-    std::unique_ptr<ast::Fn> parse_top_level_expr() {
-        try {
-            auto E = parse_expr();
-            auto proto = std::make_unique<ast::Pro>("_main", std::vector<std::string>(), 0);
-            return std::make_unique<ast::Fn>(std::move(proto), std::move(E));
-        } catch(...) {
-            util::rethrow(__func__);
-            return nullptr;
-        }
+    llvm::Expected<std::unique_ptr<ast::Fn>> parse_top_level_expr() {
+        uint32_t offset = lexer.current.offset;
+        auto E = parse_expr();
+        if (!E)
+            return diag::trace(E.takeError(), __func__);
+
+        auto proto = ast::at(offset, std::make_unique<ast::Pro>(ast::MAIN, std::vector<symbols::Id>(), 0));
+        std::unique_ptr<ast::Fn> fn = ast::at(offset, std::make_unique<ast::Fn>(std::move(proto), std::move(*E)));
+        fn->file = lexer.file;
+        return fn;
     }
 
-    std::unique_ptr<ast::Pro> parse_prototype();
-
     // FnDef ::= 'def' Proto Expr
-    std::unique_ptr<ast::Fn> parse_def() {
-        if (!tokens::current::is_keyword("def"))
-            util::init_throw(__func__, "Expected 'def' at the start of function definition.");
-        tokens::next(); // Move past def
-
-        try {
-            auto proto = parse_prototype();
-
-            // Allow function body definition on
-            // a new line.
-            tokens::skip_newlines();
-
-            auto expression = parse_expr();
-            std::unique_ptr<ast::Fn> fn = std::make_unique<ast::Fn>(std::move(proto), std::move(expression));
-            return fn;
-        } catch(...) {
-            util::rethrow(__func__);
-            return nullptr;
-        }
+    llvm::Expected<std::unique_ptr<ast::Fn>> parse_def() {
+        if (!lexer.current.is_keyword(tokens::KW_DEF))
+            return fail(diag::Code::INTERNAL, __func__, "Expected 'def' at the start of function definition.");
+        uint32_t offset = lexer.current.offset;
+        lexer.next(); // Move past def
+
+        auto proto = parse_prototype();
+        if (!proto)
+            return diag::trace(proto.takeError(), __func__);
+
+        // The precedence is needed for parsing anything after this, including
+        // the body, since the operator could be used recursively.
+        if ((*proto)->is_binary())
+            define((*proto)->get_symbol(), (*proto)->precedence);
+
+        // Allow function body definition on
+        // a new line.
+        lexer.skip_newlines();
+
+        auto expression = parse_expr();
+        if (!expression)
+            return diag::trace(expression.takeError(), __func__);
+
+        std::unique_ptr<ast::Fn> fn = ast::at(offset, std::make_unique<ast::Fn>(std::move(*proto), std::move(*expression)));
+        fn->file = lexer.file;
+        return fn;
     }
 
-
             
     // Extern ::= 'extern' Proto 
-    std::unique_ptr<ast::Pro> parse_extern() {
-        if (!tokens::current::is_keyword("extern"))
-            util::init_throw(__func__, "Expected keyword 'extern' at the start of external definition." );
-        tokens::next(); // Move past extern
-
-        try {
-            return parse_prototype();
-        } catch(...) {
-            util::rethrow(__func__);
-            return nullptr;
-        }
+    llvm::Expected<std::unique_ptr<ast::Pro>> parse_extern() {
+        if (!lexer.current.is_keyword(tokens::KW_EXTERN))
+            return fail(diag::Code::INTERNAL, __func__, "Expected keyword 'extern' at the start of external definition." );
+        lexer.next(); // Move past extern
+
+        auto proto = parse_prototype();
+        if (!proto)
+            return diag::trace(proto.takeError(), __func__);
+        return proto;
     }
 
     // Proto ::= (identifier | ('unary' operator) | ('binary' operator number)) '(' identifier* ')' 
-    std::unique_ptr<ast::Pro> parse_prototype() {
-        std::string name;
+    llvm::Expected<std::unique_ptr<ast::Pro>> parse_prototype() {
+        uint32_t offset = lexer.current.offset;
+        symbols::Id name;
         double precedence = 0;
         int expected_arg_count = -1;
-        if (tokens::current::is(tokens::IDENTIFIER)) {
-            name = tokens::current::text;
-            tokens::next(); // Move past the identifier.
-        }
-        else if (tokens::current::is_keyword("unary")) {
-            tokens::next(); // Move past the keyword 'unary'.
-            if (!tokens::current::is(tokens::OPERATOR))
-                util::init_throw(__func__, "Expected operator symbol after keyword 'unary'.");
-            name = "unary" + std::string(1, tokens::current::symbol);
+        if (lexer.current.is(tokens::IDENTIFIER)) {
+            name = symbols::intern(lexer.current.text);
+            lexer.next(); // Move past the identifier.
+        }
+        else if (lexer.current.is_keyword(tokens::KW_UNARY)) {
+            lexer.next(); // Move past the keyword 'unary'.
+            if (!lexer.current.is(tokens::OPERATOR))
+                return fail(diag::Code::UNEXPECTED, __func__, "Expected operator symbol after keyword 'unary'.");
+            name = ast::unary_name(lexer.current.symbol);
             expected_arg_count = 1;
-            tokens::next(); // Move past the operator symbol.
-        }
-        else if (tokens::current::is_keyword("binary")) {
-            tokens::next(); // Move past the keyword 'binary'.
-            if (!tokens::current::is(tokens::OPERATOR))
-                util::init_throw(__func__, "Expected operator symbol after keyword 'binary'.");
-            name = "binary" + std::string(1, tokens::current::symbol);
-            tokens::next(); // Move past the operator symbol.
-            if (!tokens::current::is(tokens::NUMBER))
-                util::init_throw(__func__, "Expected precedence after keyword binary and operator symbol.");
-            precedence = tokens::current::num;
+            lexer.next(); // Move past the operator symbol.
+        }
+        else if (lexer.current.is_keyword(tokens::KW_BINARY)) {
+            lexer.next(); // Move past the keyword 'binary'.
+            if (!lexer.current.is(tokens::OPERATOR))
+                return fail(diag::Code::UNEXPECTED, __func__, "Expected operator symbol after keyword 'binary'.");
+            name = ast::binary_name(lexer.current.symbol);
+            lexer.next(); // Move past the operator symbol.
+            if (!lexer.current.is(tokens::NUMBER))
+                return fail(diag::Code::UNEXPECTED, __func__, "Expected precedence after keyword binary and operator symbol.");
+            precedence = lexer.current.num;
             expected_arg_count = 2;
-            tokens::next(); // Move past the precedence number.
+            lexer.next(); // Move past the precedence number.
         }
         else {
-            util::init_throw(__func__, "Expected identifier, 'binary', or 'unary' at the beginning of prototype.");
+            return fail(diag::Code::UNEXPECTED, __func__, "Expected identifier, 'binary', or 'unary' at the beginning of prototype.");
         }
 
-        if (!tokens::current::is_key_symbol('('))
-            util::init_throw(__func__, "Expected '(' after prototype identification.");
-        tokens::next(); // Move past '('
+        if (!lexer.current.is_key_symbol('('))
+            return fail(diag::Code::UNEXPECTED, __func__, "Expected '(' after prototype identification.");
+        lexer.next(); // Move past '('
 
-        std::vector<std::string> arg_names;
-        while (tokens::current::is(tokens::IDENTIFIER)) {
-            arg_names.push_back(tokens::current::text);
-            tokens::next();
+        std::vector<symbols::Id> arg_names;
+        while (lexer.current.is(tokens::IDENTIFIER)) {
+            arg_names.push_back(symbols::intern(lexer.current.text));
+            lexer.next();
         }
 
-        if (tokens::current::is_key_symbol(','))
-            printf("NOTE: Prototype arguments aren't comma delimited. E.g.: 'def f(a b)'\n");
+        if (lexer.current.is_key_symbol(','))
+            report("NOTE: Prototype arguments aren't comma delimited. E.g.: 'def f(a b)'\n");
 
-        if (!tokens::current::is_key_symbol(')'))
-            util::init_throw(__func__, "Expected ')' at the end of prototype arguments");
-        tokens::next(); // Move past ')'
+        if (!lexer.current.is_key_symbol(')'))
+            return fail(diag::Code::UNEXPECTED, __func__, "Expected ')' at the end of prototype arguments");
+        lexer.next(); // Move past ')'
 
         if (expected_arg_count != arg_names.size()) {
             if (expected_arg_count == 1)
-                util::init_throw(__func__, "Expected strictly 1 argument for a unary operator.");
+                return fail(diag::Code::OPERATOR_ARITY, __func__, "Expected strictly 1 argument for a unary operator.");
             else if (expected_arg_count == 2)
-                util::init_throw(__func__, "Expected strictly 2 arguments for a binary operator.");
+                return fail(diag::Code::OPERATOR_ARITY, __func__, "Expected strictly 2 arguments for a binary operator.");
         }
 
-        return std::make_unique<ast::Pro>(name, std::move(arg_names), precedence);
+        return ast::at(offset, std::make_unique<ast::Pro>(name, std::move(arg_names), precedence));
     }
 
-    std::unique_ptr<ast::Expr> parse_primary();
-    std::unique_ptr<ast::Expr> parse_rhs(double, std::unique_ptr<ast::Expr>);
+    // Expr ::= Primary (operator SKIP Primary)*
+    //
+    // Rather than recursing for each operator, nested group or call, this keeps a stack
+    // of whatever is unfinished, so there is no limit on how deeply an expression can 
+    // nest. (Only keyword expressions, such as if, recurse) 
+    // Binary operators are left associative, and higher precedences bind tighter.
+    llvm::Expected<std::unique_ptr<ast::Expr>> parse_expr() {
+        // Something that has been started, waiting on the expression after it.
+        struct Pending {
+            enum Kind { UNARY, BINARY, GROUP, CALL, ASSIGNMENT } kind;
+            char op;
+            double precedence;
+            symbols::Id name;
+            // For calls, where the arguments start on the operand stack.
+            size_t first_arg;
+            // The token it started at.
+            size_t start;
+            // Where the node goes in the source. (See ast::Item::offset)
+            uint32_t offset;
+        };
+
+        std::vector<Pending> pending;
+        std::vector<std::unique_ptr<ast::Expr>> operands;
+
+        // Build the node for the binary operator on top of the stack.
+        auto reduce_binary = [&]() {
+            std::unique_ptr<ast::Expr> rhs = std::move(operands.back());
+            operands.pop_back();
+            std::unique_ptr<ast::Expr> lhs = std::move(operands.back());
+            operands.pop_back();
+            size_t first = spans ? spans->at(lhs.get()).first : 0;
+            operands.push_back(ast::at(pending.back().offset, std::make_unique<ast::Bin>(pending.back().op, std::move(lhs), std::move(rhs))));
+            record(operands.back().get(), first);
+            pending.pop_back();
+        };
+
+        // Unary operators apply to a single primary, so they are finished 
+        // as soon as the primary is.
+        auto reduce_unary = [&]() {
+            while (pending.size() > 0 && pending.back().kind == Pending::UNARY) {
+                std::unique_ptr<ast::Expr> rhs = std::move(operands.back());
+                operands.pop_back();
+                operands.push_back(ast::at(pending.back().offset, std::make_unique<ast::Un>(pending.back().op, std::move(rhs))));
+                record(operands.back().get(), pending.back().start);
+                pending.pop_back();
+            }
+        };
 
-    // Expr ::= primary (operator Primary)*
-    std::unique_ptr<ast::Expr> parse_expr() {
-        try {
-            auto LHS = parse_primary();
-            return parse_rhs(0, std::move(LHS));
-        } catch(...) {
-            util::rethrow(__func__);
-            return nullptr;
-        }
-    }
+        while (true) {
+            // Expecting a primary.
+            size_t first = lexer.position();
+            uint32_t offset = lexer.current.offset;
+
+            // Unary ::= operator SKIP Primary
+            if (lexer.current.is(tokens::OPERATOR)) {
+                pending.push_back({Pending::UNARY, lexer.current.symbol, 0, 0, 0, first, offset});
+                lexer.next(); // Move past the operator symbol.
+                lexer.skip_newlines(); // Expression definitely not finished.
+                continue;
+            }
 
-    std::unique_ptr<ast::Expr> parse_unary();
-    std::unique_ptr<ast::Expr> parse_identifier();
-    std::unique_ptr<ast::Expr> parse_number();
-    std::unique_ptr<ast::Expr> parse_if();
-    std::unique_ptr<ast::Expr> parse_for();
-    std::unique_ptr<ast::Expr> parse_group();
-    std::unique_ptr<ast::With> parse_with();
-
-    // Primary ::= Num | Group | Var | If | For | With | Unary
-    std::unique_ptr<ast::Expr> parse_primary() {
-        try {
-            if (tokens::current::is_keyword("if"))
-                return parse_if();
-            else if (tokens::current::is_keyword("for"))
-                return parse_for();
-            else if (tokens::current::is_keyword("with"))
-                return parse_with();
-            else if (tokens::current::is_key_symbol('('))
-                return parse_group();
-            else if (tokens::current::is(tokens::OPERATOR))
-                return parse_unary();
-            else if (tokens::current::is(tokens::IDENTIFIER))
-                return parse_identifier();
-            else if (tokens::current::is(tokens::NUMBER))
-                return parse_number();
-        } catch(...) {
-            util::rethrow(__func__);
-            return nullptr;
-        }
+            // Group ::= '(' SKIP Expr SKIP ')'
+            if (lexer.current.is_key_symbol('(')) {
+                pending.push_back({Pending::GROUP, 0, 0, 0, 0, first, offset});
+                lexer.next(); // Move on from '('
+                lexer.skip_newlines(); // Definitely not finished here.
+                continue;
+            }
 
-        util::init_throw(__func__, "Expected identifier, number, or '('.");
-        return nullptr;
-    } 
+            // Var ::= Ref | Assignment | FnCall
+            if (lexer.current.is(tokens::IDENTIFIER)) {
+                symbols::Id name = symbols::intern(lexer.current.text);
+                lexer.next(); // Move on from the identifier.
+
+                // Assignment ::= identifier '=' Expr
+                if (lexer.current.is_key_symbol('=')) {
+                    pending.push_back({Pending::ASSIGNMENT, 0, 0, name, 0, first, offset});
+                    lexer.next(); // Move on from '='
+                    lexer.skip_newlines(); // Definitely not done.
+                    continue;
+                }
+
+                // FnCall ::= identifier '(' SKIP (Expr (',' SKIP Expr)*)? SKIP ')'
+                if (lexer.current.is_key_symbol('(')) {
+                    lexer.next(); // Move on from '('
+                    lexer.skip_newlines(); // Definitely not finished here.
+
+                    if (!lexer.current.is_key_symbol(')')) {
+                        pending.push_back({Pending::CALL, 0, 0, name, operands.size(), first, offset});
+                        continue;
+                    }
+
+                    lexer.next(); // Move on from ')'
+                    operands.push_back(std::make_unique<ast::Call>(name, ast::List<std::unique_ptr<ast::Expr>>()));
+                }
+                // Ref ::= identifier
+                else {
+                    operands.push_back(std::make_unique<ast::Var>(name));
+                }
+            }
+            else {
+                auto primary = parse_primary();
+                if (!primary)
+                    return diag::trace(primary.takeError(), __func__);
+                operands.push_back(std::move(*primary));
+            }
+            operands.back()->offset = offset;
+            record(operands.back().get(), first);
+
+            reduce_unary();
+
+            // Expecting an operator, or the end of something.
+            while (true) {
+                double precedence = get_precedence();
+
+                if (precedence >= 0) {
+                    // Anything before this that binds at least as tightly is finished.
+                    while (pending.size() > 0 && pending.back().kind == Pending::BINARY 
+                        && pending.back().precedence >= precedence)
+                        reduce_binary();
 
-    // Unary ::= operator Primary
-    std::unique_ptr<ast::Expr> parse_unary() {
-        if (!tokens::current::is(tokens::OPERATOR))
-            util::init_throw(__func__, "Expected operator at the beginning of unary expression.");
-        char op = tokens::current::symbol;
-        tokens::next(); // Move past the operator symbol.
-        tokens::skip_newlines(); // Expression definitely not finished.
-        std::unique_ptr<ast::Expr> rhs = parse_primary();
-        return std::make_unique<ast::Un>(op, std::move(rhs));
+                    pending.push_back({Pending::BINARY, lexer.current.symbol, precedence, 0, 0, 0, lexer.current.offset});
+                    lexer.next(); // Move on past the operator.
+                    lexer.skip_newlines(); // Expression is definitely not finished.
+                    break;
+                }
+
+                // Not an operator, so the innermost unfinished expression ends here.
+                while (pending.size() > 0 && pending.back().kind == Pending::BINARY)
+                    reduce_binary();
+
+                if (pending.size() == 0)
+                    return std::move(operands.back());
+
+                Pending& top = pending.back();
+                if (top.kind == Pending::ASSIGNMENT) {
+                    std::unique_ptr<ast::Expr> value = std::move(operands.back());
+                    operands.pop_back();
+                    operands.push_back(ast::at(top.offset, std::make_unique<ast::Assignment>(top.name, std::move(value))));
+                    record(operands.back().get(), top.start);
+                    pending.pop_back();
+                }
+                else if (top.kind == Pending::GROUP) {
+                    lexer.skip_newlines(); // Not finished until that last bracket is added in.        
+                    if (!lexer.current.is_key_symbol(')'))
+                        return diag::trace(fail(diag::Code::UNEXPECTED, "parse_group", "Expected ')'"), __func__);
+                    lexer.next(); // Move on from ')'
+                    // (The operand stays as it is, there is no node for a group)
+                    record(operands.back().get(), top.start, true);
+                    pending.pop_back();
+                }
+                else if (top.kind == Pending::CALL) {
+                    lexer.skip_newlines(); // Definitely not finished.
+
+                    if (lexer.current.is_key_symbol(',')) {
+                        lexer.next(); // Move on from ','
+                        lexer.skip_newlines(); // Definitely not finished here.
+                        break; // On to the next argument.
+                    }
+
+                    if (!lexer.current.is_key_symbol(')'))
+                        return diag::trace(fail(diag::Code::UNEXPECTED, "parse_call", "Expected ')' or ',' after expression in function argument list."), __func__);
+                    lexer.next(); // Move on from ')'
+
+                    ast::List<std::unique_ptr<ast::Expr>> args;
+                    args.reserve(operands.size() - top.first_arg);
+                    for (size_t i = top.first_arg; i < operands.size(); i++)
+                        args.push_back(std::move(operands[i]));
+                    operands.resize(top.first_arg);
+                    operands.push_back(ast::at(top.offset, std::make_unique<ast::Call>(top.name, std::move(args))));
+                    record(operands.back().get(), top.start);
+                    pending.pop_back();
+                }
+
+                reduce_unary();
+            }
+        }
     }
 
+    // Primary ::= Num | If | For | With
+    // (The rest are dealt with by parse_expr)
+    llvm::Expected<std::unique_ptr<ast::Expr>> parse_primary() {
+        llvm::Expected<std::unique_ptr<ast::Expr>> result = nullptr;
+        if (lexer.current.is_keyword(tokens::KW_IF))
+            result = parse_if();
+        else if (lexer.current.is_keyword(tokens::KW_FOR))
+            result = parse_for();
+        else if (lexer.current.is_keyword(tokens::KW_WITH))
+            result = parse_with();
+        else if (lexer.current.is(tokens::NUMBER))
+            result = parse_number();
+        else
+            return fail(diag::Code::UNEXPECTED, __func__, "Expected identifier, number, or '('.");
+
+        if (!result)
+            return diag::trace(result.takeError(), __func__);
+        return result;
+    } 
+
     // With ::= 'with' SKIP identifier ('=' SKIP Expr)? (',' SKIP identifier ('=' SKIP Expr)?)+ SKIP 'in' SKIP Exr
-    std::unique_ptr<ast::With> parse_with() {
-        if (!tokens::current::is_keyword("with"))
-            util::init_throw(__func__, "Expected 'with' at the beginning of 'with' expression.");
+    llvm::Expected<std::unique_ptr<ast::Expr>> parse_with() {
+        if (!lexer.current.is_keyword(tokens::KW_WITH))
+            return fail(diag::Code::INTERNAL, __func__, "Expected 'with' at the beginning of 'with' expression.");
 
-        std::vector<std::pair<std::string, std::unique_ptr<ast::Expr>>> assignments;
+        ast::List<std::pair<symbols::Id, std::unique_ptr<ast::Expr>>> assignments;
 
         do {
-            tokens::next(); // Move past the 'with' keyword, or the ',' symbol.
-            tokens::skip_newlines(); // Expression definitely not finished.
+            lexer.next(); // Move past the 'with' keyword, or the ',' symbol.
+            lexer.skip_newlines(); // Expression definitely not finished.
 
-            if (!tokens::current::is(tokens::IDENTIFIER))
-                util::init_throw(__func__, "Expected variable assignment in with to begin with identifier.");
-            std::string current_name = tokens::current::text;
-            tokens::next(); // Move past the identifier.
+            if (!lexer.current.is(tokens::IDENTIFIER))
+                return fail(diag::Code::UNEXPECTED, __func__, "Expected variable assignment in with to begin with identifier.");
+            symbols::Id current_name = symbols::intern(lexer.current.text);
+            lexer.next(); // Move past the identifier.
 
             std::unique_ptr<ast::Expr> current_expr = nullptr;
-            if (tokens::current::is_key_symbol('=')) {
-                tokens::next(); // Move past the '=' symbol.
-                tokens::skip_newlines(); // Definitely not done.
-                try {
-                    current_expr = parse_expr();
-                } 
-                catch (...) {
-                    util::rethrow(__func__, "assignment value");
-                    return nullptr;
-                }
+            if (lexer.current.is_key_symbol('=')) {
+                lexer.next(); // Move past the '=' symbol.
+                lexer.skip_newlines(); // Definitely not done.
+                auto value = parse_expr();
+                if (!value)
+                    return diag::trace(value.takeError(), __func__, "assignment value");
+                current_expr = std::move(*value);
             }
 
-            assignments.push_back(std::move(std::pair<std::string, std::unique_ptr<ast::Expr>>(current_name, std::move(current_expr))));
-        } while (tokens::current::is_key_symbol(','));
+            assignments.push_back(std::move(std::pair<symbols::Id, std::unique_ptr<ast::Expr>>(current_name, std::move(current_expr))));
+        } while (lexer.current.is_key_symbol(','));
 
         if (assignments.size() == 0)
-            util::init_throw(__func__, "Expected variable identifier after 'with' keyword.");
+            return fail(diag::Code::UNEXPECTED, __func__, "Expected variable identifier after 'with' keyword.");
         
-        tokens::skip_newlines(); // The body can start on the next line.
-        if (!tokens::current::is_keyword("in"))
-            util::init_throw(__func__, "Expected 'in' keyword after 'with' expression header.");
-        tokens::next(); // Move past the 'in' keyword.
-        tokens::skip_newlines();
-
-        std::unique_ptr<ast::Expr> body;
-        try {
-            body = parse_expr();
-        }
-        catch (...) {
-            util::rethrow(__func__, "body");
-            return nullptr;
-        }
+        lexer.skip_newlines(); // The body can start on the next line.
+        if (!lexer.current.is_keyword(tokens::KW_IN))
+            return fail(diag::Code::UNEXPECTED, __func__, "Expected 'in' keyword after 'with' expression header.");
+        lexer.next(); // Move past the 'in' keyword.
+        lexer.skip_newlines();
 
-        return std::make_unique<ast::With>(std::move(assignments), std::move(body));
+        auto body = parse_expr();
+        if (!body)
+            return diag::trace(body.takeError(), __func__, "body");
+
+        return std::make_unique<ast::With>(std::move(assignments), std::move(*body));
     }
 
     // Binary operators and precedence
 
-    std::map<char, double> operator_precedence;
-
-}
-
-void register_precedence(char op, double precedence) {
-    operator_precedence[op] = precedence;
-}
-
-namespace {
-
     double get_precedence() {
-        if (!tokens::current::is(tokens::OPERATOR))
+        if (!lexer.current.is(tokens::OPERATOR))
             return -1.;
 
-        if (operator_precedence.count(tokens::current::symbol) == 0)
-            return 0.;
-
-        return operator_precedence[tokens::current::symbol];
+        unsigned char symbol = (unsigned char)lexer.current.symbol;
+        used[symbol] = true;
+        return (*table)[symbol];
     }
 
-    void setup_precedence() {
-        // TODO: extend this for other ops!
-        operator_precedence['^'] = 11;
-        operator_precedence['*'] = 10;
-        operator_precedence['/'] = 10;
-        operator_precedence['+'] = 9;
-        operator_precedence['-'] = 9;
-        operator_precedence['<'] = 8;
-        operator_precedence['>'] = 8;
-        operator_precedence['='] = 7;
-        operator_precedence['&'] = 6;
-        operator_precedence['|'] = 5;
+    // A new operator precedence, from a definition that has just been parsed.
+    void define(char op, double precedence) {
+        (*table)[(unsigned char)op] = precedence;
+        defined.push_back(std::make_pair(op, precedence));
     }
 
-    std::unique_ptr<ast::Expr> parse_rhs(
-        double expr_precedence,
-        std::unique_ptr<ast::Expr> lhs
-    ) {
-        // If this is a binary operator, find its precedence.
-        while (true) {
-            double token_precedence = get_precedence();
-
-            // If this binop does not bind at least as tightly as the current binop,
-            // then we are done.
-            if (token_precedence < expr_precedence)
-                return lhs;
-
-            // Okay, we know this is a binary operator.
-            // (get_precedence() already checked that this is a symbol, note)
-            int binary_op = tokens::current::symbol;
-
-            tokens::next(); // Move on past the operator.
-            tokens::skip_newlines(); // Expression is definitely not finished.
-
-            // Parse the primary expression after the binary operator.
-            std::unique_ptr<ast::Expr> rhs;
-            try {
-                rhs = parse_primary();
-            } catch(...) {
-                util::rethrow(__func__);
-                return nullptr;
-            }
-
-            // If binary_op binds less tightly with RHS than the operator after RHS, let
-            // the pending operator take RHS as its LHS.
-            double next_precedence = get_precedence();
-            if (token_precedence < next_precedence) {
-                rhs = parse_rhs(token_precedence + 1, std::move(rhs));
-            }
+    // Define the precedences of any operators defined by a builtin import.
+    // Only the prototypes matter here, so the tokens are just scanned for "binary op precedence".
+    void define_imported(const std::string& name) {
+        auto iter = builtins::map.find(name);
+        if (iter == builtins::map.end())
+            return;
 
-            // Merge LHS/RHS.
-            lhs = std::make_unique<ast::Bin>(binary_op, std::move(lhs), std::move(rhs));
+        tokens::Buffer buffer = tokens::lex_all(*iter->second);
+        for (size_t i = 0; i + 2 < buffer.size(); i++) {
+            if (buffer.kinds[i] == tokens::KEYWORD && buffer.words[i] == tokens::KW_BINARY
+                && buffer.kinds[i + 1] == tokens::OPERATOR && buffer.kinds[i + 2] == tokens::NUMBER)
+                define(buffer.text(i + 1)[0], buffer.nums[i + 2]);
         }
     }
 
     // For ::= 'for' identifier '=' start:Expr ',' end:Expr (',' inc:Expr) 'in' body:Expr
-    std::unique_ptr<ast::Expr> parse_for() {
-        if (!tokens::current::is_keyword("for"))
-            util::init_throw(__func__, "Tried to parse a series of tokens which don't start with 'for', as a for-expression.");
-        tokens::next(); // Move on from the 'for' keyword.
-
-        if (!tokens::current::is(tokens::IDENTIFIER))
-            util::init_throw(__func__, "Expected variable name after 'for' keyword.");
-        std::string var_name = tokens::current::text;
-        tokens::next(); // Move on from the identifier.
-
-        if (!tokens::current::is_key_symbol('='))
-            util::init_throw(__func__, "Expected '=' after variable name for assignment in for loop.");
-        tokens::next(); // Move on from the '=' symbol.
-
-        std::unique_ptr<ast::Expr> start;
-        try {
-            start = parse_expr();
-        }
-        catch(...) {
-            util::rethrow(__func__, "start");
-            return nullptr;
-        }
+    llvm::Expected<std::unique_ptr<ast::Expr>> parse_for() {
+        if (!lexer.current.is_keyword(tokens::KW_FOR))
+            return fail(diag::Code::INTERNAL, __func__, "Tried to parse a series of tokens which don't start with 'for', as a for-expression.");
+        lexer.next(); // Move on from the 'for' keyword.
 
-        if (!tokens::current::is_key_symbol(','))
-            util::init_throw(__func__, "Expected ',' after variable declaration in for-expression.");
-        tokens::next(); // Move on from the ',' symbol.
-        tokens::skip_newlines(); // Allow each header segment to be on a separate line.
+        if (!lexer.current.is(tokens::IDENTIFIER))
+            return fail(diag::Code::UNEXPECTED, __func__, "Expected variable name after 'for' keyword.");
+        symbols::Id var_name = symbols::intern(lexer.current.text);
+        lexer.next(); // Move on from the identifier.
 
-        std::unique_ptr<ast::Expr> end;
-        try {
-            end = parse_expr();
-        } catch(...) {
-            util::rethrow(__func__, "end");
-            return nullptr;
-        }
+        if (!lexer.current.is_key_symbol('='))
+            return fail(diag::Code::UNEXPECTED, __func__, "Expected '=' after variable name for assignment in for loop.");
+        lexer.next(); // Move on from the '=' symbol.
+
+        auto start = parse_expr();
+        if (!start)
+            return diag::trace(start.takeError(), __func__, "start");
+
+        if (!lexer.current.is_key_symbol(','))
+            return fail(diag::Code::UNEXPECTED, __func__, "Expected ',' after variable declaration in for-expression.");
+        lexer.next(); // Move on from the ',' symbol.
+        lexer.skip_newlines(); // Allow each header segment to be on a separate line.
+
+        auto end = parse_expr();
+        if (!end)
+            return diag::trace(end.takeError(), __func__, "end");
 
         std::unique_ptr<ast::Expr> inc = nullptr;
-        if (tokens::current::is_key_symbol(',')) {
-            tokens::next(); // Move on from the ',' symbol.
-            tokens::skip_newlines(); // Allow each header segment to be on a separate line.
-            try {
-                inc = parse_expr();
-            } catch(...) {
-                util::rethrow(__func__, "inc");
-                return nullptr;
-            }
+        if (lexer.current.is_key_symbol(',')) {
+            lexer.next(); // Move on from the ',' symbol.
+            lexer.skip_newlines(); // Allow each header segment to be on a separate line.
+            auto step = parse_expr();
+            if (!step)
+                return diag::trace(step.takeError(), __func__, "inc");
+            inc = std::move(*step);
         }
 
         // I'm being free with newlines here.
-        tokens::skip_newlines();
-        if (!tokens::current::is_keyword("in"))
-            util::init_throw(__func__, "Expected 'in' keyword before body in for-expression.");
-        tokens::next(); // Move on from the 'in' keyword.
-        tokens::skip_newlines();
-
-        std::unique_ptr<ast::Expr> body;
-        try {
-            body = parse_expr();
-        }
-        catch(...) {
-            util::rethrow(__func__, "body");
-            return nullptr;
-        }
-
-        return std::make_unique<ast::For>(var_name, std::move(start), 
-            std::move(end), std::move(inc), std::move(body));
+        lexer.skip_newlines();
+        if (!lexer.current.is_keyword(tokens::KW_IN))
+            return fail(diag::Code::UNEXPECTED, __func__, "Expected 'in' keyword before body in for-expression.");
+        lexer.next(); // Move on from the 'in' keyword.
+        lexer.skip_newlines();
+
+        auto body = parse_expr();
+        if (!body)
+            return diag::trace(body.takeError(), __func__, "body");
+
+        return std::make_unique<ast::For>(var_name, std::move(*start), 
+            std::move(*end), std::move(inc), std::move(*body));
     }
 
     // If ::= 'if' cond:Expr 'then' a:Expr ('else' b:Expr)?
-    std::unique_ptr<ast::Expr> parse_if() {
-        if (!tokens::current::is_keyword("if"))
-            util::init_throw(__func__, "Tried to parse a series of tokens which don't start with 'if', as an if-expression.");
-        tokens::next(); // Move on from the 'if' keyword.
-
-        std::unique_ptr<ast::Expr> condition;
-        try {  
-            condition = parse_expr();
-        }
-        catch(...) {
-            util::rethrow(__func__, "condition");
-            return nullptr;
-        }
+    llvm::Expected<std::unique_ptr<ast::Expr>> parse_if() {
+        if (!lexer.current.is_keyword(tokens::KW_IF))
+            return fail(diag::Code::INTERNAL, __func__, "Tried to parse a series of tokens which don't start with 'if', as an if-expression.");
+        lexer.next(); // Move on from the 'if' keyword.
+
+        auto condition = parse_expr();
+        if (!condition)
+            return diag::trace(condition.takeError(), __func__, "condition");
 
         // The then keyword can be placed on a line with the body, or with
         // the header, or on its own, it doesn't matter.
-        tokens::skip_newlines();
-        if (!tokens::current::is_keyword("then"))
-            util::init_throw(__func__, "Expected 'then' keyword after 'if' and condition expression.");
-        tokens::next(); // Move on from the 'then' keyword.
+        lexer.skip_newlines();
+        if (!lexer.current.is_keyword(tokens::KW_THEN))
+            return fail(diag::Code::UNEXPECTED, __func__, "Expected 'then' keyword after 'if' and condition expression.");
+        lexer.next(); // Move on from the 'then' keyword.
         // The if statement body can be on the next line.
-        tokens::skip_newlines();
+        lexer.skip_newlines();
 
-        std::unique_ptr<ast::Expr> a;
-        try {
-            a = parse_expr();
-        }
-        catch(...) {
-            util::rethrow(__func__, "then");
-            return nullptr;
-        }
+        auto a = parse_expr();
+        if (!a)
+            return diag::trace(a.takeError(), __func__, "then");
 
         // This is arguable. It means that the else can
         // be on the next line, but also that a short if-statement
         // must be terminated by a ';'.
-        tokens::skip_newlines();
+        lexer.skip_newlines();
 
         std::unique_ptr<ast::Expr> b = nullptr;
-        if (tokens::current::is_keyword("else")) {
-            tokens::next(); // Move on from the 'else' keyword.
-            tokens::skip_newlines(); // The else statement body can be on a new line.
-            try {
-                b = parse_expr();
-            }
-            catch(...) {
-                util::rethrow(__func__, "else");
-                return nullptr;
-            }
+        if (lexer.current.is_keyword(tokens::KW_ELSE)) {
+            lexer.next(); // Move on from the 'else' keyword.
+            lexer.skip_newlines(); // The else statement body can be on a new line.
+            auto otherwise = parse_expr();
+            if (!otherwise)
+                return diag::trace(otherwise.takeError(), __func__, "else");
+            b = std::move(*otherwise);
         }
 
-        return std::make_unique<ast::If>(std::move(condition), std::move(a), std::move(b));
+        return std::make_unique<ast::If>(std::move(*condition), std::move(*a), std::move(b));
     }
 
-    // Call ::= Ref | FnCall | Assignment
-    // Ref ::= identifier
-    // FnCall ::= identifier '(' (expression (',' expression)*)? ')'
-    // Assignment ::= identifier '=' Expr
-    std::unique_ptr<ast::Expr> parse_identifier() {
-        if (!tokens::current::is(tokens::IDENTIFIER))
-            util::init_throw(__func__, "Tried to parse token that was not an identifier, as an identifier.");
-        std::string name = tokens::current::text; // Use the current identifier token.
-        tokens::next(); // Move on from the identifier.
-
-        // It could be an assignment.
-        if (tokens::current::is_key_symbol('=')) {
-            tokens::next(); // Move on from '='
-            tokens::skip_newlines(); // Definitely not done.
-            std::unique_ptr<ast::Expr> value;
-            try {
-                value = parse_expr();
-            }
-            catch (...) {
-                util::rethrow(__func__, "assignment value");
-                return nullptr;
-            }
-            return std::make_unique<ast::Assignment>(name, std::move(value));
+    // Num ::= number
+    llvm::Expected<std::unique_ptr<ast::Expr>> parse_number() {
+        if (!lexer.current.is(tokens::NUMBER))
+            return fail(diag::Code::INTERNAL, __func__, "Attempted to parse token that was not a number, as a number.");
+
+        auto result = std::make_unique<ast::Num>(lexer.current.num);
+        lexer.next(); // Move on from the number.
+        return std::move(result);
+    }};
+
+// The parser for the REPL, reading from std::cin.
+Parser repl(precedences);
+
+// The result of parsing one file with parse_files().
+struct Parsed {
+    std::string path;
+    // Everything in the file, or nullptr if there was an error.
+    std::unique_ptr<ast::Block> block;
+    // Any errors or other messages, to be shown when the block is run.
+    std::string errors;
+};
+
+namespace {
+    struct BatchItem {
+        Parsed parsed;
+        Precedences seen;
+        std::vector<std::pair<char, double>> defined;
+        std::array<bool, 256> used {};
+    };
+
+    void parse_into(BatchItem& item) {
+        item.parsed.block = nullptr;
+        item.parsed.errors.clear();
+
+        llvm::Expected<tokens::Buffer> buffer = tokens::lex_file(item.parsed.path);
+        if (!buffer) {
+            item.parsed.errors = "Unable to read '" + item.parsed.path + "': " + llvm::toString(buffer.takeError()) + "\n";
+            return;
         }
 
-        // If it's not an assignment or a followed by an open bracket (a call),#
-        // then it is a basic reference.
-        if (!tokens::current::is_key_symbol('('))
-            return std::make_unique<ast::Var>(name);
+        // The parser adds to the table as it goes, so it gets a copy.
+        Precedences table = item.seen;
+        Parser parser(table);
+        parser.errors = &item.parsed.errors;
+        parser.interactive_mode = false;
+        parser.lexer.set_input(*buffer);
 
-        // Else, a function call.
-        tokens::next(); // Move on from '('
-        tokens::skip_newlines(); // Definitely not finished here.
+        // Not interactive, so this is one block for the whole file.
+        parser.input("");
+        item.parsed.block = std::move(parser.current);
+        item.defined = std::move(parser.defined);
+        item.used = parser.used;
+    }
 
-        std::vector<std::unique_ptr<ast::Expr>> args;
-        if (!tokens::current::is_key_symbol(')')) {
-            while (true) {
-                if (auto arg = parse_expr())
-                    args.push_back(std::move(arg));
-                else
-                    util::init_throw(__func__, "Expected expression after '(' or ',' in function argument list.");
-                tokens::skip_newlines(); // Definitely not finished.
+}
 
-                if (tokens::current::is_key_symbol(')'))
-                    break;
+// Parse whole files at once, in parallel, each into its own block.
+// 
+// Each file is parsed with the precedences as they were before the batch, and after
+// everything is parsed the operators defined by each file are added to expr::precedences,
+// in the order of the files. So the result is the same as if they had been parsed one at a
+// time: if a file uses an operator whose precedence was changed by an earlier file
+// in the batch, it is parsed again with the right precedences.
+std::vector<Parsed> parse_files(const std::vector<std::string>& paths) {
+    std::vector<BatchItem> items(paths.size());
+    for (size_t i = 0; i < paths.size(); i++) {
+        items[i].parsed.path = paths[i];
+        items[i].seen = precedences;
+    }
 
-                if (!tokens::current::is_key_symbol(','))
-                    util::init_throw(__func__, "Expected ')' or ',' after expression in function argument list.");
-                
-                tokens::next(); // Move on from ','
-                tokens::skip_newlines(); // Definitely not finished here.
+    threads::Pool& pool = threads::pool();
+    for (BatchItem& item: items)
+        pool.submit([&item]() { parse_into(item); });
+    pool.wait();
+
+    std::vector<Parsed> result;
+    for (BatchItem& item: items) {
+        bool stale = false;
+        for (int op = 0; op < 256; op++) {
+            if (item.used[op] && item.seen[op] != precedences[op]) {
+                stale = true;
+                break;
             }
         }
 
-        tokens::next(); // Move on from ')'
+        if (stale) {
+            item.seen = precedences;
+            parse_into(item);
+        }
+
+        for (std::pair<char, double>& definition: item.defined)
+            register_precedence(definition.first, definition.second);
 
-        return std::make_unique<ast::Call>(name, std::move(args));
+        result.push_back(std::move(item.parsed));
     }
 
-    // Group ::= '(' Expr ')'
-    std::unique_ptr<ast::Expr> parse_group() {
-        if (!tokens::current::is_key_symbol('('))
-            util::init_throw(__func__, "Expected '(' at the beginning of an expression group.");
-        tokens::next(); // Move on from '('
-        tokens::skip_newlines(); // Definitely not finished here.
-
-        std::unique_ptr<ast::Expr> expression;
-        try {
-            expression = parse_expr();
-        } catch(...) {
-            util::rethrow(__func__);
-            return nullptr;
-        }
+    return result;
+}
 
-        tokens::skip_newlines(); // Not finished until that last bracket is added in.        
-        if (!tokens::current::is_key_symbol(')'))
-            util::init_throw(__func__, "Expected ')'");
+/*
+    EXAMPLE
+*/
 
-        tokens::next(); // Move on from ')'
+llvm::Error interactive() {
+    init();
+    debug = true;
 
-        return expression;
-    }
+    printf("\n");
+    printf("Expressions:\n");
+    printf(" -> x \t\t\t(basic reference)\n");
+    printf(" -> 2 + 2 \t\t(binary operator)\n");
+    printf(" -> 2*2 + 2/2 \t\t(operator precedence)\n");
+    printf(" -> 2*(2 + var) \t(grouping)\n");
+    printf(" -> 2 + 3 + 4 \t\t(associativity)\n");
+    printf("\nDefintions:\n");
+    printf(" -> def f() x \t\t\t(function definition)\n");
+    printf(" -> def f(x) 2*x; f(2) \t\t(function call, multiple statements)\n");
+    printf(" -> extern print(text, end); \t(external definition)\n");
+    printf("\n");
 
-    // Num ::= number
-    std::unique_ptr<ast::Expr> parse_number() {
-        if (!tokens::current::is(tokens::NUMBER))
-            util::init_throw(__func__, "Attempted to parse token that was not a number, as a number.");
+    while (repl.has_next())
+        repl.input("parsing");
 
-        auto result = std::make_unique<ast::Num>(tokens::current::num);
-        tokens::next(); // Move on from the number.
-        return std::move(result);
-    }
+    printf("Info: end of input reached, exiting.\n");
+        
+    return llvm::Error::success();
 }
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,717 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <memory>
+#include <cstring>
+#include <functional>
+#include <unordered_map>
+
+#include "ast.cpp"
+#include "visitor.h"
+
+// A flat form of the syntax tree.
+//
+// Instead of a node per allocation, linked by pointers, each kind of node has an array of its
+// own, and children are referred to by their place in the array for their kind. (See Ref)
+// Nodes are small fixed size structs with no pointers in them, so a tree is cheap to copy
+// or compare, and walking one reads memory in order rather than chasing pointers.
+//
+// Anything that doesn't fit in a node is in a side table: names, (as indices into the
+// tree's own list of symbols) number literals, and the lists of call arguments, 'with'
+// variables and prototype parameters.
+//
+// Children are always added before their parents, so the root of each statement is the
+// last node added for it. Make one with flatten(), see gen::Generator and Stringifier
+// for walking one. unflatten() goes back to ast items. (See cache.cpp)
+//
+// A tree can also be shared, (hash-consed) in which case an expression that is the same as
+// one already in the tree is not added again, and the existing one is referred to instead.
+// So the tree becomes a graph, where a Ref is the identity of an expression: two Refs in the
+// same tree are equal if and only if the expressions are. Each node also gets a structural
+// hash, which is the same for the same expression in any tree. (See Tree::hash)
+//
+// Only numbers, variables, operators, and calls to functions said to be pure are shared.
+// Anything else, such as an assignment or a call that prints something, is added every time,
+// and so is anything with one of those inside it. A shared node keeps the offset of the
+// first place it was found, so locations in errors and debug info point there.
+
+namespace flat {
+
+enum Kind : uint8_t {
+    NUM, VAR, UN, BIN, CALL, IF, FOR, ASSIGNMENT, WITH
+};
+constexpr size_t KINDS = WITH + 1;
+
+// An expression, as its kind and its index in the array for that kind.
+// The default is no expression, as for an 'if' without an 'else'.
+class Ref {
+    static constexpr uint32_t NONE = ~0u;
+    static constexpr uint32_t INDEX_BITS = 28;
+    uint32_t bits = NONE;
+
+public:
+    Ref() = default;
+    Ref(Kind kind, uint32_t index): bits(((uint32_t)kind << INDEX_BITS) | index) {}
+
+    Kind kind() const { return Kind(bits >> INDEX_BITS); }
+    uint32_t index() const { return bits & ((1u << INDEX_BITS) - 1); }
+    explicit operator bool() const { return bits != NONE; }
+
+    bool operator==(Ref other) const { return bits == other.bits; }
+    bool operator!=(Ref other) const { return bits != other.bits; }
+};
+
+// Some run of entries in one of the side tables.
+struct Range {
+    uint32_t first = 0;
+    uint32_t count = 0;
+};
+
+// Names are indices into Tree::names, and offsets are as in ast::Item.
+struct Num { uint32_t offset; uint32_t literal; };
+struct Var { uint32_t offset; uint32_t name; };
+struct Un { uint32_t offset; char op; Ref rhs; };
+struct Bin { uint32_t offset; char op; Ref lhs, rhs; };
+// The arguments are a range of Tree::args.
+struct Call { uint32_t offset; uint32_t callee; Range args; };
+struct If { uint32_t offset; Ref cond, a, b; };
+struct For { uint32_t offset; uint32_t var_name; Ref start, end, inc, body; };
+struct Assignment { uint32_t offset; uint32_t name; Ref value; };
+// The variables are a range of Tree::bindings.
+struct With { uint32_t offset; Range bindings; Ref body; };
+struct Binding { uint32_t name; Ref value; };
+
+// The parameters are a range of Tree::params.
+struct Pro { uint32_t offset; uint32_t name; Range params; double precedence; };
+struct Fn { uint32_t offset; uint32_t proto; Ref body; };
+
+// A top-level statement, as its kind and its index in Tree::fns or Tree::pros.
+// For imports and commands, the index is into Tree::texts instead.
+struct Statement {
+    enum Kind : uint8_t { FN, PRO, IMPORT, COMMAND };
+    Kind kind;
+    uint32_t index;
+};
+
+class Tree {
+public:
+    std::vector<Num> nums;
+    std::vector<Var> vars;
+    std::vector<Un> uns;
+    std::vector<Bin> bins;
+    std::vector<Call> calls;
+    std::vector<If> ifs;
+    std::vector<For> fors;
+    std::vector<Assignment> assignments;
+    std::vector<With> withs;
+
+    std::vector<Pro> pros;
+    std::vector<Fn> fns;
+    std::vector<Statement> statements;
+
+    // Side tables.
+    std::vector<symbols::Id> names;
+    std::vector<double> literals;
+    std::vector<Ref> args;
+    std::vector<Binding> bindings;
+    std::vector<uint32_t> params;
+    std::vector<std::string> texts;
+
+    // The source of the functions in the tree, if it is known. (See ast::Fn::file)
+    std::shared_ptr<const source::File> file;
+
+    // Whether identical expressions are added only once. This can't be changed once
+    // anything has been added.
+    bool shared = false;
+    // Structural hashes of the nodes, by kind, in the same order as the nodes.
+    // Only for shared trees.
+    std::array<std::vector<uint64_t>, KINDS> hashes;
+
+    symbols::Id name(uint32_t index) const {
+        return names[index];
+    }
+
+    uint64_t hash(Ref ref) const {
+        return hashes[ref.kind()][ref.index()];
+    }
+
+    // The parameter names of a prototype.
+    std::vector<symbols::Id> param_names(const Pro& pro) const {
+        std::vector<symbols::Id> result;
+        result.reserve(pro.params.count);
+        for (uint32_t i = 0; i < pro.params.count; i++)
+            result.push_back(names[params[pro.params.first + i]]);
+        return result;
+    }
+
+    // Nodes in the tree, not counting statements or side tables.
+    size_t size() const {
+        return nums.size() + vars.size() + uns.size() + bins.size() + calls.size()
+            + ifs.size() + fors.size() + assignments.size() + withs.size();
+    }
+};
+
+// Which functions have no side effects, for shared trees. Calls to them, (and user
+// defined operators, by their function names) are shared.
+typedef std::function<bool(symbols::Id)> Purity;
+
+namespace {
+    uint64_t combine(uint64_t seed, uint64_t value) {
+        uint64_t x = seed ^ (value + 0x9e3779b97f4a7c15 + (seed << 6) + (seed >> 2));
+        x ^= x >> 31;
+        x *= 0x7fb5d329728ea185;
+        x ^= x >> 27;
+        return x;
+    }
+
+    uint64_t bits(double value) {
+        uint64_t result;
+        std::memcpy(&result, &value, sizeof(result));
+        return result;
+    }
+
+    // Adds ast items to a tree, children first.
+    class Flattener : public Visitor {
+    public:
+        Tree& tree;
+        const Purity& pure;
+
+        Flattener(Tree& tree, const Purity& pure): tree(tree), pure(pure) {
+            for (uint32_t i = 0; i < tree.names.size(); i++)
+                indices[tree.names[i]] = i + 1;
+
+            if (tree.shared) {
+                for (Kind kind: {NUM, VAR, UN, BIN, CALL}) {
+                    for (uint32_t i = 0; i < tree.hashes[kind].size(); i++) {
+                        if (shareable(Ref(kind, i)))
+                            seen.emplace(tree.hashes[kind][i], Ref(kind, i));
+                    }
+                }
+            }
+        }
+
+        // The latest expression added.
+        Ref ref;
+
+        Ref add(ast::Expr* expr) {
+            if (!expr)
+                return Ref();
+            expr->visit(*this);
+            return ref;
+        }
+
+        // Add a node. In a shared tree, if it can be shared and the same node is already
+        // there, that one is used instead.
+        template<class T>
+        Ref push(std::vector<T>& nodes, Kind kind, T node, uint64_t hash, bool share = false) {
+            if (tree.shared && share) {
+                auto range = seen.equal_range(hash);
+                for (auto it = range.first; it != range.second; it++) {
+                    if (it->second.kind() == kind && same(nodes[it->second.index()], node))
+                        return ref = it->second;
+                }
+            }
+
+            nodes.push_back(node);
+            ref = Ref(kind, (uint32_t)(nodes.size() - 1));
+            if (tree.shared) {
+                tree.hashes[kind].push_back(hash);
+                if (share)
+                    seen.emplace(hash, ref);
+            }
+            return ref;
+        }
+
+        uint32_t name(symbols::Id id) {
+            uint32_t& index = indices[id];
+            if (index == 0) {
+                tree.names.push_back(id);
+                index = (uint32_t)tree.names.size();
+            }
+            return index - 1;
+        }
+
+        void visit_num(ast::Num& target) override {
+            tree.literals.push_back(target.value);
+            size_t count = tree.nums.size();
+            push(tree.nums, NUM, {target.offset, (uint32_t)(tree.literals.size() - 1)}, combine(NUM, bits(target.value)), true);
+            if (tree.nums.size() == count)
+                tree.literals.pop_back();
+        }
+
+        void visit_var(ast::Var& target) override {
+            uint32_t index = name(target.name);
+            push(tree.vars, VAR, {target.offset, index}, combine(VAR, name_hash(index)), true);
+        }
+
+        void visit_un(ast::Un& target) override {
+            Ref rhs = add(target.rhs.get());
+            uint64_t hash = combine(combine(UN, target.op), child_hash(rhs));
+            push(tree.uns, UN, {target.offset, target.op, rhs}, hash, share_un(target.op));
+        }
+
+        void visit_bin(ast::Bin& target) override {
+            Ref lhs = add(target.lhs.get());
+            Ref rhs = add(target.rhs.get());
+            uint64_t hash = combine(combine(combine(BIN, target.op), child_hash(lhs)), child_hash(rhs));
+            push(tree.bins, BIN, {target.offset, target.op, lhs, rhs}, hash, share_bin(target.op));
+        }
+
+        void visit_call(ast::Call& target) override {
+            // The arguments' own arguments go in the same table, so they are all added
+            // before any of these.
+            std::vector<Ref> args;
+            args.reserve(target.args.size());
+            for (std::unique_ptr<ast::Expr>& arg: target.args)
+                args.push_back(add(arg.get()));
+
+            uint32_t callee = name(target.callee);
+            uint64_t hash = combine(CALL, name_hash(callee));
+            for (Ref arg: args)
+                hash = combine(hash, child_hash(arg));
+
+            Range range {(uint32_t)tree.args.size(), (uint32_t)args.size()};
+            tree.args.insert(tree.args.end(), args.begin(), args.end());
+            size_t count = tree.calls.size();
+            push(tree.calls, CALL, {target.offset, callee, range}, hash, pure_function(target.callee));
+            if (tree.calls.size() == count)
+                tree.args.resize(range.first);
+        }
+
+        void visit_if(ast::If& target) override {
+            Ref cond = add(target.cond.get());
+            Ref a = add(target.a.get());
+            Ref b = add(target.b.get());
+            uint64_t hash = combine(combine(combine(IF, child_hash(cond)), child_hash(a)), child_hash(b));
+            push(tree.ifs, IF, {target.offset, cond, a, b}, hash);
+        }
+
+        void visit_for(ast::For& target) override {
+            Ref start = add(target.start.get());
+            Ref end = add(target.end.get());
+            Ref inc = add(target.inc.get());
+            Ref body = add(target.body.get());
+            uint32_t var_name = name(target.var_name);
+            uint64_t hash = combine(FOR, name_hash(var_name));
+            for (Ref child: {start, end, inc, body})
+                hash = combine(hash, child_hash(child));
+            push(tree.fors, FOR, {target.offset, var_name, start, end, inc, body}, hash);
+        }
+
+        void visit_assignment(ast::Assignment& target) override {
+            Ref value = add(target.value.get());
+            uint32_t index = name(target.identifier);
+            uint64_t hash = combine(combine(ASSIGNMENT, name_hash(index)), child_hash(value));
+            push(tree.assignments, ASSIGNMENT, {target.offset, index, value}, hash);
+        }
+
+        void visit_with(ast::With& target) override {
+            std::vector<Binding> bindings;
+            bindings.reserve(target.assignments.size());
+            uint64_t hash = WITH;
+            for (auto& assignment: target.assignments) {
+                bindings.push_back({name(assignment.first), add(assignment.second.get())});
+                hash = combine(combine(hash, name_hash(bindings.back().name)), child_hash(bindings.back().value));
+            }
+            Ref body = add(target.body.get());
+            hash = combine(hash, child_hash(body));
+
+            Range range {(uint32_t)tree.bindings.size(), (uint32_t)bindings.size()};
+            tree.bindings.insert(tree.bindings.end(), bindings.begin(), bindings.end());
+            push(tree.withs, WITH, {target.offset, range, body}, hash);
+        }
+
+        // Statements.
+
+        uint32_t add_pro(ast::Pro& target) {
+            Range range {(uint32_t)tree.params.size(), (uint32_t)target.args.size()};
+            for (symbols::Id arg: target.args)
+                tree.params.push_back(name(arg));
+            tree.pros.push_back({target.offset, name(target.name), range, target.precedence});
+            return (uint32_t)(tree.pros.size() - 1);
+        }
+
+        void visit_pro(ast::Pro& target) override {
+            tree.statements.push_back({Statement::PRO, add_pro(target)});
+        }
+
+        void visit_fn(ast::Fn& target) override {
+            uint32_t proto = add_pro(*target.proto);
+            Ref body = add(target.body.get());
+            tree.fns.push_back({target.offset, proto, body});
+            tree.statements.push_back({Statement::FN, (uint32_t)(tree.fns.size() - 1)});
+
+            if (!tree.file)
+                tree.file = target.file;
+        }
+
+        void visit_import(ast::Import& target) override {
+            tree.texts.push_back(target.file);
+            tree.statements.push_back({Statement::IMPORT, (uint32_t)(tree.texts.size() - 1)});
+        }
+
+        void visit_command(ast::Command& target) override {
+            tree.texts.push_back(target.text);
+            tree.statements.push_back({Statement::COMMAND, (uint32_t)(tree.texts.size() - 1)});
+        }
+
+        void visit_block(ast::Block& target) override {
+            for (std::unique_ptr<ast::Statement>& statement: target.statements)
+                statement->visit(*this);
+        }
+
+    private:
+        // Where each symbol is in tree.names, plus one.
+        symbols::Table<uint32_t> indices;
+        // Hashes of the names' text, by index in tree.names. Not of the ids, since which id a
+        // name gets can change from run to run.
+        std::vector<uint64_t> name_hashes;
+        // Nodes in a shared tree that can be shared, by hash.
+        std::unordered_multimap<uint64_t, Ref> seen;
+
+        uint64_t name_hash(uint32_t index) {
+            while (name_hashes.size() <= index)
+                name_hashes.push_back(std::hash<std::string_view>()(symbols::name(tree.names[name_hashes.size()])));
+            return name_hashes[index];
+        }
+
+        uint64_t child_hash(Ref child) {
+            if (!child)
+                return 0;
+            return tree.shared ? tree.hash(child) : 0;
+        }
+
+        bool pure_function(symbols::Id name) {
+            return pure && pure(name);
+        }
+
+        bool share_un(char op) {
+            return pure_function(ast::unary_name(op));
+        }
+
+        bool share_bin(char op) {
+            return ast::is_builtin(op) || pure_function(ast::binary_name(op));
+        }
+
+        // Whether a node already in the tree could have been shared.
+        bool shareable(Ref ref) {
+            switch (ref.kind()) {
+            case NUM:
+            case VAR:
+                return true;
+            case UN:
+                return share_un(tree.uns[ref.index()].op);
+            case BIN:
+                return share_bin(tree.bins[ref.index()].op);
+            case CALL:
+                return pure_function(tree.name(tree.calls[ref.index()].callee));
+            default:
+                return false;
+            }
+        }
+
+        // Whether two nodes are the same expression. Their children are already shared, so
+        // they are the same if their refs are.
+        bool same(const Num& a, const Num& b) {
+            return bits(tree.literals[a.literal]) == bits(tree.literals[b.literal]);
+        }
+
+        bool same(const Var& a, const Var& b) {
+            return a.name == b.name;
+        }
+
+        bool same(const Un& a, const Un& b) {
+            return a.op == b.op && a.rhs == b.rhs;
+        }
+
+        bool same(const Bin& a, const Bin& b) {
+            return a.op == b.op && a.lhs == b.lhs && a.rhs == b.rhs;
+        }
+
+        bool same(const Call& a, const Call& b) {
+            if (a.callee != b.callee || a.args.count != b.args.count)
+                return false;
+            for (uint32_t i = 0; i < a.args.count; i++) {
+                if (tree.args[a.args.first + i] != tree.args[b.args.first + i])
+                    return false;
+            }
+            return true;
+        }
+
+        // Nothing else is shared.
+        template<class T>
+        bool same(const T&, const T&) {
+            return false;
+        }
+    };
+}
+
+// Add statements to the end of a tree. All of the functions should be from the same source.
+void add(Tree& tree, ast::Item& item, const Purity& pure = nullptr) {
+    Flattener flattener(tree, pure);
+    item.visit(flattener);
+}
+
+Tree flatten(ast::Item& item) {
+    Tree tree;
+    add(tree, item);
+    return tree;
+}
+
+// A shared tree, see the top of the file.
+Tree flatten_shared(ast::Item& item, const Purity& pure = nullptr) {
+    Tree tree;
+    tree.shared = true;
+    add(tree, item, pure);
+    return tree;
+}
+
+// An ast prototype for one in a tree, allocated from the current arena.
+std::unique_ptr<ast::Pro> prototype(const Tree& tree, uint32_t index) {
+    const Pro& node = tree.pros[index];
+    return ast::at(node.offset, std::make_unique<ast::Pro>(tree.name(node.name), tree.param_names(node), node.precedence));
+}
+
+namespace {
+    // Makes ast items from a tree, the other way to Flattener.
+    class Unflattener {
+    public:
+        const Tree& tree;
+
+        Unflattener(const Tree& tree): tree(tree) {}
+
+        std::unique_ptr<ast::Expr> expr(Ref ref) {
+            if (!ref)
+                return nullptr;
+
+            uint32_t i = ref.index();
+            switch (ref.kind()) {
+            case NUM:
+                return ast::at(tree.nums[i].offset, std::make_unique<ast::Num>(tree.literals[tree.nums[i].literal]));
+            case VAR:
+                return ast::at(tree.vars[i].offset, std::make_unique<ast::Var>(tree.name(tree.vars[i].name)));
+            case UN: {
+                const Un& un = tree.uns[i];
+                return ast::at(un.offset, std::make_unique<ast::Un>(un.op, expr(un.rhs)));
+            }
+            case BIN: {
+                const Bin& bin = tree.bins[i];
+                return ast::at(bin.offset, std::make_unique<ast::Bin>(bin.op, expr(bin.lhs), expr(bin.rhs)));
+            }
+            case CALL: {
+                const Call& call = tree.calls[i];
+                ast::List<std::unique_ptr<ast::Expr>> args;
+                args.reserve(call.args.count);
+                for (uint32_t j = 0; j < call.args.count; j++)
+                    args.push_back(expr(tree.args[call.args.first + j]));
+                return ast::at(call.offset, std::make_unique<ast::Call>(tree.name(call.callee), std::move(args)));
+            }
+            case IF: {
+                const If& node = tree.ifs[i];
+                return ast::at(node.offset, std::make_unique<ast::If>(expr(node.cond), expr(node.a), expr(node.b)));
+            }
+            case FOR: {
+                const For& node = tree.fors[i];
+                return ast::at(node.offset, std::make_unique<ast::For>(tree.name(node.var_name),
+                    expr(node.start), expr(node.end), expr(node.inc), expr(node.body)));
+            }
+            case ASSIGNMENT: {
+                const Assignment& node = tree.assignments[i];
+                return ast::at(node.offset, std::make_unique<ast::Assignment>(tree.name(node.name), expr(node.value)));
+            }
+            case WITH: {
+                const With& node = tree.withs[i];
+                ast::List<std::pair<symbols::Id, std::unique_ptr<ast::Expr>>> assignments;
+                assignments.reserve(node.bindings.count);
+                for (uint32_t j = 0; j < node.bindings.count; j++) {
+                    const Binding& binding = tree.bindings[node.bindings.first + j];
+                    assignments.emplace_back(tree.name(binding.name), expr(binding.value));
+                }
+                return ast::at(node.offset, std::make_unique<ast::With>(std::move(assignments), expr(node.body)));
+            }
+            }
+            return nullptr;
+        }
+
+        std::unique_ptr<ast::Statement> statement(const Statement& statement) {
+            switch (statement.kind) {
+            case Statement::FN: {
+                const Fn& node = tree.fns[statement.index];
+                std::unique_ptr<ast::Fn> fn = ast::at(node.offset, std::make_unique<ast::Fn>(prototype(tree, node.proto), expr(node.body)));
+                fn->file = tree.file;
+                return fn;
+            }
+            case Statement::PRO:
+                return prototype(tree, statement.index);
+            case Statement::IMPORT:
+                return std::make_unique<ast::Import>(tree.texts[statement.index]);
+            case Statement::COMMAND:
+                return std::make_unique<ast::Command>(std::string(tree.texts[statement.index]));
+            }
+            return nullptr;
+        }
+    };
+}
+
+// An ast block for the statements in a tree, allocated from the current arena as if it had
+// just been parsed. Expressions that are shared in the tree get a copy each.
+std::unique_ptr<ast::Block> unflatten(const Tree& tree) {
+    Unflattener unflattener(tree);
+    std::vector<std::unique_ptr<ast::Statement>> statements;
+    statements.reserve(tree.statements.size());
+    for (const Statement& statement: tree.statements)
+        statements.push_back(unflattener.statement(statement));
+    return std::make_unique<ast::Block>(std::move(statements));
+}
+
+namespace {
+    // Checks a tree that came from outside, (see check) the same way round as Unflattener.
+    class Checker {
+    public:
+        const Tree& tree;
+
+        Checker(const Tree& tree): tree(tree) {
+            size_t counts[KINDS] = {
+                tree.nums.size(), tree.vars.size(), tree.uns.size(), tree.bins.size(), tree.calls.size(),
+                tree.ifs.size(), tree.fors.size(), tree.assignments.size(), tree.withs.size()
+            };
+            for (uint32_t kind = 0; kind < KINDS; kind++)
+                states[kind].assign(counts[kind], UNSEEN);
+        }
+
+        bool check() {
+            // Every node is checked, not only the ones the statements use, since adding to a
+            // shared tree looks at all of them. (See Flattener)
+            for (uint32_t kind = 0; kind < KINDS; kind++) {
+                if (tree.shared ? tree.hashes[kind].size() != states[kind].size() : !tree.hashes[kind].empty())
+                    return false;
+                for (uint32_t i = 0; i < states[kind].size(); i++) {
+                    if (!expr(Ref(Kind(kind), i)))
+                        return false;
+                }
+            }
+
+            for (const Statement& statement: tree.statements) {
+                if (!this->statement(statement))
+                    return false;
+            }
+            return true;
+        }
+
+    private:
+        // Where each node is up to, so that one that is inside itself is found.
+        enum State : uint8_t { UNSEEN, CHECKING, CHECKED };
+        std::array<std::vector<State>, KINDS> states;
+
+        bool in(Range range, size_t size) const {
+            return (uint64_t)range.first + range.count <= size;
+        }
+
+        bool name(uint32_t index) const {
+            return index < tree.names.size();
+        }
+
+        bool expr(Ref ref, bool optional = false) {
+            if (!ref)
+                return optional;
+            if (ref.kind() >= KINDS || ref.index() >= states[ref.kind()].size())
+                return false;
+
+            State& state = states[ref.kind()][ref.index()];
+            if (state != UNSEEN)
+                return state == CHECKED;
+            state = CHECKING;
+
+            uint32_t i = ref.index();
+            bool valid = false;
+            switch (ref.kind()) {
+            case NUM:
+                valid = tree.nums[i].literal < tree.literals.size();
+                break;
+            case VAR:
+                valid = name(tree.vars[i].name);
+                break;
+            case UN:
+                valid = expr(tree.uns[i].rhs);
+                break;
+            case BIN:
+                valid = expr(tree.bins[i].lhs) && expr(tree.bins[i].rhs);
+                break;
+            case CALL: {
+                const Call& call = tree.calls[i];
+                valid = name(call.callee) && in(call.args, tree.args.size());
+                for (uint32_t j = 0; valid && j < call.args.count; j++)
+                    valid = expr(tree.args[call.args.first + j]);
+                break;
+            }
+            case IF: {
+                const If& node = tree.ifs[i];
+                valid = expr(node.cond) && expr(node.a) && expr(node.b, true);
+                break;
+            }
+            case FOR: {
+                const For& node = tree.fors[i];
+                valid = name(node.var_name) && expr(node.start) && expr(node.end) && expr(node.inc, true) && expr(node.body);
+                break;
+            }
+            case ASSIGNMENT:
+                valid = name(tree.assignments[i].name) && expr(tree.assignments[i].value);
+                break;
+            case WITH: {
+                const With& node = tree.withs[i];
+                valid = in(node.bindings, tree.bindings.size());
+                for (uint32_t j = 0; valid && j < node.bindings.count; j++) {
+                    const Binding& binding = tree.bindings[node.bindings.first + j];
+                    valid = name(binding.name) && expr(binding.value, true);
+                }
+                valid = valid && expr(node.body);
+                break;
+            }
+            }
+
+            if (valid)
+                state = CHECKED;
+            return valid;
+        }
+
+        bool pro(uint32_t index) const {
+            if (index >= tree.pros.size())
+                return false;
+            const Pro& node = tree.pros[index];
+            if (!name(node.name) || !in(node.params, tree.params.size()))
+                return false;
+            for (uint32_t j = 0; j < node.params.count; j++) {
+                if (!name(tree.params[node.params.first + j]))
+                    return false;
+            }
+            return true;
+        }
+
+        bool statement(const Statement& statement) {
+            switch (statement.kind) {
+            case Statement::FN:
+                return statement.index < tree.fns.size() && pro(tree.fns[statement.index].proto) 
+                    && expr(tree.fns[statement.index].body);
+            case Statement::PRO:
+                return pro(statement.index);
+            case Statement::IMPORT:
+            case Statement::COMMAND:
+                return statement.index < tree.texts.size();
+            }
+            return false;
+        }
+    };
+}
+
+// Whether everything in a tree that refers to something else in the tree is there, and no
+// expression is inside itself. A tree made by flatten() always is, but one read back from
+// somewhere else (see cache::load) is checked before anything walks it.
+bool check(const Tree& tree) {
+    return Checker(tree).check();
+}
+
+}
@@ -9,12 +9,15 @@
 #include "llvm/Support/TargetSelect.h"
 #pragma warning(pop)
 
+#include "flat.cpp"
 #include "visitors/generator.cpp"
 
 namespace gen {
     bool debug = false;
     llvm::Error init();
     void emit(ast::Item&, const llvm::DataLayout*, const llvm::Triple*);
+    void emit(const flat::Tree&, const llvm::DataLayout*, const llvm::Triple*);
+    void emit(const flat::Tree&, uint32_t, resolve::Names&, const llvm::DataLayout*, const llvm::Triple*);
 
     llvm::Error interactive() {
         printf("IR Generation\n");
@@ -31,12 +34,12 @@ namespace gen {
         if (auto error = init())
             return error;
 
-        while(tokens::has_next()) {
-            expr::input("generator");
-            if (!expr::current)
+        while(expr::repl.has_next()) {
+            expr::repl.input("generator");
+            if (!expr::repl.current)
                 continue;
             
-            emit(*expr::current, nullptr, nullptr);
+            emit(*expr::repl.current, nullptr, nullptr);
         }
 
         return llvm::Error::success();
@@ -75,31 +78,50 @@ namespace gen {
         return llvm::Error::success();
     }
 
-    void emit(ast::Item& source, const llvm::DataLayout* layout, const llvm::Triple* triple) {
-        // Remember - the module needs to be destroyed *before* the context.
-        current_module = nullptr;
-        current_context = nullptr;
-
-        Generator generator(layout, triple);
-        try {
-            source.visit(generator);
-        } catch(std::exception& e) {
-            util::print_exception(e);
-            generator.clear();
-            return;
-        }
+    namespace {
+        // If there are any errors, they are all printed. The functions that could still be
+        // generated are kept, (see Generator::visit_fn) so one bad definition doesn't take the
+        // rest of a file with it.
+        void generate(llvm::function_ref<llvm::Error(Generator&)> walk, const llvm::DataLayout* layout, const llvm::Triple* triple) {
+            // Remember - the module needs to be destroyed *before* the context.
+            current_module = nullptr;
+            current_context = nullptr;
+
+            Generator generator(layout, triple);
+            if (llvm::Error error = walk(generator)) {
+                diag::print(std::move(error));
+                if (!generator.has_definitions()) {
+                    generator.clear();
+                    return;
+                }
+            }
 
-        if (generator.has_result()) {
-            current_context = std::move(generator.take_context());
-            current_module = std::move(generator.take_module());
-            
-            if (debug) {
-                printf("IR:\n");
-                current_module->print(llvm::outs(), nullptr);
+            if (generator.has_result()) {
+                current_context = std::move(generator.take_context());
+                current_module = std::move(generator.take_module());
+                
+                if (debug) {
+                    printf("IR:\n");
+                    current_module->print(llvm::outs(), nullptr);
+                }
+            }
+            else {
+                printf("(No IR generated)\n");
             }
         }
-        else {
-            printf("(No IR generated)\n");
-        }
     }
-}
\ No newline at end of file
+
+    void emit(ast::Item& source, const llvm::DataLayout* layout, const llvm::Triple* triple) {
+        generate([&](Generator& generator) { return generator.walk(source).takeError(); }, layout, triple);
+    }
+
+    // The same as for the ast items that the tree was made from.
+    void emit(const flat::Tree& tree, const llvm::DataLayout* layout, const llvm::Triple* triple) {
+        generate([&](Generator& generator) { return generator.walk_tree(tree); }, layout, triple);
+    }
+
+    // One function in a tree, with what is resolved for it kept in names. (See jit::Unit)
+    void emit(const flat::Tree& tree, uint32_t fn, resolve::Names& names, const llvm::DataLayout* layout, const llvm::Triple* triple) {
+        generate([&](Generator& generator) { return generator.walk_tree_fn(tree, fn, names); }, layout, triple);
+    }
+}
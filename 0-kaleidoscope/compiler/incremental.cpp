@@ -0,0 +1,706 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include "tokens.cpp"
+#include "ast.cpp"
+#include "expr.cpp"
+#include "diagnostics.cpp"
+
+// Incremental parsing, for source that is loaded again after being edited. (See jit::load)
+//
+// A document keeps the tokens and syntax tree of each of its top-level statements. When
+// new text comes in, only the tokens around the edit are read again, (see tokens::relex)
+// and only the smallest expression around those tokens is parsed again. Everything else
+// in the tree stays as it was, so the work done depends on the size of the edit, rather
+// than the size of the function it is in.
+//
+// When the edit isn't inside a single expression, the statement is parsed again, and if it
+// isn't inside a single statement, the statements it touches are. If operator precedences
+// change, everything after the change is parsed again too.
+//
+// Lines typed into the REPL don't go through this. A redefinition typed there is new text,
+// rather than an edit of some text that was read before, so there is nothing to diff it
+// against, and it's lexed and parsed in full. Only what it makes stale is compiled again.
+// (See jit::compile_functions)
+
+namespace incremental {
+
+// One top-level statement of a document.
+struct Statement {
+    // Where the statement's text starts in the document. It runs up to the start of the next
+    // statement, so it includes any separators after it.
+    uint32_t start = 0;
+    // Offsets are from the start of the statement, for the tokens and the tree.
+    tokens::Buffer tokens;
+    std::unique_ptr<ast::Statement> tree;
+    // Token positions of every expression in the tree.
+    expr::Spans spans;
+};
+
+// What the latest update had to do again.
+struct Stats {
+    size_t tokens = 0;
+    size_t expressions = 0;
+    size_t statements = 0;
+};
+
+namespace {
+    bool is_separator(const tokens::Buffer& buffer, size_t i) {
+        return buffer.kinds[i] == tokens::KEY_SYMBOL && (buffer.text(i)[0] == ';' || buffer.text(i)[0] == '\n');
+    }
+
+    // The child expressions of an expression, and how it fits in with what is around it.
+    class Children : public Visitor {
+    public:
+        std::vector<std::unique_ptr<ast::Expr>*> slots;
+
+        bool binary = false;
+        char op = 0;
+
+        // Whether the expression takes in any operators that follow it, as the body of a
+        // 'for' does. (Or an 'else', for an 'if')
+        bool open = false;
+        // The child at the end of the expression, if an operator after it would be taken in by it.
+        std::unique_ptr<ast::Expr>* last = nullptr;
+
+        void visit_num(ast::Num&) override {}
+        void visit_var(ast::Var&) override {}
+
+        void visit_un(ast::Un& un) override {
+            slots.push_back(&un.rhs);
+            last = &un.rhs;
+        }
+
+        void visit_bin(ast::Bin& bin) override {
+            binary = true;
+            op = bin.op;
+            slots.push_back(&bin.lhs);
+            slots.push_back(&bin.rhs);
+            last = &bin.rhs;
+        }
+
+        void visit_call(ast::Call& call) override {
+            for (std::unique_ptr<ast::Expr>& arg: call.args)
+                slots.push_back(&arg);
+        }
+
+        void visit_if(ast::If& node) override {
+            open = true;
+            slots.push_back(&node.cond);
+            slots.push_back(&node.a);
+            if (node.b)
+                slots.push_back(&node.b);
+        }
+
+        void visit_for(ast::For& node) override {
+            open = true;
+            slots.push_back(&node.start);
+            slots.push_back(&node.end);
+            if (node.inc)
+                slots.push_back(&node.inc);
+            slots.push_back(&node.body);
+        }
+
+        void visit_assignment(ast::Assignment& assignment) override {
+            open = true;
+            slots.push_back(&assignment.value);
+        }
+
+        void visit_with(ast::With& with) override {
+            open = true;
+            for (auto& assignment: with.assignments) {
+                if (assignment.second)
+                    slots.push_back(&assignment.second);
+            }
+            slots.push_back(&with.body);
+        }
+
+        // Not expressions.
+        void visit_pro(ast::Pro&) override {}
+        void visit_fn(ast::Fn&) override {}
+        void visit_import(ast::Import&) override {}
+        void visit_block(ast::Block&) override {}
+        void visit_command(ast::Command&) override {}
+    };
+
+    Children children(ast::Expr& expr) {
+        Children result;
+        expr.visit(result);
+        return result;
+    }
+
+    // Whether an operator, or an 'else', after the expression would be taken in by it.
+    bool is_open(ast::Expr* expr, const expr::Spans& spans) {
+        while (expr && !spans.at(expr).grouped) {
+            Children node = children(*expr);
+            if (node.open)
+                return true;
+            expr = node.last ? node.last->get() : nullptr;
+        }
+        return false;
+    }
+
+    // Remove the spans of an expression and everything in it.
+    void forget(ast::Expr* expr, expr::Spans& spans) {
+        std::vector<ast::Expr*> stack = {expr};
+        while (stack.size() > 0) {
+            ast::Expr* top = stack.back();
+            stack.pop_back();
+            spans.erase(top);
+            for (std::unique_ptr<ast::Expr>* slot: children(*top).slots)
+                stack.push_back(slot->get());
+        }
+    }
+
+    // Call f on the offset of every item in a statement.
+    template<class F>
+    void for_each_offset(ast::Statement& statement, F f) {
+        f(statement.offset);
+
+        std::vector<ast::Expr*> stack;
+        if (ast::Fn* fn = statement.as_fn()) {
+            f(fn->proto->offset);
+            stack.push_back(fn->body.get());
+        }
+
+        // Only the slots are used, so one visitor does for every item.
+        Children node;
+        while (stack.size() > 0) {
+            ast::Expr* top = stack.back();
+            stack.pop_back();
+            f(top->offset);
+            node.slots.clear();
+            top->visit(node);
+            for (std::unique_ptr<ast::Expr>* slot: node.slots)
+                stack.push_back(slot->get());
+        }
+    }
+
+    // Move the offsets in a statement to where their tokens are after a patch.
+    // Every offset is where a token starts, so those in the patched tokens are found by position.
+    void move_offsets(ast::Statement& statement, const tokens::Buffer& old, const tokens::Patch& patch) {
+        uint32_t before = patch.first < old.size() ? old.offsets[patch.first] : UINT32_MAX;
+        uint32_t after = patch.end < old.size() ? old.offsets[patch.end] : UINT32_MAX;
+        bool same = patch.same_tokens(old);
+
+        for_each_offset(statement, [&](uint32_t& offset) {
+            if (offset < before)
+                return;
+            if (offset >= after) {
+                offset = (uint32_t)(offset + patch.shift);
+                return;
+            }
+
+            // Only if the tokens line up. (Otherwise the item is being replaced anyway)
+            auto begin = old.offsets.begin() + patch.first, end = old.offsets.begin() + patch.end;
+            auto found = std::lower_bound(begin, end, offset);
+            if (same && found != end && *found == offset)
+                offset = patch.tokens.offsets[found - begin];
+        });
+    }
+
+    // The tokens of the old buffer from first to end, as they are after the patch, followed by END.
+    tokens::Buffer patched(const tokens::Buffer& old, const tokens::Patch& patch, size_t first, size_t end) {
+        tokens::Buffer result;
+        result.source = patch.tokens.source;
+
+        for (size_t i = first; i < patch.first; i++)
+            result.push(old, i);
+        for (size_t i = 0; i < patch.tokens.size(); i++)
+            result.push(patch.tokens, i);
+        for (size_t i = patch.end; i < end; i++)
+            result.push(old, i, patch.shift);
+
+        if (result.size() == 0 || result.kinds.back() != tokens::END) {
+            uint32_t offset = end < old.size() ? (uint32_t)(old.offsets[end] + patch.shift) : (uint32_t)result.source.size();
+            result.push(tokens::END, offset, 0);
+        }
+        return result;
+    }
+
+    // Parse a statement's tokens on their own, with nothing but separators around it.
+    // If the tokens don't make exactly one statement, this returns nullptr.
+    // Unless it's the last statement, it has to end with a separator, so that it is
+    // kept apart from the next one.
+    std::unique_ptr<ast::Statement> parse_alone(const tokens::Buffer& buffer, expr::Spans& spans, bool last) {
+        expr::Parser parser(expr::precedences);
+        parser.spans = &spans;
+        parser.lexer.set_input(buffer);
+        parser.lexer.next();
+
+        while (parser.lexer.current.is_key_symbol(';') || parser.lexer.current.is_key_symbol('\n'))
+            parser.lexer.next();
+        if (!parser.lexer.has_current())
+            return nullptr;
+
+        llvm::Expected<std::unique_ptr<ast::Statement>> result = parser.statement();
+        if (!result) {
+            // The caller parses more of the document instead, which reports the error.
+            llvm::consumeError(result.takeError());
+            return nullptr;
+        }
+        if (!last && !parser.lexer.has_current())
+            return nullptr;
+
+        for (size_t i = parser.lexer.position(); i + 1 < buffer.size(); i++) {
+            if (!is_separator(buffer, i))
+                return nullptr;
+        }
+        return std::move(*result);
+    }
+}
+
+// Source text, kept as a list of statements.
+class Document {
+public:
+    // The name to give locations in the document, such as its path.
+    std::string name;
+    // The latest text, held by file.
+    std::string_view text;
+    std::shared_ptr<const source::File> file;
+    std::vector<Statement> statements;
+    Stats stats;
+
+    // Replace the text of the document. This returns the statements that are new or
+    // have changed, in order.
+    // If there are errors, they are all returned and the document is left as it was.
+    llvm::Expected<std::vector<size_t>> update(std::string new_text) {
+        stats = Stats();
+
+        // The edit is whatever is between the start and end that the old and new text have in common.
+        size_t same = std::min(text.size(), new_text.size());
+        uint32_t start = (uint32_t)(std::mismatch(text.begin(), text.begin() + same, new_text.begin()).first - text.begin());
+        uint32_t suffix = (uint32_t)(std::mismatch(text.rbegin(), text.rbegin() + (same - start), new_text.rbegin()).first - text.rbegin());
+        uint32_t old_end = (uint32_t)text.size() - suffix;
+        uint32_t new_end = (uint32_t)new_text.size() - suffix;
+        int64_t shift = (int64_t)new_end - (int64_t)old_end;
+
+        if (statements.size() > 0 && old_end == start && new_end == start)
+            return std::vector<size_t>();
+
+        expr::Precedences before = expr::precedences;
+        std::vector<size_t> changed;
+        bool done = false;
+        size_t first = 0, end = 0;
+        if (statements.size() > 0) {
+            first = find(start);
+            end = (old_end > start ? find(old_end - 1) : first) + 1;
+
+            // A statement can be read on its own if it ends with a newline that is kept, 
+            // since nothing (not even a comment) carries on past one.
+            bool last = end == statements.size();
+            bool kept_apart = last || (old_end < end_of(first) && text[end_of(first) - 1] == '\n');
+            if (end == first + 1 && kept_apart)
+                done = update_statement(first, new_text, start, old_end, new_end, changed);
+        }
+
+        if (!done) {
+            // The statement before might take in the start of this one, as with an 'else'.
+            if (statements.size() > 0 && first > 0 && start == statements[first].start)
+                first--;
+            llvm::Expected<std::vector<size_t>> result = update_statements(first, end, new_text, shift, before);
+            if (!result) {
+                expr::precedences = before;
+                return diag::trace(result.takeError(), __func__);
+            }
+            changed = std::move(*result);
+        }
+
+        file = std::make_shared<source::File>(name, std::move(new_text));
+        text = file->text;
+        for (size_t i = 0; i < statements.size(); i++)
+            statements[i].tokens.source = std::string_view(text).substr(statements[i].start, end_of(i) - statements[i].start);
+
+        stats.statements = changed.size();
+        return changed;
+    }
+
+    // Copies of the statements that should be run after an update: the ones that have
+    // changed, and all top-level expressions. (The JIT holds on to what it runs)
+    std::unique_ptr<ast::Block> to_run(const std::vector<size_t>& changed) {
+        std::vector<std::unique_ptr<ast::Statement>> result;
+        size_t next = 0;
+        for (size_t i = 0; i < statements.size(); i++) {
+            bool is_changed = next < changed.size() && changed[next] == i;
+            if (is_changed)
+                next++;
+
+            ast::Statement& statement = *statements[i].tree;
+            size_t count = result.size();
+            if (ast::Fn* fn = statement.as_fn()) {
+                if (is_changed || fn->proto->name == ast::MAIN) {
+                    std::unique_ptr<ast::Fn> copy = fn->copy();
+                    copy->file = file;
+                    result.push_back(std::move(copy));
+                }
+            }
+            else if (!is_changed) {
+                continue;
+            }
+            else if (ast::Pro* pro = statement.as_pro()) {
+                result.push_back(pro->copy());
+            }
+            else if (ast::Import* import = statement.as_import()) {
+                result.push_back(ast::at(import->offset, std::make_unique<ast::Import>(import->file)));
+            }
+            else if (ast::Command* command = statement.as_command()) {
+                result.push_back(ast::at(command->offset, std::make_unique<ast::Command>(std::string(command->text))));
+            }
+
+            // From the start of the statement, to the start of the document.
+            if (result.size() > count)
+                for_each_offset(*result.back(), [&](uint32_t& offset) { offset += statements[i].start; });
+        }
+        return std::make_unique<ast::Block>(std::move(result));
+    }
+
+private:
+    uint32_t end_of(size_t i) const {
+        return i + 1 < statements.size() ? statements[i + 1].start : (uint32_t)text.size();
+    }
+
+    // The statement that the text at the offset is a part of.
+    size_t find(uint32_t offset) const {
+        auto after = std::upper_bound(statements.begin(), statements.end(), offset,
+            [](uint32_t offset, const Statement& statement) { return offset < statement.start; });
+        return after == statements.begin() ? 0 : (after - statements.begin()) - 1;
+    }
+
+    // An edit inside a single statement. Returns false if the statement is no longer a single
+    // statement on its own, or it changed the operator precedences, which means the
+    // statements around it have to be parsed again. Nothing is changed in that case.
+    bool update_statement(size_t index, const std::string& new_text,
+        uint32_t start, uint32_t old_end, uint32_t new_end, std::vector<size_t>& changed) {
+        Statement& statement = statements[index];
+        bool last = index + 1 == statements.size();
+
+        int64_t shift = (int64_t)new_end - (int64_t)old_end;
+        uint32_t new_size = (uint32_t)(end_of(index) - statement.start + shift);
+        std::string_view source = std::string_view(new_text).substr(statement.start, new_size);
+
+        tokens::Patch patch = tokens::relex(statement.tokens, source,
+            start - statement.start, old_end - statement.start, new_end - statement.start);
+        stats.tokens += patch.tokens.size();
+
+        // Only spacing or comments changed.
+        if (patch.same_tokens(statement.tokens)) {
+            move_offsets(*statement.tree, statement.tokens, patch);
+            statement.tokens.splice(patch.first, patch.end, patch.tokens, patch.shift);
+            shift_after(index, shift);
+            return true;
+        }
+
+        if (replace_expression(statement, patch)) {
+            shift_after(index, shift);
+            changed.push_back(index);
+            return true;
+        }
+
+        // The whole statement, then.
+        expr::Precedences before = expr::precedences;
+        tokens::Buffer buffer = patched(statement.tokens, patch, 0, statement.tokens.size());
+        expr::Spans spans;
+        std::unique_ptr<ast::Statement> tree = parse_alone(buffer, spans, last);
+        if (!tree || expr::precedences != before) {
+            expr::precedences = before;
+            return false;
+        }
+
+        stats.expressions += spans.size();
+        statement.tokens = std::move(buffer);
+        statement.tree = std::move(tree);
+        statement.spans = std::move(spans);
+        shift_after(index, shift);
+        changed.push_back(index);
+        return true;
+    }
+
+    // Parse the smallest expression around the patch again, and put it in place of the old one.
+    // This only works if the new expression fits in the same place in the tree, as it would
+    // if the whole statement was parsed again.
+    bool replace_expression(Statement& statement, const tokens::Patch& patch) {
+        ast::Fn* fn = statement.tree->as_fn();
+        if (!fn)
+            return false;
+
+        auto covers = [&](std::unique_ptr<ast::Expr>* slot) {
+            const expr::Span& span = statement.spans.at(slot->get());
+            return span.first <= patch.first && patch.end <= span.end;
+        };
+
+        // The expressions around the patch, from the outside in.
+        std::vector<std::unique_ptr<ast::Expr>*> path;
+        if (covers(&fn->body))
+            path.push_back(&fn->body);
+        while (path.size() > 0) {
+            std::unique_ptr<ast::Expr>* inner = nullptr;
+            for (std::unique_ptr<ast::Expr>* slot: children(**path.back()).slots) {
+                if (covers(slot)) {
+                    inner = slot;
+                    break;
+                }
+            }
+            if (!inner)
+                break;
+            path.push_back(inner);
+        }
+
+        int64_t added = (int64_t)patch.tokens.size() - (int64_t)(patch.end - patch.first);
+
+        // If the innermost one doesn't work, try the ones around it. Each one tried is at least
+        // twice the size of the last, so that a long chain of operators isn't parsed over and over.
+        size_t tried = 0;
+        while (path.size() > 0) {
+            std::unique_ptr<ast::Expr>* slot = path.back();
+            path.pop_back();
+            bool root = path.size() == 0;
+            expr::Span old_span = statement.spans.at(slot->get());
+
+            size_t size = old_span.end - old_span.first;
+            if (size < tried * 2)
+                continue;
+            tried = size;
+
+            tokens::Buffer buffer = patched(statement.tokens, patch, old_span.first, old_span.end);
+            expr::Spans spans;
+            expr::Parser parser(expr::precedences);
+            parser.spans = &spans;
+            parser.lexer.set_input(buffer);
+            parser.lexer.next();
+
+            llvm::Expected<std::unique_ptr<ast::Expr>> parsed = parser.expression();
+            if (!parsed) {
+                llvm::consumeError(parsed.takeError());
+                continue;
+            }
+            std::unique_ptr<ast::Expr> replacement = std::move(*parsed);
+            stats.expressions += spans.size();
+            if (parser.lexer.has_current())
+                continue;
+
+            if (!root && !fits(slot->get(), statement.spans, replacement.get(), spans))
+                continue;
+
+            // Anything that would be taken in by the new expression has to not be there.
+            if (is_open(replacement.get(), spans)) {
+                size_t after = old_span.end;
+                tokens::TokenKind kind = statement.tokens.kinds[after];
+                bool ends = kind == tokens::KEY_SYMBOL && statement.tokens.text(after)[0] != '\n';
+                if (kind == tokens::KEYWORD)
+                    ends = statement.tokens.words[after] != tokens::KW_ELSE;
+                if (kind == tokens::END)
+                    ends = true;
+                if (!ends)
+                    continue;
+            }
+
+            // It fits, so the tokens, the spans and the tree are all updated.
+            move_offsets(*statement.tree, statement.tokens, patch);
+            statement.tokens.splice(patch.first, patch.end, patch.tokens, patch.shift);
+
+            forget(slot->get(), statement.spans);
+            if (added != 0) {
+                for (auto& entry: statement.spans) {
+                    expr::Span& span = entry.second;
+                    if (span.first >= old_span.end)
+                        span.first = (uint32_t)(span.first + added);
+                    if (span.end >= old_span.end)
+                        span.end = (uint32_t)(span.end + added);
+                }
+            }
+            for (auto& entry: spans) {
+                expr::Span span = entry.second;
+                span.first += old_span.first;
+                span.end += old_span.first;
+                statement.spans[entry.first] = span;
+            }
+
+            *slot = std::move(replacement);
+
+            // A top-level expression starts where its body does.
+            if (fn->proto->name == ast::MAIN)
+                fn->offset = fn->proto->offset = statement.tokens.offsets[statement.spans.at(fn->body.get()).first];
+            return true;
+        }
+
+        return false;
+    }
+
+    // Whether a new expression can take the place of an old one.
+    // Anything that is parsed as a single operand can go anywhere, but a binary operator
+    // can only replace another at the same precedence.
+    static bool fits(ast::Expr* old_expr, const expr::Spans& old_spans, ast::Expr* new_expr, const expr::Spans& new_spans) {
+        Children new_node = children(*new_expr);
+        if (!new_node.binary || new_spans.at(new_expr).grouped)
+            return true;
+
+        Children old_node = children(*old_expr);
+        if (!old_node.binary || old_spans.at(old_expr).grouped)
+            return false;
+
+        return expr::precedences[(unsigned char)old_node.op] == expr::precedences[(unsigned char)new_node.op];
+    }
+
+    // Parse the statements [first, end) again, along with any after them that the new text
+    // joins on to. If precedences change, everything after them is parsed again.
+    // After an error, parsing carries on from the next statement, so that all of the errors
+    // in the region are returned together.
+    llvm::Expected<std::vector<size_t>> update_statements(size_t first, size_t end, const std::string& new_text,
+        int64_t shift, const expr::Precedences& before) {
+        while (true) {
+            expr::precedences = before;
+            stats.tokens = 0;
+            stats.expressions = 0;
+
+            uint32_t start = first < statements.size() ? statements[first].start : 0;
+            bool bounded = end < statements.size();
+            // Where the statement after the region starts, and ends, in the new text.
+            uint32_t boundary = bounded ? (uint32_t)(statements[end].start + shift - start) : 0;
+            uint32_t limit = end + 1 < statements.size() ? (uint32_t)(statements[end + 1].start + shift) : (uint32_t)new_text.size();
+
+            std::string_view source = std::string_view(new_text).substr(start, limit - start);
+            tokens::Buffer buffer = tokens::lex_all(source);
+            stats.tokens += buffer.size();
+
+            std::vector<Statement> parsed;
+            // Where each statement's tokens start. (The first statement starts at 0, so
+            // that any separators before it are kept with it)
+            std::vector<size_t> firsts;
+
+            expr::Parser parser(expr::precedences);
+            parser.lexer.set_input(buffer);
+            parser.lexer.next();
+
+            // Set if the region has to grow, to take in the statement before or after it.
+            bool grow_back = false, grow_forward = false;
+            diag::Log errors;
+            // The new text, for the location of any errors. (Made when the first one is found)
+            std::shared_ptr<const source::File> error_file;
+            while (true) {
+                while (parser.lexer.current.is_key_symbol(';') || parser.lexer.current.is_key_symbol('\n'))
+                    parser.lexer.next();
+
+                uint32_t offset = parser.lexer.current.offset;
+                if (bounded && offset > boundary)
+                    grow_forward = true;
+                if (!parser.lexer.has_current() || (bounded && offset >= boundary))
+                    break;
+
+                parsed.emplace_back();
+                firsts.push_back(parsed.size() == 1 ? 0 : parser.lexer.position());
+                parsed.back().start = start + (parsed.size() == 1 ? 0 : offset);
+                parser.spans = &parsed.back().spans;
+
+                llvm::Error error = llvm::Error::success();
+                llvm::Expected<std::unique_ptr<ast::Statement>> tree = parser.statement();
+                if (!tree) {
+                    error = tree.takeError();
+                }
+                else {
+                    parsed.back().tree = std::move(*tree);
+                    if (parser.lexer.has_current() && !(parser.lexer.current.is_key_symbol(';') || parser.lexer.current.is_key_symbol('\n')))
+                        error = diag::error(diag::Code::END_OF_STATEMENT, "parse_statement", "End of statement expected.", 
+                            nullptr, parser.lexer.current.offset, (uint32_t)parser.lexer.current.text.size());
+                }
+                if (!error)
+                    continue;
+
+                // The statement after the region might finish it off.
+                if (bounded && parser.lexer.current.offset >= boundary) {
+                    llvm::consumeError(std::move(error));
+                    grow_forward = true;
+                    break;
+                }
+
+                // The offsets are from the start of the region, and the lexer has no file.
+                if (!error_file)
+                    error_file = std::make_shared<source::File>(name, new_text);
+                size_t count = errors.size();
+                errors.add(diag::trace(std::move(error), __func__));
+                for (size_t i = count; i < errors.size(); i++) {
+                    diag::Diagnostic& diagnostic = errors.diagnostics[i];
+                    diagnostic.file = error_file;
+                    diagnostic.offset += start;
+                    diagnostic.note = "(Error Token: " + parser.lexer.current.describe() + ")";
+                }
+
+                parsed.pop_back();
+                firsts.pop_back();
+                parser.recover();
+            }
+
+            // Only separators, which have to go with another statement.
+            if (parsed.size() == 0 && errors.empty() && (first > 0 || bounded)) {
+                if (first > 0)
+                    grow_back = true;
+                else
+                    grow_forward = true;
+            }
+
+            if (grow_back) {
+                first--;
+                continue;
+            }
+            if (grow_forward) {
+                end++;
+                continue;
+            }
+
+            if (end < statements.size() && expr::precedences != before) {
+                end = statements.size();
+                continue;
+            }
+
+            if (!errors.empty())
+                return errors.take();
+
+            // Split up the tokens between the statements.
+            size_t tokens_end = bounded ? parser.lexer.position() : buffer.size() - 1;
+            for (size_t i = 0; i < parsed.size(); i++) {
+                Statement& statement = parsed[i];
+                uint32_t relative = statement.start - start;
+                size_t last = i + 1 < parsed.size() ? firsts[i + 1] : tokens_end;
+                uint32_t size = (i + 1 < parsed.size() ? parsed[i + 1].start - start : (bounded ? boundary : (uint32_t)source.size())) - relative;
+
+                statement.tokens.source = source.substr(relative, size);
+                for (size_t j = firsts[i]; j < last; j++)
+                    statement.tokens.push(buffer, j, -(int64_t)relative);
+                statement.tokens.push(tokens::END, size, 0);
+                if (relative > 0)
+                    for_each_offset(*statement.tree, [&](uint32_t& offset) { offset -= relative; });
+
+                for (auto& entry: statement.spans) {
+                    entry.second.first -= (uint32_t)firsts[i];
+                    entry.second.end -= (uint32_t)firsts[i];
+                }
+                stats.expressions += statement.spans.size();
+            }
+
+            std::vector<size_t> changed;
+            for (size_t i = 0; i < parsed.size(); i++)
+                changed.push_back(first + i);
+
+            size_t count = parsed.size();
+            statements.erase(statements.begin() + first, statements.begin() + end);
+            statements.insert(statements.begin() + first, std::make_move_iterator(parsed.begin()), std::make_move_iterator(parsed.end()));
+            for (size_t i = first + count; i < statements.size(); i++)
+                statements[i].start = (uint32_t)(statements[i].start + shift);
+
+            return changed;
+        }
+    }
+
+    void shift_after(size_t index, int64_t shift) {
+        if (shift == 0)
+            return;
+        for (size_t i = index + 1; i < statements.size(); i++)
+            statements[i].start = (uint32_t)(statements[i].start + shift);
+    }
+};
+
+}
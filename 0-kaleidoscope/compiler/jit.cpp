@@ -5,14 +5,21 @@
 #include "llvm/Support/Error.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/ExecutionEngine/JITLink/EHFrameSupport.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/DebugObjectManagerPlugin.h"
+#include "llvm/ExecutionEngine/Orc/EPCDebugObjectRegistrar.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
 #include "llvm/ExecutionEngine/Orc/Mangling.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 #include "llvm/IR/DataLayout.h"
@@ -20,15 +27,28 @@
 #include "llvm/MC/TargetRegistry.h"
 #pragma warning(pop)
 
+#include <algorithm>
+#include <assert.h>
+#include <atomic>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <stdlib.h>
 
 #include "gen.cpp"
+#include "cache.cpp"
 #include "imports.cpp"
+#include "incremental.cpp"
+#include "memory.cpp"
+#include "optimize.cpp"
+#include "threads.cpp"
 #include "visitors/generator.cpp"
 
 namespace jit {
     bool debug = false;
+    // Functions are only compiled when they are first called. Set with KALEIDOSCOPE_LAZY=1,
+    // since it can't be changed once anything has been defined. (See define)
+    bool lazy = false;
     llvm::Error init();
 
     // The double ptr will be null if there was no value returned from the evaluated item.
@@ -47,6 +67,8 @@ namespace jit {
         printf("For a demo, use 'import pre', 'import mandel', and then 'demo()'\n");
         printf("'help' can be used to display info about the language.'\n");
         printf("'toggle ir', 'toggle expressions', and 'toggle tokens' can be used to display more detail when evaluating things.\n");
+        printf("'toggle json' and 'toggle indent' change how expressions are displayed.\n");
+        printf("'toggle optimizer' turns off simplifying expressions before they are compiled.\n");
         printf("\n");
         
         debug = true;
@@ -54,7 +76,10 @@ namespace jit {
         if (auto error = init())
             return error;
 
-        while(tokens::has_next()) {
+        if (lazy)
+            printf("(Lazy mode, functions are compiled on their first call)\n\n");
+
+        while(expr::repl.has_next()) {
             auto result = execute("jit");
             if (!result)
                 return std::move(result.takeError());
@@ -98,23 +123,134 @@ namespace jit {
         printf(" -> def unary-(x) 0-x\n");
         printf(" -> def binary:1(a b) 0\n");
         printf("\n");
+
+        printf("Source files\n");
+        printf(" -> load file.k  # runs the file, or after it's been edited, only what changed\n");
+        printf("\n");
+
+        printf("Memory\n");
+        printf(" -> memory  # how much memory compiled code has, by tracker and by function\n");
+        printf("\n");
     }
 
     namespace {
         std::unique_ptr<llvm::orc::ExecutionSession> session;
         std::unique_ptr<llvm::orc::MangleAndInterner> mangle;
-        std::unique_ptr<llvm::orc::RTDyldObjectLinkingLayer> obj_layer;
+        // JITLink's ObjectLinkingLayer where it's supported, RuntimeDyld elsewhere. (See init)
+        std::unique_ptr<llvm::orc::ObjectLayer> obj_layer;
+        // Owned by the ObjectLinkingLayer, null with RuntimeDyld. (See memory.cpp)
+        memory::Slabs* slabs = nullptr;
+        memory::Accounting* accounting = nullptr;
         std::unique_ptr<llvm::orc::IRCompileLayer> compile_layer;
 
-        std::map<std::string, std::shared_ptr<ast::Block>> associations;
-        std::map<std::string, llvm::orc::ResourceTrackerSP> module_trackers;
-        std::set<std::shared_ptr<ast::Block>> blocks;
+        // Materializing, (which is where modules are compiled) is done on these, so modules
+        // that don't depend on each other are compiled at the same time. (See init_workers)
+        // Declared after the session, so that they are stopped before it is destroyed.
+        std::unique_ptr<threads::Pool> workers;
+        // Set when cleanup() starts, after which the workers aren't given anything more.
+        std::atomic<bool> stopping{false};
+
+        // Generating IR uses a lot of shared state, (see gen.cpp and resolve.cpp) so only one
+        // thread does it at a time. Compiling the IR is what is done in parallel.
+        std::mutex generating;
+
+        // Modules that were added, and are being compiled without anything waiting for them.
+        // (See start_compiling)
+        std::mutex compiling_mutex;
+        std::condition_variable compiled;
+        size_t compiling = 0;
+
+        // What a unit is compiled from: a function as it was parsed, or one of the functions
+        // in the tree of a cached import. (See execute_builtin)
+        struct Source {
+            std::shared_ptr<ast::Fn> fn;
+            std::shared_ptr<const flat::Tree> tree;
+            // Which of the tree's functions it is.
+            uint32_t index = 0;
+
+            symbols::Id name() const {
+                return fn ? fn->proto->name : tree->name(tree->pros[tree->fns[index].proto].name);
+            }
+        };
+
+        // What code is generated from for a unit. It's shared with whatever generates it, (see
+        // LazyFunction) since the unit may have been replaced by the time that happens.
+        struct Body {
+            // A copy of the source that has been simplified.
+            std::shared_ptr<ast::Fn> fn;
+            // Or the tree, which is generated from as it is, with what is resolved for the
+            // function kept in names. The optimizer only works on ast items, so it isn't
+            // simplified, or inlined into anything.
+            std::shared_ptr<const flat::Tree> tree;
+            uint32_t index = 0;
+            std::shared_ptr<resolve::Names> names;
+
+            llvm::Error resolve() const {
+                if (fn)
+                    return resolve::function(*fn);
+                return resolve::function(*tree, index, *names);
+            }
+
+            // Whether resolve() has been done, without errors.
+            bool resolved() const {
+                return fn ? fn->resolved : names->resolved;
+            }
+
+            void emit() const {
+                if (fn)
+                    gen::emit(*fn, &*layout, triple);
+                else
+                    gen::emit(*tree, index, *names, &*layout, triple);
+            }
+        };
+
+        // Each function is a module of its own, with its own tracker, so that defining it
+        // again only recompiles it. (See compile_functions)
+        struct Unit {
+            // As it was parsed, for when it has to be compiled again.
+            Source source;
+            // What is resolved, and generated.
+            Body body;
+            llvm::orc::ResourceTrackerSP tracker;
+            // The functions it refers to. (See dependents)
+            std::vector<symbols::Id> uses;
+            // When the name was first defined.
+            size_t index = 0;
+        };
+
+        symbols::Table<std::unique_ptr<Unit>> units;
+        // The functions that refer to each function, by name.
+        symbols::Table<std::set<symbols::Id>> dependents;
+        // The names of all the units, in the order they were first defined.
+        std::vector<symbols::Id> defined;
 
         const std::string LIB_NAME = "<main>";
+
+        // The bodies of functions go in a JITDylib of their own, and the main one only has a
+        // stub for each function, which jumps to wherever the function is. (See init_stubs)
+        const std::string BODIES_NAME = "<bodies>";
+        std::unique_ptr<llvm::orc::LazyCallThroughManager> call_through;
+        std::unique_ptr<llvm::orc::IndirectStubsManager> stubs;
+
+        // Files run with the 'load' command, by path.
+        std::map<std::string, incremental::Document> documents;
     }
 
+    void wait_for_compiling();
+
+    // Has to be called before exiting, from wherever that is. Static destruction would
+    // otherwise tear down the layers and stubs while the workers may still be using them.
+    // So the workers are stopped first, and then the session is ended, which removes all
+    // of the compiled code while everything it needs is still there.
     void cleanup() {
-        session->getJITDylibByName(LIB_NAME)->clear();
+        if (!session || stopping.exchange(true))
+            return;
+
+        wait_for_compiling();
+        workers.reset();
+
+        if (auto error = session->endSession())
+            diag::print(std::move(error));
     }
 
     llvm::Expected<llvm::DataLayout&> get_layout() {
@@ -125,8 +261,23 @@ namespace jit {
         return *layout;
     }
 
+    llvm::Error init_stubs();
+    void init_workers();
+    bool use_jitlink(const llvm::Triple& triple);
+    llvm::Error init_jitlink();
+    void init_rtdyld(bool coff);
+
     llvm::Error init() {
+        // main() does this before interactive() does it again. Replacing the session would
+        // leave the layers pointing at the old one.
+        if (session)
+            return llvm::Error::success();
+
+        if (const char* setting = std::getenv("KALEIDOSCOPE_LAZY"))
+            lazy = std::string(setting) == "1";
+
         builtins::init();
+        cache::init();
         if (auto error = gen::init())
             return std::move(error);
 
@@ -138,6 +289,7 @@ namespace jit {
             return std::move(control.takeError());
 
         session = std::make_unique<llvm::orc::ExecutionSession>(std::move(*control));
+        init_workers();
         triple = &session->getExecutorProcessControl().getTargetTriple();
         llvm::orc::JITTargetMachineBuilder builder(*triple);
 
@@ -147,9 +299,17 @@ namespace jit {
         layout = std::make_unique<llvm::DataLayout>(expected_layout.get());
 
         mangle = std::make_unique<llvm::orc::MangleAndInterner>(*session, *layout);
-        obj_layer = std::make_unique<llvm::orc::RTDyldObjectLinkingLayer>(*session, [](){
-            return std::make_unique<llvm::SectionMemoryManager>();
-        });
+        if (use_jitlink(*triple)) {
+            // What JITLink expects. Calls to other modules go through entries it adds to each
+            // module, so it doesn't matter how far away they are.
+            builder.setRelocationModel(llvm::Reloc::PIC_);
+            builder.setCodeModel(llvm::CodeModel::Small);
+            if (auto error = init_jitlink())
+                return error;
+        }
+        else {
+            init_rtdyld(builder.getTargetTriple().isOSBinFormatCOFF());
+        }
         compile_layer = std::make_unique<llvm::orc::IRCompileLayer>(*session, *obj_layer, 
             std::make_unique<llvm::orc::ConcurrentIRCompiler>(std::move(builder))
         );
@@ -158,22 +318,159 @@ namespace jit {
         // Names are required to be unique, so that isn't a concern.
         session->createBareJITDylib(LIB_NAME)
             .addGenerator(llvm::cantFail(llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(layout->getGlobalPrefix())));
-        
-        if (builder.getTargetTriple().isOSBinFormatCOFF()) {
-            obj_layer->setOverrideObjectFlagsWithResponsibilityFlags(true);
-            obj_layer->setAutoClaimResponsibilityForObjectSymbols(true);
+
+        return init_stubs();
+    }
+
+    // JITLink is used for ELF on x86-64 Linux, which is where this version of LLVM supports
+    // it fully. KALEIDOSCOPE_JITLINK=0 goes back to RuntimeDyld, to compare the two.
+    bool use_jitlink(const llvm::Triple& triple) {
+        if (const char* setting = std::getenv("KALEIDOSCOPE_JITLINK")) {
+            if (std::string(setting) == "0")
+                return false;
         }
+        return triple.isOSLinux() && triple.isOSBinFormatELF() && triple.getArch() == llvm::Triple::x86_64;
+    }
+
+    // Modules are packed into slabs of memory, rather than each being mapped on its own.
+    // (See memory.cpp) KALEIDOSCOPE_HUGE_PAGES=1 has big modules use huge pages.
+    llvm::Error init_jitlink() {
+        bool huge_pages = false;
+        if (const char* setting = std::getenv("KALEIDOSCOPE_HUGE_PAGES"))
+            huge_pages = std::string(setting) == "1";
+
+        auto created = memory::Slabs::create(huge_pages);
+        if (!created)
+            return created.takeError();
+        slabs = created->get();
+        auto layer = std::make_unique<llvm::orc::ObjectLinkingLayer>(*session, std::move(*created));
+
+        auto counter = std::make_unique<memory::Accounting>(*slabs);
+        accounting = counter.get();
+        layer->addPlugin(std::move(counter));
+
+        // So that debuggers and profilers can unwind through compiled code.
+        layer->addPlugin(std::make_unique<llvm::orc::EHFrameRegistrationPlugin>(*session,
+            std::make_unique<llvm::jitlink::InProcessEHFrameRegistrar>()));
+
+        // Tell debuggers about compiled code, along with its debug info, so they can map it back
+        // to source lines. (See Generator::locate) Only there if the GDB JIT interface was
+        // linked in with LLVM. (There's no perf support for JITLink in this version)
+        if (auto registrar = llvm::orc::createJITLoaderGDBRegistrar(*session))
+            layer->addPlugin(std::make_unique<llvm::orc::DebugObjectManagerPlugin>(*session, std::move(*registrar)));
+        else
+            llvm::consumeError(registrar.takeError());
+
+        obj_layer = std::move(layer);
+        return llvm::Error::success();
+    }
+
+    void init_rtdyld(bool coff) {
+        auto layer = std::make_unique<llvm::orc::RTDyldObjectLinkingLayer>(*session, [](){
+            return std::make_unique<llvm::SectionMemoryManager>();
+        });
+
+        // Tell debuggers about compiled code, along with its debug info, so they (and profilers
+        // that read it from them) can map it back to source lines. (See Generator::locate)
+        layer->registerJITEventListener(*llvm::JITEventListener::createGDBRegistrationListener());
+        // Only there if LLVM was built with perf support.
+        if (llvm::JITEventListener* perf = llvm::JITEventListener::createPerfJITEventListener())
+            layer->registerJITEventListener(*perf);
+
+        if (coff) {
+            layer->setOverrideObjectFlagsWithResponsibilityFlags(true);
+            layer->setAutoClaimResponsibilityForObjectSymbols(true);
+        }
+
+        obj_layer = std::move(layer);
+    }
+
+    // KALEIDOSCOPE_JIT_THREADS sets how many workers there are, one per core by default. 
+    // With 0, materializing is done on whichever thread asked for it, as it was before.
+    void init_workers() {
+        size_t count = 0;
+        if (const char* setting = std::getenv("KALEIDOSCOPE_JIT_THREADS")) {
+            count = std::strtoul(setting, nullptr, 10);
+            if (count == 0)
+                return;
+        }
+
+        workers = std::make_unique<threads::Pool>(count);
+        session->setDispatchTask([pool = workers.get()](std::unique_ptr<llvm::orc::Task> task) {
+            // The pool refuses tasks once cleanup() has started, since it's being stopped. 
+            // Anything that still comes in is run where it came from, because dropping it 
+            // would leave its symbols neither compiled nor failed.
+            if (stopping) {
+                task->run();
+                return;
+            }
+
+            // (The pool's tasks have to be copyable)
+            std::shared_ptr<llvm::orc::Task> shared(task.release());
+            pool->submit([shared]() { shared->run(); });
+        });
+    }
+
+    namespace {
+        // Where a call goes if the function couldn't be compiled. (The error will have been
+        // shown already) It takes the place of the function, so it gets its arguments, but
+        // those can be ignored.
+        double call_failed() {
+            printf("Error: Unable to compile a function that was called, 0 is used instead.\n");
+            return 0;
+        }
+    }
+
+    // Calls from anywhere, including from one body to another, go through the stubs. So the
+    // bodies are linked against the main JITDylib, and not against each other. That way a
+    // function can be replaced without touching anything that calls it. (See define)
+    llvm::Error init_stubs() {
+        llvm::orc::JITDylib& main = *session->getJITDylibByName(LIB_NAME);
+        llvm::orc::JITDylib& bodies = session->createBareJITDylib(BODIES_NAME);
+        bodies.setLinkOrder({{&main, llvm::orc::JITDylibLookupFlags::MatchAllSymbols}}, /*LinkAgainstThisJITDylibFirst*/ false);
+
+        auto manager = llvm::orc::createLocalLazyCallThroughManager(*triple, *session, 
+            (llvm::JITTargetAddress)(intptr_t)&call_failed);
+        if (!manager)
+            return manager.takeError();
+        call_through = std::move(*manager);
+        stubs = llvm::orc::createLocalIndirectStubsManagerBuilder(*triple)();
 
         return llvm::Error::success();
     }
 
     llvm::Expected<std::unique_ptr<double>> execute(std::unique_ptr<ast::Block>);
-    llvm::Expected<std::unique_ptr<double>> execute(std::string promt) {
-        expr::input(promt);
-        if (!expr::current)
+    llvm::Expected<std::unique_ptr<double>> execute(expr::Parser& parser, std::string promt) {
+        parser.input(promt);
+        if (!parser.current) {
+            parser.reuse_arena();
             return nullptr;
+        }
         
-        return std::move(execute(std::move(expr::current)));
+        llvm::Expected<std::unique_ptr<double>> result = execute(std::move(parser.current));
+        parser.reuse_arena();
+        return result;
+    }
+
+    llvm::Expected<std::unique_ptr<double>> execute(std::string promt) {
+        return execute(expr::repl, promt);
+    }
+
+    void execute_tree(std::shared_ptr<const flat::Tree> tree);
+
+    namespace {
+        // Whether a tree only defines things, which is all that is run straight from a cached
+        // tree. Anything else has to be run in order with what is defined around it, so an
+        // import with top-level expressions or commands in it is parsed each time.
+        bool only_definitions(const flat::Tree& tree) {
+            for (const flat::Statement& statement: tree.statements) {
+                if (statement.kind == flat::Statement::PRO)
+                    continue;
+                if (statement.kind != flat::Statement::FN || tree.name(tree.pros[tree.fns[statement.index].proto].name) == ast::MAIN)
+                    return false;
+            }
+            return true;
+        }
     }
 
     void execute_builtin(std::string key) {
@@ -184,22 +481,98 @@ namespace jit {
 
         printf("Importing '%s'. Source: \n%s\n", key.c_str(), (*builtins::map[key]).c_str());
 
-        std::istringstream stream(*builtins::map[key]);
-        tokens::set_input(stream);
-        expr::interactive_mode = false;
+        std::shared_ptr<std::string> text = builtins::map[key];
+        std::shared_ptr<source::File> file = std::make_shared<source::File>("<" + key + ">", *text, text);
 
-        while(tokens::has_next())
-            execute("");
-        
-        tokens::set_input(std::cin);
-        expr::interactive_mode = true;
+        // The same source can parse differently if operators have been defined since, so the
+        // precedences are a part of the key.
+        uint64_t cache_key = cache::key(*text, llvm::ArrayRef<uint8_t>(
+            (const uint8_t*)expr::precedences.data(), sizeof(expr::precedences)));
+
+        std::optional<flat::Tree> tree = cache::load(cache_key);
+        if (tree && only_definitions(*tree)) {
+            tree->file = file;
+            execute_tree(std::make_shared<const flat::Tree>(std::move(*tree)));
+            printf("\n");
+            return;
+        }
+
+        // A parser of its own, so that whatever was being parsed before carries on
+        // from where it was afterwards. (Imports can be inside files, too)
+        tokens::Buffer buffer = tokens::lex_all(*text);
+        buffer.file = file;
+        expr::Parser parser(expr::precedences);
+        parser.lexer.set_input(buffer);
+        parser.interactive_mode = false;
+
+        flat::Tree parsed;
+        while(parser.has_next()) {
+            parser.input("");
+            if (parser.current) {
+                flat::add(parsed, *parser.current);
+                if (auto result = execute(std::move(parser.current)); !result)
+                    printf("%s\n", llvm::toString(result.takeError()).c_str());
+            }
+            parser.reuse_arena();
+        }
+
+        // Only saved if all of it parsed, so that the errors are still shown next time.
+        if (parser.failures == 0 && only_definitions(parsed))
+            cache::store(cache_key, parsed);
 
         printf("\n");
     }
 
-    llvm::Error compile(ast::Item& item, llvm::orc::ResourceTrackerSP tracker);
+    // Run source files, in order. The files are all parsed up front, in parallel. 
+    // (See expr::parse_files)
+    void execute_files(const std::vector<std::string>& paths) {
+        std::vector<expr::Parsed> files = expr::parse_files(paths);
+
+        for (expr::Parsed& file: files) {
+            if (file.block) {
+                if (auto result = execute(std::move(file.block)); !result)
+                    printf("%s\n", llvm::toString(result.takeError()).c_str());
+            }
+
+            // Shown after running what came before them, as if the file was run a statement at a time.
+            printf("%s", file.errors.c_str());
+        }
+    }
+
+    // Run a source file, for the 'load' command.
+    // When a file is loaded again, only the definitions that changed are parsed and compiled 
+    // again, (see incremental.cpp) and then all of its top-level expressions are run.
+    void load(const std::string& path) {
+        auto file = llvm::MemoryBuffer::getFile(path, /*IsText*/ false, /*RequiresNullTerminator*/ false);
+        if (!file) {
+            printf("Unable to read '%s': %s\n", path.c_str(), file.getError().message().c_str());
+            return;
+        }
+
+        incremental::Document& document = documents[path];
+        document.name = path;
+        llvm::Expected<std::vector<size_t>> update = document.update(std::string((*file)->getBuffer()));
+        if (!update) {
+            diag::print(update.takeError());
+            return;
+        }
+        std::vector<size_t>& changed = *update;
+
+        if (debug) {
+            printf("Loaded '%s': %zd statement(s) changed. (%zd token(s) read, %zd expression(s) parsed)\n", path.c_str(), 
+                changed.size(), document.stats.tokens, document.stats.expressions);
+        }
+
+        if (auto result = execute(document.to_run(changed)); !result)
+            printf("%s\n", llvm::toString(result.takeError()).c_str());
+    }
+
+    llvm::Error compile(ast::Item& item, llvm::orc::ResourceTrackerSP tracker, bool start = false);
+    llvm::Error compile(const Body& body, llvm::orc::ResourceTrackerSP tracker, bool start = false);
+    llvm::Error define(Unit& unit);
+    void print_memory();
     void execute_externs(std::vector<std::unique_ptr<ast::Statement>> externs);
-    llvm::Error compile_functions(std::vector<std::unique_ptr<ast::Fn>> functions);
+    llvm::Error compile_functions(std::vector<Source> functions);
     llvm::Expected<std::unique_ptr<double>> execute_anonymous_fn(ast::Fn& fn);
     llvm::Error compile_to_obj_file();
 
@@ -208,10 +581,9 @@ namespace jit {
 
         std::unique_ptr<double> result = nullptr;
 
-        // Multiple (non-main) functions in a row are grouped into a single module for neatness.
-        // This does make things complicated when a function within a group is redefined, since
-        // I think only modules as a whole can be compiled/recompiled.
-        std::vector<std::unique_ptr<ast::Fn>> functions;
+        // Multiple (non-main) functions in a row are compiled together, once something needs
+        // them. Each one is still a module of its own. (See compile_functions)
+        std::vector<Source> functions;
 
         // Extern defs are grouped too, but this is just for the sake of neat output.
         // No actual IR is generated for extern statements, they just register names.
@@ -219,9 +591,10 @@ namespace jit {
 
         for (std::unique_ptr<ast::Statement>& statement: block->statements) {
             ast::Fn* fn = statement->as_fn();
-            if (fn && fn->proto->name != "_main") {
+
+            if (fn && fn->proto->name != ast::MAIN) {
                 std::unique_ptr<ast::Fn> taken_fn = std::unique_ptr<ast::Fn>((ast::Fn*)statement.release());
-                functions.push_back(std::move(taken_fn));
+                functions.push_back({std::move(taken_fn)});
             }
             else if (ast::Pro* pro = statement->as_pro()) {
                 std::unique_ptr<ast::Pro> taken_pro = std::unique_ptr<ast::Pro>((ast::Pro*)statement.release());
@@ -237,13 +610,16 @@ namespace jit {
                 }
 
                 if (functions.size() > 0) {
-                    compile_functions(std::move(functions));
+                    if (auto error = compile_functions(std::move(functions)))
+                        diag::print(std::move(error));
                     // Is std::move guaranteed to leave a valid (but cleared) vector,
                     // or must a new one be initialized?
-                    functions = std::vector<std::unique_ptr<ast::Fn>>();
+                    functions = std::vector<Source>();
                 }
 
-                if (fn && fn->proto->name == "_main") {
+                if (fn && fn->proto->name == ast::MAIN) {
+                    // After the functions before it, so that it can inline their operators.
+                    optimize::function(*fn);
                     llvm::Expected<std::unique_ptr<double>> expected = execute_anonymous_fn(*fn);
                     if (!expected) return expected.takeError();
                     result = std::move(*expected);
@@ -259,8 +635,18 @@ namespace jit {
                         if (auto error = compile_to_obj_file()) 
                             return std::move(error);
                     }
+                    else if (command->text.rfind("load", 0) == 0) {
+                        std::string path = command->text.substr(4);
+                        path.erase(0, path.find_first_not_of(" \t"));
+                        path.erase(path.find_last_not_of(" \t\r") + 1);
+                        load(path);
+                    }
+                    else if (command->text == "memory") {
+                        print_memory();
+                    }
                     else if (command->text == "exit") {
                         printf("Goodbye!\n");
+                        cleanup();
                         std::exit(0);
                     }
                     else if (command->text == "toggle ir")  {
@@ -285,6 +671,21 @@ namespace jit {
                         }
                         return nullptr;
                     }
+                    else if (command->text == "toggle optimizer") {
+                        optimize::enabled = !optimize::enabled;
+                        printf("Optimizer %s.\n", optimize::enabled ? "enabled" : "disabled");
+                        return nullptr;
+                    }
+                    else if (command->text == "toggle json") {
+                        expr::style.json = !expr::style.json;
+                        printf("Expressions will be displayed as %s.\n", expr::style.json ? "JSON" : "text");
+                        return nullptr;
+                    }
+                    else if (command->text == "toggle indent") {
+                        expr::style.indent = expr::style.indent ? 0 : 2;
+                        printf("Expressions will be displayed %s.\n", expr::style.indent ? "indented" : "on one line");
+                        return nullptr;
+                    }
                     else if (command->text == "toggle tokens") {
                         if (expr::debug) {
                             tokens::debug = false;
@@ -304,7 +705,8 @@ namespace jit {
         }
         // Compile any pending functions.
         execute_externs(std::move(externs));
-        compile_functions(std::move(functions));
+        if (auto error = compile_functions(std::move(functions)))
+            diag::print(std::move(error));
 
         return std::move(result);
     }
@@ -314,82 +716,149 @@ namespace jit {
             return;
 
         if (debug) printf("Declaring %zd external symbol(s).\n", externs.size());
+        for (std::unique_ptr<ast::Statement>& statement: externs)
+            optimize::declare(*statement->as_pro());
+
+        std::lock_guard<std::mutex> lock(generating);
         gen::emit(ast::Block(std::move(externs)), &*layout, triple);
     }
 
-    llvm::Error compile_functions(std::vector<std::unique_ptr<ast::Fn>> functions) {
+    llvm::Error compile_unit(Source source, std::map<size_t, symbols::Id>& stale);
+
+    // Run the definitions in a cached import, as execute() does for them once they're parsed.
+    // Each function is a unit, the same as if it had been parsed, but its code is generated
+    // straight from the tree. (See Body)
+    void execute_tree(std::shared_ptr<const flat::Tree> tree) {
+        std::vector<Source> functions;
+        std::vector<uint32_t> externs;
+        for (const flat::Statement& statement: tree->statements) {
+            if (statement.kind == flat::Statement::PRO) {
+                externs.push_back(statement.index);
+                continue;
+            }
+
+            // Parsing would have defined these.
+            std::unique_ptr<ast::Pro> proto = flat::prototype(*tree, tree->fns[statement.index].proto);
+            if (proto->is_binary())
+                expr::register_precedence(proto->get_symbol(), proto->precedence);
+            functions.push_back({nullptr, tree, statement.index});
+        }
+
+        // The same as execute_externs.
+        if (debug && !externs.empty()) printf("Declaring %zd external symbol(s).\n", externs.size());
+        for (uint32_t pro: externs) {
+            optimize::declare(tree->name(tree->pros[pro].name));
+            std::lock_guard<std::mutex> lock(generating);
+            resolve::declare(*tree, pro);
+        }
+
+        if (auto error = compile_functions(std::move(functions)))
+            diag::print(std::move(error));
+    }
+
+    // Calls go through stubs, (see define) so redefining a function only recompiles that one
+    // function. The exceptions are the functions that refer to it, (see dependents) when they
+    // would call it the wrong way, because the number of arguments changed, or when they have
+    // its old body inlined into them. (See optimize::inlined) Those are recompiled from their
+    // source, in the order they were first defined.
+    llvm::Error compile_functions(std::vector<Source> functions) {
         if (functions.size() == 0)
             return llvm::Error::success();
 
         if (debug) printf("Compiling %zd function(s).\n", functions.size());
 
-        // Remove old compiled code, find all functions that were removed by association.
+        // There's no point recompiling a function that is about to be defined again.
+        std::multiset<symbols::Id> pending;
+        for (Source& fn: functions)
+            pending.insert(fn.name());
 
-        std::vector<std::shared_ptr<ast::Block>> to_compile;
-        for (std::unique_ptr<ast::Fn>& new_fn: functions) {
-            auto tracker_iter = module_trackers.find(new_fn->proto->name);
-            if (tracker_iter != module_trackers.end()) {
-                tracker_iter->second->remove();
-            }
-
-            auto assoc_iter = associations.find(new_fn->proto->name);
-            if (assoc_iter != associations.end()) {
-                to_compile.push_back(assoc_iter->second);
-            }
-        }
+        for (Source& fn: functions) {
+            pending.erase(pending.find(fn.name()));
 
-        // Remove association between any new function and previous functions, the new
-        // functions will form a new associated group.
+            // By the index of the unit.
+            std::map<size_t, symbols::Id> stale;
+            if (auto error = compile_unit(std::move(fn), stale))
+                printf("%s\n", llvm::toString(std::move(error)).c_str());
 
-        for (std::unique_ptr<ast::Fn>& new_fn: functions) {
-            for (std::shared_ptr<ast::Block>& block: to_compile) {
-                for (auto it = block->statements.begin(); it != block->statements.end();) {
-                    ast::Fn* fn = (*it)->as_fn();
-                    if (!fn) return llvm::make_error<llvm::StringError>(ERROR_CODE, "Internal error: non-function statement stored in an associated function block.");
+            while (!stale.empty()) {
+                symbols::Id name = stale.begin()->second;
+                stale.erase(stale.begin());
+                if (pending.count(name))
+                    continue;
 
-                    if (fn->proto->name == new_fn->proto->name) {
-                        it = block->statements.erase(it);
-                    }
-                    else {
-                        it++;
-                    }
-                }
+                if (debug) printf("Recompiling '%s', since a function it uses changed.\n", symbols::str(name).c_str());
+                if (auto error = compile_unit((*units.find(name))->source, stale))
+                    printf("%s\n", llvm::toString(std::move(error)).c_str());
             }
         }
 
-        // Create a block to compile for the new functions, and a tracker.
-        // (Is it possible to just cast A<B*> to A<C*> where B:C?)
+        return llvm::Error::success();
+    }
 
-        std::vector<std::unique_ptr<ast::Statement>> statements;
-        std::shared_ptr<ast::Block> new_block = std::make_shared<ast::Block>(std::move(statements));
-        
-        for (std::unique_ptr<ast::Fn>& new_fn: functions) {
-            associations[new_fn->proto->name] = new_block;
-            new_block->statements.push_back(std::move(new_fn));
+    // Replace whatever was compiled for a function's name with the source given. The functions
+    // that have to be recompiled because of it are added to stale.
+    llvm::Error compile_unit(Source source, std::map<size_t, symbols::Id>& stale) {
+        symbols::Id name = source.name();
+        std::unique_ptr<Unit>& entry = units[name];
+        if (!entry) {
+            entry = std::make_unique<Unit>();
+            entry->index = defined.size();
+            defined.push_back(name);
         }
-        blocks.insert(new_block);
-        to_compile.push_back(new_block);
+        Unit& unit = *entry;
 
-        // Compile all blocks, update all trackers.
+        if (unit.tracker) {
+            wait_for_compiling();
+            if (auto error = unit.tracker->remove())
+                return error;
+        }
 
-        for (std::shared_ptr<ast::Block>& block: to_compile) {
-            if (block->statements.size() == 0)
-                continue;
-            
-            llvm::orc::ResourceTrackerSP tracker = session->getJITDylibByName(LIB_NAME)->createResourceTracker();
-            for (std::unique_ptr<ast::Statement>& statement: block->statements) {
-                if (ast::Fn* fn = statement->as_fn()) {
-                    module_trackers[fn->proto->name] = tracker;
-                }
+        int arity = resolve::arity(name);
+        bool inlined = optimize::inlined(name);
+
+        for (symbols::Id used: unit.uses)
+            dependents[used].erase(name);
+        unit.uses = source.fn ? resolve::references(*source.fn) : resolve::references(*source.tree, source.index);
+        for (symbols::Id used: unit.uses)
+            dependents[used].insert(name);
+
+        unit.source = std::move(source);
+        unit.body = Body();
+        if (unit.source.fn) {
+            {
+                arena::Scope scope(unit.source.fn->memory);
+                unit.body.fn = unit.source.fn->copy();
             }
+            // In order, so that each function can inline the operators defined before it.
+            optimize::function(*unit.body.fn);
+        }
+        else {
+            unit.body.tree = unit.source.tree;
+            unit.body.index = unit.source.index;
+            unit.body.names = std::make_shared<resolve::Names>(*unit.source.tree);
+            optimize::declare(name);
+        }
+
+        unit.tracker = session->getJITDylibByName(BODIES_NAME)->createResourceTracker();
+        llvm::Error error = define(unit);
 
-            compile(*block, tracker);
+        if (inlined || (arity != -1 && arity != resolve::arity(name))) {
+            for (symbols::Id dependent: dependents[name]) {
+                if (dependent != name)
+                    stale[(*units.find(dependent))->index] = dependent;
+            }
         }
 
-        return llvm::Error::success();
+        return error;
     }
 
     llvm::Expected<std::unique_ptr<double>> execute_anonymous_fn(ast::Fn& fn) {
+        // Nothing to compile if it has been folded down to a number. (See optimize.cpp)
+        if (const ast::Num* constant = optimize::constant(fn)) {
+            if (debug) printf("Result: %f\n", constant->value);
+            return std::make_unique<double>(constant->value);
+        }
+
         llvm::orc::ResourceTrackerSP temp_tracker = session->getJITDylibByName(LIB_NAME)->createResourceTracker();
         if (auto error = compile(fn, temp_tracker))
             return std::move(error);
@@ -414,31 +883,206 @@ namespace jit {
         return result;
     }
 
-    llvm::Error compile(ast::Item& item, llvm::orc::ResourceTrackerSP tracker) {
-        gen::emit(item, &*layout, triple);
+    void start_compiling(llvm::orc::JITDylib& lib, llvm::orc::SymbolLookupSet symbols);
+
+    llvm::Error compile(llvm::function_ref<void()> emit, llvm::orc::ResourceTrackerSP tracker, bool start);
+
+    llvm::Error compile(ast::Item& item, llvm::orc::ResourceTrackerSP tracker, bool start) {
+        return compile([&]() { gen::emit(item, &*layout, triple); }, tracker, start);
+    }
+
+    llvm::Error compile(const Body& body, llvm::orc::ResourceTrackerSP tracker, bool start) {
+        return compile([&]() { body.emit(); }, tracker, start);
+    }
+
+    // Compile the module that emit generates. If start is set, and there are workers, it starts
+    // being compiled straight away, rather than when something first needs it. (See start_compiling)
+    llvm::Error compile(llvm::function_ref<void()> emit, llvm::orc::ResourceTrackerSP tracker, bool start) {
+        std::unique_lock<std::mutex> lock(generating);
+        emit();
         if (!gen::has_current()) {
             // TODO: Maybe thing about adding a useful name here.
             printf("WARNING: failed to regen IR for module.\n");
             return llvm::Error::success();
         }
 
-        llvm::orc::ThreadSafeModule thread_safe_mod(std::move(gen::take_module()), std::move(gen::take_context()));
+        std::unique_ptr<llvm::Module> mod = gen::take_module();
+        llvm::orc::SymbolLookupSet defined;
+        if (start && workers) {
+            for (llvm::Function& fn: *mod) {
+                if (!fn.isDeclaration())
+                    defined.add((*mangle)(fn.getName()));
+            }
+        }
+        llvm::orc::ThreadSafeModule thread_safe_mod(std::move(mod), gen::take_context());
+        lock.unlock();
 
         if (auto error = compile_layer->add(tracker, std::move(thread_safe_mod))) {
             printf("gen::interactive (replace existing module) -> ");
             return std::move(error);
         }
 
+        if (!defined.empty())
+            start_compiling(tracker->getJITDylib(), std::move(defined));
+
         return llvm::Error::success();
     }
 
+    // Look up what a module defines, without waiting for the result, which has the workers
+    // compile it while the next statement is read. The REPL thread only waits for code when
+    // it looks up '_main'.
+    void start_compiling(llvm::orc::JITDylib& lib, llvm::orc::SymbolLookupSet symbols) {
+        {
+            std::lock_guard<std::mutex> lock(compiling_mutex);
+            compiling++;
+        }
+
+        session->lookup(llvm::orc::LookupKind::Static, {{&lib, llvm::orc::JITDylibLookupFlags::MatchAllSymbols}},
+            std::move(symbols), llvm::orc::SymbolState::Ready,
+            [](llvm::Expected<llvm::orc::SymbolMap> result) {
+                // Anything that went wrong has been reported by the layer it went wrong in, 
+                // and comes up again when the symbols are looked up for a call.
+                if (!result)
+                    llvm::consumeError(result.takeError());
+
+                std::lock_guard<std::mutex> lock(compiling_mutex);
+                if (--compiling == 0)
+                    compiled.notify_all();
+            },
+            llvm::orc::NoDependenciesToRegister);
+    }
+
+    // A tracker shouldn't be removed while its module is being compiled, since that would
+    // fail the compile, and report it as an error.
+    void wait_for_compiling() {
+        std::unique_lock<std::mutex> lock(compiling_mutex);
+        compiled.wait(lock, []() { return compiling == 0; });
+    }
+
+    namespace {
+        // A function that hasn't been compiled yet. IR is generated for it, and compiled, when
+        // its body is first looked up, which is on its first call. (See define)
+        class LazyFunction : public llvm::orc::MaterializationUnit {
+        public:
+            LazyFunction(symbols::Id name, Body body, llvm::orc::SymbolFlagsMap symbols):
+                MaterializationUnit(Interface(std::move(symbols), nullptr)), name(name), body(std::move(body)) {}
+
+            llvm::StringRef getName() const override {
+                return "LazyFunction";
+            }
+
+            void materialize(std::unique_ptr<llvm::orc::MaterializationResponsibility> responsibility) override {
+                if (debug) printf("Compiling '%s' on its first call.\n", symbols::str(name).c_str());
+
+                // This is usually on a worker. Resolving here would change what is declared
+                // while the REPL thread is defining something else, so only what define()
+                // resolved is ever made into a LazyFunction.
+                assert(body.resolved() && "A lazy function should be resolved when it's defined.");
+
+                std::unique_lock<std::mutex> lock(generating);
+                body.emit();
+                if (!gen::has_current()) {
+                    lock.unlock();
+                    responsibility->failMaterialization();
+                    return;
+                }
+
+                llvm::orc::ThreadSafeModule thread_safe_mod(gen::take_module(), gen::take_context());
+                lock.unlock();
+                compile_layer->emit(std::move(responsibility), std::move(thread_safe_mod));
+            }
+
+        private:
+            symbols::Id name;
+            // Shared with the unit, which may have been replaced by the time this runs.
+            Body body;
+
+            void discard(const llvm::orc::JITDylib&, const llvm::orc::SymbolStringPtr&) override {}
+        };
+    }
+
+    // Add a unit's body to the bodies JITDylib, and point the function's stub at a trampoline
+    // that looks it up, and then points the stub straight at it. In lazy mode, looking the body
+    // up is what compiles it. (See LazyFunction) Otherwise it is compiled now.
+    //
+    // A name only ever gets one stub. When a function is defined again, its stub is pointed at
+    // a new trampoline, so that everything that already calls it gets the new definition.
+    llvm::Error define(Unit& unit) {
+        llvm::orc::JITDylib& main = *session->getJITDylibByName(LIB_NAME);
+        llvm::orc::JITDylib& bodies = *session->getJITDylibByName(BODIES_NAME);
+        llvm::JITSymbolFlags flags = llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable;
+
+        std::string name = symbols::str(unit.source.name());
+        llvm::orc::SymbolStringPtr symbol = (*mangle)(name);
+        bool has_stub = (bool)stubs->findStub(name, /*ExportedStubsOnly*/ false);
+
+        // Names are resolved now, and only now, rather than on the first call. So errors are
+        // shown when the function is defined, and generating it later on a worker only reads
+        // what was resolved. (See Generator::walk_fn) A function with errors has no body, so
+        // calling it ends up at call_failed.
+        std::unique_lock<std::mutex> lock(generating);
+        llvm::Error errors = unit.body.resolve();
+        lock.unlock();
+        if (errors) {
+            diag::print(std::move(errors));
+            if (!has_stub)
+                return llvm::Error::success();
+        }
+        else if (lazy) {
+            llvm::orc::SymbolFlagsMap symbols = {{symbol, flags}};
+            if (auto error = bodies.define(std::make_unique<LazyFunction>(unit.source.name(), unit.body, std::move(symbols)), unit.tracker))
+                return error;
+        }
+        else if (auto error = compile(unit.body, unit.tracker, /*start*/ true)) {
+            return error;
+        }
+
+        auto trampoline = call_through->getCallThroughTrampoline(bodies, symbol, [name](llvm::JITTargetAddress address) {
+            return stubs->updatePointer(name, address);
+        });
+        if (!trampoline)
+            return trampoline.takeError();
+
+        if (has_stub)
+            return stubs->updatePointer(name, *trampoline);
+
+        if (auto error = stubs->createStub(name, *trampoline, flags))
+            return error;
+        llvm::JITEvaluatedSymbol stub = stubs->findStub(name, /*ExportedStubsOnly*/ false);
+        return main.define(llvm::orc::absoluteSymbols({{symbol, stub}}));
+    }
+
+    // The memory of each tracker, biggest first. Each function has a tracker of its own, (see
+    // Unit) so that's mostly one line per function, with how much of it is the code itself.
+    void print_memory() {
+        if (!slabs) {
+            printf("Memory is only counted when linking with JITLink.\n");
+            return;
+        }
+
+        memory::Stats stats = slabs->stats();
+        printf("%zd slab(s), %llu KiB reserved, %llu KiB in use, %llu KiB free for reuse.\n", stats.slabs,
+            (unsigned long long)stats.reserved / 1024, (unsigned long long)stats.used / 1024, (unsigned long long)stats.free / 1024);
+
+        std::vector<memory::Usage> usage = accounting->usage();
+        std::sort(usage.begin(), usage.end(), [](const memory::Usage& a, const memory::Usage& b) {
+            return a.bytes > b.bytes;
+        });
+        for (memory::Usage& tracker: usage) {
+            std::string functions;
+            for (auto& function: tracker.functions)
+                functions += " " + function.first + " (" + std::to_string(function.second) + " bytes of code)";
+            printf(" -> %llu bytes:%s\n", (unsigned long long)tracker.bytes, functions.c_str());
+        }
+    }
+
     llvm::Error compile_to_obj_file() {
-        if (blocks.size() == 0) {
+        if (defined.size() == 0) {
             printf("Nothing to compile.\n");
             return llvm::Error::success();
         } 
 
-        printf("Compiling %zd blocks to external object file.\n", blocks.size());
+        printf("Compiling %zd function(s) to external object file.\n", defined.size());
 
         std::string triple_text = llvm::sys::getDefaultTargetTriple();
 
@@ -456,13 +1100,17 @@ namespace jit {
         const llvm::Triple& machine_triple = machine->getTargetTriple();
         const llvm::DataLayout machine_layout = machine->createDataLayout();
 
+        std::lock_guard<std::mutex> lock(generating);
         gen::Generator generator(&machine_layout, &machine_triple);
-        try {
-            for (const std::shared_ptr<ast::Block>& block: blocks) {
-                block->visit(generator);
-            }
-        } catch(std::exception& e) {
-            util::print_exception(e);
+        llvm::Error errors = llvm::Error::success();
+        for (symbols::Id name: defined) {
+            Body& body = (*units.find(name))->body;
+            llvm::Error error = body.fn ? generator.walk(*body.fn).takeError() : generator.walk_tree_fn(*body.tree, body.index, *body.names);
+            if (error)
+                errors = llvm::joinErrors(std::move(errors), std::move(error));
+        }
+        if (errors) {
+            diag::print(std::move(errors));
             generator.clear();
             return llvm::Error::success();
         }
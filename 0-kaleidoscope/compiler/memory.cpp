@@ -0,0 +1,554 @@
+#pragma once
+
+// LLVM generates lots of warnings I can't do anything about.
+#pragma warning(push, 0)
+#include "llvm/ExecutionEngine/JITLink/JITLink.h"
+#include "llvm/ExecutionEngine/JITLink/JITLinkMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/Shared/AllocationActions.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/Process.h"
+#pragma warning(pop)
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+// Memory for compiled code, when it is linked by JITLink. (See jit::init)
+//
+// LLVM's own memory managers map new pages for every module, and then change their permissions
+// once it has been linked. Most modules here are tiny, one function or one top-level expression,
+// so that's a few system calls for a few bytes of code, and a mapping of its own for each one.
+//
+// Instead, address space is reserved in large slabs, and modules are given pages from them one
+// after another. Each slab is split into a region for each kind of page, (see Region) so the
+// code of one module goes right after the code of the one before. Pages still have their
+// permissions set, but neighbouring pages with the same permissions are merged into a single
+// mapping by the kernel, so there are far fewer mappings, and code that was compiled together
+// stays close together.
+//
+// A module is removed after every top-level expression, and whenever a function is defined
+// again, so pages are given back all the time. They are kept, and given to the next modules
+// that fit, rather than being returned to the system a few at a time. (See Slab::free) A slab
+// only goes back to the system once nothing in it is used, and then it goes in one piece.
+//
+// Optionally, segments of a module that are bigger than a huge page are given whole huge pages.
+// (See Slabs::create) What each tracker has is kept count of by Accounting.
+
+namespace memory {
+
+// Pages aren't backed by anything until they're first written to, so a slab is cheap.
+const uint64_t SLAB_SIZE = 64 << 20;
+// The size of a transparent huge page on x86-64.
+const uint64_t HUGE_PAGE_SIZE = 2 << 20;
+
+// Which part of a slab pages with the given permissions are taken from.
+enum Region {
+    CODE,
+    READ_ONLY,
+    READ_WRITE,
+    // Anything unusual, such as pages that are writable and executable.
+    OTHER,
+    REGIONS,
+};
+
+Region region(llvm::jitlink::MemProt permissions) {
+    using llvm::sys::Memory;
+    unsigned flags = llvm::jitlink::toSysMemoryProtectionFlags(permissions);
+    if (flags == (Memory::MF_READ | Memory::MF_EXEC))
+        return CODE;
+    if (flags == Memory::MF_READ)
+        return READ_ONLY;
+    if (flags == (Memory::MF_READ | Memory::MF_WRITE))
+        return READ_WRITE;
+    return OTHER;
+}
+
+// For the 'memory' command. (See jit::print_memory)
+struct Stats {
+    size_t slabs = 0;
+    // Address space, most of which isn't backed by anything.
+    uint64_t reserved = 0;
+    // Pages that modules have.
+    uint64_t used = 0;
+    // Pages that were given back, and are kept for the next modules.
+    uint64_t free = 0;
+};
+
+class Slabs : public llvm::jitlink::JITLinkMemoryManager {
+public:
+    // With huge_pages, big segments are given whole huge pages, which the kernel is asked to
+    // back with huge pages. (Only on Linux, with transparent huge pages turned on)
+    static llvm::Expected<std::unique_ptr<Slabs>> create(bool huge_pages) {
+        llvm::Expected<unsigned> page_size = llvm::sys::Process::getPageSize();
+        if (!page_size)
+            return page_size.takeError();
+        return std::make_unique<Slabs>(*page_size, huge_pages);
+    }
+
+    Slabs(uint64_t page_size, bool huge_pages): page_size(page_size), huge_pages(huge_pages) {}
+
+    ~Slabs() {
+        for (std::unique_ptr<Slab>& slab: slabs)
+            llvm::sys::Memory::releaseMappedMemory(slab->memory);
+    }
+
+    Slabs(const Slabs&) = delete;
+    Slabs& operator=(const Slabs&) = delete;
+
+    // Called from whichever thread is linking the module. (See jit::init_workers)
+    void allocate(const llvm::jitlink::JITLinkDylib*, llvm::jitlink::LinkGraph& graph, OnAllocatedFunction on_allocated) override {
+        llvm::jitlink::BasicLayout layout(graph);
+        // (Only to check that nothing needs to be aligned to more than a page)
+        if (auto sizes = layout.getContiguousPageBasedLayoutSizes(page_size); !sizes)
+            return on_allocated(sizes.takeError());
+
+        std::unique_ptr<InFlight> in_flight = std::make_unique<InFlight>(*this, std::move(layout));
+        if (llvm::Error error = place(*in_flight))
+            return on_allocated(std::move(error));
+
+        // Pages that were used before have to be made writable again, and cleared, since
+        // the parts of a module that start out as zeros aren't written.
+        llvm::Error error = llvm::Error::success();
+        for (Run& run: in_flight->runs) {
+            if (!run.recycled)
+                continue;
+            if (run.region != READ_WRITE) {
+                llvm::sys::MemoryBlock pages(run.start, run.size);
+                if (std::error_code code = llvm::sys::Memory::protectMappedMemory(pages, llvm::sys::Memory::MF_READ | llvm::sys::Memory::MF_WRITE)) {
+                    error = llvm::errorCodeToError(code);
+                    break;
+                }
+            }
+            std::memset(run.start, 0, run.size);
+        }
+
+        // Copies the contents of the module into place.
+        if (!error)
+            error = in_flight->layout.apply();
+        if (error) {
+            in_flight->release();
+            return on_allocated(std::move(error));
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            placed[&graph] = in_flight->kept();
+        }
+        on_allocated(std::move(in_flight));
+    }
+
+    using JITLinkMemoryManager::allocate;
+
+    // Called when a module's tracker is removed.
+    void deallocate(std::vector<FinalizedAlloc> allocations, OnDeallocatedFunction on_deallocated) override {
+        llvm::Error errors = llvm::Error::success();
+
+        // In reverse, as JITLinkMemoryManager asks.
+        for (auto it = allocations.rbegin(); it != allocations.rend(); it++) {
+            std::unique_ptr<Allocation> allocation(it->release().toPtr<Allocation*>());
+            errors = llvm::joinErrors(std::move(errors), llvm::orc::shared::runDeallocActions(allocation->dealloc_actions));
+            give_back(allocation->runs);
+        }
+
+        on_deallocated(std::move(errors));
+    }
+
+    using JITLinkMemoryManager::deallocate;
+
+    // How many bytes of pages a module was given, which is only known once. (See Accounting)
+    uint64_t take_placed(const llvm::jitlink::LinkGraph& graph) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = placed.find(&graph);
+        if (found == placed.end())
+            return 0;
+        uint64_t bytes = found->second;
+        placed.erase(found);
+        return bytes;
+    }
+
+    Stats stats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        Stats stats;
+        stats.slabs = slabs.size();
+        for (std::unique_ptr<Slab>& slab: slabs) {
+            stats.reserved += slab->memory.allocatedSize();
+            stats.used += slab->used;
+        }
+        stats.free = free_bytes;
+        return stats;
+    }
+
+private:
+    struct Slab {
+        llvm::sys::MemoryBlock memory;
+        // The start of the first region, which is aligned to a huge page if they're used.
+        char* base;
+        uint64_t region_size;
+        // How far into each region pages have been given out from, the first time around.
+        uint64_t bumped[REGIONS] = {};
+        // Runs of pages in each region that were given back, by where they start, and how big
+        // they are. Runs next to each other are merged.
+        std::map<char*, uint64_t> free[REGIONS];
+        // How much of the slab has been given out, and not given back.
+        uint64_t used = 0;
+
+        char* region_start(Region region) const {
+            return base + region * region_size;
+        }
+    };
+
+    // Some pages given to one segment of a module.
+    struct Run {
+        Slab* slab;
+        Region region;
+        char* start;
+        uint64_t size;
+        // If it's a segment that is kept once the module has been finalized.
+        bool kept;
+        // If the pages were used before.
+        bool recycled;
+    };
+
+    // What a FinalizedAlloc points to.
+    struct Allocation {
+        std::vector<Run> runs;
+        std::vector<llvm::orc::shared::WrapperFunctionCall> dealloc_actions;
+    };
+
+    // A module that has memory, but hasn't been finalized yet.
+    class InFlight : public llvm::jitlink::JITLinkMemoryManager::InFlightAlloc {
+    public:
+        llvm::jitlink::BasicLayout layout;
+        // In the same order as the segments of the layout.
+        std::vector<Run> runs;
+
+        InFlight(Slabs& slabs, llvm::jitlink::BasicLayout layout): layout(std::move(layout)), slabs(slabs) {}
+
+        void finalize(OnFinalizedFunction on_finalized) override {
+            size_t i = 0;
+            for (auto& entry: layout.segments()) {
+                Run& run = runs[i++];
+                llvm::sys::MemoryBlock pages(run.start, run.size);
+                llvm::sys::Memory::ProtectionFlags flags = llvm::jitlink::toSysMemoryProtectionFlags(entry.first.getMemProt());
+
+                if (std::error_code error = llvm::sys::Memory::protectMappedMemory(pages, flags))
+                    return on_finalized(llvm::errorCodeToError(error));
+                if (flags & llvm::sys::Memory::MF_EXEC)
+                    llvm::sys::Memory::InvalidateInstructionCache(pages.base(), pages.allocatedSize());
+            }
+
+            auto dealloc_actions = llvm::orc::shared::runFinalizeActions(layout.graphAllocActions());
+            if (!dealloc_actions)
+                return on_finalized(dealloc_actions.takeError());
+
+            // The segments that were only needed until now.
+            std::vector<Run> kept;
+            std::vector<Run> temporary;
+            for (Run& run: runs)
+                (run.kept ? kept : temporary).push_back(run);
+            slabs.give_back(temporary);
+
+            Allocation* allocation = new Allocation{std::move(kept), std::move(*dealloc_actions)};
+            on_finalized(FinalizedAlloc(llvm::orc::ExecutorAddr::fromPtr(allocation)));
+        }
+
+        void abandon(OnAbandonedFunction on_abandoned) override {
+            release();
+            on_abandoned(llvm::Error::success());
+        }
+
+        void release() {
+            slabs.give_back(runs);
+            runs.clear();
+        }
+
+        uint64_t kept() const {
+            uint64_t bytes = 0;
+            for (const Run& run: runs) {
+                if (run.kept)
+                    bytes += run.size;
+            }
+            return bytes;
+        }
+
+    private:
+        Slabs& slabs;
+    };
+
+    uint64_t page_size;
+    bool huge_pages;
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Slab>> slabs;
+    // The total size of the free runs of all the slabs.
+    uint64_t free_bytes = 0;
+    // How much each module that is being linked has. (See take_placed)
+    std::unordered_map<const llvm::jitlink::LinkGraph*, uint64_t> placed;
+
+    // How many bytes a segment is given. Whole pages, or whole huge pages for big segments.
+    uint64_t size(const llvm::jitlink::BasicLayout::Segment& segment) const {
+        uint64_t size = llvm::alignTo(segment.ContentSize + segment.ZeroFillSize, page_size);
+        if (huge_pages && size >= HUGE_PAGE_SIZE)
+            return llvm::alignTo(size, HUGE_PAGE_SIZE);
+        return size;
+    }
+
+    // Give each segment of a module pages from the region for its permissions. They all come
+    // from the same slab, so that the module's code can refer to its data with 32 bit offsets.
+    // Older slabs are tried first, so that the space in them is used up before a new one is
+    // started, and the newer ones have more of a chance to be let go of.
+    llvm::Error place(InFlight& in_flight) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (std::unique_ptr<Slab>& slab: slabs) {
+            if (place(*slab, in_flight))
+                return llvm::Error::success();
+        }
+
+        // Bigger than usual, if the module wouldn't fit in a slab otherwise.
+        uint64_t needed[REGIONS] = {};
+        for (auto& entry: in_flight.layout.segments())
+            needed[region(entry.first.getMemProt())] += size(entry.second);
+        uint64_t alignment = huge_pages ? HUGE_PAGE_SIZE : page_size;
+        // (Room to line everything up with huge pages)
+        auto segments = in_flight.layout.segments();
+        uint64_t slack = huge_pages ? HUGE_PAGE_SIZE * std::distance(segments.begin(), segments.end()) : 0;
+        uint64_t region_size = std::max(SLAB_SIZE / REGIONS, *std::max_element(needed, needed + REGIONS) + slack);
+        region_size = llvm::alignTo(region_size, alignment);
+
+        std::error_code error;
+        llvm::sys::MemoryBlock memory = llvm::sys::Memory::allocateMappedMemory(region_size * REGIONS + slack, nullptr,
+            llvm::sys::Memory::MF_READ | llvm::sys::Memory::MF_WRITE, error);
+        if (error)
+            return llvm::errorCodeToError(error);
+
+        std::unique_ptr<Slab> slab = std::make_unique<Slab>();
+        slab->memory = memory;
+        slab->base = (char*)llvm::alignTo((uintptr_t)memory.base(), alignment);
+        slab->region_size = region_size;
+        slabs.push_back(std::move(slab));
+
+        if (!place(*slabs.back(), in_flight))
+            return llvm::make_error<llvm::StringError>("A module didn't fit in a new slab of memory.", llvm::inconvertibleErrorCode());
+        return llvm::Error::success();
+    }
+
+    // Place a module in one slab, if there is room for all of it there.
+    bool place(Slab& slab, InFlight& in_flight) {
+        for (auto& entry: in_flight.layout.segments()) {
+            llvm::jitlink::BasicLayout::Segment& segment = entry.second;
+            Region from = region(entry.first.getMemProt());
+            uint64_t bytes = size(segment);
+            bool huge = huge_pages && bytes >= HUGE_PAGE_SIZE;
+
+            bool recycled = false;
+            char* start = take(slab, from, bytes, huge ? HUGE_PAGE_SIZE : page_size, recycled);
+            if (!start) {
+                // Put back what was taken from this slab, to try the next one.
+                for (Run& run: in_flight.runs)
+                    put_back(run);
+                in_flight.runs.clear();
+                return false;
+            }
+
+#ifdef __linux__
+            if (huge)
+                madvise(start, bytes, MADV_HUGEPAGE);
+#endif
+
+            segment.WorkingMem = start;
+            segment.Addr = llvm::orc::ExecutorAddr::fromPtr(start);
+            bool kept = entry.first.getMemDeallocPolicy() == llvm::jitlink::MemDeallocPolicy::Standard;
+            in_flight.runs.push_back(Run{&slab, from, start, bytes, kept, recycled});
+        }
+        return true;
+    }
+
+    // Some pages from a region of a slab, lined up to the alignment, or nullptr if there isn't
+    // room. The first free run they fit in is used, or else pages that haven't been used yet.
+    char* take(Slab& slab, Region from, uint64_t bytes, uint64_t alignment, bool& recycled) {
+        std::map<char*, uint64_t>& runs = slab.free[from];
+        for (auto it = runs.begin(); it != runs.end(); it++) {
+            char* run_start = it->first;
+            char* run_end = run_start + it->second;
+            char* start = (char*)llvm::alignTo((uintptr_t)run_start, alignment);
+            if (start + bytes > run_end)
+                continue;
+
+            runs.erase(it);
+            free_bytes -= run_end - run_start;
+            add_free(slab, from, run_start, start - run_start);
+            add_free(slab, from, start + bytes, run_end - (start + bytes));
+            slab.used += bytes;
+            recycled = true;
+            return start;
+        }
+
+        char* end = slab.region_start(from) + slab.bumped[from];
+        char* start = (char*)llvm::alignTo((uintptr_t)end, alignment);
+        if (start + bytes > slab.region_start(from) + slab.region_size)
+            return nullptr;
+
+        add_free(slab, from, end, start - end);
+        slab.bumped[from] = start + bytes - slab.region_start(from);
+        slab.used += bytes;
+        recycled = false;
+        return start;
+    }
+
+    void add_free(Slab& slab, Region from, char* start, uint64_t bytes) {
+        if (bytes == 0)
+            return;
+        free_bytes += bytes;
+
+        std::map<char*, uint64_t>& runs = slab.free[from];
+        auto next = runs.lower_bound(start);
+        if (next != runs.end() && start + bytes == next->first) {
+            bytes += next->second;
+            next = runs.erase(next);
+        }
+        if (next != runs.begin()) {
+            auto previous = std::prev(next);
+            if (previous->first + previous->second == start) {
+                previous->second += bytes;
+                return;
+            }
+        }
+        runs.emplace_hint(next, start, bytes);
+    }
+
+    // (The mutex has to be held)
+    void put_back(const Run& run) {
+        run.slab->used -= run.size;
+        add_free(*run.slab, run.region, run.start, run.size);
+    }
+
+    // Pages keep their contents and permissions until they're given out again. A slab that
+    // nothing uses any more goes back to the system, unless it's the only one.
+    void give_back(const std::vector<Run>& runs) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const Run& run: runs) {
+            put_back(run);
+            if (run.slab->used > 0 || slabs.size() == 1)
+                continue;
+
+            for (std::map<char*, uint64_t>& region: run.slab->free) {
+                for (auto& entry: region)
+                    free_bytes -= entry.second;
+            }
+            llvm::sys::Memory::releaseMappedMemory(run.slab->memory);
+            slabs.erase(std::find_if(slabs.begin(), slabs.end(), [&](std::unique_ptr<Slab>& slab) {
+                return slab.get() == run.slab;
+            }));
+        }
+    }
+};
+
+// What a tracker has.
+struct Usage {
+    // Pages, from Slabs.
+    uint64_t bytes = 0;
+    // The functions in it, and how many bytes of code each one is.
+    std::vector<std::pair<std::string, uint64_t>> functions;
+};
+
+// Keeps count of the memory each tracker has, (see Usage) by following what happens to the
+// modules that the ObjectLinkingLayer links.
+class Accounting : public llvm::orc::ObjectLinkingLayer::Plugin {
+public:
+    Accounting(Slabs& slabs): slabs(slabs) {}
+
+    void modifyPassConfig(llvm::orc::MaterializationResponsibility& responsibility, llvm::jitlink::LinkGraph&,
+            llvm::jitlink::PassConfiguration& config) override {
+        // Once the module has memory, and its functions have been laid out.
+        config.PostAllocationPasses.push_back([this, &responsibility](llvm::jitlink::LinkGraph& graph) {
+            Usage usage;
+            usage.bytes = slabs.take_placed(graph);
+            for (llvm::jitlink::Symbol* symbol: graph.defined_symbols()) {
+                if (symbol->hasName() && symbol->isCallable())
+                    usage.functions.emplace_back(symbol->getName().str(), symbol->getSize());
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            linking[&responsibility] = std::move(usage);
+            return llvm::Error::success();
+        });
+    }
+
+    llvm::Error notifyEmitted(llvm::orc::MaterializationResponsibility& responsibility) override {
+        Usage usage = take_linking(responsibility);
+        return responsibility.withResourceKeyDo([&](llvm::orc::ResourceKey key) {
+            std::lock_guard<std::mutex> lock(mutex);
+            add(trackers[key], std::move(usage));
+        });
+    }
+
+    // The pages are given back by Slabs, so there's nothing to count.
+    llvm::Error notifyFailed(llvm::orc::MaterializationResponsibility& responsibility) override {
+        take_linking(responsibility);
+        return llvm::Error::success();
+    }
+
+    llvm::Error notifyRemovingResources(llvm::orc::ResourceKey key) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        trackers.erase(key);
+        return llvm::Error::success();
+    }
+
+    void notifyTransferringResources(llvm::orc::ResourceKey to, llvm::orc::ResourceKey from) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = trackers.find(from);
+        if (found == trackers.end())
+            return;
+        Usage usage = std::move(found->second);
+        trackers.erase(found);
+        add(trackers[to], std::move(usage));
+    }
+
+    // Each tracker that has any memory.
+    std::vector<Usage> usage() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<Usage> result;
+        for (auto& entry: trackers)
+            result.push_back(entry.second);
+        return result;
+    }
+
+private:
+    Slabs& slabs;
+
+    std::mutex mutex;
+    std::unordered_map<llvm::orc::ResourceKey, Usage> trackers;
+    // Modules that have memory, but haven't been emitted yet.
+    std::unordered_map<llvm::orc::MaterializationResponsibility*, Usage> linking;
+
+    Usage take_linking(llvm::orc::MaterializationResponsibility& responsibility) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = linking.find(&responsibility);
+        if (found == linking.end())
+            return Usage();
+        Usage usage = std::move(found->second);
+        linking.erase(found);
+        return usage;
+    }
+
+    static void add(Usage& total, Usage usage) {
+        total.bytes += usage.bytes;
+        std::move(usage.functions.begin(), usage.functions.end(), std::back_inserter(total.functions));
+    }
+};
+
+}
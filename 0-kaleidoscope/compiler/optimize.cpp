@@ -0,0 +1,387 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ast.cpp"
+#include "arena.cpp"
+#include "symbols.cpp"
+
+// Simplifies ast items before code is generated for them.
+//
+// Arithmetic on numbers is done up front, (constant folding) and so are the few identities
+// that hold for every double, like x*1 and x-0. An 'if' with a number for a condition becomes
+// the branch that would be taken.
+//
+// Small operators, such as the ones in the prelude, are inlined. '!x' becomes
+// 'if x then 0 else 1', and then just 0 or 1 if x is a number. An operator can be inlined
+// if, once simplified itself, it is only made of numbers, its parameters, builtin operators
+// and 'if'. (See Operator)
+//
+// So a top-level expression such as '!0 + 2*3' comes out as a single number, which doesn't
+// need to be compiled at all. (See jit::execute_anonymous_fn)
+//
+// None of this changes what a program does, or the order of its side effects. When an operator
+// that was inlined is defined again, the functions it was inlined into have to be simplified
+// again, from their source. (See inlined, and jit::compile_functions)
+
+namespace optimize {
+    bool debug = false;
+    // Turned off with 'toggle optimizer', to see the IR for the code as it was written.
+    bool enabled = true;
+
+    namespace {
+        // The most items in the body of an operator that is inlined.
+        const size_t MAX_INLINE_SIZE = 24;
+
+        // An operator that can be inlined.
+        struct Operator {
+            std::vector<symbols::Id> params;
+            // How many times each parameter is used in the body.
+            std::vector<uint32_t> uses;
+            std::unique_ptr<ast::Expr> body;
+        };
+
+        // By the name of the function, such as "binary|".
+        symbols::Table<std::unique_ptr<Operator>> operators;
+
+        const ast::Num* number(const ast::Expr& expr) {
+            return expr.kind == ast::Kind::NUM ? static_cast<const ast::Num*>(&expr) : nullptr;
+        }
+
+        // The same as the condition of a generated 'if', which is false for NaN.
+        bool truthy(double value) {
+            return value < 0 || value > 0;
+        }
+
+        // A builtin operator on two numbers, as the generated instruction would do it.
+        double fold(char op, double lhs, double rhs) {
+            switch (op) {
+                case '+': return lhs + rhs;
+                case '-': return lhs - rhs;
+                case '*': return lhs * rhs;
+                // The comparison is unordered, so it's true if either side is NaN.
+                default: return (std::isnan(lhs) || std::isnan(rhs) || lhs < rhs) ? 1 : 0;
+            }
+        }
+
+        // Whether an expression has no side effects, so that it doesn't matter when (or how
+        // many times) it is evaluated.
+        bool pure(const ast::Expr& expr) {
+            switch (expr.kind) {
+                case ast::Kind::NUM:
+                case ast::Kind::VAR:
+                    return true;
+                case ast::Kind::BIN: {
+                    const ast::Bin& bin = static_cast<const ast::Bin&>(expr);
+                    return ast::is_builtin(bin.op) && pure(*bin.lhs) && pure(*bin.rhs);
+                }
+                case ast::Kind::IF: {
+                    const ast::If& branch = static_cast<const ast::If&>(expr);
+                    return pure(*branch.cond) && pure(*branch.a) && (!branch.b || pure(*branch.b));
+                }
+                default:
+                    return false;
+            }
+        }
+
+        // Whether a body can be inlined, counting its items and the uses of each parameter.
+        bool inlinable(const ast::Expr& expr, const std::vector<symbols::Id>& params, std::vector<uint32_t>& uses, size_t& size) {
+            if (++size > MAX_INLINE_SIZE)
+                return false;
+
+            switch (expr.kind) {
+                case ast::Kind::NUM:
+                    return true;
+                case ast::Kind::VAR: {
+                    symbols::Id name = static_cast<const ast::Var&>(expr).name;
+                    for (size_t i = 0; i < params.size(); i++) {
+                        if (params[i] == name) {
+                            uses[i]++;
+                            return true;
+                        }
+                    }
+                    return false;
+                }
+                case ast::Kind::BIN: {
+                    const ast::Bin& bin = static_cast<const ast::Bin&>(expr);
+                    return ast::is_builtin(bin.op) && inlinable(*bin.lhs, params, uses, size) && inlinable(*bin.rhs, params, uses, size);
+                }
+                case ast::Kind::IF: {
+                    const ast::If& branch = static_cast<const ast::If&>(expr);
+                    return inlinable(*branch.cond, params, uses, size) && inlinable(*branch.a, params, uses, size)
+                        && (!branch.b || inlinable(*branch.b, params, uses, size));
+                }
+                default:
+                    return false;
+            }
+        }
+
+        class Optimizer : public ast::Walker<Optimizer, std::unique_ptr<ast::Expr>> {
+        public:
+            // Simplify an expression, replacing it if it can be made into something simpler.
+            void simplify(std::unique_ptr<ast::Expr>& expr) {
+                if (std::unique_ptr<ast::Expr> replacement = walk(*expr))
+                    expr = std::move(replacement);
+            }
+
+            // Each walk function returns what the item should be replaced with, or nullptr
+            // to keep it. (Its children may have been replaced either way)
+
+            std::unique_ptr<ast::Expr> walk_num(ast::Num&) {
+                return nullptr;
+            }
+
+            std::unique_ptr<ast::Expr> walk_var(ast::Var&) {
+                return nullptr;
+            }
+
+            std::unique_ptr<ast::Expr> walk_un(ast::Un& target) {
+                simplify(target.rhs);
+
+                std::vector<std::unique_ptr<ast::Expr>> args;
+                args.push_back(std::move(target.rhs));
+                std::unique_ptr<ast::Expr> inlined = inline_operator(ast::unary_name(target.op), args, target.offset);
+                if (!inlined)
+                    target.rhs = std::move(args[0]);
+                return inlined;
+            }
+
+            std::unique_ptr<ast::Expr> walk_bin(ast::Bin& target) {
+                simplify(target.lhs);
+                simplify(target.rhs);
+
+                if (!ast::is_builtin(target.op)) {
+                    std::vector<std::unique_ptr<ast::Expr>> args;
+                    args.push_back(std::move(target.lhs));
+                    args.push_back(std::move(target.rhs));
+                    std::unique_ptr<ast::Expr> inlined = inline_operator(ast::binary_name(target.op), args, target.offset);
+                    if (!inlined) {
+                        target.lhs = std::move(args[0]);
+                        target.rhs = std::move(args[1]);
+                    }
+                    return inlined;
+                }
+
+                const ast::Num* lhs = number(*target.lhs);
+                const ast::Num* rhs = number(*target.rhs);
+                if (lhs && rhs)
+                    return ast::at(target.offset, std::make_unique<ast::Num>(fold(target.op, lhs->value, rhs->value)));
+
+                // Only the identities that are exact for every double. (x+0 isn't, for -0)
+                if (target.op == '*' && rhs && rhs->value == 1)
+                    return std::move(target.lhs);
+                if (target.op == '*' && lhs && lhs->value == 1)
+                    return std::move(target.rhs);
+                if (target.op == '-' && rhs && rhs->value == 0 && !std::signbit(rhs->value))
+                    return std::move(target.lhs);
+                if (target.op == '+' && rhs && rhs->value == 0 && std::signbit(rhs->value))
+                    return std::move(target.lhs);
+                return nullptr;
+            }
+
+            std::unique_ptr<ast::Expr> walk_call(ast::Call& target) {
+                for (std::unique_ptr<ast::Expr>& arg: target.args)
+                    simplify(arg);
+                return nullptr;
+            }
+
+            std::unique_ptr<ast::Expr> walk_if(ast::If& target) {
+                simplify(target.cond);
+                simplify(target.a);
+                if (target.b)
+                    simplify(target.b);
+
+                const ast::Num* cond = number(*target.cond);
+                if (!cond)
+                    return nullptr;
+                if (truthy(cond->value))
+                    return std::move(target.a);
+                if (target.b)
+                    return std::move(target.b);
+                return ast::at(target.offset, std::make_unique<ast::Num>(0.));
+            }
+
+            // Loops are left as they are, apart from their parts.
+            std::unique_ptr<ast::Expr> walk_for(ast::For& target) {
+                simplify(target.start);
+                simplify(target.end);
+                if (target.inc)
+                    simplify(target.inc);
+                simplify(target.body);
+                return nullptr;
+            }
+
+            // If the body is a number, the variables are only needed for the side effects of
+            // their values.
+            std::unique_ptr<ast::Expr> walk_with(ast::With& target) {
+                bool all_pure = true;
+                for (auto& assignment: target.assignments) {
+                    if (assignment.second) {
+                        simplify(assignment.second);
+                        all_pure = all_pure && pure(*assignment.second);
+                    }
+                }
+                simplify(target.body);
+
+                if (all_pure && number(*target.body))
+                    return std::move(target.body);
+                return nullptr;
+            }
+
+            std::unique_ptr<ast::Expr> walk_assignment(ast::Assignment& target) {
+                simplify(target.value);
+                return nullptr;
+            }
+
+            std::unique_ptr<ast::Expr> walk_fn(ast::Fn& target) {
+                simplify(target.body);
+                return nullptr;
+            }
+
+            std::unique_ptr<ast::Expr> walk_block(ast::Block& target) {
+                for (std::unique_ptr<ast::Statement>& statement: target.statements)
+                    walk(*statement);
+                return nullptr;
+            }
+
+            std::unique_ptr<ast::Expr> walk_pro(ast::Pro&) { return nullptr; }
+            std::unique_ptr<ast::Expr> walk_import(ast::Import&) { return nullptr; }
+            std::unique_ptr<ast::Expr> walk_command(ast::Command&) { return nullptr; }
+
+        private:
+            // For the names of the variables that hold the arguments of inlined operators.
+            uint32_t inlined = 0;
+
+            // The body of an operator, with its parameters replaced by the arguments, or nullptr
+            // if it can't be inlined. (In which case the arguments are left as they are)
+            //
+            // Arguments are still evaluated once each, in order, as for a call: each one is put
+            // in a variable, unless it can be used in place. That is when it's a number, or when
+            // it's pure and either used only once or a variable. (A variable is only used in
+            // place if nothing before it could assign to it, which is when all of them are pure)
+            std::unique_ptr<ast::Expr> inline_operator(symbols::Id name, std::vector<std::unique_ptr<ast::Expr>>& args, uint32_t offset) {
+                std::unique_ptr<Operator>* found = operators.find(name);
+                if (!found || !*found || (*found)->params.size() != args.size())
+                    return nullptr;
+                const Operator& op = **found;
+
+                bool all_pure = true;
+                for (std::unique_ptr<ast::Expr>& arg: args)
+                    all_pure = all_pure && pure(*arg);
+
+                ast::List<std::pair<symbols::Id, std::unique_ptr<ast::Expr>>> variables;
+                std::vector<std::unique_ptr<ast::Expr>> values(args.size());
+                for (size_t i = 0; i < args.size(); i++) {
+                    bool in_place = number(*args[i])
+                        || (all_pure && (op.uses[i] <= 1 || args[i]->kind == ast::Kind::VAR));
+                    if (in_place) {
+                        values[i] = std::move(args[i]);
+                        continue;
+                    }
+
+                    // Can't be the same as any name in the source, since those are only letters
+                    // and digits.
+                    symbols::Id variable = symbols::intern(symbols::str(op.params[i]) + "." + std::to_string(inlined++));
+                    variables.emplace_back(variable, std::move(args[i]));
+                    values[i] = ast::at(offset, std::make_unique<ast::Var>(variable));
+                }
+
+                std::unique_ptr<ast::Expr> body = instantiate(*op.body, op, values, offset);
+                simplify(body);
+
+                // As for walk_with.
+                bool variables_pure = true;
+                for (auto& variable: variables)
+                    variables_pure = variables_pure && pure(*variable.second);
+                if (variables.empty() || (variables_pure && number(*body)))
+                    return body;
+                return ast::at(offset, std::make_unique<ast::With>(std::move(variables), std::move(body)));
+            }
+
+            // A copy of an operator's body, with the values in place of the parameters. Each
+            // value that is used more than once is copied. Everything is put at the offset of
+            // the operator that was inlined, for debug info.
+            std::unique_ptr<ast::Expr> instantiate(const ast::Expr& expr, const Operator& op, std::vector<std::unique_ptr<ast::Expr>>& values, uint32_t offset) {
+                switch (expr.kind) {
+                    case ast::Kind::VAR: {
+                        symbols::Id name = static_cast<const ast::Var&>(expr).name;
+                        size_t i = 0;
+                        while (op.params[i] != name)
+                            i++;
+                        return values[i]->copy();
+                    }
+                    case ast::Kind::BIN: {
+                        const ast::Bin& bin = static_cast<const ast::Bin&>(expr);
+                        return ast::at(offset, std::make_unique<ast::Bin>(bin.op,
+                            instantiate(*bin.lhs, op, values, offset), instantiate(*bin.rhs, op, values, offset)));
+                    }
+                    case ast::Kind::IF: {
+                        const ast::If& branch = static_cast<const ast::If&>(expr);
+                        return ast::at(offset, std::make_unique<ast::If>(instantiate(*branch.cond, op, values, offset),
+                            instantiate(*branch.a, op, values, offset), branch.b ? instantiate(*branch.b, op, values, offset) : nullptr));
+                    }
+                    default:
+                        return ast::at(offset, expr.copy());
+                }
+            }
+        };
+    }
+
+    // Simplify a function, and remember it for inlining if it's a small operator.
+    // Functions have to be given in the order they are defined, so that each one can inline
+    // the operators before it.
+    void function(ast::Fn& fn) {
+        if (enabled) {
+            // Anything new goes in the same arena as the rest of the function.
+            arena::Scope scope(fn.memory);
+            Optimizer().walk(fn);
+        }
+
+        if (!fn.proto->is_operator())
+            return;
+
+        std::unique_ptr<Operator> op = std::make_unique<Operator>();
+        op->params = fn.proto->args;
+        op->uses.assign(op->params.size(), 0);
+        size_t size = 0;
+        if (enabled && inlinable(*fn.body, op->params, op->uses, size)) {
+            // On the heap, since it can outlive the function.
+            arena::Scope scope(nullptr);
+            op->body = fn.body->copy();
+            operators[fn.proto->name] = std::move(op);
+            if (debug) printf("Operator '%s' will be inlined.\n", symbols::str(fn.proto->name).c_str());
+        }
+        else {
+            operators[fn.proto->name] = nullptr;
+        }
+    }
+
+    // An 'extern' replaces whatever was defined with its name before. So does a function that
+    // is compiled without being simplified, such as one from a cached import. (See jit::Unit)
+    void declare(symbols::Id name) {
+        if (std::unique_ptr<Operator>* found = operators.find(name))
+            *found = nullptr;
+    }
+
+    void declare(ast::Pro& proto) {
+        declare(proto.name);
+    }
+
+    // Whether calls to a function are being replaced with its body, so that anything that
+    // calls it is out of date once it is defined again.
+    bool inlined(symbols::Id name) {
+        std::unique_ptr<Operator>* found = operators.find(name);
+        return found && *found;
+    }
+
+    // The value of a function, if it's just a number.
+    const ast::Num* constant(const ast::Fn& fn) {
+        if (!enabled)
+            return nullptr;
+        return number(*fn.body);
+    }
+}
@@ -0,0 +1,567 @@
+#pragma once
+
+// LLVM generates lots of warnings I can't do anything about.
+#pragma warning(push, 0)
+#include "llvm/Support/Error.h"
+#pragma warning(pop)
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ast.cpp"
+#include "flat.cpp"
+#include "symbols.cpp"
+#include "diagnostics.cpp"
+
+// Name resolution, done for each function just before code is generated for it.
+//
+// Every variable in a function gets a slot, which is a dense index: the parameters first, then
+// each 'for' and 'with' variable in the order they are found. A variable that shadows another
+// gets a slot of its own, so nothing has to be put back at the end of a scope. References and
+// assignments are given the slot that they refer to, (see ast::Var::slot) and calls, including
+// operators, are given the id of the function that they call. (See Functions)
+//
+// So the generator only has to index arrays, and any unknown names in a function are all
+// reported before anything is generated for it. Functions in flat trees are resolved the same
+// way, into a side table. (See Names)
+
+namespace resolve {
+
+// Every function that has been declared, by id.
+// A name keeps the same id when it is declared again, and ids are dense, so that each module
+// can keep its functions in an array indexed by id. (See gen::Generator)
+class Functions {
+public:
+    // The id of a declared function, or ast::UNRESOLVED.
+    uint32_t find(symbols::Id name) const {
+        uint32_t id = ids.get(name);
+        if (id == 0 || !prototypes[id - 1])
+            return ast::UNRESOLVED;
+        return id - 1;
+    }
+
+    const ast::Pro& prototype(uint32_t id) const {
+        return *prototypes[id];
+    }
+
+    // Set the prototype of a function, giving it an id if it's new. The prototype it had
+    // before, if any, is returned, so that it can be put back. (See restore)
+    std::unique_ptr<ast::Pro> declare(std::unique_ptr<ast::Pro> proto) {
+        uint32_t& id = ids[proto->name];
+        if (id == 0) {
+            prototypes.emplace_back();
+            id = (uint32_t)prototypes.size();
+        }
+        std::swap(prototypes[id - 1], proto);
+        return proto;
+    }
+
+    void restore(symbols::Id name, std::unique_ptr<ast::Pro> previous) {
+        prototypes[ids[name] - 1] = std::move(previous);
+    }
+
+    size_t size() const {
+        return prototypes.size();
+    }
+
+private:
+    // Plus one, so that zero is no id.
+    symbols::Table<uint32_t> ids;
+    std::vector<std::unique_ptr<ast::Pro>> prototypes;
+};
+
+// This has to be kept between modules, so that a call in one can refer to a function
+// in another.
+Functions functions;
+
+// What is resolved for the functions in a flat tree, which can't be kept on the nodes, since
+// in a shared tree one node can be used in more than one scope. (See flat.cpp) So instead it
+// is kept by node, for the nodes that mean the same thing wherever they are: the function
+// that each call and user operator calls, and the slot of each variable that is bound or
+// assigned. Of those, only operators and calls can be shared, and the function one of them
+// calls doesn't depend on where it is. A variable is looked up as the tree is walked, from the
+// slots of the bindings that are in scope. (See gen::Generator::walk_tree)
+//
+// The tables are indexed the same as the arrays in the tree, and are filled in for one
+// function at a time, just before it is generated.
+struct Names {
+    std::vector<uint32_t> uns, bins, calls;
+    std::vector<uint32_t> fors, bindings, assignments;
+    // How many slots the last function resolved has.
+    uint32_t slots = 0;
+    // Whether the last function was resolved without errors. A function can keep tables of its
+    // own, so that it's resolved once, and generated from them later. (See jit::Unit)
+    bool resolved = false;
+
+    Names(const flat::Tree& tree):
+        uns(tree.uns.size(), ast::UNRESOLVED), bins(tree.bins.size(), ast::UNRESOLVED), 
+        calls(tree.calls.size(), ast::UNRESOLVED), fors(tree.fors.size(), ast::UNRESOLVED), 
+        bindings(tree.bindings.size(), ast::UNRESOLVED), assignments(tree.assignments.size(), ast::UNRESOLVED) {}
+};
+
+namespace {
+    // What the resolvers have in common: the variables in scope, and the errors found so far.
+    class Scope {
+    protected:
+        Scope(std::shared_ptr<const source::File> file): file(std::move(file)) {}
+
+        std::shared_ptr<const source::File> file;
+        llvm::Error errors = llvm::Error::success();
+
+        // The slot each name refers to, plus one, so that zero is nothing.
+        symbols::Table<uint32_t> scope;
+        // The names in scope, and what they referred to before, innermost last.
+        std::vector<std::pair<symbols::Id, uint32_t>> bound;
+        uint32_t slots = 0;
+
+        uint32_t bind(symbols::Id name) {
+            uint32_t& entry = scope[name];
+            bound.push_back({name, entry});
+            entry = ++slots;
+            return slots - 1;
+        }
+
+        // Take the names bound since the mark out of scope again.
+        void unbind(size_t mark) {
+            while (bound.size() > mark) {
+                scope[bound.back().first] = bound.back().second;
+                bound.pop_back();
+            }
+        }
+
+        // (A name that isn't in scope has zero, which comes out as ast::UNRESOLVED)
+        uint32_t lookup(symbols::Id name) const {
+            return scope.get(name) - 1;
+        }
+
+        uint32_t variable(symbols::Id name, uint32_t offset) {
+            uint32_t slot = lookup(name);
+            if (slot == ast::UNRESOLVED)
+                fail(diag::Code::UNKNOWN_VARIABLE, "Unknown variable '" + symbols::str(name) + "'", offset);
+            return slot;
+        }
+
+        uint32_t assigned(symbols::Id name, uint32_t offset) {
+            uint32_t slot = lookup(name);
+            if (slot == ast::UNRESOLVED)
+                fail(diag::Code::UNKNOWN_VARIABLE, "Unrecognized variable name: '" + symbols::str(name) + "'", offset);
+            return slot;
+        }
+
+        uint32_t unary(char op, uint32_t offset) {
+            uint32_t fn = functions.find(ast::unary_name(op));
+            if (fn == ast::UNRESOLVED)
+                fail(diag::Code::UNKNOWN_OPERATOR, "Unary operator not implemented: '" + std::string(1, op) + "'.", offset);
+            return fn;
+        }
+
+        // Builtin operators don't call anything, so they are left unresolved.
+        uint32_t binary(char op, uint32_t offset) {
+            if (ast::is_builtin(op))
+                return ast::UNRESOLVED;
+            uint32_t fn = functions.find(ast::binary_name(op));
+            if (fn == ast::UNRESOLVED)
+                fail(diag::Code::UNKNOWN_OPERATOR, "Binary operator not implemented: '" + std::string(1, op) + "'.", offset);
+            return fn;
+        }
+
+        uint32_t call(symbols::Id callee, size_t args, uint32_t offset) {
+            uint32_t fn = functions.find(callee);
+            std::string name = "'" + symbols::str(callee) + "'";
+            if (fn == ast::UNRESOLVED) {
+                fail(diag::Code::UNKNOWN_FUNCTION, "Unknown function: " + name + ".", offset);
+            }
+            else if (functions.prototype(fn).args.size() != args) {
+                std::string expected = std::to_string(functions.prototype(fn).args.size());
+                std::string found = std::to_string(args);
+                fail(diag::Code::ARGUMENT_COUNT, expected + " args expected for function " + name + ", found " + found + ".", offset);
+            }
+            return fn;
+        }
+
+        void fail(diag::Code code, std::string message, uint32_t offset) {
+            errors = llvm::joinErrors(std::move(errors), diag::error(code, "resolve", std::move(message), file, offset));
+        }
+    };
+
+    class Resolver : public ast::Walker<Resolver, void>, Scope {
+    public:
+        Resolver(std::shared_ptr<const source::File> file): Scope(std::move(file)) {}
+
+        // Gives the parameters their slots, and then resolves the body.
+        llvm::Error resolve(ast::Fn& fn) {
+            for (symbols::Id arg: fn.proto->args)
+                bind(arg);
+            walk(*fn.body);
+            fn.slots = slots;
+            return std::move(errors);
+        }
+
+        void walk_num(ast::Num&) {}
+
+        void walk_var(ast::Var& target) {
+            target.slot = variable(target.name, target.offset);
+        }
+
+        void walk_un(ast::Un& target) {
+            walk(*target.rhs);
+            target.fn = unary(target.op, target.offset);
+        }
+
+        void walk_bin(ast::Bin& target) {
+            walk(*target.lhs);
+            walk(*target.rhs);
+            target.fn = binary(target.op, target.offset);
+        }
+
+        void walk_call(ast::Call& target) {
+            target.fn = call(target.callee, target.args.size(), target.offset);
+            for (std::unique_ptr<ast::Expr>& arg: target.args)
+                walk(*arg);
+        }
+
+        void walk_if(ast::If& target) {
+            walk(*target.cond);
+            walk(*target.a);
+            if (target.b)
+                walk(*target.b);
+        }
+
+        // The loop variable is in scope for everything but the start value.
+        void walk_for(ast::For& target) {
+            walk(*target.start);
+            size_t mark = bound.size();
+            target.slot = bind(target.var_name);
+            walk(*target.end);
+            if (target.inc)
+                walk(*target.inc);
+            walk(*target.body);
+            unbind(mark);
+        }
+
+        // Each initial value can use the variables before it.
+        void walk_with(ast::With& target) {
+            size_t mark = bound.size();
+            target.slots.clear();
+            for (auto& assignment: target.assignments) {
+                if (assignment.second)
+                    walk(*assignment.second);
+                target.slots.push_back(bind(assignment.first));
+            }
+            walk(*target.body);
+            unbind(mark);
+        }
+
+        void walk_assignment(ast::Assignment& target) {
+            target.slot = assigned(target.identifier, target.offset);
+            walk(*target.value);
+        }
+
+        // None of these are found in a function body.
+        void walk_pro(ast::Pro& target) { internal(target); }
+        void walk_fn(ast::Fn& target) { internal(target); }
+        void walk_import(ast::Import& target) { internal(target); }
+        void walk_block(ast::Block& target) { internal(target); }
+        void walk_command(ast::Command& target) { internal(target); }
+
+    private:
+        void internal(ast::Item& target) {
+            fail(diag::Code::INTERNAL, "Unexpected statement in a function body.", target.offset);
+        }
+    };
+
+    // The same as Resolver, for a function in a flat tree, with what it finds kept in a 
+    // side table. (See Names)
+    class TreeResolver : Scope {
+    public:
+        TreeResolver(const flat::Tree& tree, Names& names): Scope(tree.file), tree(tree), names(names) {}
+
+        llvm::Error resolve(const flat::Fn& fn) {
+            for (symbols::Id arg: tree.param_names(tree.pros[fn.proto]))
+                bind(arg);
+            walk(fn.body);
+            names.slots = slots;
+            return std::move(errors);
+        }
+
+    private:
+        const flat::Tree& tree;
+        Names& names;
+
+        void walk(flat::Ref ref) {
+            if (!ref)
+                return;
+
+            uint32_t i = ref.index();
+            switch (ref.kind()) {
+            case flat::NUM:
+                return;
+            case flat::VAR:
+                variable(tree.name(tree.vars[i].name), tree.vars[i].offset);
+                return;
+            case flat::UN: {
+                const flat::Un& node = tree.uns[i];
+                walk(node.rhs);
+                names.uns[i] = unary(node.op, node.offset);
+                return;
+            }
+            case flat::BIN: {
+                const flat::Bin& node = tree.bins[i];
+                walk(node.lhs);
+                walk(node.rhs);
+                names.bins[i] = binary(node.op, node.offset);
+                return;
+            }
+            case flat::CALL: {
+                const flat::Call& node = tree.calls[i];
+                names.calls[i] = call(tree.name(node.callee), node.args.count, node.offset);
+                for (uint32_t arg = 0; arg < node.args.count; arg++)
+                    walk(tree.args[node.args.first + arg]);
+                return;
+            }
+            case flat::IF: {
+                const flat::If& node = tree.ifs[i];
+                walk(node.cond);
+                walk(node.a);
+                walk(node.b);
+                return;
+            }
+            case flat::FOR: {
+                const flat::For& node = tree.fors[i];
+                walk(node.start);
+                size_t mark = bound.size();
+                names.fors[i] = bind(tree.name(node.var_name));
+                walk(node.end);
+                walk(node.inc);
+                walk(node.body);
+                unbind(mark);
+                return;
+            }
+            case flat::ASSIGNMENT: {
+                const flat::Assignment& node = tree.assignments[i];
+                names.assignments[i] = assigned(tree.name(node.name), node.offset);
+                walk(node.value);
+                return;
+            }
+            case flat::WITH: {
+                const flat::With& node = tree.withs[i];
+                size_t mark = bound.size();
+                for (uint32_t j = node.bindings.first; j < node.bindings.first + node.bindings.count; j++) {
+                    walk(tree.bindings[j].value);
+                    names.bindings[j] = bind(tree.name(tree.bindings[j].name));
+                }
+                walk(node.body);
+                unbind(mark);
+                return;
+            }
+            }
+        }
+    };
+
+    // Collects the names of the functions that a body calls, including user operators.
+    class References : public ast::Walker<References, void> {
+    public:
+        std::vector<symbols::Id> names;
+
+        void walk_num(ast::Num&) {}
+        void walk_var(ast::Var&) {}
+
+        void walk_un(ast::Un& target) {
+            add(ast::unary_name(target.op));
+            walk(*target.rhs);
+        }
+
+        void walk_bin(ast::Bin& target) {
+            if (!ast::is_builtin(target.op))
+                add(ast::binary_name(target.op));
+            walk(*target.lhs);
+            walk(*target.rhs);
+        }
+
+        void walk_call(ast::Call& target) {
+            add(target.callee);
+            for (std::unique_ptr<ast::Expr>& arg: target.args)
+                walk(*arg);
+        }
+
+        void walk_if(ast::If& target) {
+            walk(*target.cond);
+            walk(*target.a);
+            if (target.b)
+                walk(*target.b);
+        }
+
+        void walk_for(ast::For& target) {
+            walk(*target.start);
+            walk(*target.end);
+            if (target.inc)
+                walk(*target.inc);
+            walk(*target.body);
+        }
+
+        void walk_with(ast::With& target) {
+            for (auto& assignment: target.assignments) {
+                if (assignment.second)
+                    walk(*assignment.second);
+            }
+            walk(*target.body);
+        }
+
+        void walk_assignment(ast::Assignment& target) {
+            walk(*target.value);
+        }
+
+        // Not found in a function body. (The Resolver reports them)
+        void walk_pro(ast::Pro&) {}
+        void walk_fn(ast::Fn&) {}
+        void walk_import(ast::Import&) {}
+        void walk_block(ast::Block&) {}
+        void walk_command(ast::Command&) {}
+
+    private:
+        // Bodies are small, so a linear search is fine.
+        void add(symbols::Id name) {
+            if (std::find(names.begin(), names.end(), name) == names.end())
+                names.push_back(name);
+        }
+    };
+
+    // The same, for a function in a flat tree.
+    class TreeReferences {
+    public:
+        TreeReferences(const flat::Tree& tree): tree(tree) {}
+
+        std::vector<symbols::Id> names;
+
+        void walk(flat::Ref ref) {
+            if (!ref)
+                return;
+
+            uint32_t i = ref.index();
+            switch (ref.kind()) {
+            case flat::NUM:
+            case flat::VAR:
+                return;
+            case flat::UN:
+                add(ast::unary_name(tree.uns[i].op));
+                walk(tree.uns[i].rhs);
+                return;
+            case flat::BIN: {
+                const flat::Bin& node = tree.bins[i];
+                if (!ast::is_builtin(node.op))
+                    add(ast::binary_name(node.op));
+                walk(node.lhs);
+                walk(node.rhs);
+                return;
+            }
+            case flat::CALL: {
+                const flat::Call& node = tree.calls[i];
+                add(tree.name(node.callee));
+                for (uint32_t arg = 0; arg < node.args.count; arg++)
+                    walk(tree.args[node.args.first + arg]);
+                return;
+            }
+            case flat::IF: {
+                const flat::If& node = tree.ifs[i];
+                walk(node.cond);
+                walk(node.a);
+                walk(node.b);
+                return;
+            }
+            case flat::FOR: {
+                const flat::For& node = tree.fors[i];
+                walk(node.start);
+                walk(node.end);
+                walk(node.inc);
+                walk(node.body);
+                return;
+            }
+            case flat::ASSIGNMENT:
+                walk(tree.assignments[i].value);
+                return;
+            case flat::WITH: {
+                const flat::With& node = tree.withs[i];
+                for (uint32_t j = node.bindings.first; j < node.bindings.first + node.bindings.count; j++)
+                    walk(tree.bindings[j].value);
+                walk(node.body);
+                return;
+            }
+            }
+        }
+
+    private:
+        const flat::Tree& tree;
+
+        void add(symbols::Id name) {
+            if (std::find(names.begin(), names.end(), name) == names.end())
+                names.push_back(name);
+        }
+    };
+}
+
+// Declare a function and resolve everything in its body. (See Resolver)
+// If anything can't be resolved, all of the errors are returned, and whatever was declared
+// with the name before is put back.
+llvm::Error function(ast::Fn& fn) {
+    symbols::Id name = fn.proto->name;
+    std::unique_ptr<ast::Pro> previous = functions.declare(fn.proto->copy());
+
+    if (llvm::Error errors = Resolver(fn.file).resolve(fn)) {
+        functions.restore(name, std::move(previous));
+        return errors;
+    }
+    fn.resolved = true;
+    return llvm::Error::success();
+}
+
+// The same, for a function in a flat tree, with what is resolved kept in names.
+llvm::Error function(const flat::Tree& tree, uint32_t fn, Names& names) {
+    std::unique_ptr<ast::Pro> proto = flat::prototype(tree, tree.fns[fn].proto);
+    symbols::Id name = proto->name;
+    std::unique_ptr<ast::Pro> previous = functions.declare(std::move(proto));
+
+    names.resolved = false;
+    if (llvm::Error errors = TreeResolver(tree, names).resolve(tree.fns[fn])) {
+        functions.restore(name, std::move(previous));
+        return errors;
+    }
+    names.resolved = true;
+    return llvm::Error::success();
+}
+
+// An 'extern' declaration.
+void declare(ast::Pro& proto) {
+    functions.declare(proto.copy());
+}
+
+void declare(const flat::Tree& tree, uint32_t pro) {
+    functions.declare(flat::prototype(tree, pro));
+}
+
+// The functions that a function refers to, each once, whether or not they have been declared.
+// (So this can be used on a function that hasn't been resolved, see jit::compile_functions)
+std::vector<symbols::Id> references(ast::Fn& fn) {
+    References walker;
+    walker.walk(*fn.body);
+    return std::move(walker.names);
+}
+
+std::vector<symbols::Id> references(const flat::Tree& tree, uint32_t fn) {
+    TreeReferences walker(tree);
+    walker.walk(tree.fns[fn].body);
+    return std::move(walker.names);
+}
+
+// How many arguments a function takes, or -1 if there isn't one with the name.
+int arity(symbols::Id name) {
+    uint32_t id = functions.find(name);
+    if (id == ast::UNRESOLVED)
+        return -1;
+    return (int)functions.prototype(id).args.size();
+}
+
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+
+#include "../../common/scan.cpp"
+
+// Source files, for turning offsets back into lines and columns.
+//
+// Tokens and syntax tree items only keep a 32 bit offset from the start of their
+// source. Lines aren't counted while reading, the line table of a file is only built
+// the first time a location in it is asked for. (For an error, or debug info)
+
+namespace source {
+
+// Both count from 1.
+struct Location {
+    uint32_t line = 0;
+    uint32_t column = 0;
+};
+
+class File {
+    // Declared before text, so that text can point into it.
+    const std::string owned;
+    const std::shared_ptr<const void> owner;
+
+public:
+    // The path, or something like "<pre>" for text that isn't from a file.
+    const std::string name;
+    const std::string_view text;
+
+    // A file that holds on to its own copy of the text.
+    File(std::string name, std::string text):
+        owned(std::move(text)), name(std::move(name)), text(owned) {}
+
+    // Text that is kept alive by something else, such as a mapped file.
+    // If the owner is nullptr, the text has to outlive the file.
+    File(std::string name, std::string_view text, std::shared_ptr<const void> owner):
+        owner(std::move(owner)), name(std::move(name)), text(text) {}
+
+    File(const File&) = delete;
+    File& operator=(const File&) = delete;
+
+    Location locate(uint32_t offset) const {
+        // Files can be shared between threads, so only one of them builds the table.
+        std::call_once(built, [this]() { build(); });
+
+        // The last line that starts at or before the offset.
+        size_t line = std::upper_bound(starts.begin(), starts.end(), offset) - starts.begin();
+        return {(uint32_t)line, offset - starts[line - 1] + 1};
+    }
+
+    // As "name:line:column".
+    std::string describe(uint32_t offset) const {
+        Location location = locate(offset);
+        return name + ":" + std::to_string(location.line) + ":" + std::to_string(location.column);
+    }
+
+private:
+    mutable std::once_flag built;
+    // The offset that each line starts at.
+    mutable std::vector<uint32_t> starts;
+
+    void build() const {
+        starts.push_back(0);
+
+        const char* begin = text.data();
+        const char* end = begin + text.size();
+        for (const char* p = scan::line(begin, end); p < end; p = scan::line(p + 1, end))
+            starts.push_back((uint32_t)(p + 1 - begin));
+    }
+};
+
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <mutex>
+
+// Interned names.
+// Each distinct name (variables, functions, operators...) is stored once, here, and
+// everything else refers to it by a 32-bit id. Ids are cheap to copy and compare, and
+// anything keyed by name can be an array indexed by id, see symbols::Table.
+//
+// Interning is thread-safe, since files can be parsed in parallel. (See expr::parse_files)
+// Which id a name gets then depends on timing, so nothing should depend on the order of ids.
+
+namespace symbols {
+
+typedef uint32_t Id;
+
+namespace {
+    // A deque, so that the strings never move once added.
+    // (The keys of the map below point into them)
+    std::deque<std::string> names;
+    std::unordered_map<std::string_view, Id> ids;
+    std::mutex mutex;
+}
+
+// The id for a name, adding it if it's new.
+Id intern(std::string_view name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto iter = ids.find(name);
+    if (iter != ids.end())
+        return iter->second;
+
+    Id id = (Id)names.size();
+    names.emplace_back(name);
+    ids.emplace(names.back(), id);
+    return id;
+}
+
+std::string_view name(Id id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return names[id];
+}
+
+// The name as a std::string, for building messages and such.
+std::string str(Id id) {
+    return std::string(name(id));
+}
+
+size_t count() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return names.size();
+}
+
+// An array indexed by symbol id, which grows as needed.
+// Missing entries are default constructed, (e.g. nullptr)
+template<class T>
+class Table {
+private:
+    std::vector<T> items;
+public:
+    T& operator[](Id id) {
+        if (id >= items.size())
+            items.resize(id + 1);
+        return items[id];
+    }
+
+    // The entry for the id, without adding one if missing.
+    T get(Id id) const {
+        if (id >= items.size())
+            return T();
+        return items[id];
+    }
+
+    // The same as get(), for entries that can't be copied.
+    T* find(Id id) {
+        if (id >= items.size())
+            return nullptr;
+        return &items[id];
+    }
+
+    void clear() {
+        items.clear();
+    }
+};
+
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// A simple pool of worker threads, which steal work from each other.
+//
+// Each worker has a queue of its own. A task submitted by a worker goes on its own queue, and
+// it takes the newest task from there first, since what it just made is likely to still be in
+// its cache. Tasks from anywhere else are spread over the queues in turn. A worker with an
+// empty queue takes the oldest task from another one, so none of them sit idle while there is
+// work waiting.
+//
+// Tasks can run in any order, so anything that needs a particular order has to sort that out
+// itself once they're done.
+
+namespace threads {
+
+class Pool {
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<Queue>> queues;
+
+    std::mutex mutex;
+    // Signalled when there is a new task, or when the pool is stopping.
+    std::condition_variable task_ready;
+    // Signalled when the last running task finishes.
+    std::condition_variable all_done;
+    // Tasks in any of the queues that no worker has claimed yet.
+    size_t waiting = 0;
+    // Tasks claimed by a worker but not finished yet.
+    size_t running = 0;
+    bool stopping = false;
+    // The queue for the next task submitted from outside the pool.
+    std::atomic<size_t> next{0};
+
+    // The pool the current thread works for, if any, and which worker it is.
+    static thread_local Pool* current;
+    static thread_local size_t index;
+
+    // Take a task that has already been claimed, (see work) from the worker's own queue if
+    // it has one, or from the front of another one.
+    std::function<void()> take(size_t worker) {
+        while (true) {
+            for (size_t i = 0; i < queues.size(); i++) {
+                Queue& queue = *queues[(worker + i) % queues.size()];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if (queue.tasks.empty())
+                    continue;
+
+                std::function<void()> task;
+                if (i == 0) {
+                    task = std::move(queue.tasks.back());
+                    queue.tasks.pop_back();
+                }
+                else {
+                    task = std::move(queue.tasks.front());
+                    queue.tasks.pop_front();
+                }
+                return task;
+            }
+            // Another worker got to the queue first, but since the task was claimed, there
+            // is one left somewhere else.
+            std::this_thread::yield();
+        }
+    }
+
+    void work(size_t worker) {
+        current = this;
+        index = worker;
+
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                task_ready.wait(lock, [this]() { return stopping || waiting > 0; });
+                if (waiting == 0)
+                    return;
+
+                waiting--;
+                running++;
+            }
+
+            // Tasks are expected to deal with their own errors.
+            take(worker)();
+
+            std::lock_guard<std::mutex> lock(mutex);
+            running--;
+            if (running == 0 && waiting == 0)
+                all_done.notify_all();
+        }
+    }
+
+public:
+    // One worker per core, if count is 0.
+    Pool(size_t count = 0) {
+        if (count == 0)
+            count = std::thread::hardware_concurrency();
+        if (count == 0)
+            count = 1;
+
+        for (size_t i = 0; i < count; i++)
+            queues.push_back(std::make_unique<Queue>());
+        for (size_t i = 0; i < count; i++)
+            workers.emplace_back([this, i]() { work(i); });
+    }
+
+    // Any tasks still waiting are run before the workers stop.
+    ~Pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        task_ready.notify_all();
+        for (std::thread& worker: workers)
+            worker.join();
+    }
+
+    Pool(const Pool&) = delete;
+    Pool& operator=(const Pool&) = delete;
+
+    size_t size() const {
+        return workers.size();
+    }
+
+    void submit(std::function<void()> task) {
+        size_t queue = current == this ? index : next++ % queues.size();
+        {
+            std::lock_guard<std::mutex> lock(queues[queue]->mutex);
+            queues[queue]->tasks.push_back(std::move(task));
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            waiting++;
+        }
+        task_ready.notify_one();
+    }
+
+    // Block until every submitted task has finished.
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        all_done.wait(lock, [this]() { return running == 0 && waiting == 0; });
+    }
+};
+
+thread_local Pool* Pool::current = nullptr;
+thread_local size_t Pool::index = 0;
+
+// The pool shared by everything in the compiler, created on first use.
+Pool& pool() {
+    static Pool shared;
+    return shared;
+}
+
+}
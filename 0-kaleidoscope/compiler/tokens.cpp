@@ -1,19 +1,34 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <iostream>
 #include <sstream>
 #include <vector>
 #include <memory>
 #include <map>
 #include <fstream>
+#include <array>
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 // LLVM generates lots of warnings I can't do anything about.
 #pragma warning(push, 0)   
 #include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
 #pragma warning(pop)
 
-#include "util.cpp"
+#include "../../common/scan.cpp"
+#include "../../common/numbers.cpp"
+#include "../../common/phash.cpp"
+#include "source.cpp"
 
 namespace tokens {
 
@@ -27,31 +42,31 @@ enum TokenKind {
 
     // Commands - not really a part of the language, more like
     // preprocessor directives.
-    // The value is stored at tokens::current::text.
+    // The value is stored at Token::text.
     COMMAND,
 
     // Keywords
-    // The value is stored at tokens::current::text.
+    // The value is stored at Token::text.
     KEYWORD,
 
     // Non-key words 
-    // The value is stored at tokens::current::text.
+    // The value is stored at Token::text.
     IDENTIFIER,
 
     // Literal number
-    // The value is stored at tokens::current::num.
+    // The value is stored at Token::num.
     NUMBER,
 
     // Key Symbols, such as "(" or ","
-    // The value is stored at tokens::current::symbol.
+    // The value is stored at Token::symbol.
     KEY_SYMBOL,
 
     // Symbols that are not key, which are candidates for operators.
-    // The value is stored at tokens::current::symbol.
+    // The value is stored at Token::symbol.
     OPERATOR,
 
     // Lines of text intended to be ignored, mostly.
-    // The value is stored at tokens::current::text.
+    // The value is stored at Token::text.
     COMMENT,
 
     // The End.
@@ -59,40 +74,71 @@ enum TokenKind {
 };
 
 std::array<char, 6> KEY_SYMBOLS = {'\n', ';', '(', ',', ')', '='};
-std::array<std::string, 11> KEYWORDS = {
+// Keywords and commands. 
+// The order here has to match the spellings in WORDS below.
+enum Word {
+    KW_DEF, KW_EXTERN, KW_IMPORT,
+    KW_IF, KW_THEN, KW_ELSE,
+    KW_FOR, KW_WITH, KW_IN,
+    KW_UNARY, KW_BINARY,
+
+    // Everything from here on is a command rather than a keyword.
+    CMD_COMPILE, CMD_EXIT, CMD_TOGGLE, CMD_HELP, CMD_LOAD, CMD_MEMORY,
+
+    NOT_A_WORD = -1
+};
+
+constexpr std::array<std::string_view, 17> WORDS = {
     "def", "extern", "import",
     "if", "then", "else",
     "for", "with", "in",
-    "unary", "binary"
-};
-std::array<std::string, 4> COMMANDS = {
-    "compile", "exit", "toggle", "help"
+    "unary", "binary",
+    "compile", "exit", "toggle", "help", "load", "memory"
 };
 
-// Main entry point to tokenization.
-namespace current {
+namespace {
+    constexpr phash::Table<17, 64> WORD_TABLE(WORDS);
+}
+
+// Keyword or command for a piece of text, or NOT_A_WORD.
+Word find_word(std::string_view text) {
+    return (Word)WORD_TABLE.find(text);
+}
+
+// A single token, see Lexer::current.
+struct Token {
     TokenKind kind = START;
 
-    // WARNING: If the current token does not make use of these, they
+    // WARNING: If the token does not make use of these, they
     // could contain anything! (Usually they would contain the content
     // of the last token that made use of them)    
-    std::string text;
-    double num;
-    char symbol;
 
-    bool is(TokenKind target) {
+    // When reading from a buffer, this points straight into the source text.
+    // When reading from a stream, it points into a scratch string that is reused
+    // for every token. Either way, copy it if it's needed after the next token.
+    std::string_view text;
+    double num = 0;
+    // For numbers, whether it's a whole number that num holds exactly. See numbers::Number.
+    bool integer = false;
+    char symbol = 0;
+    // Which keyword or command.
+    Word word = NOT_A_WORD;
+    // Where the token starts, as a count of characters from the start of the input.
+    uint32_t offset = 0;
+
+    bool is(TokenKind target) const {
         return kind == target;
     }
 
-    bool is_keyword(std::string keyword) {
-        return kind == KEYWORD && text == keyword;
+    bool is_keyword(Word keyword) const {
+        return kind == KEYWORD && word == keyword;
     }
 
-    bool is_key_symbol(char targetSymbol) {
+    bool is_key_symbol(char targetSymbol) const {
         return kind == KEY_SYMBOL && symbol == targetSymbol;
     }
 
-    std::string describe() {
+    std::string describe() const {
         std::string content;
         std::string desc;
     
@@ -142,61 +188,99 @@ namespace current {
 
         return "'" + content + "' (" + desc + ")";
     }
-}
-
-std::istream* stream = &std::cin;
-void set_input(std::istream& new_stream) {
-    stream = &new_stream;
-    current::kind = START;
-}
-
-bool has_current() {
-    return current::kind != START && current::kind != END;
-}
-
-bool has_next() {
-    return current::kind != END;
-}
+};
 
-void next();
+// A whole input, tokenized in one go by lex_all().
+// This is stored as parallel arrays, with an entry in each per token. The 
+// parser can then walk through it by index, see Lexer::set_input(const Buffer&).
+struct Buffer {
+    // The text that offsets and lengths refer to.
+    std::string_view source;
+    // The file the source is from, for locations, if it is known. If the source is
+    // a mapped file, this also keeps it mapped. See lex_file().
+    std::shared_ptr<const source::File> file;
+
+    std::vector<TokenKind> kinds;
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> lengths;
+    // The value of number tokens, 0 for anything else.
+    std::vector<double> nums;
+    // Token::integer of number tokens, false for anything else.
+    std::vector<bool> integers;
+    // The keyword or command, NOT_A_WORD for anything else.
+    std::vector<Word> words;
+
+    size_t size() const {
+        return kinds.size();
+    }
 
+    std::string_view text(size_t i) const {
+        return source.substr(offsets[i], lengths[i]);
+    }
 
-/*
-    EXAMPLES & TESTS
-*/
+    void push(TokenKind kind, uint32_t offset, uint32_t length, double num = 0, bool integer = false, Word word = NOT_A_WORD) {
+        kinds.push_back(kind);
+        offsets.push_back(offset);
+        lengths.push_back(length);
+        nums.push_back(num);
+        integers.push_back(integer);
+        words.push_back(word);
+    }
 
-llvm::Error interactive() {
-    std::cout << "Hello World" << std::endl;
+    // Copy token i of another buffer, moving its offset along by shift.
+    void push(const Buffer& other, size_t i, int64_t shift = 0) {
+        push(other.kinds[i], (uint32_t)(other.offsets[i] + shift), other.lengths[i], other.nums[i], other.integers[i], other.words[i]);
+    }
 
-    printf("\n");
-    printf("Spacing is ignored, usually.");
-    printf(" (Newlines can be optionally returned, for the sake of interactive mode)\n");
-    printf("Comments begin with a '#'.\n");
-    
-    printf("Key symbols: ");
-    for (char& symbol: KEY_SYMBOLS) {
-        if (symbol == '\n') printf("'\\n' ");
-        else printf("'%s' ", std::string(1, symbol).c_str());
+    // Replace the tokens [first, end) with all of the given tokens, and move the offsets 
+    // of the tokens after them along by shift. See relex().
+    void splice(size_t first, size_t end, const Buffer& tokens, int64_t shift) {
+        kinds.erase(kinds.begin() + first, kinds.begin() + end);
+        offsets.erase(offsets.begin() + first, offsets.begin() + end);
+        lengths.erase(lengths.begin() + first, lengths.begin() + end);
+        nums.erase(nums.begin() + first, nums.begin() + end);
+        integers.erase(integers.begin() + first, integers.begin() + end);
+        words.erase(words.begin() + first, words.begin() + end);
+
+        kinds.insert(kinds.begin() + first, tokens.kinds.begin(), tokens.kinds.end());
+        offsets.insert(offsets.begin() + first, tokens.offsets.begin(), tokens.offsets.end());
+        lengths.insert(lengths.begin() + first, tokens.lengths.begin(), tokens.lengths.end());
+        nums.insert(nums.begin() + first, tokens.nums.begin(), tokens.nums.end());
+        integers.insert(integers.begin() + first, tokens.integers.begin(), tokens.integers.end());
+        words.insert(words.begin() + first, tokens.words.begin(), tokens.words.end());
+
+        if (shift != 0) {
+            for (size_t i = first + tokens.size(); i < offsets.size(); i++)
+                offsets[i] = (uint32_t)(offsets[i] + shift);
+        }
     }
-    printf("\n");
-    
-    printf("Keywords: ");
-    for (std::string& keyword: KEYWORDS) printf("'%s' ", keyword.c_str());
-    printf("\n");
-    
-    printf("Otherwise it's just numbers, operators, and identifiers.\n");
-    printf("\n");
+};
 
-    debug = true;
-    printf("tokens> ");
-    while (true) {
-        if (current::is_key_symbol('\n'))
-            printf("tokens> ");
-        next();
+// Tokens to replace part of a buffer with, after its source was edited. See relex().
+struct Patch {
+    // The tokens [first, end) of the old buffer are replaced by tokens.
+    size_t first = 0, end = 0;
+    Buffer tokens;
+    // How far the offsets of the old tokens from end onwards move.
+    int64_t shift = 0;
+
+    // Whether only offsets have changed. (Such as after an edit to a comment, or spacing)
+    bool same_tokens(const Buffer& old) const {
+        if (tokens.size() != end - first)
+            return false;
+
+        for (size_t i = 0; i < tokens.size(); i++) {
+            if (tokens.kinds[i] != old.kinds[first + i] || tokens.lengths[i] != old.lengths[first + i]
+                || tokens.nums[i] != old.nums[first + i] || tokens.words[i] != old.words[first + i])
+                return false;
+            
+            // Same length and kind isn't enough to be the same identifier or symbol.
+            if (tokens.text(i) != old.text(first + i))
+                return false;
+        }
+        return true;
     }
-    
-    return llvm::Error::success();
-}
+};
 
 // Following the Kaleidoscope tutorial into to LLVM
 // https://llvm.org/docs/tutorial/
@@ -208,42 +292,351 @@ llvm::Error interactive() {
 // Moving through tokens.
 // These can be single characters, such as with key symbols.
 // Or they can be words, or numbers.
+//
+// All of the state for reading an input lives in a Lexer, so any number of inputs
+// can be read at once, on different threads if need be. (See expr::parse_files)
+class Lexer {
+public:
+    // Main entry point to tokenization.
+    Token current;
+
+    // The file being read, if it is known. Token offsets can be looked up in it.
+    std::shared_ptr<const source::File> file;
+
+    // Reads from std::cin, until given something else.
+    Lexer() {
+        set_input(std::cin);
+    }
 
-namespace {
-    // Getting a single token.
-    void read_token();
-}
+    Lexer(std::istream& stream) {
+        set_input(stream);
+    }
+
+    Lexer(std::string_view source) {
+        set_input(source);
+    }
 
-// Move tokens::current to the next single token.
-// Newlines are counted as SYMBOL tokens here.
-void next() {
-    read_token();
+    Lexer(const Buffer& buffer) {
+        set_input(buffer);
+    }
+
+    void set_input(std::istream& new_stream) {
+        stream_reader.reset(&new_stream);
+        buffer_reader = BufferReader();
+        tokens_buffer = nullptr;
+        file = nullptr;
+        current = Token();
+    }
+
+    // Read tokens directly from memory. The source is not copied, so it must outlive 
+    // the tokens read from it. (current.text points into it)
+    void set_input(std::string_view source) {
+        stream_reader.stream = nullptr;
+        buffer_reader.start = source.data();
+        buffer_reader.cursor = source.data();
+        buffer_reader.end = source.data() + source.size();
+        tokens_buffer = nullptr;
+        file = nullptr;
+        current = Token();
+    }
+
+    // Walk through tokens that have already been read, see lex_all().
+    // The buffer (and its source) must outlive the tokens read from it.
+    void set_input(const Buffer& buffer) {
+        stream_reader.stream = nullptr;
+        buffer_reader = BufferReader();
+        tokens_buffer = &buffer;
+        tokens_index = 0;
+        file = buffer.file;
+        current = Token();
+    }
+
+    // Read tokens from a file. LLVM memory-maps the file if it's big enough to be worth it,
+    // so there is no copy and no stream in the way.
+    llvm::Error set_input_file(const std::string& path) {
+        auto mapped = llvm::MemoryBuffer::getFile(path, /*IsText*/ false, /*RequiresNullTerminator*/ false);
+        if (!mapped)
+            return llvm::errorCodeToError(mapped.getError());
+
+        std::shared_ptr<llvm::MemoryBuffer> buffer = std::move(*mapped);
+        std::string_view text(buffer->getBufferStart(), buffer->getBufferSize());
+        set_input(text);
+        // This keeps the mapping alive for as long as tokens are being read from it.
+        file = std::make_shared<source::File>(path, text, buffer);
+        return llvm::Error::success();
+    }
+
+    bool has_current() const {
+        return current.kind != START && current.kind != END;
+    }
+
+    bool has_next() const {
+        return current.kind != END;
+    }
+
+    // Move current to the next single token.
+    // Newlines are counted as SYMBOL tokens here.
+    void next() {
+        if (tokens_buffer) {
+            read_buffered_token();
+            if (debug) 
+                printf("Token: %s\n", current.describe().c_str());
+            return;
+        }
 
-    // For now I'm skipping comments entirely.
-    while (has_next() && current::is(COMMENT)) 
         read_token();
 
-    if (debug) 
-        printf("Token: %s\n", current::describe().c_str());
-}
+        // For now I'm skipping comments entirely.
+        while (has_next() && current.is(COMMENT)) 
+            read_token();
 
-// Move past any newlines, if currently on a newline.
-// This has no effect if the current token is not a newline.
-void skip_newlines() {
-    while (has_next() && current::is_key_symbol('\n'))
-        next();
-}
+        if (debug) 
+            printf("Token: %s\n", current.describe().c_str());
+    }
+
+    // Move past any newlines, if currently on a newline.
+    // This has no effect if the current token is not a newline.
+    void skip_newlines() {
+        while (has_next() && current.is_key_symbol('\n'))
+            next();
+    }
+
+    // Where the parser is in the current token buffer, see set_input(const Buffer&).
+    size_t position() const {
+        return tokens_index == 0 ? 0 : tokens_index - 1;
+    }
+
+    // Jump back (or forward) to a position in the current token buffer.
+    // The token at the position is read again.
+    void seek(size_t position) {
+        tokens_index = position;
+        read_buffered_token();
+    }
+
+    // The kind of the token k tokens ahead of the current one.
+    // This is only possible with a token buffer, see set_input(const Buffer&).
+    TokenKind lookahead(size_t k) const {
+        assert(tokens_buffer && "Lookahead is only possible when reading from a token buffer.");
+
+        size_t i = tokens_index + k - 1;
+        if (i >= tokens_buffer->size())
+            return END;
+        return tokens_buffer->kinds[i];
+    }
+
+private:
+    // Characters from a stream. This is what the REPL uses.
+    // Whatever input is waiting is read at once into a buffer, (a line as it's typed, or
+    // many lines after a paste or on a pipe) which is then read like any other text in 
+    // memory. Only whole lines are handed out, so a token never spans two reads. Nothing 
+    // more is read until a character after the last newline is asked for, since that 
+    // would block before the REPL has shown its prompt.
+    class StreamReader {
+    public:
+        std::istream* stream = nullptr;
+
+        void reset(std::istream* new_stream) {
+            stream = new_stream;
+            count = 0;
+            buffer.clear();
+            pending.clear();
+            ended = false;
+            cursor = 0;
+        }
+
+        bool eof() { return !fill(); }
+        int peek() { return fill() ? (unsigned char)buffer[cursor] : EOF; }
+        void skip() { cursor++; }
+        size_t position() { return count + cursor; }
+
+        // The text is only good until more is read, which is never in the middle of 
+        // a token.
+        void begin_text() { text_start = cursor; }
+        void take() { cursor++; }
+        std::string_view text() { return std::string_view(buffer).substr(text_start, cursor - text_start); }
+
+        // Runs of characters, see scan.cpp for the classes.
+        // Only spaces can run on past the end of the buffer, the rest stop at the newline
+        // that it ends with.
+        void skip_spaces() {
+            while (fill()) {
+                cursor = run(scan::spaces);
+                if (cursor < buffer.size())
+                    return;
+            }
+        }
+
+        void skip_blanks() {
+            if (fill())
+                cursor = run(scan::blanks);
+        }
+
+        void take_alnum() { cursor = run(scan::alnum); }
+        void take_decimal() { cursor = run(scan::decimal); }
+        void take_line() { cursor = run(scan::line); }
+
+        // The whole run of digits and '.' is taken, even though the value stops
+        // at the first character that doesn't fit (e.g. a second '.'), like strtod.
+        void take_number(numbers::Number& number) {
+            const char* end = buffer.data() + buffer.size();
+            cursor = scan::decimal(numbers::parse(buffer.data() + cursor, end, number), end) - buffer.data();
+        }
+
+    private:
+        // More than this isn't read at once, even if it is there.
+        static constexpr size_t READ_AHEAD = 1 << 16;
+
+        // Whole lines, apart from maybe the last one in the stream.
+        std::string buffer;
+        // What has been read after the last newline in the buffer.
+        std::string pending;
+        // Reused for each line read from a stream other than std::cin.
+        std::string line;
+        bool ended = false;
+        size_t cursor = 0;
+        size_t text_start = 0;
+        // Characters read before the start of the buffer.
+        size_t count = 0;
+
+        size_t run(const char* (*scan)(const char*, const char*)) {
+            return scan(buffer.data() + cursor, buffer.data() + buffer.size()) - buffer.data();
+        }
+
+        // Make sure there is something left in the buffer, by reading more once it 
+        // has all been used. Returns false at the end of the stream.
+        // The buffer is left alone at the end, so text() from the last line is still good.
+        bool fill() {
+            if (cursor < buffer.size())
+                return true;
+
+            size_t newline;
+            while ((newline = pending.rfind('\n')) == std::string::npos && !ended)
+                read_more();
+            if (pending.empty())
+                return false;
+
+            // The last line might not have a newline, at the end of the stream.
+            size_t lines = newline == std::string::npos ? pending.size() : newline + 1;
+            count += buffer.size();
+            buffer.assign(pending, 0, lines);
+            pending.erase(0, lines);
+            cursor = 0;
+            return true;
+        }
+
+        // Add whatever is waiting to pending, blocking if there's nothing. 
+        void read_more() {
+            if (stream == &std::cin) {
+                // Read straight from the file, since std::cin would hand it over a 
+                // character at a time while it is synced with stdio. Which means the 
+                // prompt has to be flushed here, since stdio doesn't see this read.
+                fflush(stdout);
+                size_t size = pending.size();
+                pending.resize(size + READ_AHEAD);
+                long read = read_stdin(&pending[size], READ_AHEAD);
+                pending.resize(size + (read > 0 ? read : 0));
+                ended = read <= 0;
+                return;
+            }
+
+            // Any other stream is read a line at a time.
+            if (!std::getline(*stream, line)) {
+                ended = true;
+                return;
+            }
+            pending += line;
+            if (!stream->eof())
+                pending += '\n';
+        }
+
+        static long read_stdin(char* data, size_t size) {
+#ifdef _WIN32
+            return _read(0, data, (unsigned)size);
+#else
+            long read;
+            do read = (long)::read(0, data, size);
+            while (read < 0 && errno == EINTR);
+            return read;
+#endif
+        }
+    };
+
+    // Characters from memory, see set_input(std::string_view).
+    // Text is handed out as a slice of the source, no copying.
+    class BufferReader {
+    public:
+        const char* start = nullptr;
+        const char* cursor = nullptr;
+        const char* end = nullptr;
+        const char* text_start = nullptr;
+
+        bool eof() { return cursor >= end; }
+        int peek() { return eof() ? EOF : (unsigned char)*cursor; }
+        void skip() { cursor++; }
+        size_t position() { return cursor - start; }
+
+        void begin_text() { text_start = cursor; }
+        void take() { cursor++; }
+        std::string_view text() { return std::string_view(text_start, cursor - text_start); }
+
+        void skip_spaces() { cursor = scan::spaces(cursor, end); }
+        void skip_blanks() { cursor = scan::blanks(cursor, end); }
+        void take_alnum() { cursor = scan::alnum(cursor, end); }
+        void take_decimal() { cursor = scan::decimal(cursor, end); }
+        // The value is read in the same pass as finding the end of it, the rest of the run is
+        // only scanned if there is more after the value. (Such as a second '.')
+        void take_number(numbers::Number& number) { cursor = scan::decimal(numbers::parse(cursor, end, number), end); }
+        void take_line() { cursor = scan::line(cursor, end); }
+    };
+
+    StreamReader stream_reader;
+    BufferReader buffer_reader;
+
+    // Set when reading from a buffer that has already been tokenized.
+    const Buffer* tokens_buffer = nullptr;
+    size_t tokens_index = 0;
+
+    // lex_all() and relex() want comments as well, to be able to leave them out themselves.
+    friend Buffer lex_all(std::string_view source);
+    friend Patch relex(const Buffer& buffer, std::string_view source, uint32_t start, uint32_t old_end, uint32_t new_end);
+
+    // Load the next token from tokens_buffer into current.
+    void read_buffered_token() {
+        const Buffer& buffer = *tokens_buffer;
+        if (tokens_index >= buffer.size()) {
+            current.kind = END;
+            return;
+        }
+
+        size_t i = tokens_index++;
+        current.kind = buffer.kinds[i];
+        current.offset = buffer.offsets[i];
+        current.text = buffer.text(i);
+        current.num = buffer.nums[i];
+        current.integer = buffer.integers[i];
+        current.word = buffer.words[i];
+        if (current.text.size() > 0)
+            current.symbol = current.text[0];
+    }
 
-namespace {
-    // Read in a single token from the command line.
     void read_token() {
-        if (!stream) {
-            util::init_throw(__func__, "Attempted to read token from null stream!");
+        if (buffer_reader.cursor) {
+            read_token(buffer_reader);
+            return;
         }
 
-        if (stream->eof()) {
-            // The end of the input stream has been reached.
-            current::kind = END;
+        assert(stream_reader.stream && "Attempted to read token from null stream!");
+
+        read_token(stream_reader);
+    }
+
+    // Read in a single token from the source.
+    template<class Reader>
+    void read_token(Reader& source) {
+        if (source.eof()) {
+            // The end of the input has been reached.
+            current.kind = END;
+            current.offset = (uint32_t)source.position();
             return;
         }
 
@@ -253,16 +646,14 @@ namespace {
         // - However, after returning '\n', any more whitespace (including newlines!)
         // after that is ignored until the next non-newline token.
 
-        // Note: current::is_key_symbol refers to the latest token read, NOT the current character.
-        if (current::is_key_symbol('\n')) {
-            while ((!stream->eof()) && isspace(stream->peek()))
-                stream->get();
+        // Note: current.is_key_symbol refers to the latest token read, NOT the current character.
+        if (current.is_key_symbol('\n')) {
+            source.skip_spaces();
         }
         else {
-            while ((!stream->eof()) && isspace(stream->peek()) && (stream->peek() != '\n'))
-                stream->get();
+            source.skip_blanks();
             
-            if (stream->peek() == '\n') {
+            if (source.peek() == '\n') {
 
                 // DO NOT move past this newline!
                 // nextChar()
@@ -273,86 +664,247 @@ namespace {
                 // this, though, the function would hang after the enter key
                 // has been pressed.
 
-                current::symbol = '\n';
-                current::kind = KEY_SYMBOL;
+                current.symbol = '\n';
+                current.kind = KEY_SYMBOL;
+                current.offset = (uint32_t)source.position();
                 return;
             }
         }
 
         // After moving past whitespace, EOF may have been reached.
-        if (stream->eof()) {
-            current::kind = END;
+        if (source.eof()) {
+            current.kind = END;
+            current.offset = (uint32_t)source.position();
             return;
         }
 
-        // Recognize keywords and identifiers.
-        if (isalpha(stream->peek())) {
-            current::text = "";
-            while (isalnum(stream->peek())) {
-                current::text += stream->peek();
-                stream->get();
-            }
+        current.offset = (uint32_t)source.position();
 
-            if (std::find(KEYWORDS.begin(), KEYWORDS.end(), current::text) != std::end(KEYWORDS)) {
-                current::kind = KEYWORD;
+        // Recognize keywords and identifiers.
+        if (isalpha(source.peek())) {
+            source.begin_text();
+            source.take_alnum();
+            current.text = source.text();
+
+            current.word = find_word(current.text);
+            if (current.word == NOT_A_WORD) {
+                current.kind = IDENTIFIER;
                 return;
             }
 
-            if (std::find(COMMANDS.begin(), COMMANDS.end(), current::text) != std::end(COMMANDS)) {
-                current::kind = COMMAND;
-
-                while (stream->peek() != '\n') {
-                    current::text += stream->peek();
-                    stream->get();
-                }
-
+            if (current.word < CMD_COMPILE) {
+                current.kind = KEYWORD;
                 return;
             }
 
-            current::kind = IDENTIFIER;
+            current.kind = COMMAND;
+
+            // The rest of the line is a part of the command.
+            source.take_line();
+            current.text = source.text();
             return;
         }
 
         // Recognize numbers.
-        if (isdigit(stream->peek()) || stream->peek() == '.') {
-            std::string NumStr;
-            while (isdigit(stream->peek()) || stream->peek() == '.') {
-                NumStr += stream->peek();
-                stream->get();
-            }
-
-            current::num = strtod(NumStr.c_str(), 0);
-            current::kind = NUMBER;
+        if (isdigit(source.peek()) || source.peek() == '.') {
+            source.begin_text();
+            numbers::Number number;
+            source.take_number(number);
+
+            // The value is 0 if there is nothing to parse, as with ".".
+            current.text = source.text();
+            current.num = number.value;
+            current.integer = number.integer;
+            current.kind = NUMBER;
             return;
         }
 
         // Ignore the current line if it is a comment,
         // and move straight to the next line. (Recursively)
-        if (stream->peek() == '#') {
-            stream->get(); // Move past the '#' symbol.
+        if (source.peek() == '#') {
+            source.skip(); // Move past the '#' symbol.
 
-            current::text = "";
-            while ((!stream->eof()) && stream->peek() != '\n') {
-                current::text += stream->peek();
-                stream->get();
-            }
+            source.begin_text();
+            source.take_line();
+            current.text = source.text();
             
-            current::kind = COMMENT;
+            current.kind = COMMENT;
+
+            // A comment on the last line.
+            if (source.eof())
+                return;
         }
 
         // If the character is not recognized as a token,
         // return it as a character. i.e. Key symbol.
 
-        current::symbol = stream->peek();
-        if (std::find(KEY_SYMBOLS.begin(), KEY_SYMBOLS.end(), current::symbol) != std::end(KEY_SYMBOLS))
-            current::kind = KEY_SYMBOL;
+        current.offset = (uint32_t)source.position();
+        current.symbol = source.peek();
+        if (std::find(KEY_SYMBOLS.begin(), KEY_SYMBOLS.end(), current.symbol) != std::end(KEY_SYMBOLS))
+            current.kind = KEY_SYMBOL;
         else
-            current::kind = OPERATOR;
+            current.kind = OPERATOR;
         
-       stream->get(); // Move past the symbol.
+        source.skip(); // Move past the symbol.
 
         return;
     }
+};
+
+// Tokenize all of the source in one go. As with Lexer::next(), comments are left out.
+// Reading the tokens back with Lexer::set_input(const Buffer&) gives the same 
+// tokens as reading the source directly would.
+namespace {
+    uint32_t length(const Token& token) {
+        switch (token.kind) {
+            case COMMAND: case KEYWORD: case IDENTIFIER: case NUMBER:
+                return (uint32_t)token.text.size();
+            case KEY_SYMBOL: case OPERATOR:
+                return 1;
+            default: 
+                return 0;
+        }
+    }
+
+    void push_token(Buffer& buffer, const Token& token) {
+        buffer.push(token.kind, token.offset, length(token), 
+            token.is(NUMBER) ? token.num : 0, 
+            token.is(NUMBER) && token.integer,
+            (token.is(KEYWORD) || token.is(COMMAND)) ? token.word : NOT_A_WORD);
+    }
 }
 
-}
\ No newline at end of file
+Buffer lex_all(std::string_view source) {
+    Buffer result;
+    result.source = source;
+
+    Lexer lexer(source);
+    Token& current = lexer.current;
+    do {
+        lexer.read_token();
+        if (current.is(COMMENT))
+            continue;
+
+        push_token(result, current);
+    } while (lexer.has_next());
+
+    return result;
+}
+
+// Work out how the tokens of a buffer change after an edit to its source, without
+// reading all of the new source. (See incremental.cpp)
+// The edit replaced the old source's [start, old_end) with the new source's [start, new_end).
+//
+// Reading starts from a token before the edit, so that anything the edit joins on to is
+// read again. It stops at the first token past the edit that lines up with an old token, 
+// (same kind and length, at the same place relative to the end of the edit) since
+// everything from there on is read the same as before. That always happens by the end.
+Patch relex(const Buffer& buffer, std::string_view source, uint32_t start, uint32_t old_end, uint32_t new_end) {
+    Patch patch;
+    patch.shift = (int64_t)new_end - (int64_t)old_end;
+    patch.tokens.source = source;
+
+    // The first token that has to be read again, the last one before the edit.
+    size_t first = 0;
+    while (first + 1 < buffer.size() && buffer.offsets[first + 1] < start)
+        first++;
+
+    // If the next token starts right at the edit, the one before only needs reading again
+    // if the edit could join on to it, or there is a comment in between. After a newline 
+    // the lexer skips space differently, so that needs reading again too.
+    if (first + 1 < buffer.size() && buffer.offsets[first] < start && buffer.offsets[first + 1] == start) {
+        uint32_t end = buffer.offsets[first] + buffer.lengths[first];
+        std::string_view between = buffer.source.substr(end, start - end);
+        bool newline = buffer.kinds[first] == KEY_SYMBOL && buffer.text(first)[0] == '\n';
+        bool single = buffer.kinds[first] == KEY_SYMBOL || buffer.kinds[first] == OPERATOR;
+        bool joins = between.size() == 0 && !single;
+        if (!newline && !joins && between.find('#') == std::string_view::npos)
+            first++;
+    }
+    patch.first = first;
+
+    // Any space before the first token is read again along with it.
+    uint32_t from = first == 0 ? 0 : buffer.offsets[first];
+
+    Lexer lexer(source);
+    lexer.buffer_reader.cursor = source.data() + from;
+    Token& current = lexer.current;
+
+    size_t old_index = first;
+    do {
+        lexer.read_token();
+        if (current.is(COMMENT))
+            continue;
+
+        if (current.offset >= new_end) {
+            int64_t old_offset = (int64_t)current.offset - patch.shift;
+            while (old_index < buffer.size() && buffer.offsets[old_index] < old_offset)
+                old_index++;
+
+            if (old_index < buffer.size() && buffer.offsets[old_index] == old_offset && old_offset >= old_end
+                && buffer.kinds[old_index] == current.kind && buffer.lengths[old_index] == length(current)) {
+                patch.end = old_index;
+                return patch;
+            }
+        }
+
+        push_token(patch.tokens, current);
+    } while (lexer.has_next());
+
+    // The end lines up with the old end, so this is never reached with a whole buffer.
+    patch.end = buffer.size();
+    return patch;
+}
+
+// The same as lex_all(), for a memory-mapped file.
+llvm::Expected<Buffer> lex_file(const std::string& path) {
+    auto file = llvm::MemoryBuffer::getFile(path, /*IsText*/ false, /*RequiresNullTerminator*/ false);
+    if (!file)
+        return llvm::errorCodeToError(file.getError());
+
+    std::shared_ptr<llvm::MemoryBuffer> mapped = std::move(*file);
+    Buffer result = lex_all(std::string_view(mapped->getBufferStart(), mapped->getBufferSize()));
+    result.file = std::make_shared<source::File>(path, result.source, mapped);
+    return result;
+}
+
+
+/*
+    EXAMPLES & TESTS
+*/
+
+llvm::Error interactive() {
+    std::cout << "Hello World" << std::endl;
+
+    printf("\n");
+    printf("Spacing is ignored, usually.");
+    printf(" (Newlines can be optionally returned, for the sake of interactive mode)\n");
+    printf("Comments begin with a '#'.\n");
+    
+    printf("Key symbols: ");
+    for (char& symbol: KEY_SYMBOLS) {
+        if (symbol == '\n') printf("'\\n' ");
+        else printf("'%s' ", std::string(1, symbol).c_str());
+    }
+    printf("\n");
+    
+    printf("Keywords: ");
+    for (int i = 0; i < CMD_COMPILE; i++) printf("'%s' ", std::string(WORDS[i]).c_str());
+    printf("\n");
+    
+    printf("Otherwise it's just numbers, operators, and identifiers.\n");
+    printf("\n");
+
+    debug = true;
+    Lexer lexer;
+    printf("tokens> ");
+    while (true) {
+        if (lexer.current.is_key_symbol('\n'))
+            printf("tokens> ");
+        lexer.next();
+    }
+    
+    return llvm::Error::success();
+}
+
+}
@@ -3,10 +3,11 @@
 #include <map>
 #include <vector>
 
-#include "../visitor.h"
 #include "../ast.cpp"
-#include "../util.cpp"
+#include "../diagnostics.cpp"
 #include "../expr.cpp"
+#include "../flat.cpp"
+#include "../resolve.cpp"
 
 // LLVM generates lots of warnings I can't do anything about.
 #pragma warning(push, 0)        
@@ -14,6 +15,8 @@
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/DIBuilder.h"
+#include "llvm/Support/Path.h"
 #include "llvm/ADT/APFloat.h"
 #include "llvm/IR/Value.h"
 #include "llvm/IR/Type.h"
@@ -28,12 +31,8 @@
 #pragma warning(pop)
 
 namespace gen {
-    // This has to be kept between modules so that a call in
-    // one can refer to a function in another.
-    std::map<std::string, std::unique_ptr<ast::Pro>> prototypes;
-
     namespace {
-        class Generator: public Visitor {
+        class Generator: public ast::Walker<Generator, llvm::Expected<llvm::Value*>> {
         private:
             const llvm::DataLayout* layout;
             const llvm::Triple* triple;
@@ -43,15 +42,71 @@ namespace gen {
 
             std::unique_ptr<llvm::IRBuilder<>> builder;
 
-            std::map<std::string, llvm::AllocaInst*> named_values;
-            llvm::Value* value;
+            // The variables of the function being generated, by slot. (See resolve.cpp)
+            std::vector<llvm::AllocaInst*> locals;
+            // The functions in the module, by id, made as they are used.
+            std::vector<llvm::Function*> functions;
 
             // I'm not sure what replaces the legacy pass manager used in the tutorial below.
             // The legacy stuff seems to work well enough, anyways.
             // See: https://llvm.org/docs/tutorial/MyFirstLanguageFrontend/LangImpl04.html
             std::unique_ptr<llvm::legacy::FunctionPassManager> fn_pass_manager;
 
-            void init_module(std::string name) {
+            // Debug info, for functions whose source is known. (See ast::Fn::file)
+            // This is what lets a debugger or profiler map JIT'd code back to lines.
+            std::unique_ptr<llvm::DIBuilder> di;
+            std::map<const source::File*, llvm::DIFile*> di_files;
+            // The source and debug scope of the function being generated, if it has them.
+            std::shared_ptr<const source::File> file;
+            llvm::DISubprogram* scope = nullptr;
+
+            llvm::DIFile* get_di_file(const source::File& source) {
+                llvm::DIFile*& result = di_files[&source];
+                if (!result)
+                    result = di->createFile(llvm::sys::path::filename(source.name), llvm::sys::path::parent_path(source.name));
+                return result;
+            }
+
+            // Start the debug info for a function, if its source is known.
+            void begin_debug_info(std::shared_ptr<const source::File> source, uint32_t offset, symbols::Id name, llvm::Function* fn) {
+                file = std::move(source);
+                scope = nullptr;
+                // So that nothing is given a location in the last function.
+                builder->SetCurrentDebugLocation(llvm::DebugLoc());
+                if (!file)
+                    return;
+
+                if (!di) {
+                    di = std::make_unique<llvm::DIBuilder>(*mod);
+                    mod->addModuleFlag(llvm::Module::Warning, "Debug Info Version", llvm::DEBUG_METADATA_VERSION);
+                    // Darwin only supports dwarf2.
+                    if (triple && triple->isOSDarwin())
+                        mod->addModuleFlag(llvm::Module::Warning, "Dwarf Version", 2);
+                    di->createCompileUnit(llvm::dwarf::DW_LANG_C, get_di_file(*file), "Kaleidoscope", true, "", 0);
+                }
+
+                // Everything is a double.
+                llvm::DIType* double_type = di->createBasicType("double", 64, llvm::dwarf::DW_ATE_float);
+                std::vector<llvm::Metadata*> types(fn->arg_size() + 1, double_type);
+                llvm::DISubroutineType* fn_type = di->createSubroutineType(di->getOrCreateTypeArray(types));
+
+                llvm::DIFile* di_file = get_di_file(*file);
+                unsigned line = file->locate(offset).line;
+                scope = di->createFunction(di_file, symbols::name(name), llvm::StringRef(), di_file, line, 
+                    fn_type, line, llvm::DINode::FlagPrototyped, llvm::DISubprogram::SPFlagDefinition);
+                fn->setSubprogram(scope);
+                locate(offset);
+            }
+
+            // Instructions from here on are given the location of the item at the offset.
+            void locate(uint32_t offset) {
+                if (!scope)
+                    return;
+                source::Location location = file->locate(offset);
+                builder->SetCurrentDebugLocation(llvm::DILocation::get(*context, location.line, location.column, scope));
+            }
+
+            void init_module(symbols::Id name) {
                 // The module is initialized with the name of the first function visited.
                 // Currently, there are no nested functions, and a module corresponds to one
                 // expression tree only, so the name of the module is the name of the one function
@@ -60,7 +115,7 @@ namespace gen {
                     return;
 
                 context = std::make_unique<llvm::LLVMContext>();
-                mod = std::make_unique<llvm::Module>(name, *context);
+                mod = std::make_unique<llvm::Module>(symbols::name(name), *context);
                 if (layout) mod->setDataLayout(*layout); 
                 if (triple) mod->setTargetTriple(triple->getTriple());
                 
@@ -81,36 +136,37 @@ namespace gen {
                 fn_pass_manager->add(llvm::createCFGSimplificationPass());
                 fn_pass_manager->doInitialization();
 
-                named_values.clear();
+                functions.clear();
             }
 
-            llvm::Function* get_fn(std::string name) {
-                if (llvm::Function* existing = mod->getFunction(name))
-                    return existing;
+            // The function for an id, declaring it in the module if it isn't there yet.
+            llvm::Function* get_fn(uint32_t id) {
+                if (id >= functions.size())
+                    functions.resize(resolve::functions.size());
+                if (functions[id])
+                    return functions[id];
 
-                auto iterator = prototypes.find(name);
-                if (iterator == prototypes.end())
-                    return nullptr;
-                
-                std::vector<std::string> args = iterator->second->args;
+                const ast::Pro& proto = resolve::functions.prototype(id);
+                const std::vector<symbols::Id>& args = proto.args;
 
                 std::vector<llvm::Type*> arg_types(args.size(), llvm::Type::getDoubleTy(*context));
                 llvm::Type* ret_type = llvm::Type::getDoubleTy(*context);
                 bool is_varag = false;
 
                 llvm::FunctionType* fn_type = llvm::FunctionType::get(ret_type, arg_types, is_varag);
-                llvm::Function* fn = llvm::Function::Create(fn_type, llvm::Function::ExternalLinkage, name, mod.get());
+                llvm::Function* fn = llvm::Function::Create(fn_type, llvm::Function::ExternalLinkage, symbols::name(proto.name), mod.get());
 
                 int i = 0;
                 for (auto& arg: fn->args())
-                    arg.setName(args[i++]);
+                    arg.setName(symbols::name(args[i++]));
                 
+                functions[id] = fn;
                 return fn;
             }
 
-            llvm::AllocaInst* create_allocation(llvm::Function* fn, const std::string& var_name) {
+            llvm::AllocaInst* create_allocation(llvm::Function* fn, symbols::Id var_name) {
                 llvm::IRBuilder<> temp_builder(&fn->getEntryBlock(), fn->getEntryBlock().begin());
-                return temp_builder.CreateAlloca(llvm::Type::getDoubleTy(*context), 0, var_name);
+                return temp_builder.CreateAlloca(llvm::Type::getDoubleTy(*context), 0, symbols::name(var_name));
             }
         public:
             Generator(const llvm::DataLayout* layout, const llvm::Triple* triple): layout(layout), triple(triple) {}
@@ -142,7 +198,22 @@ namespace gen {
                 return bool(mod);
             }
 
+            // Whether any function has been generated, rather than only declared.
+            bool has_definitions() {
+                if (!mod)
+                    return false;
+                for (llvm::Function& fn: *mod) {
+                    if (!fn.isDeclaration())
+                        return true;
+                }
+                return false;
+            }
+
             std::unique_ptr<llvm::Module> take_module() {
+                if (di)
+                    di->finalize();
+                di = nullptr;
+                di_files.clear();
                 return std::move(mod);
             }
 
@@ -151,170 +222,145 @@ namespace gen {
             }
 
             void clear() {
+                di = nullptr;
+                di_files.clear();
+                functions.clear();
                 mod = nullptr;
                 context = nullptr;
             }
 
-            void visit_num(ast::Num& target) override {
-                value = llvm::ConstantFP::get(*context, llvm::APFloat(target.value));
+        private:
+            // Each kind of expression is generated by one of the visit_* functions below that
+            // take its parts, so that the same code is used for ast items and for flat trees.
+            // (See flat.cpp) Children are generated by calling back into the walk.
+            // Names are resolved before a function is generated, (see resolve.cpp) so the only
+            // errors here are from generating the children. Errors are named after these, see
+            // diag::trace.
+            typedef llvm::Expected<llvm::Value*> Result;
+            typedef llvm::function_ref<Result()> Emit;
+
+            Result visit_num(double number) {
+                return llvm::ConstantFP::get(*context, llvm::APFloat(number));
             }
 
-            void visit_var(ast::Var& target) override {
-                llvm::AllocaInst* ptr = named_values[target.name];
-                if (!ptr)
-                    util::init_throw(__func__, "Unknown variable '" + target.name + "'");
-                
-                value = builder->CreateLoad(llvm::Type::getDoubleTy(*context), ptr, target.name);
+            Result visit_var(uint32_t offset, symbols::Id name, uint32_t slot) {
+                locate(offset);
+                return builder->CreateLoad(llvm::Type::getDoubleTy(*context), locals[slot], symbols::name(name));
             }
 
-            void visit_un(ast::Un& target) override {
-                llvm::Value* rhs;
-                try {
-                    target.rhs->visit(*this);
-                    rhs = value;
-                }
-                catch(...) {
-                    util::rethrow(__func__);
-                    return;
-                }
+            Result visit_un(uint32_t offset, uint32_t fn, Emit emit_rhs) {
+                Result rhs = emit_rhs();
+                if (!rhs)
+                    return diag::trace(rhs.takeError(), __func__);
 
-                std::string name = "unary" + std::string(1, target.op);
-                if (llvm::Function* fn = get_fn(name)) {
-                    std::vector<llvm::Value*> args {rhs};
-                    value = builder->CreateCall(fn, args, "calltmp");
-                }
-                else {
-                    std::string msg = "Unary operator not implemented: '" + std::string(1, target.op) + "'.";
-                    util::init_throw(__func__, msg);
-                }
+                locate(offset);
+                return builder->CreateCall(get_fn(fn), {*rhs}, "calltmp");
             }
 
-            void visit_bin(ast::Bin& target) override {
-                llvm::Value* lhs;
-                llvm::Value* rhs;
-                try {
-                    target.lhs->visit(*this);
-                    lhs = value;
-
-                    target.rhs->visit(*this);
-                    rhs = value;
-                } catch (...) {
-                    util::rethrow(__func__);
-                    return;
-                }
-
-                switch(target.op) {
-                    case '+': value = builder->CreateFAdd(lhs, rhs, "addtmp"); break;
-                    case '-': value = builder->CreateFSub(lhs, rhs, "subtmp"); break;
-                    case '*': value = builder->CreateFMul(lhs, rhs, "multmp"); break;
+            // fn is the function for a user operator.
+            Result visit_bin(uint32_t offset, char op, uint32_t fn, Emit emit_lhs, Emit emit_rhs) {
+                Result lhs = emit_lhs();
+                if (!lhs)
+                    return diag::trace(lhs.takeError(), __func__);
+                Result rhs = emit_rhs();
+                if (!rhs)
+                    return diag::trace(rhs.takeError(), __func__);
+
+                locate(offset);
+                switch(op) {
+                    case '+': return builder->CreateFAdd(*lhs, *rhs, "addtmp");
+                    case '-': return builder->CreateFSub(*lhs, *rhs, "subtmp");
+                    case '*': return builder->CreateFMul(*lhs, *rhs, "multmp");
                     case '<': {
-                        llvm::Value* cmp_result = builder->CreateFCmpULT(lhs, rhs, "cmptmp");
-                        value = builder->CreateUIToFP(cmp_result, llvm::Type::getDoubleTy(*context), "booltmp");
-                        break;
+                        llvm::Value* cmp_result = builder->CreateFCmpULT(*lhs, *rhs, "cmptmp");
+                        return builder->CreateUIToFP(cmp_result, llvm::Type::getDoubleTy(*context), "booltmp");
                     }
                     default: 
-                        std::string fn_name = "binary" + std::string(1, target.op);
-                        if (llvm::Function* fn = get_fn(fn_name)) {
-                            std::vector<llvm::Value*> args {lhs, rhs};
-                            value = builder->CreateCall(fn, args, "calltmp");
-                        }
-                        else {
-                            std::string msg = "Binary operator not implemented: '" + std::string(1, target.op) + "'.";
-                            util::init_throw(__func__, msg);
-                        }
+                        return builder->CreateCall(get_fn(fn), {*lhs, *rhs}, "calltmp");
                 }
             }
 
-            void visit_call(ast::Call& target) override {
-                llvm::Function* fn = get_fn(target.callee);
-                if (!fn)
-                    util::init_throw(__func__, "Unknown function: '" + target.callee + "'.");
-                
-                if (fn->arg_size() != target.args.size()) {
-                    std::string expected = std::to_string(fn->arg_size());
-                    std::string found = std::to_string(target.args.size());
-                    std::string name = "'" + target.callee + "'";
-                    util::init_throw(__func__, expected + " args expected for function " + name + ", found " + found + ".");
-                }
-
+            Result visit_call(uint32_t offset, uint32_t fn, size_t arg_count, llvm::function_ref<Result(size_t)> emit_arg) {
                 std::vector<llvm::Value*> args;
-                for (int i = 0; i < target.args.size(); i++) {
-                    try {
-                        target.args[i]->visit(*this);
-                    } catch (...) {
-                        util::rethrow(__func__);
-                    }
-                    args.push_back(value);
+                args.reserve(arg_count);
+                for (size_t i = 0; i < arg_count; i++) {
+                    Result arg = emit_arg(i);
+                    if (!arg)
+                        return diag::trace(arg.takeError(), __func__);
+                    args.push_back(*arg);
                 }
 
-                value = builder->CreateCall(fn, args, "calltmp");
-            }
-
-            void visit_pro(ast::Pro& target) override {
-                prototypes[target.name] = target.copy();
+                locate(offset);
+                return builder->CreateCall(get_fn(fn), args, "calltmp");
             }
 
-            void visit_fn(ast::Fn& target) override {
-                init_module(target.proto->name);
-                prototypes[target.proto->name] = target.proto->copy();
-
-                ast::Pro& proto = *target.proto;
-                if (proto.is_binary()) {
-                    expr::register_precedence(proto.get_symbol(), proto.precedence);
-                }
-
-                llvm::Function* fn = get_fn(target.proto->name);
+            // The function has already been resolved, and declared by that. If the body can't be
+            // generated, the function is left out of the module.
+            Result visit_fn(std::shared_ptr<const source::File> source, uint32_t offset, symbols::Id name, 
+                const std::vector<symbols::Id>& params, uint32_t slots, Emit emit_body) {
+                init_module(name);
+                uint32_t id = resolve::functions.find(name);
+                llvm::Function* fn = get_fn(id);
 
                 llvm::BasicBlock* entry_block = llvm::BasicBlock::Create(*context, "entry", fn);
                 builder->SetInsertPoint(entry_block);
+                begin_debug_info(std::move(source), offset, name, fn);
 
-                named_values.clear();
+                // The parameters are the first slots.
+                locals.assign(slots, nullptr);
+                uint32_t slot = 0;
                 for (llvm::Value& arg: fn->args()) {
-                    llvm::AllocaInst* ptr = create_allocation(fn, arg.getName().str());
+                    llvm::AllocaInst* ptr = create_allocation(fn, params[slot]);
                     builder->CreateStore(&arg, ptr);
-                    named_values[std::string(arg.getName())] = ptr;
+                    locals[slot++] = ptr;
                 }
 
-                try {
-                    target.body->visit(*this);
-                } catch(...) {
-                    util::rethrow(__func__);
-                    return;
+                Result body = emit_body();
+                if (!body) {
+                    builder->ClearInsertionPoint();
+                    fn->eraseFromParent();
+                    functions[id] = nullptr;
+                    return diag::trace(body.takeError(), __func__);
                 }
 
-                builder->CreateRet(value);
+                locate(offset);
+                builder->CreateRet(*body);
                 llvm::verifyFunction(*fn);
                 
                 fn_pass_manager->run(*fn);
-                value = fn;
+                return fn;
             }
 
-            void visit_if(ast::If& target) override {
-                try {
-                    target.cond->visit(*this);
-                } catch(...) {
-                    util::rethrow(__func__, "condition");
-                    return;
-                }
+            // b is optional.
+            Result visit_if(uint32_t offset, Emit emit_cond, Emit emit_a, Emit emit_b) {
+                Result cond = emit_cond();
+                if (!cond)
+                    return diag::trace(cond.takeError(), __func__, "condition");
+                locate(offset);
                 llvm::Value* zero = llvm::ConstantFP::get(*context, llvm::APFloat(0.));
-                llvm::Value* cond_value = builder->CreateFCmpONE(value, zero);
+                llvm::Value* cond_value = builder->CreateFCmpONE(*cond, zero);
 
                 llvm::Function* fn = builder->GetInsertBlock()->getParent();
                 llvm::BasicBlock* then_block = llvm::BasicBlock::Create(*context, "then", fn);
                 llvm::BasicBlock* else_block = llvm::BasicBlock::Create(*context, "else");
                 llvm::BasicBlock* merge_block = llvm::BasicBlock::Create(*context, "merge");
 
+                // After an error, the blocks that aren't in the function yet are put in it, so
+                // that they are deleted along with it. (See visit_fn)
+                auto abandon = [&](llvm::Error error) -> Result {
+                    if (!else_block->getParent())
+                        fn->getBasicBlockList().push_back(else_block);
+                    fn->getBasicBlockList().push_back(merge_block);
+                    return diag::trace(std::move(error), __func__);
+                };
+
                 builder->CreateCondBr(cond_value, then_block, else_block);
 
                 builder->SetInsertPoint(then_block);
-                try {
-                    target.a->visit(*this);
-                }
-                catch(...) {
-                    util::rethrow(__func__);
-                    return;
-                }
-                llvm::Value* then_value = value;
+                Result then_value = emit_a();
+                if (!then_value)
+                    return abandon(then_value.takeError());
+                locate(offset);
                 builder->CreateBr(merge_block);
 
                 // This could be the same as then_block, but it won't be
@@ -327,19 +373,17 @@ namespace gen {
                 fn->getBasicBlockList().push_back(else_block);
 
                 builder->SetInsertPoint(else_block);
-                if (target.b) {
-                    try {
-                        target.b->visit(*this);
-                    } catch(...) {
-                        util::rethrow(__func__);
-                        return;
-                    }
+                Result else_value = nullptr;
+                if (emit_b) {
+                    else_value = emit_b();
+                    if (!else_value)
+                        return abandon(else_value.takeError());
                 }
                 else {
                     // If there is no else statement given, default to a value of 0 for it.
-                    value = llvm::ConstantFP::get(*context, llvm::APFloat(0.));
+                    else_value = llvm::ConstantFP::get(*context, llvm::APFloat(0.));
                 }
-                llvm::Value* else_value = value;
+                locate(offset);
                 builder->CreateBr(merge_block);
 
                 llvm::BasicBlock* else_end_block = builder->GetInsertBlock();
@@ -349,25 +393,22 @@ namespace gen {
                 builder->SetInsertPoint(merge_block);
 
                 llvm::PHINode* phi = builder->CreatePHI(llvm::Type::getDoubleTy(*context), 2, "iftmp");
-                phi->addIncoming(then_value, then_end_block);
-                phi->addIncoming(else_value, else_end_block);
+                phi->addIncoming(*then_value, then_end_block);
+                phi->addIncoming(*else_value, else_end_block);
 
-                value = phi;
+                return phi;
             }
 
-            void visit_for(ast::For& target) {
-                try {
-                    target.start->visit(*this);
-                }
-                catch(...) {
-                    util::rethrow(__func__, "start");
-                    return;
-                }
-                llvm::Value* start_value = value;
+            // inc is optional.
+            Result visit_for(uint32_t offset, symbols::Id var_name, uint32_t slot, Emit emit_start, Emit emit_end, Emit emit_inc, Emit emit_body) {
+                Result start_value = emit_start();
+                if (!start_value)
+                    return diag::trace(start_value.takeError(), __func__, "start");
 
+                locate(offset);
                 llvm::Function* fn = builder->GetInsertBlock()->getParent();
-                llvm::AllocaInst* loop_var_ptr = create_allocation(fn, target.var_name);
-                builder->CreateStore(start_value, loop_var_ptr);
+                llvm::AllocaInst* loop_var_ptr = create_allocation(fn, var_name);
+                builder->CreateStore(*start_value, loop_var_ptr);
 
                 llvm::BasicBlock* first_loop_block = llvm::BasicBlock::Create(*context, "loop", fn);
 
@@ -377,148 +418,308 @@ namespace gen {
                 builder->CreateBr(first_loop_block);
                 builder->SetInsertPoint(first_loop_block);
 
-                // If the loop variable shadows a variable from the enclosing scope, a backup
-                // of the enclosing reference is needed.
-                llvm::AllocaInst* backup = named_values[target.var_name];
-                named_values[target.var_name] = loop_var_ptr;
+                // The loop variable has a slot of its own, even if it shadows another.
+                locals[slot] = loop_var_ptr;
 
-                try {
-                    target.body->visit(*this);
-                } 
-                catch(...) {
-                    util::rethrow(__func__, "body");
-                    return;
-                }
                 // The value of the body is not used here.
-
-                llvm::Value* step;
-                if (target.inc) {
-                    try {
-                        target.inc->visit(*this);
-                    }
-                    catch(...) {
-                        util::rethrow(__func__, "step");
-                        return;
-                    }
-                    step = value;
+                Result body = emit_body();
+                if (!body)
+                    return diag::trace(body.takeError(), __func__, "body");
+
+                Result step = nullptr;
+                if (emit_inc) {
+                    step = emit_inc();
+                    if (!step)
+                        return diag::trace(step.takeError(), __func__, "step");
                 }
                 else {
                     step = llvm::ConstantFP::get(*context, llvm::APFloat(1.));
                 }
-                llvm::Value* current_value = builder->CreateLoad(llvm::Type::getDoubleTy(*context), loop_var_ptr, target.var_name);
-                llvm::Value* next_value = builder->CreateFAdd(current_value, step, "next");
+                locate(offset);
+                llvm::Value* current_value = builder->CreateLoad(llvm::Type::getDoubleTy(*context), loop_var_ptr, symbols::name(var_name));
+                llvm::Value* next_value = builder->CreateFAdd(current_value, *step, "next");
                 builder->CreateStore(next_value, loop_var_ptr);
 
-                try {
-                    target.end->visit(*this);
-                }
-                catch(...) {
-                    util::rethrow(__func__, "end");
-                    return;
-                }
                 // Note: "end" is a double 0 or 1 representing true/false, not the end
                 // of a range or something like that.
-                llvm::Value* end = value;
+                Result end = emit_end();
+                if (!end)
+                    return diag::trace(end.takeError(), __func__, "end");
+                locate(offset);
                 // Convert from 1/0 to true/false.
                 llvm::Value* zero = llvm::ConstantFP::get(*context, llvm::APFloat(0.));
-                llvm::Value* end_bool = builder->CreateFCmpONE(end, zero, "loop_ended");
+                llvm::Value* end_bool = builder->CreateFCmpONE(*end, zero, "loop_ended");
 
                 llvm::BasicBlock* end_block = llvm::BasicBlock::Create(*context, "after", fn);
                 builder->CreateCondBr(end_bool, first_loop_block, end_block);   
                 builder->SetInsertPoint(end_block);           
 
-                if (backup)
-                    named_values[target.var_name] = backup;
-                else
-                    named_values.erase(target.var_name);
-
-                value = llvm::ConstantFP::getNullValue(llvm::Type::getDoubleTy(*context));
+                return llvm::ConstantFP::getNullValue(llvm::Type::getDoubleTy(*context));
             }
 
-            void visit_import(ast::Import& target) override {
-                util::init_throw(__func__, "Internal error: attempted to generate IR for an import statement!");
+            // emit_value gives nullptr for a variable without an initial value, which starts
+            // at zero.
+            Result visit_with(uint32_t offset, size_t count, llvm::function_ref<symbols::Id(size_t)> name_of, 
+                llvm::function_ref<uint32_t(size_t)> slot_of, llvm::function_ref<Result(size_t)> emit_value, Emit emit_body) {
+                for (size_t i = 0; i < count; i++) {
+                    symbols::Id name = name_of(i);
+                    llvm::AllocaInst* new_ptr = create_allocation(builder->GetInsertBlock()->getParent(), name);
+
+                    Result initial_val = emit_value(i);
+                    if (!initial_val)
+                        return diag::trace(initial_val.takeError(), __func__, "initial value for '" + symbols::str(name) + "'");
+                    if (!*initial_val)
+                        *initial_val = llvm::ConstantFP::getNullValue(llvm::Type::getDoubleTy(*context));
+
+                    locals[slot_of(i)] = new_ptr;
+                    locate(offset);
+                    builder->CreateStore(*initial_val, new_ptr);
+                }
+
+                // (The value is the value of the body expression.)
+                Result body = emit_body();
+                if (!body)
+                    return diag::trace(body.takeError(), __func__, "body");
+                return body;
             }
 
-            void visit_command(ast::Command& target) override {
-                util::init_throw(__func__, "Internal error: attempted to generate IR for a command!");
+            Result visit_assignment(uint32_t offset, uint32_t slot, Emit emit_value) {
+                Result result = emit_value();
+                if (!result)
+                    return diag::trace(result.takeError(), __func__);
+
+                locate(offset);
+                builder->CreateStore(*result, locals[slot]);
+                return result;
             }
 
-            void visit_block(ast::Block& target) override {
-                for (const std::unique_ptr<ast::Statement>& statement: target.statements) {
-                    statement->visit(*this);
+            // Generates one statement after another. A statement that fails doesn't stop the
+            // ones after it from being generated, so all of their errors are returned together.
+            template<class Statements, class Generate>
+            llvm::Error each(Statements& statements, Generate generate) {
+                llvm::Error errors = llvm::Error::success();
+                for (auto& statement: statements) {
+                    if (llvm::Error error = generate(statement))
+                        errors = llvm::joinErrors(std::move(errors), std::move(error));
                 }
+                return errors;
             }
 
-            void visit_with(ast::With& target) override {
-                std::map<std::string, llvm::AllocaInst*> shadow_vars;
+        public:
+            // Walking ast items, see ast::Walker. Each returns the value of the item, or
+            // nullptr for statements other than functions.
 
-                // Initialize the new variables, back up any shadowed ones from an enclosing scope.
-                
-                for (std::pair<std::string, std::unique_ptr<ast::Expr>>& assignment: target.assignments) {
-                    std::string name = assignment.first;
-                    llvm::AllocaInst* existing_ptr = named_values[name];
-                    if (existing_ptr)
-                        shadow_vars[name] = existing_ptr;
-                    
-                    llvm::AllocaInst* new_ptr = create_allocation(builder->GetInsertBlock()->getParent(), name);
-                    llvm::Value* initial_val;
-                    if (assignment.second) {
-                        try {
-                            assignment.second->visit(*this);
-                        }
-                        catch (...) {
-                            util::rethrow(__func__, "initial value for '" + name + "'");
-                            return;
-                        }
-                        initial_val = value;
-                    }
-                    else {
-                        initial_val = llvm::ConstantFP::getNullValue(llvm::Type::getDoubleTy(*context));
-                    }
-                    
-                    named_values[name] = new_ptr;
-                    builder->CreateStore(initial_val, new_ptr);
-                }
+            Result walk_num(ast::Num& target) {
+                return visit_num(target.value);
+            }
 
-                // Compile the body.
+            Result walk_var(ast::Var& target) {
+                return visit_var(target.offset, target.name, target.slot);
+            }
 
-                try {
-                    target.body->visit(*this);
-                }
-                catch (...) {
-                    util::rethrow(__func__, "body");
+            Result walk_un(ast::Un& target) {
+                return visit_un(target.offset, target.fn, [&]() { return walk(*target.rhs); });
+            }
+
+            Result walk_bin(ast::Bin& target) {
+                return visit_bin(target.offset, target.op, target.fn, [&]() { return walk(*target.lhs); }, [&]() { return walk(*target.rhs); });
+            }
+
+            Result walk_call(ast::Call& target) {
+                return visit_call(target.offset, target.fn, target.args.size(), [&](size_t i) { return walk(*target.args[i]); });
+            }
+
+            Result walk_pro(ast::Pro& target) {
+                resolve::declare(target);
+                return nullptr;
+            }
+
+            // The JIT resolves each function when it's defined, (see jit::define) in order with
+            // everything else that is declared, so generating it only reads what that set. That
+            // matters because it can be generated later, on a worker. Anything that hasn't been
+            // resolved yet is resolved here, since it can only use what is declared before it.
+            Result walk_fn(ast::Fn& target) {
+                if (!target.resolved) {
+                    if (llvm::Error errors = resolve::function(target))
+                        return diag::trace(std::move(errors), "visit_fn");
                 }
-                // (Leave the value as set by the body expression.)
 
-                // Remove variables going out of scope, restore any shadowed ones.
+                return visit_fn(target.file, target.offset, target.proto->name, target.proto->args, target.slots, 
+                    [&]() { return walk(*target.body); });
+            }
 
-                for (std::pair<std::string, std::unique_ptr<ast::Expr>>& assignment: target.assignments) {
-                    std::string name = assignment.first;
-                    llvm::AllocaInst* shadow = shadow_vars[name];
-                    if (shadow) {
-                        named_values[name] = shadow;
-                    }
-                    else {
-                        named_values.erase(name);
+            Result walk_if(ast::If& target) {
+                auto b = [&]() { return walk(*target.b); };
+                return visit_if(target.offset, [&]() { return walk(*target.cond); }, [&]() { return walk(*target.a); }, 
+                    target.b ? Emit(b) : Emit());
+            }
+
+            Result walk_for(ast::For& target) {
+                auto inc = [&]() { return walk(*target.inc); };
+                return visit_for(target.offset, target.var_name, target.slot, [&]() { return walk(*target.start); }, 
+                    [&]() { return walk(*target.end); }, target.inc ? Emit(inc) : Emit(), [&]() { return walk(*target.body); });
+            }
+
+            Result walk_with(ast::With& target) {
+                return visit_with(target.offset, target.assignments.size(), 
+                    [&](size_t i) { return target.assignments[i].first; },
+                    [&](size_t i) { return target.slots[i]; },
+                    [&](size_t i) { return target.assignments[i].second ? walk(*target.assignments[i].second) : Result(nullptr); },
+                    [&]() { return walk(*target.body); });
+            }
+
+            Result walk_assignment(ast::Assignment& target) {
+                return visit_assignment(target.offset, target.slot, [&]() { return walk(*target.value); });
+            }
+
+            Result walk_import(ast::Import&) {
+                return diag::error(diag::Code::INTERNAL, "visit_import", "Attempted to generate IR for an import statement!");
+            }
+
+            Result walk_command(ast::Command&) {
+                return diag::error(diag::Code::INTERNAL, "visit_command", "Attempted to generate IR for a command!");
+            }
+
+            Result walk_block(ast::Block& target) {
+                llvm::Error errors = each(target.statements, [&](const std::unique_ptr<ast::Statement>& statement) {
+                    return walk(*statement).takeError();
+                });
+                if (errors)
+                    return errors;
+                return nullptr;
+            }
+
+            // All of the statements in a flat tree, as walk_block() does for a block.
+            // Each function is resolved into a side table, (see resolve::Names) since the tree
+            // can't hold what is resolved itself.
+            llvm::Error walk_tree(const flat::Tree& tree) {
+                resolve::Names names(tree);
+                return each(tree.statements, [&](const flat::Statement& statement) -> llvm::Error {
+                    switch (statement.kind) {
+                        case flat::Statement::FN:
+                            if (llvm::Error errors = resolve::function(tree, statement.index, names))
+                                return diag::trace(std::move(errors), "visit_fn");
+                            return walk_tree_fn(tree, statement.index, names);
+                        case flat::Statement::PRO:
+                            resolve::declare(tree, statement.index);
+                            return llvm::Error::success();
+                        case flat::Statement::IMPORT:
+                            return diag::error(diag::Code::INTERNAL, "visit_import", "Attempted to generate IR for an import statement!");
+                        case flat::Statement::COMMAND:
+                            return diag::error(diag::Code::INTERNAL, "visit_command", "Attempted to generate IR for a command!");
                     }
-                }
+                    return llvm::Error::success();
+                });
             }
 
-            void visit_assignment(ast::Assignment& target) override {
-                llvm::AllocaInst* stack_ptr = named_values[target.identifier];
-                if (!stack_ptr)
-                    util::init_throw(__func__, "Unrecognized variable name: '" + target.identifier + "'");
-                
-                try {
-                    target.value->visit(*this);
+            // One function in a flat tree, as walk_fn() does for ast items. What was resolved
+            // for it is only read, unless it hasn't been resolved yet. (See jit::Unit)
+            llvm::Error walk_tree_fn(const flat::Tree& tree, uint32_t index, resolve::Names& names) {
+                if (!names.resolved) {
+                    if (llvm::Error errors = resolve::function(tree, index, names))
+                        return diag::trace(std::move(errors), "visit_fn");
                 }
-                catch (...) {
-                    util::rethrow(__func__);
-                    return;
+
+                const flat::Fn& fn = tree.fns[index];
+                std::vector<symbols::Id> params = tree.param_names(tree.pros[fn.proto]);
+                in_scope.assign(tree.names.size(), 0);
+                bound.clear();
+                for (uint32_t i = 0; i < params.size(); i++)
+                    in_scope[tree.params[tree.pros[fn.proto].params.first + i]] = i + 1;
+
+                return visit_fn(tree.file, fn.offset, tree.name(tree.pros[fn.proto].name), params, names.slots,
+                    [&]() { return emit(tree, names, fn.body); }).takeError();
+            }
+
+        private:
+            // While walking a flat tree, the slot each name refers to, plus one, by its index in
+            // the tree's names. A variable node can be in more than one scope in a shared tree,
+            // so its slot is looked up here, and the bindings put their own slots in as they
+            // come into scope, the same as resolve::Scope. (What they replace is kept in bound)
+            std::vector<uint32_t> in_scope;
+            std::vector<std::pair<uint32_t, uint32_t>> bound;
+
+            void bind(uint32_t name, uint32_t slot) {
+                bound.push_back({name, in_scope[name]});
+                in_scope[name] = slot + 1;
+            }
+
+            void unbind(size_t mark) {
+                while (bound.size() > mark) {
+                    in_scope[bound.back().first] = bound.back().second;
+                    bound.pop_back();
                 }
+            }
 
-                builder->CreateStore(value, stack_ptr);
+            Result emit(const flat::Tree& tree, const resolve::Names& names, flat::Ref ref) {
+                uint32_t i = ref.index();
+                switch (ref.kind()) {
+                    case flat::NUM:
+                        return visit_num(tree.literals[tree.nums[i].literal]);
+                    case flat::VAR: {
+                        const flat::Var& node = tree.vars[i];
+                        return visit_var(node.offset, tree.name(node.name), in_scope[node.name] - 1);
+                    }
+                    case flat::UN: {
+                        const flat::Un& node = tree.uns[i];
+                        return visit_un(node.offset, names.uns[i], [&]() { return emit(tree, names, node.rhs); });
+                    }
+                    case flat::BIN: {
+                        const flat::Bin& node = tree.bins[i];
+                        return visit_bin(node.offset, node.op, names.bins[i],
+                            [&]() { return emit(tree, names, node.lhs); }, [&]() { return emit(tree, names, node.rhs); });
+                    }
+                    case flat::CALL: {
+                        const flat::Call& node = tree.calls[i];
+                        return visit_call(node.offset, names.calls[i], node.args.count,
+                            [&](size_t arg) { return emit(tree, names, tree.args[node.args.first + arg]); });
+                    }
+                    case flat::IF: {
+                        const flat::If& node = tree.ifs[i];
+                        auto b = [&]() { return emit(tree, names, node.b); };
+                        return visit_if(node.offset, [&]() { return emit(tree, names, node.cond); }, 
+                            [&]() { return emit(tree, names, node.a); }, node.b ? Emit(b) : Emit());
+                    }
+                    case flat::FOR: {
+                        const flat::For& node = tree.fors[i];
+                        size_t mark = bound.size();
+                        // The loop variable is in scope for everything after the start value.
+                        auto start = [&]() {
+                            Result value = emit(tree, names, node.start);
+                            bind(node.var_name, names.fors[i]);
+                            return value;
+                        };
+                        auto inc = [&]() { return emit(tree, names, node.inc); };
+                        Result result = visit_for(node.offset, tree.name(node.var_name), names.fors[i], start,
+                            [&]() { return emit(tree, names, node.end); }, node.inc ? Emit(inc) : Emit(), [&]() { return emit(tree, names, node.body); });
+                        unbind(mark);
+                        return result;
+                    }
+                    case flat::ASSIGNMENT: {
+                        const flat::Assignment& node = tree.assignments[i];
+                        return visit_assignment(node.offset, names.assignments[i], [&]() { return emit(tree, names, node.value); });
+                    }
+                    case flat::WITH: {
+                        const flat::With& node = tree.withs[i];
+                        uint32_t first = node.bindings.first;
+                        size_t mark = bound.size();
+                        // Each variable is in scope once its initial value has been generated.
+                        auto value = [&](size_t binding) {
+                            const flat::Binding& node = tree.bindings[first + binding];
+                            Result result = node.value ? emit(tree, names, node.value) : Result(nullptr);
+                            bind(node.name, names.bindings[first + binding]);
+                            return result;
+                        };
+                        Result result = visit_with(node.offset, node.bindings.count, 
+                            [&](size_t binding) { return tree.name(tree.bindings[first + binding].name); },
+                            [&](size_t binding) { return names.bindings[first + binding]; },
+                            value, [&]() { return emit(tree, names, node.body); });
+                        unbind(mark);
+                        return result;
+                    }
+                }
+                return diag::error(diag::Code::INTERNAL, __func__, "Unknown kind of expression in a flat tree.");
             }
         };
     }
-}
\ No newline at end of file
+}
@@ -1,170 +1,551 @@
 #pragma once
 
-#include "../ast.cpp"
-#include "../visitor.h"
+// LLVM generates lots of warnings I can't do anything about.
+#pragma warning(push, 0)
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#pragma warning(pop)
 
-class Stringifier : public Visitor {
-private:
-    std::string result = "";
+#include <string>
+#include <string_view>
+#include <vector>
 
+#include "../ast.cpp"
+#include "../flat.cpp"
+
+// Writes out a tree, for debugging.
+//
+// The default is one line of text, such as "Bin(+, Num(1.000000), Var(x))". With indent set,
+// each child item goes on a line of its own. With json set, each item is an object instead,
+// with its kind and named fields: {"kind": "Bin", "op": "+", "lhs": {...}, "rhs": {...}}
+//
+// Everything is written straight to the stream as the tree is walked, so the time taken is
+// linear in the size of the tree, however deep it is.
+class Stringifier : public ast::Walker<Stringifier, void> {
 public:
-    std::string getResult() {
-        return result;
+    struct Options {
+        bool json = false;
+        // Spaces per level, or zero for everything on one line.
+        unsigned indent = 0;
+    };
+
+    Stringifier(llvm::raw_ostream& out, Options options): out(out), options(options) {}
+    Stringifier(llvm::raw_ostream& out): Stringifier(out, Options()) {}
+
+    void walk_num(ast::Num& target) {
+        num(target.value);
+    }
+
+    void walk_var(ast::Var& target) {
+        var(target.name);
+    }
+
+    void walk_un(ast::Un& target) {
+        open("Un");
+        field("op");
+        op(target.op);
+        child("rhs");
+        walk(*target.rhs);
+        close();
+    }
+
+    void walk_bin(ast::Bin& target) {
+        open("Bin");
+        field("op");
+        op(target.op);
+        child("lhs");
+        walk(*target.lhs);
+        child("rhs");
+        walk(*target.rhs);
+        close();
     }
 
-    void visit_num(ast::Num& target) override {
-        result = "Num(" + std::to_string(target.value) + ")";
+    void walk_call(ast::Call& target) {
+        open("Call");
+        field("callee");
+        name(target.callee);
+        field("args");
+        open_list();
+        for (std::unique_ptr<ast::Expr>& arg: target.args) {
+            item(true);
+            walk(*arg);
+        }
+        close_list();
+        close();
     }
 
-    void visit_var(ast::Var& target) override {
-        result = "Var(" + target.name + ")";
+    void walk_pro(ast::Pro& target) {
+        pro(target.name, target.args.size(), [&](size_t i) { return target.args[i]; }, target.precedence);
     }
 
-    void visit_un(ast::Un& target) {
-        std::string symbol = std::string(1, target.op);
-        target.rhs->visit(*this);
-        std::string rhs = result;
+    void walk_fn(ast::Fn& target) {
+        open("Fn");
+        child("proto");
+        walk(*target.proto);
+        child("body");
+        walk(*target.body);
+        close();
+    }
 
-        std::string args = symbol + ", " + rhs;
-        result = "Un(" + args + ")";
+    void walk_if(ast::If& target) {
+        open("If");
+        child("cond");
+        walk(*target.cond);
+        child("then");
+        walk(*target.a);
+        if (target.b) {
+            child("else");
+            walk(*target.b);
+        }
+        close();
     }
 
-    void visit_bin(ast::Bin& target) override {
-        std::string symbol = std::string(1, target.op);
+    void walk_for(ast::For& target) {
+        open("For");
+        field("var");
+        name(target.var_name);
+        child("start");
+        walk(*target.start);
+        child("end");
+        walk(*target.end);
+        if (target.inc) {
+            child("inc");
+            walk(*target.inc);
+        }
+        child("body");
+        walk(*target.body);
+        close();
+    }
 
-        target.lhs->visit(*this);
-        std::string lhs = result;
+    void walk_import(ast::Import& target) {
+        text("Import", "file", target.file);
+    }
 
-        target.rhs->visit(*this);
-        std::string rhs = result;
+    void walk_block(ast::Block& target) {
+        open("Block");
+        open_statements();
+        for (std::unique_ptr<ast::Statement>& statement: target.statements) {
+            item(true);
+            walk(*statement);
+        }
+        close_statements();
+        close();
+    }
 
-        std::string args = symbol + ", " + lhs + ", " + rhs;
-        result = "Bin(" + args + ")";
+    void walk_assignment(ast::Assignment& target) {
+        open("Assignment");
+        field("name");
+        name(target.identifier);
+        child("value");
+        walk(*target.value);
+        close();
     }
 
-    void visit_call(ast::Call& target) override {
-        std::string args = "(";
-        if (target.args.size() > 0) {
-            target.args[0]->visit(*this);
-            args += result;
-            for (int i = 1; i < target.args.size(); i++) {
-                target.args[i]->visit(*this);
-                args += ", " + result;
+    void walk_with(ast::With& target) {
+        open("With");
+        open_bindings();
+        for (auto& assignment: target.assignments) {
+            binding(assignment.first, assignment.second != nullptr);
+            if (assignment.second)
+                walk(*assignment.second);
+            close_binding();
+        }
+        close_bindings();
+        child("body");
+        walk(*target.body);
+        close();
+    }
+
+    void walk_command(ast::Command& target) {
+        text("Command", "text", target.text);
+    }
+
+    // The same output as for the ast items that a flat tree was made from.
+    void walk_tree(const flat::Tree& tree) {
+        open("Block");
+        open_statements();
+        for (const flat::Statement& statement: tree.statements) {
+            item(true);
+            switch (statement.kind) {
+                case flat::Statement::FN: {
+                    const flat::Fn& fn = tree.fns[statement.index];
+                    open("Fn");
+                    child("proto");
+                    pro(tree, tree.pros[fn.proto]);
+                    child("body");
+                    walk_flat(tree, fn.body);
+                    close();
+                    break;
+                }
+                case flat::Statement::PRO:
+                    pro(tree, tree.pros[statement.index]);
+                    break;
+                case flat::Statement::IMPORT:
+                    text("Import", "file", tree.texts[statement.index]);
+                    break;
+                case flat::Statement::COMMAND:
+                    text("Command", "text", tree.texts[statement.index]);
+                    break;
             }
         }
-        args += ")";
-        result = "Call(" + target.callee + ", " + args + ")";
+        close_statements();
+        close();
     }
 
-    void visit_pro(ast::Pro& target) override {
-        std::string args = "(";
-        if (target.args.size() > 0) {
-            args += target.args[0];
-            for (int i = 1; i < target.args.size(); i++)   
-                args += ", "+ target.args[i];
+    void walk_flat(const flat::Tree& tree, flat::Ref ref) {
+        uint32_t i = ref.index();
+        switch (ref.kind()) {
+            case flat::NUM:
+                num(tree.literals[tree.nums[i].literal]);
+                break;
+            case flat::VAR:
+                var(tree.name(tree.vars[i].name));
+                break;
+            case flat::UN: {
+                const flat::Un& node = tree.uns[i];
+                open("Un");
+                field("op");
+                op(node.op);
+                child("rhs");
+                walk_flat(tree, node.rhs);
+                close();
+                break;
+            }
+            case flat::BIN: {
+                const flat::Bin& node = tree.bins[i];
+                open("Bin");
+                field("op");
+                op(node.op);
+                child("lhs");
+                walk_flat(tree, node.lhs);
+                child("rhs");
+                walk_flat(tree, node.rhs);
+                close();
+                break;
+            }
+            case flat::CALL: {
+                const flat::Call& node = tree.calls[i];
+                open("Call");
+                field("callee");
+                name(tree.name(node.callee));
+                field("args");
+                open_list();
+                for (uint32_t arg = 0; arg < node.args.count; arg++) {
+                    item(true);
+                    walk_flat(tree, tree.args[node.args.first + arg]);
+                }
+                close_list();
+                close();
+                break;
+            }
+            case flat::IF: {
+                const flat::If& node = tree.ifs[i];
+                open("If");
+                child("cond");
+                walk_flat(tree, node.cond);
+                child("then");
+                walk_flat(tree, node.a);
+                if (node.b) {
+                    child("else");
+                    walk_flat(tree, node.b);
+                }
+                close();
+                break;
+            }
+            case flat::FOR: {
+                const flat::For& node = tree.fors[i];
+                open("For");
+                field("var");
+                name(tree.name(node.var_name));
+                child("start");
+                walk_flat(tree, node.start);
+                child("end");
+                walk_flat(tree, node.end);
+                if (node.inc) {
+                    child("inc");
+                    walk_flat(tree, node.inc);
+                }
+                child("body");
+                walk_flat(tree, node.body);
+                close();
+                break;
+            }
+            case flat::ASSIGNMENT: {
+                const flat::Assignment& node = tree.assignments[i];
+                open("Assignment");
+                field("name");
+                name(tree.name(node.name));
+                child("value");
+                walk_flat(tree, node.value);
+                close();
+                break;
+            }
+            case flat::WITH: {
+                const flat::With& node = tree.withs[i];
+                open("With");
+                open_bindings();
+                for (uint32_t binding = 0; binding < node.bindings.count; binding++) {
+                    const flat::Binding& pair = tree.bindings[node.bindings.first + binding];
+                    this->binding(tree.name(pair.name), (bool)pair.value);
+                    if (pair.value)
+                        walk_flat(tree, pair.value);
+                    close_binding();
+                }
+                close_bindings();
+                child("body");
+                walk_flat(tree, node.body);
+                close();
+                break;
+            }
         }
-        args += ")";
-        std::string prec = std::to_string(target.precedence);
-        result = "Pro(" + target.name + ", " + args +  + ", " + prec + ")";
     }
 
-    void visit_fn(ast::Fn& target) override {
-        target.proto->visit(*this);
-        std::string proto = result;
+    // The output for a tree, as a string.
+    static std::string str(ast::Item& item, Options options) {
+        std::string result;
+        llvm::raw_string_ostream out(result);
+        Stringifier(out, options).walk(item);
+        out.flush();
+        return result;
+    }
+
+    static std::string str(const flat::Tree& tree, Options options) {
+        std::string result;
+        llvm::raw_string_ostream out(result);
+        Stringifier(out, options).walk_tree(tree);
+        out.flush();
+        return result;
+    }
+
+    static std::string str(ast::Item& item) {
+        return str(item, Options());
+    }
 
-        target.body->visit(*this);
-        std::string body = result;
+    static std::string str(const flat::Tree& tree) {
+        return str(tree, Options());
+    }
 
-        result = "Fn(" + proto + ", " + body + ")";
+private:
+    llvm::raw_ostream& out;
+    Options options;
+
+    // How deep the current item is, and whether anything has been written inside of it yet.
+    unsigned depth = 0;
+    bool first = true;
+    // The first flags of the items around the current one.
+    std::vector<bool> outer;
+
+    void newline() {
+        if (options.indent == 0)
+            return;
+        out << '\n';
+        out.indent(depth * options.indent);
     }
 
-    void visit_if(ast::If& target) override {
-        target.cond->visit(*this);
-        std::string cond = result;
+    void push() {
+        outer.push_back(first);
+        first = true;
+        depth++;
+    }
 
-        target.a->visit(*this);
-        std::string a = result;
+    void pop() {
+        first = outer.back();
+        outer.pop_back();
+        depth--;
+    }
 
-        std::string text = "If(" + cond + ", " + a;
+    // Start an item of some kind. Its fields follow, then close().
+    void open(const char* kind) {
+        if (options.json) {
+            out << "{";
+            push();
+            newline();
+            out << "\"kind\": \"" << kind << "\"";
+            first = false;
+        }
+        else {
+            out << kind << "(";
+            push();
+        }
+    }
 
-        if (target.b) {
-            target.b->visit(*this);
-            text += ", " + result;
+    void close() {
+        pop();
+        if (options.json) {
+            newline();
+            out << "}";
         }
+        else {
+            out << ")";
+        }
+    }
 
-        result = text;
-        result += ")";
+    // Before each field of an item. In text, the name is left out, and only child items go on
+    // a line of their own.
+    void field(const char* name, bool nested = false) {
+        if (options.json) {
+            out << ",";
+            newline();
+            out << "\"" << name << "\": ";
+        }
+        else {
+            item(nested);
+        }
     }
 
-    void visit_for(ast::For& target) override {
-        std::string name = target.var_name;
+    // Before a field that is an item of its own.
+    void child(const char* name) {
+        field(name, true);
+    }
 
-        target.start->visit(*this);
-        std::string start = result;
+    // Before each entry in a list, or a field in text.
+    void item(bool nested) {
+        bool own_line = (nested || options.json) && options.indent > 0;
+        if (!first)
+            out << (own_line ? "," : ", ");
+        first = false;
+        if (own_line)
+            newline();
+    }
 
-        target.end->visit(*this);
-        std::string end = result;
+    void open_list() {
+        out << (options.json ? "[" : "(");
+        push();
+    }
 
-        std::string text = "For(" + name + ", " + start + ", " + end;
+    void close_list() {
+        bool empty = first;
+        pop();
+        if (options.json && !empty)
+            newline();
+        out << (options.json ? "]" : ")");
+    }
 
-        if (target.inc) {
-            target.inc->visit(*this);
-            std::string inc = result;
-            text += ", " + inc;
+    // A block's statements are a list in JSON, and just its fields in text.
+    void open_statements() {
+        if (options.json) {
+            field("statements");
+            open_list();
         }
+    }
 
-        target.body->visit(*this);
-        std::string body = result;
+    void close_statements() {
+        if (options.json)
+            close_list();
+    }
 
-        result = text + ", " + body + ")";
+    // In JSON, each 'with' variable is an object of its own. In text, they are just names and
+    // values, one after the other.
+    void open_bindings() {
+        if (options.json) {
+            field("bindings");
+            open_list();
+        }
     }
 
-    void visit_import(ast::Import& target) override {
-        result = "Import(" + target.file + ")";
+    void close_bindings() {
+        if (options.json)
+            close_list();
     }
 
-    void visit_block(ast::Block& target) override {
-        std::string current = "Block(";
+    void binding(symbols::Id variable, bool has_value) {
+        if (options.json) {
+            item(true);
+            out << "{";
+            push();
+            newline();
+            out << "\"name\": ";
+            name(variable);
+            first = false;
+            if (has_value)
+                field("value");
+        }
+        else {
+            item(false);
+            name(variable);
+            if (has_value)
+                item(true);
+        }
+    }
 
-        if (target.statements.size() > 0) {
-            target.statements[0]->visit(*this);
-            current += result;
-            for (int i = 1; i < target.statements.size(); i++) {
-                target.statements[i]->visit(*this);
-                current += ", " + result;
-            }
+    void close_binding() {
+        if (options.json) {
+            pop();
+            newline();
+            out << "}";
         }
-        
-        current += ")";
-        result = current;
     }
 
-    void visit_assignment(ast::Assignment& target) override {
-        target.value->visit(*this);
-        result = "Assignment(" + target.identifier + ", " + result + ")";
+    void num(double value) {
+        open("Num");
+        field("value");
+        if (options.json)
+            out << llvm::format("%.17g", value);
+        else
+            out << llvm::format("%f", value);
+        close();
     }
 
-    void visit_with(ast::With& target) override {
-        std::string pairs = "";
-        if (target.assignments.size() > 0) {
-            pairs += target.assignments[0].first;
-            if (target.assignments[0].second) {
-                target.assignments[0].second->visit(*this);
-                pairs += ", " + result;
-            }
-            for (int i = 1; i < target.assignments.size(); i++) {
-                pairs += ", " + target.assignments[i].first;
-                if (target.assignments[i].second) {
-                    target.assignments[i].second->visit(*this);
-                    pairs += ", " + result;
-                }
-            }
+    void var(symbols::Id id) {
+        open("Var");
+        field("name");
+        name(id);
+        close();
+    }
+
+    template<class Param>
+    void pro(symbols::Id id, size_t count, Param param, double precedence) {
+        open("Pro");
+        field("name");
+        name(id);
+        field("params");
+        open_list();
+        for (size_t i = 0; i < count; i++) {
+            item(false);
+            name(param(i));
         }
-        target.body->visit(*this);
-        result = "With(" + pairs + ", " + result + ")";
+        close_list();
+        field("precedence");
+        out << llvm::format(options.json ? "%.17g" : "%f", precedence);
+        close();
     }
 
-    void visit_command(ast::Command& target) override {
-        result = "Command(" + target.text + ")";
+    void pro(const flat::Tree& tree, const flat::Pro& node) {
+        pro(tree.name(node.name), node.params.count,
+            [&](size_t i) { return tree.name(tree.params[node.params.first + i]); }, node.precedence);
+    }
+
+    void text(const char* kind, const char* field_name, std::string_view value) {
+        open(kind);
+        field(field_name);
+        string(value);
+        close();
+    }
+
+    void name(symbols::Id id) {
+        string(symbols::name(id));
+    }
+
+    void op(char symbol) {
+        string(std::string_view(&symbol, 1));
+    }
+
+    // Quoted and escaped in JSON, as it is in text.
+    void string(std::string_view text) {
+        if (!options.json) {
+            out << text;
+            return;
+        }
+
+        out << '"';
+        for (char c: text) {
+            if (c == '"' || c == '\\')
+                out << '\\' << c;
+            else if ((unsigned char)c < 0x20)
+                out << llvm::format("\\u%04x", (unsigned char)c);
+            else
+                out << c;
+        }
+        out << '"';
     }
 };
@@ -36,15 +36,25 @@
 // Also: https://developercommunity.visualstudio.com/t/-imp-std-init-once-complete-unresolved-external-sy/1684365#T-N10047968
 
 
-// TODO: Refactor tokens and expressions, maybe move from globals to args & returns.
-
-int main() {
+int main(int argc, char** argv) {
     jit::debug = true;
-    jit::init();
+    if (auto error = jit::init()) {
+        diag::print(std::move(error));
+        return 1;
+    }
     builtins::init();
 
+    // Any arguments are taken as source files to run in order, instead of starting the REPL.
+    if (argc > 1) {
+        jit::execute_files(std::vector<std::string>(argv + 1, argv + argc));
+
+        jit::cleanup();
+        return 0;
+    }
+
     printf("V3\n");
-    jit::interactive();
+    if (auto error = jit::interactive())
+        diag::print(std::move(error));
     
     jit::cleanup();
 }
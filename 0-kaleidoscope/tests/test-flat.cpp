@@ -0,0 +1,233 @@
+#include "../compiler/cache.cpp"
+#include "../compiler/expr.cpp"
+#include "../compiler/flat.cpp"
+#include "../compiler/imports.cpp"
+#include "../compiler/tokens.cpp"
+#include "../compiler/visitors/stringify.cpp"
+
+#include <iostream>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+namespace fs = std::filesystem;
+
+// Parse text into one block, the way a file is parsed. Any operators it defines are added to
+// expr::precedences, as they would be in the REPL. Returns nullptr if there were errors.
+std::unique_ptr<ast::Block> parse(std::string_view text) {
+    tokens::Buffer buffer = tokens::lex_all(text);
+    std::string errors;
+
+    expr::Parser parser(expr::precedences);
+    parser.errors = &errors;
+    parser.interactive_mode = false;
+    parser.lexer.set_input(buffer);
+    parser.input("");
+
+    if (!parser.current || !errors.empty()) {
+        printf("FAILED: Parsing '%s': %s\n", std::string(text).c_str(), errors.c_str());
+        return nullptr;
+    }
+    return std::move(parser.current);
+}
+
+// Calls to printd are never shared.
+bool pure(symbols::Id name) {
+    return symbols::str(name) != "printd";
+}
+
+// Trees should read the same flat as they did before, and again after going back to ast items.
+// Returns the number of failures.
+int check_round_trip(ast::Block& block, const std::string& what) {
+    int failures = 0;
+    std::string expected = Stringifier::str(block);
+
+    flat::Tree tree = flat::flatten(block);
+    if (Stringifier::str(tree) != expected) {
+        printf("FAILED: Flattening %s reads differently\n", what.c_str());
+        failures++;
+    }
+    if (Stringifier::str(*flat::unflatten(tree)) != expected) {
+        printf("FAILED: Flattening and unflattening %s reads differently\n", what.c_str());
+        failures++;
+    }
+
+    // Sharing subexpressions shouldn't change how the tree reads either.
+    flat::Tree shared = flat::flatten_shared(block, pure);
+    if (Stringifier::str(shared) != expected) {
+        printf("FAILED: Flattening %s with sharing reads differently\n", what.c_str());
+        failures++;
+    }
+    if (Stringifier::str(*flat::unflatten(shared)) != expected) {
+        printf("FAILED: Flattening and unflattening %s with sharing reads differently\n", what.c_str());
+        failures++;
+    }
+    if (shared.size() > tree.size()) {
+        printf("FAILED: Sharing %s adds nodes\n", what.c_str());
+        failures++;
+    }
+
+    // Anything flattened refers only to what is in the tree. (See flat::check)
+    if (!flat::check(tree) || !flat::check(shared)) {
+        printf("FAILED: Flattening %s gives a tree that doesn't pass flat::check\n", what.c_str());
+        failures++;
+    }
+
+    return failures;
+}
+
+// The body of the last function in a tree.
+const flat::Bin& last_body(const flat::Tree& tree) {
+    return tree.bins[tree.fns.back().body.index()];
+}
+
+// Expressions that are the same are added once, (see flat::flatten_shared) and have the same
+// hash in any tree. Returns the number of failures.
+int check_sharing() {
+    int failures = 0;
+
+    std::unique_ptr<ast::Block> twice = parse("def twice(a b) a*b + a*b");
+    std::unique_ptr<ast::Block> apart = parse("def apart(a b) a*b < a+b");
+    std::unique_ptr<ast::Block> once = parse("def once(a b) a*b - 1");
+    std::unique_ptr<ast::Block> noisy = parse("def noisy(x) printd(x) + printd(x)");
+    if (!twice || !apart || !once || !noisy)
+        return 1;
+
+    flat::Tree tree = flat::flatten_shared(*twice, pure);
+    const flat::Bin& sum = last_body(tree);
+    if (tree.bins.size() != 2 || sum.lhs != sum.rhs) {
+        printf("FAILED: Both sides of 'a*b + a*b' should be the same node\n");
+        failures++;
+    }
+
+    flat::Tree different = flat::flatten_shared(*apart, pure);
+    const flat::Bin& less = last_body(different);
+    if (different.bins.size() != 3 || less.lhs == less.rhs) {
+        printf("FAILED: 'a*b' and 'a+b' should be different nodes\n");
+        failures++;
+    }
+
+    flat::Tree other = flat::flatten_shared(*once, pure);
+    if (other.hash(last_body(other).lhs) != tree.hash(sum.lhs)) {
+        printf("FAILED: 'a*b' should have the same hash in both trees\n");
+        failures++;
+    }
+    if (other.hash(last_body(other).rhs) == tree.hash(sum.lhs)) {
+        printf("FAILED: '1' and 'a*b' should have different hashes\n");
+        failures++;
+    }
+
+    if (flat::flatten_shared(*noisy, pure).calls.size() != 2) {
+        printf("FAILED: Calls to printd should never be shared\n");
+        failures++;
+    }
+    if (flat::flatten_shared(*noisy, [](symbols::Id) { return true; }).calls.size() != 1) {
+        printf("FAILED: Calls to a pure function should be shared\n");
+        failures++;
+    }
+
+    return failures;
+}
+
+// Write the bytes of an image where cache::load looks for it.
+void put_image(uint64_t key, const std::string& image) {
+    std::ofstream out(cache::path_for(key), std::ios::binary | std::ios::trunc);
+    out.write(image.data(), image.size());
+}
+
+// A tree stored in the cache should load as the same tree, and anything else should be a miss
+// rather than a tree that's wrong. (See cache.cpp) Returns the number of failures.
+int check_cache(ast::Block& block, const std::string& sample) {
+    llvm::SmallString<256> directory;
+    if (llvm::sys::fs::createUniqueDirectory("test-flat", directory)) {
+        printf("FAILED: Making a directory for the cache\n");
+        return 1;
+    }
+    cache::directory = std::string(directory.str());
+
+    int failures = 0;
+    flat::Tree tree = flat::flatten_shared(block, pure);
+    uint64_t key = cache::key(sample);
+    cache::store(key, tree);
+
+    std::optional<flat::Tree> loaded = cache::load(key);
+    if (!loaded || Stringifier::str(*loaded) != Stringifier::str(tree) || loaded->hashes != tree.hashes) {
+        printf("FAILED: The stored tree doesn't load as the same tree\n");
+        failures++;
+    }
+
+    // An edited source has another key.
+    if (cache::load(cache::key(sample + " "))) {
+        printf("FAILED: An edited source loads the tree of the original\n");
+        failures++;
+    }
+
+    // A damaged image is a miss, wherever the damage is.
+    std::string image = cache::write(tree, key);
+    for (size_t at: {(size_t)0, image.size() / 2, image.size() - 1}) {
+        std::string damaged = image;
+        damaged[at] ^= 0x5a;
+        put_image(key, damaged);
+        if (cache::load(key)) {
+            printf("FAILED: An image damaged at byte %d of %d loads\n", (int)at, (int)image.size());
+            failures++;
+        }
+    }
+
+    // So is half of one.
+    put_image(key, image.substr(0, image.size() / 2));
+    if (cache::load(key)) {
+        printf("FAILED: Half of an image loads\n");
+        failures++;
+    }
+
+    llvm::sys::fs::remove_directories(cache::directory);
+    cache::directory.clear();
+    return failures;
+}
+
+int main() {
+    printf("test-flat v1\n");
+
+    fs::path target = fs::path("./tests/samples/syntax.k");
+
+    if (!fs::exists(target)) {
+        std::cout << "Target file " << target << " does not seem to exist." << std::endl;
+        return 1;
+    }
+
+    std::ifstream file(target, std::ios::binary);
+    std::stringstream contents;
+    contents << file.rdbuf();
+    std::string sample = contents.str();
+
+    expr::init();
+    builtins::init();
+
+    std::unique_ptr<ast::Block> block = parse(sample);
+    if (!block) {
+        printf("1 failed\n");
+        return 1;
+    }
+    std::cout << Stringifier::str(*block, {false, 2}) << std::endl;
+
+    int failures = check_round_trip(*block, "the sample");
+
+    // The prelude first, since the others use its operators.
+    std::unique_ptr<ast::Block> prelude = parse(*builtins::map["pre"]);
+    failures += prelude ? check_round_trip(*prelude, "the prelude") : 1;
+    for (auto& [name, text]: builtins::map) {
+        std::unique_ptr<ast::Block> builtin = parse(*text);
+        failures += builtin ? check_round_trip(*builtin, "the builtin '" + name + "'") : 1;
+    }
+
+    failures += check_sharing();
+    failures += check_cache(*block, sample);
+
+    if (failures) {
+        printf("%d failed\n", failures);
+        return 1;
+    }
+    printf("All passed\n");
+    return 0;
+}
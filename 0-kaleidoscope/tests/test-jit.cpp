@@ -0,0 +1,346 @@
+#include "../compiler/jit.cpp"
+
+#include <atomic>
+#include <cmath>
+#include <string>
+
+// Something the optimizer can't see through, for comparing what it folds with what the
+// compiled code does. Found in the process, like printd. (See imports.cpp)
+extern "C" DLLEXPORT double testnan() {
+    return std::nan("");
+}
+
+// Parse text into one block, the way a file is parsed. The REPL's parser would wait for more
+// input on stdin if it thought something wasn't finished. Returns nullptr if there were errors.
+std::unique_ptr<ast::Block> parse(const std::string& text) {
+    tokens::Buffer buffer = tokens::lex_all(text);
+    std::string errors;
+
+    expr::Parser parser(expr::precedences);
+    parser.errors = &errors;
+    parser.interactive_mode = false;
+    parser.lexer.set_input(buffer);
+    parser.input("");
+
+    if (!parser.current || !errors.empty()) {
+        printf("FAILED: Parsing '%s': %s\n", text.c_str(), errors.c_str());
+        return nullptr;
+    }
+    return std::move(parser.current);
+}
+
+// Run text as a file would be run.
+llvm::Expected<std::unique_ptr<double>> execute(const std::string& text) {
+    std::unique_ptr<ast::Block> block = parse(text);
+    if (!block)
+        return llvm::make_error<llvm::StringError>("It didn't parse.", llvm::inconvertibleErrorCode());
+    return jit::execute(std::move(block));
+}
+
+bool same(double a, double b) {
+    return (std::isnan(a) && std::isnan(b)) || a == b;
+}
+
+// What a top-level expression folds to, or nullptr if it isn't a number once it's simplified.
+const ast::Num* fold(ast::Fn& fn) {
+    optimize::function(fn);
+    return optimize::constant(fn);
+}
+
+typedef std::unique_ptr<ast::Expr> Expr;
+
+Expr num(double value) {
+    return std::make_unique<ast::Num>(value);
+}
+
+Expr bin(char op, Expr lhs, Expr rhs) {
+    return std::make_unique<ast::Bin>(op, std::move(lhs), std::move(rhs));
+}
+
+// There is no literal for NaN, so the optimizer is given it in an expression made by hand,
+// and the compiled code gets it from testnan(). Folding the expression should give what
+// running the text does. (See optimize::fold) Returns the number of failures.
+int check_nan(const std::string& text, Expr expr, double expected) {
+    int failures = 0;
+    ast::Fn fn(std::make_unique<ast::Pro>(ast::MAIN, std::vector<symbols::Id>(), 0), std::move(expr));
+    const ast::Num* folded = fold(fn);
+    if (!folded || !same(folded->value, expected)) {
+        printf("FAILED: '%s' with a NaN literal folds to %f, not %f\n", text.c_str(), folded ? folded->value : 0., expected);
+        failures++;
+    }
+
+    llvm::Expected<std::unique_ptr<double>> result = execute(text);
+    if (!result || !*result || !same(**result, expected)) {
+        printf("FAILED: '%s' should be %f\n", text.c_str(), expected);
+        if (!result)
+            llvm::consumeError(result.takeError());
+        failures++;
+    }
+    return failures;
+}
+
+// Returns the number of failures.
+int check_nans() {
+    const double NaN = std::nan("");
+    int failures = 0;
+    // '<' is an unordered comparison, (see gen::Generator) so it's true if either side is NaN.
+    failures += check_nan("testnan() < 1", bin('<', num(NaN), num(1)), 1);
+    failures += check_nan("1 < testnan()", bin('<', num(1), num(NaN)), 1);
+    failures += check_nan("testnan() < testnan()", bin('<', num(NaN), num(NaN)), 1);
+    failures += check_nan("testnan() * 0 < 0", bin('<', bin('*', num(NaN), num(0)), num(0)), 1);
+    // But the condition of an 'if' is only true for something other than zero, which NaN isn't.
+    failures += check_nan("if testnan() then 2 else 3",
+        std::make_unique<ast::If>(num(NaN), num(2), num(3)), 3);
+    failures += check_nan("if testnan() < 1 then 2 else 3",
+        std::make_unique<ast::If>(bin('<', num(NaN), num(1)), num(2), num(3)), 2);
+    failures += check_nan("testnan() - testnan()", bin('-', num(NaN), num(NaN)), NaN);
+    return failures;
+}
+
+// Small operators are inlined, so a top-level expression that only uses them can be folded
+// to a number, and isn't compiled at all. Returns the number of failures.
+int check_inlining() {
+    int failures = 0;
+    llvm::Expected<std::unique_ptr<double>> defined =
+        execute("def binary~5(a b) (a + b) * 2\ndef unary-(x) 0 - x\nextern printd(x)\ndef binary@5(a b) printd(a) + b");
+    if (!defined) {
+        printf("FAILED: Defining operators: %s\n", llvm::toString(defined.takeError()).c_str());
+        return 1;
+    }
+
+    std::unique_ptr<ast::Block> block = parse("1 ~ -2");
+    const ast::Num* folded = block ? fold(*block->statements.back()->as_fn()) : nullptr;
+    if (!folded || folded->value != -2) {
+        printf("FAILED: '1 ~ -2' should fold to -2 once '~' and '-' are inlined\n");
+        failures++;
+    }
+
+    // Unless what would be inlined has a side effect.
+    std::unique_ptr<ast::Block> noisy = parse("1 @ 2");
+    if (!noisy || fold(*noisy->statements.back()->as_fn())) {
+        printf("FAILED: '1 @ 2' shouldn't fold, since '@' prints something\n");
+        failures++;
+    }
+    return failures;
+}
+
+// Functions are resolved when they are defined, on this thread, and lazy ones are generated
+// later, on a worker. (See jit::LazyFunction) So functions are defined and defined again
+// while others that use them are being generated, and each should still do what the last
+// definition before its call says. Returns the number of failures.
+int check_lazy_race() {
+    if (!jit::lazy) {
+        printf("Not compiling lazily, skipping the lazy test.\n");
+        return 0;
+    }
+
+    int failures = 0;
+    llvm::Expected<std::unique_ptr<double>> defined = execute("def base(x) x + 1");
+    if (!defined) {
+        printf("FAILED: Defining base: %s\n", llvm::toString(defined.takeError()).c_str());
+        return 1;
+    }
+
+    const int ROUNDS = 20;
+    const int USERS = 10;
+    for (int round = 0; round < ROUNDS; round++) {
+        llvm::orc::SymbolLookupSet users;
+        for (int i = 0; i < USERS; i++) {
+            std::string name = "user" + std::to_string(round) + "x" + std::to_string(i);
+            defined = execute("def " + name + "(x) base(x) * " + std::to_string(i));
+            if (!defined) {
+                printf("FAILED: Defining %s: %s\n", name.c_str(), llvm::toString(defined.takeError()).c_str());
+                failures++;
+            }
+            users.add((*jit::mangle)(name));
+        }
+
+        // Nothing has called them, so they are generated on the workers, while the next
+        // function is defined here. Defining base again waits for them. (See compile_unit)
+        jit::start_compiling(*jit::session->getJITDylibByName(jit::BODIES_NAME), std::move(users));
+        std::string round_text = std::to_string(round);
+        defined = execute("def other" + round_text + "(x) base(x) + " + round_text);
+        if (defined)
+            defined = execute("def base(x) x + " + round_text);
+        if (!defined) {
+            printf("FAILED: Defining functions in round %d: %s\n", round, llvm::toString(defined.takeError()).c_str());
+            failures++;
+        }
+    }
+    jit::wait_for_compiling();
+
+    // The last base is 'x + 19'.
+    llvm::Expected<std::unique_ptr<double>> result = execute("user3x7(1)");
+    if (!result || !*result || **result != 20 * 7) {
+        printf("FAILED: user3x7(1) should be %d\n", 20 * 7);
+        if (!result)
+            llvm::consumeError(result.takeError());
+        failures++;
+    }
+
+    result = execute("other5(1)");
+    if (!result || !*result || **result != 20 + 5) {
+        printf("FAILED: other5(1) should be %d\n", 20 + 5);
+        if (!result)
+            llvm::consumeError(result.takeError());
+        failures++;
+    }
+    return failures;
+}
+
+// Functions are called through stubs, (see jit::define) so defining one again changes what
+// everything that calls it does, whether that has been compiled yet or not.
+// Returns the number of failures.
+int check_redefine() {
+    int failures = 0;
+    llvm::Expected<std::unique_ptr<double>> result = execute("def f(x) x + 1\ndef g(x) f(x) * 2\ng(1)");
+    if (!result || !*result || **result != 4) {
+        printf("FAILED: 'def f(x) x + 1; def g(x) f(x) * 2; g(1)' should be 4\n");
+        if (!result)
+            llvm::consumeError(result.takeError());
+        failures++;
+    }
+    result = execute("def f(x) x + 10\ng(1)");
+    if (!result || !*result || **result != 22) {
+        printf("FAILED: 'def f(x) x + 10; g(1)' should be 22\n");
+        if (!result)
+            llvm::consumeError(result.takeError());
+        failures++;
+    }
+    // And again before what calls it is compiled, which matters when compiling is lazy.
+    result = execute("def f(x) x + 100\ndef k(x) f(x) * 3\ndef f(x) x + 1000\nk(1)");
+    if (!result || !*result || **result != 3003) {
+        printf("FAILED: 'def f(x) x + 100; def k(x) f(x) * 3; def f(x) x + 1000; k(1)' should be 3003\n");
+        if (!result)
+            llvm::consumeError(result.takeError());
+        failures++;
+    }
+
+    // Small operators are inlined, so what calls them is compiled again instead.
+    result = execute("def binary%5(a b) a*b + 1\ndef h(x) x % 2\nh(3)");
+    if (!result || !*result || **result != 7) {
+        printf("FAILED: 'def binary%%5(a b) a*b + 1; def h(x) x %% 2; h(3)' should be 7\n");
+        if (!result)
+            llvm::consumeError(result.takeError());
+        failures++;
+    }
+    if (!optimize::inlined(symbols::intern("binary%"))) {
+        printf("FAILED: 'binary%%' should be inlined\n");
+        failures++;
+    }
+    result = execute("def binary%5(a b) a - b\nh(3)");
+    if (!result || !*result || **result != 1) {
+        printf("FAILED: 'def binary%%5(a b) a - b; h(3)' should be 1\n");
+        if (!result)
+            llvm::consumeError(result.takeError());
+        failures++;
+    }
+    result = execute("def binary%5(a b) a * b * 2\nh(3)");
+    if (!result || !*result || **result != 12) {
+        printf("FAILED: 'def binary%%5(a b) a * b * 2; h(3)' should be 12\n");
+        if (!result)
+            llvm::consumeError(result.takeError());
+        failures++;
+    }
+    return failures;
+}
+
+// The memory for each top-level expression is given back once it has run, (see memory.cpp)
+// so running a lot of them in a row shouldn't keep needing more. The first few dozen do, for
+// things the session keeps, such as stubs, so those are run before counting.
+// Returns the number of failures.
+int check_slabs() {
+    if (!jit::slabs) {
+        printf("No slabs with RuntimeDyld, skipping the slab test.\n");
+        return 0;
+    }
+
+    int failures = 0;
+    llvm::Expected<std::unique_ptr<double>> result = execute("def twice(x) x * 2");
+    if (!result) {
+        printf("FAILED: Defining twice: %s\n", llvm::toString(result.takeError()).c_str());
+        return 1;
+    }
+
+    memory::Stats before;
+    for (int i = 0; i < 500; i++) {
+        if (i == 100)
+            before = jit::slabs->stats();
+
+        // testnan() keeps it from being folded, so it's compiled each time.
+        std::string text = "twice(" + std::to_string(i) + ") - testnan()";
+        result = execute(text);
+        if (!result || !*result || !std::isnan(**result)) {
+            printf("FAILED: '%s' should be NaN\n", text.c_str());
+            if (!result)
+                llvm::consumeError(result.takeError());
+            failures++;
+        }
+    }
+    memory::Stats after = jit::slabs->stats();
+
+    if (after.slabs != before.slabs) {
+        printf("FAILED: 400 top-level expressions took %d slabs more\n", (int)(after.slabs - before.slabs));
+        failures++;
+    }
+    if (after.used != before.used) {
+        printf("FAILED: 400 top-level expressions kept %lld pages\n", (long long)(after.used - before.used));
+        failures++;
+    }
+    return failures;
+}
+
+// Modules are compiled on a pool of workers. (See threads::Pool) Returns the number of failures.
+int check_pool() {
+    int failures = 0;
+    threads::Pool pool(4);
+    std::atomic<int> count = 0;
+    for (int i = 0; i < 1000; i++)
+        pool.submit([&]() { count++; });
+    pool.wait();
+    if (count != 1000) {
+        printf("FAILED: %d of 1000 tasks had run when wait() returned\n", count.load());
+        failures++;
+    }
+
+    // Tasks can submit more tasks, which are waited for too.
+    for (int i = 0; i < 10; i++) {
+        pool.submit([&]() {
+            for (int j = 0; j < 100; j++)
+                pool.submit([&]() { count++; });
+        });
+    }
+    pool.wait();
+    if (count != 2000) {
+        printf("FAILED: %d of 1000 tasks submitted by other tasks had run when wait() returned\n", count.load() - 1000);
+        failures++;
+    }
+    return failures;
+}
+
+int main() {
+    printf("test-jit v1\n");
+
+    if (auto error = jit::init()) {
+        diag::print(std::move(error));
+        return 1;
+    }
+    printf("Compiling %s.\n", jit::lazy ? "lazily" : "eagerly");
+
+    llvm::Expected<std::unique_ptr<double>> declared = execute("extern testnan()");
+    if (!declared) {
+        diag::print(declared.takeError());
+        return 1;
+    }
+
+    int failures = check_nans() + check_redefine() + check_inlining() + check_lazy_race() + check_slabs()
+        + check_pool();
+
+    jit::cleanup();
+    if (failures) {
+        printf("%d failed\n", failures);
+        return 1;
+    }
+    printf("All passed\n");
+    return 0;
+}
@@ -0,0 +1,278 @@
+#include "../compiler/incremental.cpp"
+#include "../compiler/tokens.cpp"
+#include "../compiler/visitors/stringify.cpp"
+
+#include <cctype>
+#include <iostream>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+bool same_tokens(const tokens::Buffer& a, const tokens::Buffer& b) {
+    return a.kinds == b.kinds && a.offsets == b.offsets && a.lengths == b.lengths
+        && a.nums == b.nums && a.integers == b.integers && a.words == b.words;
+}
+
+// Files are lexed where they are mapped, (see tokens::lex_file) so check that gives the same
+// tokens as lexing a copy of the text. Returns the number of failures.
+int check_file(const fs::path& target, const std::string& text) {
+    llvm::Expected<tokens::Buffer> mapped = tokens::lex_file(target.string());
+    if (!mapped) {
+        printf("FAILED: Mapping %s: %s\n", target.string().c_str(), llvm::toString(mapped.takeError()).c_str());
+        return 1;
+    }
+
+    int failures = 0;
+    if (!same_tokens(*mapped, tokens::lex_all(text))) {
+        printf("FAILED: Different tokens from a mapped file and from a copy of it\n");
+        failures++;
+    }
+    if (!mapped->file || mapped->source != text) {
+        printf("FAILED: The tokens of a mapped file don't refer to its text\n");
+        failures++;
+    }
+    return failures;
+}
+
+// Numbers are read into Buffer::nums along with their text, with the kernel shared with River.
+// (See common/numbers.cpp) River's test-tokens has the harder cases, so these check that the
+// values end up with the right tokens. The expected values are the compiler's own reading of
+// the same literals, so they have to match exactly.
+struct NumberCase {
+    std::string text;
+    double value;
+    bool integer;
+};
+
+std::vector<NumberCase> number_cases = {
+    {"0", 0, true},
+    {"1.5", 1.5, false},
+    {".5", .5, false},
+    {"5.", 5., false},
+    {"9007199254740992", 9007199254740992., true},
+    {"9007199254740993", 9007199254740992., false},
+    {"0.00000000000000000000001", 1e-23, false},
+};
+
+// Returns the number of failures.
+int check_numbers() {
+    int failures = 0;
+    for (NumberCase& test: number_cases) {
+        std::string text = "x + " + test.text + " * y";
+        tokens::Buffer buffer = tokens::lex_all(text);
+        if (buffer.size() < 3 || buffer.kinds[2] != tokens::NUMBER || buffer.text(2) != test.text
+            || buffer.nums[2] != test.value || buffer.integers[2] != test.integer) {
+            printf("FAILED: '%s' read as %.17g (integer: %d), expected %.17g (integer: %d)\n", test.text.c_str(),
+                buffer.size() < 3 ? 0. : buffer.nums[2], buffer.size() < 3 ? 0 : (int)buffer.integers[2], test.value, test.integer);
+            failures++;
+        }
+    }
+
+    // Anything else has 0.
+    tokens::Buffer buffer = tokens::lex_all("def f(x) x + 1");
+    for (size_t i = 0; i < buffer.size(); i++) {
+        if (buffer.kinds[i] != tokens::NUMBER && (buffer.nums[i] != 0 || buffer.integers[i])) {
+            printf("FAILED: Token %d of 'def f(x) x + 1' has a number, but isn't one\n", (int)i);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+int is_blank(int c) { return isspace(c) && c != '\n'; }
+int is_decimal(int c) { return isdigit(c) || c == '.'; }
+int is_word(int c) { return isalnum(c) || c == '_'; }
+int is_line(int c) { return c != '\n'; }
+
+// Each of the scanning functions, with what it should match the same as.
+struct ScanCase {
+    const char* name;
+    const char* (*scan)(const char* p, const char* end);
+    int (*in_class)(int c);
+};
+
+std::vector<ScanCase> scan_cases = {
+    {"spaces", scan::spaces, isspace},
+    {"blanks", scan::blanks, is_blank},
+    {"digits", scan::digits, isdigit},
+    {"decimal", scan::decimal, is_decimal},
+    {"alnum", scan::alnum, isalnum},
+    {"word", scan::word, is_word},
+    {"line", scan::line, is_line},
+};
+
+// The scanning kernel shared with River (see common/scan.cpp) classifies a whole chunk of
+// characters at a time, and the rest one at a time. So every character is put at every place
+// in the first few chunks and in the tail, to check it's classified as <cctype> does in the
+// "C" locale. Returns the number of failures.
+int check_scan() {
+    const int RUN = 70;
+    int failures = 0;
+    for (ScanCase& test: scan_cases) {
+        int filler = 0;
+        while (!test.in_class(filler))
+            filler++;
+        int stop = 0;
+        while (test.in_class(stop))
+            stop++;
+
+        for (int c = 0; c < 256; c++) {
+            for (int at = 0; at < RUN; at++) {
+                std::string text(RUN, (char)filler);
+                text += (char)stop;
+                text[at] = (char)c;
+
+                const char* found = test.scan(text.data(), text.data() + text.size());
+                int expected = test.in_class(c) ? RUN : at;
+                if (found - text.data() != expected) {
+                    printf("FAILED: scan::%s stopped at %d, not %d, with character %d at %d\n",
+                        test.name, (int)(found - text.data()), expected, c, at);
+                    failures++;
+                }
+            }
+        }
+
+        // Without anything to stop at, the scan runs to the end, wherever that is.
+        for (int size = 0; size < RUN; size++) {
+            std::string text(size, (char)filler);
+            if (test.scan(text.data(), text.data() + size) != text.data() + size) {
+                printf("FAILED: scan::%s didn't stop at the end of %d characters\n", test.name, size);
+                failures++;
+            }
+        }
+    }
+    return failures;
+}
+
+// Keywords and commands are found with a perfect hash. (See tokens::find_word)
+// Returns the number of failures.
+int check_words() {
+    int failures = 0;
+    for (size_t i = 0; i < tokens::WORDS.size(); i++) {
+        if (tokens::find_word(tokens::WORDS[i]) != (tokens::Word)i) {
+            printf("FAILED: '%s' isn't found as itself\n", std::string(tokens::WORDS[i]).c_str());
+            failures++;
+        }
+    }
+
+    // Names that are close to a word, but aren't one.
+    for (std::string_view text: {"", "x", "define", "de", "ifelse", "memoryy", "Def"}) {
+        if (tokens::find_word(text) != tokens::NOT_A_WORD) {
+            printf("FAILED: '%s' is found as a word\n", std::string(text).c_str());
+            failures++;
+        }
+    }
+    return failures;
+}
+
+// The first place in the sample that has the text 'before' is changed to 'after'. Only that is
+// lexed again, (see tokens::relex) and the buffer should be just what lexing all of the new
+// text gives. The same goes for the statements of a document, (see incremental.cpp) against
+// a document that reads all of the new text. Returns the number of failures.
+int check_edit(const std::string& sample, const std::string& before, const std::string& after) {
+    size_t start = sample.find(before);
+    if (start == std::string::npos) {
+        printf("FAILED: The sample doesn't have '%s' in it\n", before.c_str());
+        return 1;
+    }
+    std::string text = sample;
+    text.replace(start, before.size(), after);
+
+    // Only the part that differs counts as the edit, as incremental::Document works it out.
+    size_t prefix = 0;
+    while (prefix < before.size() && prefix < after.size() && before[prefix] == after[prefix])
+        prefix++;
+    size_t suffix = 0;
+    while (suffix < before.size() - prefix && suffix < after.size() - prefix
+        && before[before.size() - suffix - 1] == after[after.size() - suffix - 1])
+        suffix++;
+
+    int failures = 0;
+    tokens::Buffer buffer = tokens::lex_all(sample);
+    tokens::Patch patch = tokens::relex(buffer, text, (uint32_t)(start + prefix),
+        (uint32_t)(start + before.size() - suffix), (uint32_t)(start + after.size() - suffix));
+    buffer.splice(patch.first, patch.end, patch.tokens, patch.shift);
+    if (!same_tokens(buffer, tokens::lex_all(text))) {
+        printf("FAILED: Lexing again after '%s' to '%s'\n", before.c_str(), after.c_str());
+        failures++;
+    }
+
+    incremental::Document edited;
+    incremental::Document fresh;
+    edited.name = fresh.name = "syntax.k";
+    llvm::Expected<std::vector<size_t>> updated = edited.update(sample);
+    if (updated)
+        updated = edited.update(text);
+    llvm::Expected<std::vector<size_t>> read = fresh.update(text);
+    if (!updated || !read) {
+        printf("FAILED: Updating a document with '%s' to '%s'\n", before.c_str(), after.c_str());
+        llvm::consumeError(updated.takeError());
+        llvm::consumeError(read.takeError());
+        return failures + 1;
+    }
+
+    bool matches = edited.statements.size() == fresh.statements.size();
+    for (size_t i = 0; matches && i < edited.statements.size(); i++)
+        matches = Stringifier::str(*edited.statements[i].tree) == Stringifier::str(*fresh.statements[i].tree);
+    if (!matches) {
+        printf("FAILED: Parsing a document again after '%s' to '%s'\n", before.c_str(), after.c_str());
+        failures++;
+    }
+    return failures;
+}
+
+// Returns the number of failures.
+int check_edits(const std::string& sample) {
+    int failures = 0;
+    // A number that gets longer, and one that becomes a name.
+    failures += check_edit(sample, "count(4)", "count(40)");
+    failures += check_edit(sample, "count(4)", "count(x4)");
+    // Space between tokens that comes and goes.
+    failures += check_edit(sample, "x * 2", "x*2");
+    failures += check_edit(sample, "def noisy", "def  noisy");
+    // Two names that are joined into one, and one that is split.
+    failures += check_edit(sample, "a*b + a*b", "a*b + ab");
+    failures += check_edit(sample, "(a*b) +", "(a *b) +");
+    // A comment, that takes the rest of a line with it.
+    failures += check_edit(sample, "printd(x) + printd(x)", "printd(x) # + printd(x)");
+    // Whole statements that come and go.
+    failures += check_edit(sample, "extern printd(x)\n", "");
+    failures += check_edit(sample, "def noisy", "def other(x) x\n\ndef noisy");
+    failures += check_edit(sample, "shadow(1) +", "shadow(1) + count(2) +");
+    // Keywords that become names, and names that become keywords.
+    failures += check_edit(sample, "1 else 0", "1 else 0 + 0");
+    failures += check_edit(sample, "shadow(x) with", "shadow(x)with");
+    failures += check_edit(sample, "def sides", "def sidesin");
+    return failures;
+}
+
+int main() {
+    printf("test-tokens v1\n");
+
+    fs::path target = fs::path("./tests/samples/syntax.k");
+
+    if (!fs::exists(target)) {
+        std::cout << "Target file " << target << " does not seem to exist." << std::endl;
+        return 1;
+    }
+
+    std::ifstream file(target, std::ios::binary);
+    std::stringstream contents;
+    contents << file.rdbuf();
+    std::string text = contents.str();
+
+    // Parsing needs the precedences of the builtin operators.
+    expr::init();
+
+    int failures = check_file(target, text) + check_scan() + check_words() + check_edits(text)
+        + check_numbers();
+    if (failures) {
+        printf("%d failed\n", failures);
+        return 1;
+    }
+    printf("All passed\n");
+    return 0;
+}
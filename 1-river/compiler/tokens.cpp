@@ -9,6 +9,11 @@
 #include <fstream>
 #include <assert.h>
 #include <array>
+#include <string_view>
+
+#include "../../common/scan.cpp"
+#include "../../common/phash.cpp"
+#include "../../common/numbers.cpp"
 
 namespace tokens {
 
@@ -23,23 +28,31 @@ namespace tokens {
 
 namespace defs {
 
-// Key words.
-std::string 
-    DEF = "def", RETURN = "return", EXTERN = "extern",
-    IF = "else", ELSE = "else", FOR = "for", IN = "in", STEP = "step";
+// Key words and operator words.
+// The order here has to match the spellings in words below.
+enum Word {
+    KW_DEF, KW_RETURN, KW_EXTERN,
+    KW_IF, KW_ELSE, KW_FOR, KW_IN, KW_STEP,
 
-std::unordered_set<std::string> keywords {
-    DEF, RETURN, EXTERN, IF, ELSE, FOR, IN, STEP,
-};
+    // Everything from here on is an operator word rather than a key word.
+    OP_AND, OP_OR,
 
-// Operator words.
-std::string
-    AND = "and", OR = "or";
+    NOT_A_WORD = -1
+};
 
-std::unordered_set<std::string> opwords {
-    AND, OR
+constexpr std::array<std::string_view, 10> words = {
+    "def", "return", "extern",
+    "if", "else", "for", "in", "step",
+    "and", "or"
 };
 
+constexpr phash::Table<10, 32> word_table(words);
+
+// Key word or operator word for a piece of text, or NOT_A_WORD.
+Word find_word(std::string_view text) {
+    return (Word)word_table.find(text);
+}
+
 // Key symbols.
 char 
     OPEN = '(', OPEN_CURLY = '{', COMMA = ',', CLOSE_CURLY = '}', CLOSE = ')',
@@ -112,9 +125,20 @@ class Token {
 public:
     const std::string text;
     const TokenKind kind;
+    // For key words and operator words, which one.
+    const defs::Word word;
+    // For numbers, the value, read at the same time as the text. 0 for anything else.
+    const double num;
+    // For numbers, whether it's a whole number that num holds exactly. See numbers::Number.
+    const bool integer;
+
+    Token(TokenKind kind, std::string input_text, defs::Word word = defs::NOT_A_WORD): 
+        text(std::move(input_text)), kind(kind), word(word), num(0), integer(false) {}
 
-    Token(TokenKind kind, std::string input_text): 
-        kind(kind), text(std::move(input_text)) {}
+    // A number token.
+    Token(std::string input_text, numbers::Number number): 
+        text(std::move(input_text)), kind(NUMBER), word(defs::NOT_A_WORD), 
+        num(number.value), integer(number.integer) {}
 
     bool is(TokenKind kind) const {
         return this->kind == kind;
@@ -128,6 +152,10 @@ public:
         return is(kind) && text.size() == 1 && text[0] == symbol;
     }
 
+    bool is(TokenKind kind, defs::Word word) const {
+        return is(kind) && this->word == word;
+    }
+
     std::string describe() const {
         std::string kind_desc;
         switch (kind) {
@@ -159,8 +187,11 @@ private:
     std::ifstream& source;
     std::array<int, K> buffer;
 public:
+    // The buffer holds the next K characters, so the stream itself
+    // is always K characters ahead of peek().
     KCharIterator(std::ifstream& source): source(source) {
-        buffer[0] = source.peek();
+        for (int i = 0; i < K; i++)
+            buffer[i] = source.get();
     }
 
     bool eof() const { 
@@ -177,18 +208,126 @@ public:
     }
 
     void get() {
-        source.get();
         for (int i = 0; i < (K-1); i++) {
             buffer[i] = buffer[i+1];
         }
-        buffer[K-1] = source.peek();
+        buffer[K-1] = source.get();
+    }
+
+    // Runs of characters, see scan.cpp for the classes.
+    // The take_* functions append the run to the given text.
+
+    void skip_spaces() {
+        while ((!eof()) && isspace(peek()))
+            get();
+    }
+
+    void skip_blanks() {
+        while ((!eof()) && isspace(peek()) && (peek() != '\n'))
+            get();
+    }
+
+    void take_word(std::string& text) {
+        while (isalnum(peek()) || peek() == '_') {
+            text += peek();
+            get();
+        }
+    }
+
+    void take_digits(std::string& text) {
+        while (isdigit(peek())) {
+            text += peek();
+            get();
+        }
+    }
+
+    void take_line(std::string& text) {
+        while ((!eof()) && peek() != '\n') {
+            text += peek();
+            get();
+        }
+    }
+
+    // A '.' is only a part of the number if it isn't the start of a range.
+    void take_number(std::string& text, numbers::Number& number) {
+        take_digits(text);
+
+        if (peek() == '.' && peek(1) != '.') {
+            text += '.';
+            get();
+        }
+
+        take_digits(text);
+        numbers::parse(text.data(), text.data() + text.size(), number);
     }
 };
 
-class TokenIterator {
+// The same as KCharIterator, but for text that is already in memory.
+// The runs are found with the vectorized scanning in scan.cpp.
+class BufferCharIterator {
+private:
+    const char* cursor;
+    const char* end;
 public:
-    TokenIterator(std::ifstream& source): 
-        source(KCharIterator<2>(source)) {} 
+    BufferCharIterator(std::string_view source): 
+        cursor(source.data()), end(source.data() + source.size()) {}
+
+    bool eof() const {
+        return cursor >= end;
+    }
+
+    int peek() const {
+        return eof() ? -1 : (unsigned char)*cursor;
+    }
+
+    int peek(int k) {
+        assert(k > 0 && "In BufferCharIterator, k is out of range.");
+        return (end - cursor) > k ? (unsigned char)cursor[k] : -1;
+    }
+
+    void get() {
+        cursor++;
+    }
+
+    void skip_spaces() {
+        cursor = scan::spaces(cursor, end);
+    }
+
+    void skip_blanks() {
+        cursor = scan::blanks(cursor, end);
+    }
+
+    void take_word(std::string& text) {
+        const char* start = cursor;
+        cursor = scan::word(cursor, end);
+        text.append(start, cursor);
+    }
+
+    void take_digits(std::string& text) {
+        const char* start = cursor;
+        cursor = scan::digits(cursor, end);
+        text.append(start, cursor);
+    }
+
+    void take_line(std::string& text) {
+        const char* start = cursor;
+        cursor = scan::line(cursor, end);
+        text.append(start, cursor);
+    }
+
+    // The end of the number is found while reading its value.
+    void take_number(std::string& text, numbers::Number& number) {
+        const char* start = cursor;
+        cursor = numbers::parse(cursor, end, number);
+        text.append(start, cursor);
+    }
+};
+
+template<class Source>
+class BasicTokenIterator {
+public:
+    BasicTokenIterator(Source source): 
+        source(source) {} 
 
     const Token& peek() {
         return *current;
@@ -214,7 +353,7 @@ public:
             next_token();
     }
 private:
-    KCharIterator<2> source;
+    Source source;
     std::unique_ptr<Token> current;
 
     void next_token() {  
@@ -225,12 +364,10 @@ private:
         //  - However, after returning '\n', any further whitespace
         // including '\n' is ignored until the next non-newline token.
         if (has_started() && peek().is(KEY, '\n')) {
-            while ((!source.eof()) && isspace(source.peek()))
-                source.get();
+            source.skip_spaces();
         }
         else {
-            while ((!source.eof()) && isspace(source.peek()) && (source.peek() != '\n'))
-                source.get();
+            source.skip_blanks();
             
             if (source.peek() == '\n') {
                 current = std::make_unique<Token>(KEY, std::string(1, '\n'));
@@ -252,10 +389,7 @@ private:
             source.get(); // Move past the '#' symbol.
 
             std::string text = "";
-            while ((!source.eof()) && source.peek() != '\n') {
-                text += source.peek();
-                source.get();
-            }
+            source.take_line(text);
 
             current = std::make_unique<Token>(COMMENT, std::move(text));
             return;
@@ -264,60 +398,36 @@ private:
         // Words
         if (isalpha(source.peek()) || source.peek() == '_') {
             std::string text;
-            while (isalnum(source.peek()) || source.peek() == '_') {
-                text += source.peek();
-                source.get();
-            }
+            source.take_word(text);
 
             TokenKind kind = IDENTIFIER;
-            if (contains(defs::keywords, text)) {
+            defs::Word word = defs::find_word(text);
+            if (word == defs::NOT_A_WORD) {
+                kind = IDENTIFIER;
+            }
+            else if (word < defs::OP_AND) {
                 kind = KEY;
             }
-            else if (contains(defs::opwords, text)) {
+            else {
                 kind = OPERATOR;
             }
 
-            current = std::make_unique<Token>(kind, text);
+            current = std::make_unique<Token>(kind, std::move(text), word);
             return;
         }
 
-        // Numbers
-        if (isdigit(source.peek())) {
+        // Numbers, including ones beginning with a decimal point.
+        if (isdigit(source.peek()) || (source.peek() == '.' && isdigit(source.peek(1)))) {
             std::string num_text;
-            while (isdigit(source.peek())) {
-                num_text += source.peek();
-                source.get();
-            }
-
-            if (source.peek() == '.' && source.peek(1) != '.') {
-                num_text += '.';
-                source.get();
-            }
-
-            while (isdigit(source.peek())) {
-                num_text += source.peek();
-                source.get();
-            }
-
-            current = std::make_unique<Token>(NUMBER, std::move(num_text));
-            return;
-        }
+            numbers::Number number;
+            source.take_number(num_text, number);
 
-        // Numbers beginning with a decimal point.
-        if (source.peek() == '.' && isdigit(source.peek(1))) {
-            std::string num_text = std::string(1, '.');
-            source.get();
-            while (isdigit(source.peek())) {
-                num_text += source.peek();
-                source.get();
-            }
-
-            current = std::make_unique<Token>(NUMBER, std::move(num_text));
+            current = std::make_unique<Token>(std::move(num_text), number);
             return;
         }
 
         // 2-character Symbols
-        std::string multi = source.peek() + "" + source.peek(1);
+        std::string multi = {(char)source.peek(), (char)source.peek(1)};
         if (contains(defs::multi_keys, multi)) {
             current = std::make_unique<Token>(KEY, multi);
             // Moving past 2 characters here.
@@ -349,4 +459,21 @@ private:
         source.get();
     }
 };
+
+// Tokens from a stream, a character at a time.
+typedef BasicTokenIterator<KCharIterator<2>> TokenIterator;
+
+// Tokens from text in memory. 
+typedef BasicTokenIterator<BufferCharIterator> BufferTokenIterator;
+
+// The whole of a file, so that its tokens can be read from memory with a BufferTokenIterator,
+// which is a good deal faster than going through a stream. False if it couldn't be read.
+bool read_file(const std::string& path, std::string& text) {
+    std::ifstream stream(path, std::ios::binary);
+    if (!stream)
+        return false;
+
+    text.assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+    return !stream.bad();
+}
 }
\ No newline at end of file
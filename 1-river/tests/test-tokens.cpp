@@ -2,19 +2,114 @@
 
 #include <iostream>
 #include <filesystem>
+#include <vector>
 #include "diff.cpp"
 
 namespace fs = std::filesystem;
 
-int main() {
+// Numbers are read into Token::num along with their text. (See numbers.cpp)
+// The expected values are the compiler's own reading of the same literals, which is
+// correctly rounded, so they have to match exactly.
+struct NumberCase {
+    std::string text;
+    double value;
+    bool integer;
+};
+
+std::vector<NumberCase> number_cases = {
+    // Clinger's fast path: the digits fit in 53 bits, and the power of ten is exact.
+    {"0", 0, true},
+    {"42", 42, true},
+    {"007", 7, true},
+    {"1.5", 1.5, false},
+    {".5", .5, false},
+    {"5.", 5., false},
+    {"0.1", 0.1, false},
+    {"96.023", 96.023, false},
+
+    // 2^53, the last integer that a double holds along with every one below it.
+    {"9007199254740992", 9007199254740992., true},
+    // One more is past the fast path, and from_chars rounds it back down to 2^53.
+    {"9007199254740993", 9007199254740992., false},
+    // Whole, and exact, but past 2^53, so not an integer.
+    {"100000000000000000000", 1e20, false},
+
+    // 22 decimals is the most the fast path can divide by exactly, and 23 goes to from_chars.
+    {"0.0000000000000000000001", 1e-22, false},
+    {"0.00000000000000000000001", 1e-23, false},
+    {"1.0000000000000000000001", 1.0000000000000000000001, false},
+
+    // More than 19 digits don't fit in the mantissa, so these go to from_chars too.
+    {"1234567890.1234567890123", 1234567890.1234567890123, false},
+    {"123456789012345678901234.5", 123456789012345678901234.5, false},
+    {"0.000000000000000000000000125", 0.000000000000000000000000125, false},
+};
+
+// Returns the number of failures.
+int check_numbers() {
+    int failures = 0;
+    for (NumberCase& test: number_cases) {
+        tokens::BufferTokenIterator iter(tokens::BufferCharIterator{test.text});
+        iter.next();
+        const tokens::Token& token = iter.peek();
+
+        if (!token.is(tokens::NUMBER) || token.text != test.text || token.num != test.value || token.integer != test.integer) {
+            printf("FAILED: '%s' read as %s, %.17g (integer: %d), expected %.17g (integer: %d)\n",
+                test.text.c_str(), token.describe().c_str(), token.num, token.integer, test.value, test.integer);
+            failures++;
+        }
+    }
+
+    // A '.' that starts a range isn't a part of the number before it.
+    std::string range = "1..10";
+    tokens::BufferTokenIterator iter(tokens::BufferCharIterator{range});
+    iter.next();
+    bool start = iter.peek().is(tokens::NUMBER) && iter.peek().num == 1 && iter.peek().integer;
+    iter.next();
+    bool dots = iter.peek().is(tokens::KEY, tokens::defs::RANGE);
+    iter.next();
+    bool end = iter.peek().is(tokens::NUMBER) && iter.peek().num == 10 && iter.peek().integer;
+    if (!(start && dots && end)) {
+        printf("FAILED: '%s' should be read as 1, '..', 10\n", range.c_str());
+        failures++;
+    }
+
+    return failures;
+}
+
+// Files are read from memory, (see tokens::read_file) so check that gives the same tokens
+// as reading through a stream. Returns the number of failures.
+int check_buffer(const fs::path& target, const std::string& text) {
+    std::ifstream stream(target);
+    tokens::TokenIterator expected(stream);
+    tokens::BufferTokenIterator found(tokens::BufferCharIterator{text});
+
+    int count = 0;
+    while (expected.has_next() && found.has_next()) {
+        expected.next();
+        found.next();
+        count++;
 
-    test::diff("one", "two");
+        const tokens::Token& a = expected.peek();
+        const tokens::Token& b = found.peek();
+        if (a.kind != b.kind || a.text != b.text || a.word != b.word || a.num != b.num || a.integer != b.integer) {
+            printf("FAILED: Token %d is %s from a stream, but %s from memory\n", count, a.describe().c_str(), b.describe().c_str());
+            return 1;
+        }
+    }
+
+    if (expected.has_next() != found.has_next()) {
+        printf("FAILED: Different numbers of tokens from a stream and from memory\n");
+        return 1;
+    }
     return 0;
+}
 
+int main() {
     printf("test-tokens v1\n");
 
     fs::path target = fs::path("./tests/samples/tokens.river");
-    
+
     if (!fs::exists(target)) {
         std::cout << "Target file " << target << " does not seem to exist." << std::endl;
         return 1;
@@ -25,10 +120,23 @@ int main() {
         return 1;
     }
 
-    std::ifstream stream(target);
-    tokens::TokenIterator iter(stream);
+    std::string text;
+    if (!tokens::read_file(target.string(), text)) {
+        std::cout << "Target file " << target << " could not be read." << std::endl;
+        return 1;
+    }
+
+    tokens::BufferTokenIterator iter(tokens::BufferCharIterator{text});
     while (iter.has_next()) {
         iter.next();
         std::cout << "Token: " << iter.peek().describe() << std::endl;
     }
+
+    int failures = check_numbers() + check_buffer(target, text);
+    if (failures) {
+        printf("%d failed\n", failures);
+        return 1;
+    }
+    printf("All passed\n");
+    return 0;
 }
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstdint>
+#include <charconv>
+
+// Reading number literals straight into a double, without copying the text anywhere first.
+// A literal is digits, optionally with a '.' somewhere among them: "12", "1.5", ".5", "5."
+
+// Most literals are short, and for those the value comes straight out of the digits.
+// If the digits fit in the 53 bits of a double's mantissa, and there are no more than 22 of
+// them after the '.', then both the digits and the power of ten are exact doubles, and a
+// single multiply or divide rounds correctly. (This is Clinger's fast path)
+// Anything else, such as a very long literal, goes to std::from_chars, which is exact.
+
+namespace numbers {
+
+struct Number {
+    double value = 0;
+    // Written without a '.', and small enough that value holds it exactly. (Up to 2^53)
+    // So it can be given an integer type later on, without losing anything.
+    bool integer = false;
+};
+
+namespace {
+    // Every power of ten that is exact as a double.
+    constexpr double powers_of_ten[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    constexpr uint64_t MAX_EXACT = uint64_t(1) << 53;
+
+    // Any more digits than this could overflow the 64 bit mantissa.
+    constexpr int MAX_DIGITS = 19;
+
+    bool is_digit(char c) {
+        return c >= '0' && c <= '9';
+    }
+}
+
+// Read the literal at the start of [p, end) into number, and return the first character after it.
+// A '.' followed by another '.' is not a part of the number, so "1..5" reads as just 1.
+// If there are no digits at all, as with ".", the value is 0.
+const char* parse(const char* p, const char* end, Number& number) {
+    const char* start = p;
+
+    // The value is mantissa * 10^exponent, as long as nothing was truncated.
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    // Digits in the mantissa, not counting leading zeros.
+    int digits = 0;
+    bool truncated = false;
+
+    bool any_digits = false;
+    bool point = false;
+    for (; p < end; p++) {
+        if (is_digit(*p)) {
+            any_digits = true;
+            unsigned digit = *p - '0';
+            if (digits < MAX_DIGITS) {
+                mantissa = mantissa * 10 + digit;
+                if (mantissa != 0)
+                    digits++;
+                if (point)
+                    exponent--;
+            }
+            else {
+                // This digit doesn't fit, so only its place is kept.
+                if (!point)
+                    exponent++;
+                if (digit != 0)
+                    truncated = true;
+            }
+        }
+        else if (*p == '.' && !point && !(p + 1 < end && p[1] == '.')) {
+            point = true;
+        }
+        else {
+            break;
+        }
+    }
+
+    number.integer = false;
+    if (!any_digits) {
+        number.value = 0;
+        return p;
+    }
+
+    if (!truncated && mantissa <= MAX_EXACT && exponent >= -22 && exponent <= 22) {
+        double value = (double)mantissa;
+        number.value = exponent < 0 ? value / powers_of_ten[-exponent] : value * powers_of_ten[exponent];
+        number.integer = !point && exponent == 0;
+        return p;
+    }
+
+    // The slow but exact way.
+    number.value = 0;
+    std::from_chars(start, p, number.value);
+    return p;
+}
+
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <array>
+#include <string_view>
+#include <cstdint>
+#include <cstring>
+
+// A perfect hash for a small, fixed list of words, worked out at compile time.
+// Looking up a word costs one hash and one memcmp, with no allocation.
+//
+// Both tokenizers use this to recognize keywords, and Kaleidoscope's commands.
+
+namespace phash {
+
+// Only the length and a few characters are hashed, that is plenty
+// to tell apart short lists of short words.
+constexpr uint32_t hash(std::string_view word, uint32_t seed) {
+    size_t size = word.size();
+    uint32_t h = seed ^ (uint32_t)size;
+    h = (h ^ (unsigned char)word[0]) * 16777619u;
+    h = (h ^ (unsigned char)word[size / 2]) * 16777619u;
+    h = (h ^ (unsigned char)word[size - 1]) * 16777619u;
+    return h ^ (h >> 15);
+}
+
+// N words, in SIZE slots. SIZE must be a power of two bigger than N, and the bigger
+// it is the quicker a seed is found. If no seed works, the table fails to compile.
+template<size_t N, size_t SIZE>
+class Table {
+    static_assert(N > 0 && N < SIZE && (SIZE & (SIZE - 1)) == 0, "Table size must be a power of two, bigger than the word count.");
+
+private:
+    std::array<std::string_view, N> words;
+    // Index into words for each slot, or -1 for empty slots.
+    std::array<int, SIZE> slots;
+    uint32_t seed;
+    size_t shortest, longest;
+
+    constexpr bool try_seed(uint32_t candidate) {
+        for (size_t i = 0; i < SIZE; i++)
+            slots[i] = -1;
+
+        for (size_t i = 0; i < N; i++) {
+            size_t slot = hash(words[i], candidate) & (SIZE - 1);
+            if (slots[slot] != -1)
+                return false;
+            slots[slot] = (int)i;
+        }
+        return true;
+    }
+
+public:
+    constexpr Table(const std::array<std::string_view, N>& words):
+        words(words), slots(), seed(0), shortest(words[0].size()), longest(0) {
+        for (size_t i = 0; i < N; i++) {
+            shortest = words[i].size() < shortest ? words[i].size() : shortest;
+            longest = words[i].size() > longest ? words[i].size() : longest;
+        }
+
+        for (uint32_t candidate = 1; candidate < 100000; candidate++) {
+            if (try_seed(candidate)) {
+                seed = candidate;
+                return;
+            }
+        }
+
+        // Not allowed in a constant expression, so this is a compile error.
+        throw "No perfect hash seed found for the word list.";
+    }
+
+    // The index of the word in the original list, or -1 if it isn't there.
+    int find(std::string_view word) const {
+        if (word.size() < shortest || word.size() > longest)
+            return -1;
+
+        int index = slots[hash(word, seed) & (SIZE - 1)];
+        if (index == -1)
+            return -1;
+
+        const std::string_view& candidate = words[index];
+        if (candidate.size() != word.size() || std::memcmp(candidate.data(), word.data(), word.size()) != 0)
+            return -1;
+
+        return index;
+    }
+};
+
+}
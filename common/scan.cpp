@@ -0,0 +1,150 @@
+#pragma once
+
+// Character class scanning over in-memory text, for the tokenizers of both Kaleidoscope
+// and River.
+// Each function takes a range [p, end) and returns the first character in it
+// that is NOT in the class, or end if every character is.
+
+// When the target has SSE2 (any x86-64 target does), 16 characters are classified at
+// a time. If the compiler is told AVX2 is available (-mavx2 or /arch:AVX2), 32 at a time.
+// The tails, and any other target, fall back to one character at a time.
+
+#if defined(__AVX2__)
+#define SCAN_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SCAN_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace scan {
+
+// The character classes. These match isspace/isalnum/isdigit in the "C" locale.
+enum Class {
+    // Any whitespace, including '\n'.
+    SPACE,
+    // Whitespace other than '\n'.
+    BLANK,
+    // [0-9]
+    DIGIT,
+    // [0-9] and '.'
+    DECIMAL,
+    // [0-9a-zA-Z]
+    ALNUM,
+    // [0-9a-zA-Z] and '_'
+    WORD,
+    // Anything but '\n'.
+    LINE,
+};
+
+namespace {
+    template<Class C>
+    bool matches(unsigned char c) {
+        bool space = c == ' ' || (c >= '\t' && c <= '\r');
+        bool digit = c >= '0' && c <= '9';
+        bool alpha = (c | 0x20) >= 'a' && (c | 0x20) <= 'z';
+
+        switch (C) {
+            case SPACE: return space;
+            case BLANK: return space && c != '\n';
+            case DIGIT: return digit;
+            case DECIMAL: return digit || c == '.';
+            case ALNUM: return digit || alpha;
+            case WORD: return digit || alpha || c == '_';
+            case LINE: return c != '\n';
+        }
+        return false;
+    }
+
+    // Index of the lowest zero bit. The mask must not be all ones.
+    int first_zero(unsigned int mask) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward(&index, ~mask);
+        return (int)index;
+#else
+        return __builtin_ctz(~mask);
+#endif
+    }
+
+#if defined(SCAN_AVX2)
+    const int WIDTH = 32;
+    typedef __m256i Chunk;
+
+    Chunk load(const char* p) { return _mm256_loadu_si256((const __m256i*)p); }
+    Chunk splat(char c) { return _mm256_set1_epi8(c); }
+    Chunk eq(Chunk x, char c) { return _mm256_cmpeq_epi8(x, splat(c)); }
+    Chunk either(Chunk a, Chunk b) { return _mm256_or_si256(a, b); }
+    Chunk but_not(Chunk a, Chunk b) { return _mm256_andnot_si256(b, a); }
+    unsigned int bits(Chunk x) { return (unsigned int)_mm256_movemask_epi8(x); }
+
+    // There is no unsigned byte comparison, but clamping to the range
+    // only leaves a byte unchanged if it was in the range to begin with.
+    Chunk in_range(Chunk x, char lo, char hi) {
+        Chunk clamped = _mm256_min_epu8(_mm256_max_epu8(x, splat(lo)), splat(hi));
+        return _mm256_cmpeq_epi8(clamped, x);
+    }
+#elif defined(SCAN_SSE2)
+    const int WIDTH = 16;
+    typedef __m128i Chunk;
+
+    Chunk load(const char* p) { return _mm_loadu_si128((const __m128i*)p); }
+    Chunk splat(char c) { return _mm_set1_epi8(c); }
+    Chunk eq(Chunk x, char c) { return _mm_cmpeq_epi8(x, splat(c)); }
+    Chunk either(Chunk a, Chunk b) { return _mm_or_si128(a, b); }
+    Chunk but_not(Chunk a, Chunk b) { return _mm_andnot_si128(b, a); }
+    unsigned int bits(Chunk x) { return (unsigned int)_mm_movemask_epi8(x); }
+
+    // See the AVX2 version.
+    Chunk in_range(Chunk x, char lo, char hi) {
+        Chunk clamped = _mm_min_epu8(_mm_max_epu8(x, splat(lo)), splat(hi));
+        return _mm_cmpeq_epi8(clamped, x);
+    }
+#endif
+
+#if defined(SCAN_AVX2) || defined(SCAN_SSE2)
+    template<Class C>
+    Chunk classify(Chunk x) {
+        switch (C) {
+            case SPACE: return either(eq(x, ' '), in_range(x, '\t', '\r'));
+            case BLANK: return but_not(either(eq(x, ' '), in_range(x, '\t', '\r')), eq(x, '\n'));
+            case DIGIT: return in_range(x, '0', '9');
+            case DECIMAL: return either(in_range(x, '0', '9'), eq(x, '.'));
+            case ALNUM: return either(in_range(x, '0', '9'), in_range(either(x, splat(0x20)), 'a', 'z'));
+            case WORD: return either(classify<ALNUM>(x), eq(x, '_'));
+            case LINE: return but_not(splat((char)0xFF), eq(x, '\n'));
+        }
+        return x;
+    }
+#endif
+
+    template<Class C>
+    const char* skip(const char* p, const char* end) {
+#if defined(SCAN_AVX2) || defined(SCAN_SSE2)
+        const unsigned int ALL = WIDTH == 32 ? 0xFFFFFFFFu : 0xFFFFu;
+        while (end - p >= WIDTH) {
+            unsigned int mask = bits(classify<C>(load(p)));
+            if (mask != ALL)
+                return p + first_zero(mask);
+            p += WIDTH;
+        }
+#endif
+        while (p < end && matches<C>((unsigned char)*p))
+            p++;
+        return p;
+    }
+}
+
+const char* spaces(const char* p, const char* end) { return skip<SPACE>(p, end); }
+const char* blanks(const char* p, const char* end) { return skip<BLANK>(p, end); }
+const char* digits(const char* p, const char* end) { return skip<DIGIT>(p, end); }
+const char* decimal(const char* p, const char* end) { return skip<DECIMAL>(p, end); }
+const char* alnum(const char* p, const char* end) { return skip<ALNUM>(p, end); }
+const char* word(const char* p, const char* end) { return skip<WORD>(p, end); }
+const char* line(const char* p, const char* end) { return skip<LINE>(p, end); }
+
+}